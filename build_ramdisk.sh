@@ -1,5 +1,8 @@
 #!/bin/sh
 
+# Build the ramdisk tool for this host
+make -C tool/ mkramdisk || exit 1
+
 cp modules/fs_fat/fs_fat.kmod ramdisk/
 dot_clean -m ramdisk/
 ./tool/mkramdisk ramdisk
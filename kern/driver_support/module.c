@@ -513,12 +513,21 @@ bool module_load_from_file(char *path, int *err) {
 			return false;
 		}
 
-		// Get buffer and zero it
-		void *buf = (void *) paging_module_buffer();
-		memclr(buf, MODULE_MAX_SIZE);
-
-		// Read entire file
-		hal_vfs_fread(buf, file->size, module);
+		/*
+		 * Files that are already in memory (on the ramdisk) are linked in
+		 * place, like the modules loaded from the ramdisk at boot. They must
+		 * be page aligned, since their pages are mapped into driver space.
+		 */
+		void *buf = hal_vfs_map_file(module, NULL);
+
+		if(!buf || (((unsigned int) buf) & 0xFFF)) {
+			// Get buffer and zero it
+			buf = (void *) paging_module_buffer();
+			memclr(buf, MODULE_MAX_SIZE);
+
+			// Read entire file
+			hal_vfs_fread(buf, file->size, module);
+		}
 
 		// Clean up
 		hal_vfs_fclose(module);
@@ -4,14 +4,128 @@
 
 // Internal state
 static void *ramdisk;
+static size_t ramdisk_size;
 static qrfs_header_t *header;
 static qrfs_file_entry_t *files;
 
+/*
+ * Decompressed data of compressed files, by file index. Files are decompressed
+ * the first time their data is requested, and stay around for good, since
+ * pointers to the data are handed out. Files that couldn't be decompressed are
+ * marked, so they aren't tried again (leaking another buffer each time.)
+ */
+static void **file_cache;
+
+#define RAMDISK_DECOMPRESS_FAILED	((void *) -1)
+
+/*
+ * Compares a name against the name of a file, in the order that entries are
+ * sorted in.
+ */
+static int ramdisk_name_compare(const char *name, size_t length, qrfs_file_entry_t *file) {
+	size_t common = (length < file->name_length) ? length : file->name_length;
+	int result = memcmp(name, ramdisk + file->name_start, common);
+
+	if(result) {
+		return result;
+	}
+
+	if(length == file->name_length) {
+		return 0;
+	}
+
+	return (length < file->name_length) ? -1 : 1;
+}
+
+/*
+ * Converts the entries of a version 1 or 2 image, which have fixed size names
+ * and aren't sorted. The names stay where they are in the image.
+ */
+static qrfs_file_entry_t *ramdisk_convert_entries(void) {
+	qrfs_file_entry_v1_t *old = (qrfs_file_entry_v1_t *) (ramdisk + sizeof(qrfs_header_t));
+	qrfs_file_entry_t *entries = (qrfs_file_entry_t *) kmalloc(header->numFiles * sizeof(qrfs_file_entry_t));
+
+	if(!entries) {
+		return NULL;
+	}
+
+	for(unsigned int f = 0; f < header->numFiles; f++) {
+		qrfs_file_entry_t ent;
+
+		ent.name_start = ((uint8_t *) old[f].name) - ((uint8_t *) ramdisk);
+		ent.name_length = 0;
+
+		// Names that fill the whole name field aren't terminated
+		while(ent.name_length < sizeof(old[f].name) && old[f].name[ent.name_length]) {
+			ent.name_length++;
+		}
+
+		ent.file_start = old[f].file_start;
+		ent.length = old[f].length;
+		ent.attributes = old[f].attributes;
+
+		// Insert it in order; these images have at most a few hundred files
+		unsigned int i = f;
+
+		while(i && ramdisk_name_compare(ramdisk + ent.name_start, ent.name_length, &entries[i - 1]) < 0) {
+			entries[i] = entries[i - 1];
+			i--;
+		}
+
+		entries[i] = ent;
+	}
+
+	return entries;
+}
+
+/*
+ * Checks that the entries of an image, and the data they point to, lie inside
+ * of it, and that they are sorted.
+ */
+static bool ramdisk_validate_entries(void) {
+	for(unsigned int f = 0; f < header->numFiles; f++) {
+		qrfs_file_entry_t *ent = &files[f];
+
+		if(ent->name_start > ramdisk_size || ent->name_length > (ramdisk_size - ent->name_start)) {
+			return false;
+		}
+
+		// Compressed files only take up the length of their stream
+		if(!(ent->attributes & QRFS_ATTR_DIRECTORY)) {
+			if(ent->attributes & QRFS_ATTR_COMPRESSED) {
+				if(ent->file_start > (ramdisk_size - sizeof(qrfs_compressed_header_t))) {
+					return false;
+				}
+
+				// Compare without adding to the stored length, which could wrap
+				uint32_t stored = ((qrfs_compressed_header_t *) (ramdisk + ent->file_start))->stored_length;
+
+				if(stored > (ramdisk_size - ent->file_start - sizeof(qrfs_compressed_header_t))) {
+					return false;
+				}
+			} else if(ent->file_start > ramdisk_size || ent->length > (ramdisk_size - ent->file_start)) {
+				return false;
+			}
+		}
+
+		if(f && ramdisk_name_compare(ramdisk + ent->name_start, ent->name_length, &files[f - 1]) <= 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 /*
  * Called during early preboot to allow the ramdisk to be verified, and its
  * contents to be copied to kernel space.
  */
 void ramdisk_found(uint32_t addr, uint32_t size) {
+	if(size < sizeof(qrfs_header_t)) {
+		KWARNING("Module at 0x%08X is too small to be a ramdisk (%u bytes)", (unsigned int) addr, (unsigned int) size);
+		return;
+	}
+
 	// Verify magic
 	if(((qrfs_header_t *) addr)->magic == QRFS_MAGIC) {
 		// KDEBUG("Found ramdisk at 0x%08X, %u bytes", (unsigned int) addr, (unsigned int) size);
@@ -22,9 +136,46 @@ void ramdisk_found(uint32_t addr, uint32_t size) {
 
 		// Update state to reference copied location
 		header = (qrfs_header_t *) ramdisk;
-		files = (qrfs_file_entry_t *) (ramdisk+sizeof(qrfs_header_t));
+		ramdisk_size = size;
+
+		// The entries follow the header, and have to fit in the image
+		size_t entrySize = (header->version >= QRFS_VERSION_NAMES) ? sizeof(qrfs_file_entry_t) : sizeof(qrfs_file_entry_v1_t);
+
+		if(header->numFiles > ((size - sizeof(qrfs_header_t)) / entrySize)) {
+			KWARNING("Ramdisk at 0x%08X is corrupt", (unsigned int) addr);
+
+			ramdisk = NULL;
+			return;
+		}
+
+		if(header->version >= QRFS_VERSION_NAMES) {
+			files = (qrfs_file_entry_t *) (ramdisk + sizeof(qrfs_header_t));
+		} else {
+			files = ramdisk_convert_entries();
+		}
+
+		if(!files) {
+			ramdisk = NULL;
+			return;
+		}
+
+		if(!ramdisk_validate_entries()) {
+			KWARNING("Ramdisk at 0x%08X is corrupt", (unsigned int) addr);
+
+			files = NULL;
+			ramdisk = NULL;
+			return;
+		}
+
+		if(header->version >= QRFS_VERSION_COMPRESSION && header->compressed) {
+			file_cache = (void **) kmalloc(header->numFiles * sizeof(void *));
+
+			if(file_cache) {
+				memclr(file_cache, header->numFiles * sizeof(void *));
+			}
+		}
 	} else {
-		KWARNING("Module at 0x%08X is NOT ramdisk (magic 0x%08X, expected 0x%08X)", (unsigned int) addr, (unsigned int) header->magic, QRFS_MAGIC);
+		KWARNING("Module at 0x%08X is NOT ramdisk (magic 0x%08X, expected 0x%08X)", (unsigned int) addr, (unsigned int) ((qrfs_header_t *) addr)->magic, QRFS_MAGIC);
 		return;
 	}
 }
@@ -37,6 +188,152 @@ bool ramdisk_loaded(void) {
 	else return false;
 }
 
+/*
+ * Gets the number of files in the ramdisk.
+ */
+unsigned int ramdisk_num_files(void) {
+	return ramdisk ? header->numFiles : 0;
+}
+
+/*
+ * Gets the file with the given index.
+ */
+qrfs_file_entry_t *ramdisk_get_file(unsigned int index) {
+	if(!ramdisk || index >= header->numFiles) {
+		return NULL;
+	}
+
+	return &files[index];
+}
+
+/*
+ * Looks up a file by the first length bytes of its path. Entries are sorted,
+ * so this is a binary search.
+ *
+ * @return The file, or NULL if there is none by that name.
+ */
+qrfs_file_entry_t *ramdisk_lookup(const char *name, size_t length) {
+	if(!ramdisk) {
+		return NULL;
+	}
+
+	unsigned int low = 0, high = header->numFiles;
+
+	while(low < high) {
+		unsigned int mid = low + ((high - low) / 2);
+		int result = ramdisk_name_compare(name, length, &files[mid]);
+
+		if(result == 0) {
+			return &files[mid];
+		} else if(result < 0) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Gets the path of a file, relative to the root of the ramdisk. It's not
+ * terminated.
+ */
+char *ramdisk_file_name(qrfs_file_entry_t *file, size_t *length) {
+	*length = file->name_length;
+	return (char *) (ramdisk + file->name_start);
+}
+
+/*
+ * Indicates whether the entry is a directory, rather than a file.
+ */
+bool ramdisk_file_is_directory(qrfs_file_entry_t *file) {
+	return (header->version >= QRFS_VERSION_NAMES) && (file->attributes & QRFS_ATTR_DIRECTORY);
+}
+
+/*
+ * Decompresses a file into a buffer of its own. The buffer is page aligned,
+ * so modules can be linked in place, like they can be in the ramdisk.
+ */
+static void *ramdisk_decompress(qrfs_file_entry_t *file) {
+	qrfs_compressed_header_t *hdr = (qrfs_compressed_header_t *) (ramdisk + file->file_start);
+	void *buf = kmalloc_a(file->length);
+
+	if(!buf) {
+		return NULL;
+	}
+
+	// Since version 3, the terminating zeros aren't compressed
+	unsigned int expected = file->length;
+
+	if(header->version >= QRFS_VERSION_NAMES && expected >= 4) {
+		expected -= 4;
+		memclr(((uint8_t *) buf) + expected, 4);
+	}
+
+	unsigned int length = expected;
+	int err = lzfx_decompress(((uint8_t *) hdr) + sizeof(qrfs_compressed_header_t), hdr->stored_length, buf, &length);
+
+	if(err < 0 || length != expected) {
+		#if PRINT_ERROR
+		KERROR("Couldn't decompress ramdisk file (%d, %u of %u bytes)", err, length, expected);
+		#endif
+
+		// Memory from kmalloc_a can't be freed
+		return NULL;
+	}
+
+	return buf;
+}
+
+/*
+ * Gets a pointer to the data of the file. Compressed files are decompressed
+ * the first time this is called for them; otherwise, the data is inside the
+ * ramdisk.
+ *
+ * @return Pointer to the data, or NULL if it couldn't be decompressed.
+ */
+void *ramdisk_file_data(qrfs_file_entry_t *file) {
+	if(!(file->attributes & QRFS_ATTR_COMPRESSED) || header->version < QRFS_VERSION_COMPRESSION) {
+		return ramdisk + file->file_start;
+	}
+
+	if(!file_cache) {
+		return NULL;
+	}
+
+	unsigned int index = file - files;
+
+	if(!file_cache[index]) {
+		// Files with the same contents share their data
+		for(unsigned int f = 0; f < header->numFiles; f++) {
+			if(file_cache[f] && files[f].file_start == file->file_start) {
+				file_cache[index] = file_cache[f];
+				break;
+			}
+		}
+
+		if(!file_cache[index] && !(file_cache[index] = ramdisk_decompress(file))) {
+			file_cache[index] = RAMDISK_DECOMPRESS_FAILED;
+		}
+	}
+
+	if(file_cache[index] == RAMDISK_DECOMPRESS_FAILED) {
+		return NULL;
+	}
+
+	return file_cache[index];
+}
+
+/*
+ * Gets the size of the file. mkramdisk terminates each file with a dword of
+ * zeros (so text files can be used as strings in place), which isn't part of
+ * the file's contents.
+ */
+size_t ramdisk_file_size(qrfs_file_entry_t *file) {
+	return (file->length >= 4) ? (file->length - 4) : file->length;
+}
+
 /*
  * Searches for the specified filename, and if found, returns a pointer to it.
  */
@@ -46,20 +343,13 @@ void *ramdisk_fopen(const char *name) {
 		return NULL;
 	}
 
-	// Loop through all the files on the disk
-	for(int f = 0; f < header->numFiles; f++) {
-		qrfs_file_entry_t *ent = &files[f];
-//		KDEBUG("File '%s', file offset %u", ent->name, (unsigned int) ent->file_start);
-
-		// Does the name match?
-		if(strcmp(ent->name, name) == 0) {
-			// KDEBUG("Found %s, file offset %u", name, (unsigned int) ent->file_start);
-			return (void *) (ramdisk + ent->file_start);
-		}
+	qrfs_file_entry_t *ent = ramdisk_lookup(name, strlen((char *) name));
 
-		ent += sizeof(qrfs_file_entry_t);
+	if(ent && !ramdisk_file_is_directory(ent)) {
+		// KDEBUG("Found %s, file offset %u", name, (unsigned int) ent->file_start);
+		return ramdisk_file_data(ent);
 	}
 
 	KERROR("File '%s' not found in ramdisk", name);
 	return NULL;
-}
\ No newline at end of file
+}
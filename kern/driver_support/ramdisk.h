@@ -4,10 +4,22 @@
 #import <types.h>
 
 #define QRFS_MAGIC 'QRFS'
-#define QRFS_VERSION 0x00010000
+#define QRFS_VERSION 0x00030000
+
+// First version that may contain compressed files
+#define QRFS_VERSION_COMPRESSION 0x00020000
+// First version with a name string table, and entries sorted by name
+#define QRFS_VERSION_NAMES 0x00030000
+
+// Files with this attribute are stored LZFX compressed (version 2 and up)
+#define QRFS_ATTR_COMPRESSED	(1 << 0)
+// Entries with this attribute are directories, and have no data (version 3)
+#define QRFS_ATTR_DIRECTORY		(1 << 1)
 
 typedef struct qrfs_header qrfs_header_t;
 typedef struct qrfs_file_entry qrfs_file_entry_t;
+typedef struct qrfs_file_entry_v1 qrfs_file_entry_v1_t;
+typedef struct qrfs_compressed_header qrfs_compressed_header_t;
 
 // Header of the filesystem
 struct qrfs_header {
@@ -17,8 +29,26 @@ struct qrfs_header {
 	bool compressed;
 } __attribute__((packed));
 
-// Entry in a filesystem
+/*
+ * Entry in a filesystem. Names are paths relative to the root of the ramdisk,
+ * separated by slashes, and aren't terminated. They live in a string table
+ * after the entries; both they and the data are located by their offset from
+ * the start of the image.
+ *
+ * Entries are sorted by name, comparing bytes as unsigned, with a name that is
+ * a prefix of another sorting first.
+ */
 struct qrfs_file_entry {
+	uint32_t name_start;
+	uint32_t name_length;
+
+	uint32_t file_start;
+	uint32_t length;
+	uint32_t attributes;
+} __attribute__((packed));
+
+// Entry in a version 1 or 2 filesystem, which are converted when loaded
+struct qrfs_file_entry_v1 {
 	const char name[32];
 
 	uint32_t file_start;
@@ -26,8 +56,30 @@ struct qrfs_file_entry {
 	uint32_t attributes;
 } __attribute__((packed));
 
+/*
+ * Compressed files start with this header, followed by the LZFX stream. The
+ * length in the file's entry is that of the uncompressed data. From version 3
+ * on, the stream leaves out the dword of zeros terminating the file.
+ */
+struct qrfs_compressed_header {
+	uint32_t stored_length;
+} __attribute__((packed));
+
 // Called when the multiboot loader finds the RAM disk (copy to kernel mem)
 void ramdisk_found(uint32_t addr, uint32_t size);
 
 bool ramdisk_loaded(void);
 void *ramdisk_fopen(const char *name);
+
+// Enumerating files, and looking them up by path (which need not be terminated)
+unsigned int ramdisk_num_files(void);
+qrfs_file_entry_t *ramdisk_get_file(unsigned int index);
+qrfs_file_entry_t *ramdisk_lookup(const char *name, size_t length);
+
+// Gets the path of a file (not terminated) and whether it's a directory
+char *ramdisk_file_name(qrfs_file_entry_t *file, size_t *length);
+bool ramdisk_file_is_directory(qrfs_file_entry_t *file);
+
+// Gets the data (decompressing it if needed), and size, of a file in the ramdisk
+void *ramdisk_file_data(qrfs_file_entry_t *file);
+size_t ramdisk_file_size(qrfs_file_entry_t *file);
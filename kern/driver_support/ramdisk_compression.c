@@ -6,11 +6,22 @@
 #if __GNUC__ >= 3
 #define fx_expect_false(expr)  __builtin_expect((expr) != 0, 0)
 #define fx_expect_true(expr)   __builtin_expect((expr) != 0, 1)
+
+// Copies a word; unaligned accesses are fine on x86
+#define fx_copy_word(dst, src)	__builtin_memcpy((dst), (src), LZFX_WORD)
 #else
 #define fx_expect_false(expr)  (expr)
 #define fx_expect_true(expr)   (expr)
+
+#define fx_copy_word(dst, src)	memcpy((dst), (src), LZFX_WORD)
 #endif
 
+/*
+ * The decompressor copies in words of this many bytes wherever the buffers
+ * have room for it to overshoot the end of a copy.
+ */
+#define LZFX_WORD			8
+
 typedef const uint8_t *LZSTATE[LZFX_HSIZE];
 
 // Hash functions
@@ -81,7 +92,8 @@ int lzfx_compress(const void *const ibuf, const unsigned int ilen, void *obuf, u
 	 */
 	lit = 0; op++;
 
-	hval = LZFX_FRST(ip);
+	// The hash reads two bytes, which a one byte input doesn't have
+	hval = (ilen >= 2) ? LZFX_FRST(ip) : 0;
 
 	while(ip + 2 < in_end) { // Next macro reads 2 bytes
 		hval = LZFX_NEXT(hval, ip);
@@ -199,11 +211,11 @@ int lzfx_decompress(const void* ibuf, unsigned int ilen, void* obuf, unsigned in
 	}
 
 	if(obuf == NULL){
-		if(olen != 0) return LZFX_EARGS;
+		if(*olen != 0) return LZFX_EARGS;
 		return lzfx_getsize(ibuf, ilen, olen);
 	}
 
-	do {
+	while(ip < in_end) {
 		unsigned int ctrl = *ip++;
 
 		// Format 000LLLLL: a literal byte string follows, of length L+1
@@ -217,9 +229,25 @@ int lzfx_decompress(const void* ibuf, unsigned int ilen, void* obuf, unsigned in
 
 			if(fx_expect_false(ip + ctrl > in_end)) return LZFX_ECORRUPT;
 
-			do {
-				*op++ = *ip++;
-			} while(--ctrl);
+			/*
+			 * Runs are at most 32 bytes, so copy them in words, unless that
+			 * would overshoot either buffer.
+			 */
+			if(fx_expect_true(op + LZFX_MAX_LIT <= out_end && ip + LZFX_MAX_LIT <= in_end)) {
+				uint8_t *const lit_end = op + ctrl;
+
+				do {
+					fx_copy_word(op, ip);
+					op += LZFX_WORD; ip += LZFX_WORD;
+				} while(op < lit_end);
+
+				ip -= op - lit_end;
+				op = lit_end;
+			} else {
+				do {
+					*op++ = *ip++;
+				} while(--ctrl);
+			}
 
 		/*  
 		 * Format #1 [LLLooooo oooooooo]: backref of length L+1+2
@@ -237,7 +265,10 @@ int lzfx_decompress(const void* ibuf, unsigned int ilen, void* obuf, unsigned in
 			unsigned int len = (ctrl >> 5);
 			uint8_t *ref = op - ((ctrl & 0x1f) << 8) -1;
 
-			if(len==7) len += *ip++;	// i.e. format #2
+			if(len==7) {	// i.e. format #2
+				if(fx_expect_false(ip >= in_end)) return LZFX_ECORRUPT;
+				len += *ip++;
+			}
 
 			len += 2;	// len is now #octets */
 
@@ -251,20 +282,40 @@ int lzfx_decompress(const void* ibuf, unsigned int ilen, void* obuf, unsigned in
 
 			if(fx_expect_false(ref < (uint8_t*)obuf)) return LZFX_ECORRUPT;
 
-			do {
-				*op++ = *ref++;
-			} while (--len);
+			/*
+			 * Copy in words if the reference is at least a word back, so
+			 * each word only reads bytes that were already written.
+			 * Closer references repeat a short pattern, byte by byte.
+			 */
+			if(fx_expect_true(op - ref >= LZFX_WORD && op + len + LZFX_WORD <= out_end)) {
+				uint8_t *const ref_end = op + len;
+
+				do {
+					fx_copy_word(op, ref);
+					op += LZFX_WORD; ref += LZFX_WORD;
+				} while(op < ref_end);
+
+				op = ref_end;
+			} else {
+				do {
+					*op++ = *ref++;
+				} while (--len);
+			}
 		}
 
-	} while (ip < in_end);
+	}
 
 	*olen = op - (uint8_t *)obuf;
 
 	return 0;
 
 guess:
+	// The output buffer is too small; report how large it needs to be
 	rc = lzfx_getsize(ip, ilen - (ip-(uint8_t*)ibuf), &remain_len);
-	if(rc>=0) *olen = remain_len + (op - (uint8_t*)obuf);
+	if(rc>=0) {
+		*olen = remain_len + (op - (uint8_t*)obuf);
+		rc = LZFX_ESIZE;
+	}
 	return rc;
 }
 
@@ -293,6 +344,7 @@ int lzfx_getsize(const void* ibuf, unsigned int ilen, unsigned int *olen){
 			unsigned int len = (ctrl >> 5);
 
 			if(len==7){	 // i.e. format #2
+				if(ip >= in_end) return LZFX_ECORRUPT;
 				len += *ip++;
 			}
 
@@ -9,6 +9,9 @@ static int ata_drivers_loaded = 0;
 // 300ms
 #define	ATA_WAIT_TIMEOUT		30
 
+// Largest DRQ block we will negotiate with SET MULTIPLE MODE
+#define ATA_MAX_MULTIPLE		16
+
 // Command/status port bit masks
 #define ATA_SR_BSY				0x80
 #define ATA_SR_DRDY				0x40
@@ -38,6 +41,12 @@ static int ata_drivers_loaded = 0;
 #define ATA_CMD_WRITE_PIO_EXT	0x34
 #define ATA_CMD_WRITE_DMA		0xCA
 #define ATA_CMD_WRITE_DMA_EXT	0x35
+#define ATA_CMD_READ_MULTIPLE	0xC4
+#define ATA_CMD_READ_MULTIPLE_EXT	0x29
+#define ATA_CMD_WRITE_MULTIPLE	0xC5
+#define ATA_CMD_WRITE_MULTIPLE_EXT	0x39
+#define ATA_CMD_SET_MULTIPLE	0xC6
+#define ATA_CMD_WRITE_MULTIPLE_FUA_EXT	0xCE
 #define ATA_CMD_CACHE_FLUSH		0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT	0xEA
 #define ATA_CMD_PACKET			0xA0
@@ -51,6 +60,7 @@ static int ata_drivers_loaded = 0;
 #define ATA_IDENT_SECTORS		12
 #define ATA_IDENT_SERIAL		20
 #define ATA_IDENT_MODEL			54
+#define ATA_IDENT_MAX_MULTIPLE	94
 #define ATA_IDENT_CAPABILITIES	98
 #define ATA_IDENT_FIELDVALID	106
 #define ATA_IDENT_MAX_LBA		120
@@ -60,6 +70,7 @@ static int ata_drivers_loaded = 0;
 #define ATA_IDENT_PIOCYC		134
 #define ATA_IDENT_PIOCYCIORDY	136
 #define ATA_IDENT_COMMANDSETS	164
+#define ATA_IDENT_FEATURES_EXT	168
 #define ATA_IDENT_UDMASUPPORT	176
 #define ATA_IDENT_MAX_LBA_EXT	200
 
@@ -86,14 +97,21 @@ static int ata_drivers_loaded = 0;
 static uint8_t ata_reg_read(ata_driver_t *drv, uint8_t channel, uint8_t reg);
 static void ata_reg_write(ata_driver_t *drv, unsigned char channel, unsigned char reg, unsigned char data);
 static void ata_do_pio_read(ata_driver_t *drv, void* dest, uint32_t num_words, uint8_t channel);
-static int ata_access_pio(ata_driver_t *drv, uint8_t rw, uint8_t drive, uint32_t lba, uint8_t numsects, void *buf);
+static int ata_access_pio(ata_driver_t *drv, uint8_t rw, uint8_t drive, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt);
+static int ata_access_pio_buf(ata_driver_t *drv, uint8_t rw, uint8_t drive, uint64_t lba, uint32_t numsects, void *buf);
+static void ata_set_multiple(ata_driver_t *drv, uint8_t drive);
 
 // Disk manager functions
 static hal_disk_error_t ata_disk_init(hal_disk_t *disk);
 static hal_disk_error_t ata_disk_reset(hal_disk_t *disk);
 
-static hal_disk_error_t ata_disk_read(hal_disk_t *disk, uint32_t lba, uint32_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx);
-static hal_disk_error_t ata_disk_write(hal_disk_t *disk, uint32_t lba, uint32_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx);
+static hal_disk_error_t ata_disk_read(hal_disk_t *disk, uint64_t lba, uint64_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx);
+static hal_disk_error_t ata_disk_write(hal_disk_t *disk, uint64_t lba, uint64_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx);
+static hal_disk_error_t ata_disk_write_fua(hal_disk_t *disk, uint64_t lba, uint64_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx);
+static hal_disk_error_t ata_disk_flush_cache(hal_disk_t *disk);
+
+static hal_disk_error_t ata_disk_readv(hal_disk_t *disk, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *id, hal_disk_callback_t callback, void* ctx);
+static hal_disk_error_t ata_disk_writev(hal_disk_t *disk, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *id, hal_disk_callback_t callback, void* ctx);
 
 // Function structs to access thingie
 hal_disk_functions_t ata_hal_disk_functions = {
@@ -101,7 +119,13 @@ hal_disk_functions_t ata_hal_disk_functions = {
 	.reset = ata_disk_reset,
 
 	.read = ata_disk_read,
-	.write = ata_disk_write
+	.write = ata_disk_write,
+	.write_fua = ata_disk_write_fua,
+
+	.readv = ata_disk_readv,
+	.writev = ata_disk_writev,
+
+	.flush_cache = ata_disk_flush_cache
 };
 
 /*
@@ -231,7 +255,11 @@ ata_driver_t* ata_init_pci(uint32_t BAR0, uint32_t BAR1, uint32_t BAR2, uint32_t
  
 			// Get size of drive
 			if (driver->devices[count].commandSets & (1 << 26)) { // 48-bit LBA
-				driver->devices[count].size	= *((uint32_t *) (ide_buf + ATA_IDENT_MAX_LBA_EXT));
+				driver->devices[count].lba48 = true;
+
+				// WRITE MULTIPLE FUA EXT is only defined for LBA48 drives
+				driver->devices[count].fua = (*((uint16_t *) (ide_buf + ATA_IDENT_FEATURES_EXT)) & (1 << 6)) ? true : false;
+				driver->devices[count].size	= *((uint64_t *) (ide_buf + ATA_IDENT_MAX_LBA_EXT));
 			} else { // CHS or 28 bit addressing
 				driver->devices[count].size	= *((uint32_t *) (ide_buf + ATA_IDENT_MAX_LBA));
 			}
@@ -343,9 +371,14 @@ ata_driver_t* ata_init_pci(uint32_t BAR0, uint32_t BAR1, uint32_t BAR2, uint32_t
 			disk->drive_number = count;
 			disk->driver = driver;
 			disk->interface = kDiskInterfacePATA;
+			disk->num_sectors = driver->devices[count].size;
+			disk->max_transfer = driver->devices[count].lba48 ? ATA_MAX_SECTORS_LBA48 : ATA_MAX_SECTORS_LBA28;
 
 			// If the drive is a hard disk, we know that it's got media loaded
 			if(!isATAPI) {
+				// Try to transfer several sectors per DRQ block
+				ata_set_multiple(driver, count);
+
 				disk->type = kDiskTypeHardDrive;
 				disk->media_loaded = true;
 			} else {
@@ -365,9 +398,9 @@ ata_driver_t* ata_init_pci(uint32_t BAR0, uint32_t BAR1, uint32_t BAR2, uint32_t
 	for (int i = 0; i < 4; i++) {
 		if (driver->devices[i].drive_exists == true) {
 			if(driver->devices[i].type == ATA_DEVICE_TYPE_ATA) {
-				KDEBUG("Found ATA drive (%s) of %u sectors (Multiword DMA %u, UDMA %u, PIO %u)", driver->devices[i].model, (unsigned int)(driver->devices[i].size & 0xFFFFFFFF), driver->devices[i].mwdma_supported, driver->devices[i].udma_supported, driver->devices[count].pio_supported);
+				KDEBUG("Found ATA drive (%s) of %u MiB (Multiword DMA %u, UDMA %u, PIO %u, %u sectors/block)", driver->devices[i].model, (unsigned int) (driver->devices[i].size / 2048), driver->devices[i].mwdma_supported, driver->devices[i].udma_supported, driver->devices[i].pio_supported, driver->devices[i].multiple_sectors);
 			} else {
-				KDEBUG("Found ATAPI drive (%s) of %u sectors", driver->devices[i].model, (unsigned int)(driver->devices[i].size & 0xFFFFFFFF));
+				KDEBUG("Found ATAPI drive (%s) of %u MiB", driver->devices[i].model, (unsigned int) (driver->devices[i].size / 2048));
 			}
 		}
 	}
@@ -388,6 +421,9 @@ void ata_deinit(ata_driver_t *driver) {
 	for(int i = 0; i < 4; i++) {
 		if(driver->devices[i].drive_exists) {
 			// Send a flush cache command
+			if(driver->devices[i].type == ATA_DEVICE_TYPE_ATA) {
+				ata_flush_cache(driver, i);
+			}
 
 			// Release ATA info
 			if(driver->devices[i].ata_info) {
@@ -477,14 +513,8 @@ static void ata_reg_write(ata_driver_t *drv, unsigned char channel, unsigned cha
 static void ata_do_pio_read(ata_driver_t *drv, void* dest, uint32_t num_words, uint8_t channel) {
 	ata_reg_write(drv, channel, ATA_REG_CONTROL, 0x80 | drv->channels[channel].nIEN);
 
-	uint16_t *dest_ptr = (uint16_t *) dest;
-
 	// Read from PIO data port
-	static uint16_t temp;
-	for(int i = 0; i < num_words; i++) {
-		temp = io_inw(drv->channels[channel].base);
-		*dest_ptr++ = temp;
-	}
+	io_insw(drv->channels[channel].base, dest, num_words);
 
 	ata_reg_write(drv, channel, ATA_REG_CONTROL, drv->channels[channel].nIEN);
 }
@@ -531,6 +561,53 @@ int ata_poll_ready(ata_driver_t *drv, uint8_t channel, bool advanced_check) {
 	return 0;
 }
 
+/*
+ * Negotiates the number of sectors the drive transfers per DRQ block for the
+ * READ/WRITE MULTIPLE commands, using the largest block size the drive reports
+ * up to ATA_MAX_MULTIPLE. If the drive rejects the command, multiple mode is
+ * left disabled and transfers fall back to a sector per block.
+ */
+static void ata_set_multiple(ata_driver_t *drv, uint8_t drive) {
+	ata_device_t *dev = &drv->devices[drive];
+	uint8_t channel = dev->channel;
+
+	dev->multiple_sectors = 0;
+
+	// Bits 0-7 of word 47 are the maximum number of sectors per block
+	uint8_t max = *((uint16_t *) (dev->ata_info->ata_identify + ATA_IDENT_MAX_MULTIPLE)) & 0xFF;
+
+	if(max > ATA_MAX_MULTIPLE) {
+		max = ATA_MAX_MULTIPLE;
+	}
+
+	if(max < 2) {
+		return;
+	}
+
+	// Block sizes must be a power of two
+	uint8_t sectors = 1;
+	while((sectors << 1) <= max) {
+		sectors <<= 1;
+	}
+
+	// Select drive and issue SET MULTIPLE MODE
+	ata_reg_write(drv, channel, ATA_REG_HDDEVSEL, 0xE0 | ((dev->drive & 0x01) << 4));
+	ata_reg_write(drv, channel, ATA_REG_SECCOUNT0, sectors);
+	ata_reg_write(drv, channel, ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+
+	if(ata_poll_ready(drv, channel, false)) {
+		return;
+	}
+
+	// The drive aborts the command if it doesn't like the block size
+	if(ata_reg_read(drv, channel, ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF)) {
+		KWARNING("IDE: drive %u rejected SET MULTIPLE MODE (%u sectors)", drive, sectors);
+		return;
+	}
+
+	dev->multiple_sectors = sectors;
+}
+
 // ! Miscellaneous
 /*
  * Called when all drivers are loaded to attempt legacy ATA probing
@@ -600,9 +677,9 @@ static int ata_convert_error(ata_driver_t *drv, int drive, int err) {
  * Reads a certain number of sectors from the specified drive using either DMA
  * or PIO, into the user-supplied buffer.
  */
-int ata_read(ata_driver_t *drv, uint8_t drive, uint32_t lba, uint8_t sectors, void *buffer) {
+int ata_read(ata_driver_t *drv, uint8_t drive, uint64_t lba, uint32_t sectors, void *buffer) {
 	if(buffer) {
-		return ata_access_pio(drv, ATA_READ, drive, lba, sectors, buffer);
+		return ata_access_pio_buf(drv, ATA_READ, drive, lba, sectors, buffer);
 	} else {
 		return -1;
 	}
@@ -612,56 +689,145 @@ int ata_read(ata_driver_t *drv, uint8_t drive, uint32_t lba, uint8_t sectors, vo
  * Writes a certain number of sectors from the specified buffer to the LBA
  * specified on the selected drive.
  */
-int ata_write(ata_driver_t *drv, uint8_t drive, uint32_t lba, uint8_t sectors, void *buffer) {
+int ata_write(ata_driver_t *drv, uint8_t drive, uint64_t lba, uint32_t sectors, void *buffer) {
 	if(buffer) {
-		return ata_access_pio(drv, ATA_WRITE, drive, lba, sectors, buffer);
+		return ata_access_pio_buf(drv, ATA_WRITE, drive, lba, sectors, buffer);
 	} else {
 		return -1;
 	}	
 }
 
+/*
+ * Writes to the drive, with the data on stable media when this returns. Uses
+ * FUA writes if the drive supports them, otherwise the write is followed by
+ * a cache flush.
+ */
+int ata_write_fua(ata_driver_t *drv, uint8_t drive, uint64_t lba, uint32_t sectors, void *buffer) {
+	int err;
+
+	if(!buffer) {
+		return -1;
+	}
+
+	if(drv->devices[drive].fua && drv->devices[drive].multiple_sectors) {
+		return ata_access_pio_buf(drv, ATA_WRITE_FUA, drive, lba, sectors, buffer);
+	}
+
+	if((err = ata_access_pio_buf(drv, ATA_WRITE, drive, lba, sectors, buffer))) {
+		return err;
+	}
+
+	return ata_flush_cache(drv, drive);
+}
+
+/*
+ * Reads from the drive into several buffers. The segments are filled in order,
+ * starting at the given LBA; each must be a multiple of the sector size.
+ */
+int ata_readv(ata_driver_t *drv, uint8_t drive, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt) {
+	if(iov && iovcnt) {
+		return ata_access_pio(drv, ATA_READ, drive, lba, iov, iovcnt);
+	} else {
+		return -1;
+	}
+}
+
+/*
+ * Writes to the drive from several buffers, which are written to consecutive
+ * sectors starting at the given LBA.
+ */
+int ata_writev(ata_driver_t *drv, uint8_t drive, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt) {
+	if(iov && iovcnt) {
+		return ata_access_pio(drv, ATA_WRITE, drive, lba, iov, iovcnt);
+	} else {
+		return -1;
+	}
+}
+
+/*
+ * Performs a read or write into a single contiguous buffer.
+ */
+static int ata_access_pio_buf(ata_driver_t *drv, uint8_t rw, uint8_t drive, uint64_t lba, uint32_t numsects, void *buf) {
+	hal_disk_iovec_t iov = {
+		.buffer = buf,
+		.phys = 0,
+		.length = numsects * 512
+	};
+
+	return ata_access_pio(drv, rw, drive, lba, &iov, 1);
+}
+
 /*
  * Performs a read or write from a regular ATA drive.
  *
+ * If the drive accepted SET MULTIPLE MODE, READ/WRITE MULTIPLE are used so
+ * that the drive only has to be polled once per block of sectors, rather than
+ * once per sector. The data itself is moved with string IO instructions,
+ * directly into (or out of) each of the segments in the IO vector.
+ *
+ * Writes are regular cached writes: the caller is responsible for flushing the
+ * drive's cache at ordering points, or using ATA_WRITE_FUA. The latter is only
+ * valid if the drive supports FUA and has multiple mode enabled.
+ *
  * Note that this does NOT work on ATAPI drives.
  */
-static int ata_access_pio(ata_driver_t *drv, uint8_t rw, uint8_t drive, uint32_t lba, uint8_t numsects, void *buf) {
+static int ata_access_pio(ata_driver_t *drv, uint8_t rw, uint8_t drive, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt) {
 	// 1 = LBA28, 2 = LBA48
 	unsigned int lba_mode = 2;
 	uint8_t cmd = 0;
 
+	ata_device_t *dev = &drv->devices[drive];
+
 	uint8_t lba_io[6] = {0, 0, 0, 0, 0, 0};
-	uint8_t channel = drv->devices[drive].channel; // channel
-	uint8_t slavebit = drv->devices[drive].drive & 0x01; // master/slave
+	uint8_t channel = dev->channel; // channel
+	uint8_t slavebit = dev->drive & 0x01; // master/slave
 	uint16_t bus_io_reg = drv->channels[channel].base; // Bus base address
 
 	// Size of a single sector in words (assume 512)
 	unsigned int sectorSize = 256;
 
-	unsigned int i;
+	// Number of sectors transferred per DRQ block
+	unsigned int blockSize = dev->multiple_sectors ? dev->multiple_sectors : 1;
+
 	uint8_t head = 0, err;
 
+	// Get the total length of the request
+	uint32_t numsects = 0;
+
+	for(unsigned int i = 0; i < iovcnt; i++) {
+		if(iov[i].length % 512) {
+			return ATA_ERR_INVALID;
+		}
+
+		numsects += iov[i].length / 512;
+	}
+
 	// Ensure the LBA is within range of this device's size
-	if(lba > drv->devices[drive].size) {
+	if(lba >= dev->size || numsects == 0) {
 		return ATA_ERR_INVALID;
 	}
 
 	// Ensure we don't try to read past the end of the drive
-	if(lba + numsects > drv->devices[drive].size) {
-		numsects = (lba + numsects) - drv->devices[drive].size;
+	if(lba + numsects > dev->size) {
+		numsects = dev->size - lba;
+	}
+
+	// The HAL splits requests larger than this
+	if(numsects > (dev->lba48 ? ATA_MAX_SECTORS_LBA48 : ATA_MAX_SECTORS_LBA28)) {
+		return ATA_ERR_INVALID;
 	}
 
 	// Select the appropriate addressing mode
-	if(lba >= 0x10000000) { // LBA48
+	if(dev->lba48 && (rw == ATA_WRITE_FUA || lba >= 0x10000000 || (lba + numsects) > 0x10000000 || numsects > ATA_MAX_SECTORS_LBA28)) { // LBA48
 		lba_mode  = 2;
-		lba_io[0] = (lba & 0x000000FF) >> 0;
-		lba_io[1] = (lba & 0x0000FF00) >> 8;
-		lba_io[2] = (lba & 0x00FF0000) >> 16;
-		lba_io[3] = (lba & 0xFF000000) >> 24;
-		lba_io[4] = 0;
-		lba_io[5] = 0;
+		lba_io[0] = (lba >> 0) & 0xFF;
+		lba_io[1] = (lba >> 8) & 0xFF;
+		lba_io[2] = (lba >> 16) & 0xFF;
+		lba_io[3] = (lba >> 24) & 0xFF;
+		lba_io[4] = (lba >> 32) & 0xFF;
+		lba_io[5] = (lba >> 40) & 0xFF;
 		head = 0;
-	} else if(drv->devices[drive].capabilities & 0x200)  { // LBA28
+	} else if(dev->capabilities & 0x200)  { // LBA28
 		lba_mode  = 1;
 		lba_io[0] = (lba & 0x00000FF) >> 0;
 		lba_io[1] = (lba & 0x000FF00) >> 8;
@@ -683,70 +849,134 @@ static int ata_access_pio(ata_driver_t *drv, uint8_t rw, uint8_t drive, uint32_t
 	// Select drive and LBA mode
 	ata_reg_write(drv, channel, ATA_REG_HDDEVSEL, 0xE0 | (slavebit << 4) | head);
 
-	// Write parameters
+	/*
+	 * Write parameters. A sector count of 0 means 256 sectors for LBA28, and
+	 * 65536 sectors for LBA48, so truncating the count does the right thing.
+	 */
 	if (lba_mode == 2) { // Write LBA48 special regs
-		ata_reg_write(drv, channel, ATA_REG_SECCOUNT1, 0);
+		ata_reg_write(drv, channel, ATA_REG_SECCOUNT1, (numsects >> 8) & 0xFF);
 		ata_reg_write(drv, channel, ATA_REG_LBA3, lba_io[3]);
 		ata_reg_write(drv, channel, ATA_REG_LBA4, lba_io[4]);
 		ata_reg_write(drv, channel, ATA_REG_LBA5, lba_io[5]);
 	}
 
-	ata_reg_write(drv, channel, ATA_REG_SECCOUNT0, numsects);
+	ata_reg_write(drv, channel, ATA_REG_SECCOUNT0, numsects & 0xFF);
 	ata_reg_write(drv, channel, ATA_REG_LBA0, lba_io[0]);
 	ata_reg_write(drv, channel, ATA_REG_LBA1, lba_io[1]);
 	ata_reg_write(drv, channel, ATA_REG_LBA2, lba_io[2]);
 
 	// Select correct command
-	if (lba_mode == 1 && rw == ATA_READ) cmd = ATA_CMD_READ_PIO;
-	else if (lba_mode == 2 && rw == ATA_READ) cmd = ATA_CMD_READ_PIO_EXT;
-	else if (lba_mode == 1 && rw == ATA_WRITE) cmd = ATA_CMD_WRITE_PIO;
-	else if (lba_mode == 2 && rw == ATA_WRITE) cmd = ATA_CMD_WRITE_PIO_EXT;
+	if(rw == ATA_WRITE_FUA) {
+		cmd = ATA_CMD_WRITE_MULTIPLE_FUA_EXT;
+	} else if(dev->multiple_sectors) {
+		if (lba_mode == 1 && rw == ATA_READ) cmd = ATA_CMD_READ_MULTIPLE;
+		else if (lba_mode == 2 && rw == ATA_READ) cmd = ATA_CMD_READ_MULTIPLE_EXT;
+		else if (lba_mode == 1 && rw == ATA_WRITE) cmd = ATA_CMD_WRITE_MULTIPLE;
+		else if (lba_mode == 2 && rw == ATA_WRITE) cmd = ATA_CMD_WRITE_MULTIPLE_EXT;
+	} else {
+		if (lba_mode == 1 && rw == ATA_READ) cmd = ATA_CMD_READ_PIO;
+		else if (lba_mode == 2 && rw == ATA_READ) cmd = ATA_CMD_READ_PIO_EXT;
+		else if (lba_mode == 1 && rw == ATA_WRITE) cmd = ATA_CMD_WRITE_PIO;
+		else if (lba_mode == 2 && rw == ATA_WRITE) cmd = ATA_CMD_WRITE_PIO_EXT;
+	}
 
 	// Send command
 	ata_reg_write(drv, channel, ATA_REG_COMMAND, cmd);
 
 	/*
-	 * To read and receive blocks, we use "rep insw"/"rep outsw" instructions.
-	 * They expect the number of words in ECX, IO port in EDX, and address to
-	 * use in ES:EDI.
+	 * Data is moved a DRQ block at a time: the drive is polled once, then the
+	 * whole block is moved with "rep insw"/"rep outsw". The last block may be
+	 * shorter than the negotiated block size. A block may span several
+	 * segments, so it's moved in as many pieces as needed.
 	 */
-	uint16_t *buffer = (uint16_t *) buf;
-
-	// Read or write data to the device
-	if (rw == ATA_READ) { // Read
-		for (uint8_t s = 0; s < numsects; s++) {
-			// Wait for drive to have a sector available
-			if ((err = ata_poll_ready(drv, channel, true))) {
-				KERROR("IDE: Device read error 0x%x (disk %u on channel %u, LBA 0x%X size 0x%X)", ata_convert_error(drv, drive, err), slavebit, channel, (unsigned int) lba, numsects);
-				return ata_convert_error(drv, drive, err);
+	uint16_t *buffer = (uint16_t *) iov[0].buffer;
+	uint32_t segmentWords = iov[0].length / 2;
+	unsigned int segment = 0;
+
+	uint32_t remaining = numsects;
+
+	while(remaining) {
+		unsigned int sectors = (remaining > blockSize) ? blockSize : remaining;
+
+		// Wait for the drive to be ready to transfer the next block
+		if ((err = ata_poll_ready(drv, channel, true))) {
+			KERROR("IDE: Device %s error 0x%x (disk %u on channel %u, LBA 0x%X%08X size 0x%X)", (rw == ATA_READ) ? "read" : "write", ata_convert_error(drv, drive, err), slavebit, channel, (unsigned int) (lba >> 32), (unsigned int) lba, (unsigned int) numsects);
+			return ata_convert_error(drv, drive, err);
+		}
+
+		uint32_t blockWords = sectors * sectorSize;
+
+		while(blockWords) {
+			// Advance to the next segment
+			while(!segmentWords) {
+				segment++;
+				buffer = (uint16_t *) iov[segment].buffer;
+				segmentWords = iov[segment].length / 2;
 			}
 
-			// Receive 256 words
-			for(unsigned int b = 0; b < sectorSize; b++) {
-				buffer[b] = io_inw(bus_io_reg);
+			uint32_t words = (blockWords > segmentWords) ? segmentWords : blockWords;
+
+			if (rw == ATA_READ) {
+				io_insw(bus_io_reg, buffer, words);
+			} else {
+				io_outsw(bus_io_reg, buffer, words);
 			}
 
-			buffer += sectorSize;
+			buffer += words;
+			segmentWords -= words;
+			blockWords -= words;
 		}
-	} else { // Write
-		for (uint8_t s = 0; s < numsects; s++) {
-			// Wait for the device to be ready to accept another sector
-			ata_poll_ready(drv, channel, false);
-
-			// Write a sector of data
-			for(unsigned int b = 0; b < sectorSize; b++) {
-				io_outw(bus_io_reg, buffer[b]);
-			}
 
-			buffer += sectorSize;
+		remaining -= sectors;
+	}
+
+	if (rw != ATA_READ) {
+		// Wait for the drive to finish writing the last block
+		if ((err = ata_poll_ready(drv, channel, false))) {
+			err = ata_convert_error(drv, drive, err);
+
+			KERROR("IDE: Device write error 0x%x (disk %u on channel %u, LBA 0x%X%08X size 0x%X)", err, slavebit, channel, (unsigned int) (lba >> 32), (unsigned int) lba, (unsigned int) numsects);
+			return err;
+		}
+
+		if (ata_reg_read(drv, channel, ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF)) {
+			err = (ata_reg_read(drv, channel, ATA_REG_STATUS) & ATA_SR_DF) ? 1 : 2;
+
+			KERROR("IDE: Device write error 0x%x (disk %u on channel %u, LBA 0x%X%08X size 0x%X)", ata_convert_error(drv, drive, err), slavebit, channel, (unsigned int) (lba >> 32), (unsigned int) lba, (unsigned int) numsects);
+			return ata_convert_error(drv, drive, err);
 		}
+	}
+
+	return ATA_ERR_NONE;
+}
 
-		// Flush cache after writing
-		uint8_t cacheCmd[3] = {ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH_EXT};
-		ata_reg_write(drv, channel, ATA_REG_COMMAND, cacheCmd[lba_mode]);
+/*
+ * Writes the contents of the drive's write cache to the media, and waits for
+ * the drive to complete the operation.
+ */
+int ata_flush_cache(ata_driver_t *drv, uint8_t drive) {
+	ata_device_t *dev = &drv->devices[drive];
+	uint8_t channel = dev->channel;
+	int err;
+
+	// Wait until the channel is no longer busy, but not forever
+	if((err = ata_poll_ready(drv, channel, false))) {
+		KERROR("IDE: Channel %u stuck busy before cache flush", channel);
+		return err;
+	}
+
+	// Select drive and send the command
+	ata_reg_write(drv, channel, ATA_REG_HDDEVSEL, 0xE0 | ((dev->drive & 0x01) << 4));
+	ata_reg_write(drv, channel, ATA_REG_COMMAND, dev->lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+
+	// Wait for the flush to complete
+	if((err = ata_poll_ready(drv, channel, false))) {
+		return err;
+	}
 
-		// Wait for the device to be ready again
-		ata_poll_ready(drv, channel, false);
+	if(ata_reg_read(drv, channel, ATA_REG_STATUS) & ATA_SR_ERR) {
+		KERROR("IDE: Cache flush failed on drive %u", drive);
+		return ata_convert_error(drv, drive, 2);
 	}
 
 	return ATA_ERR_NONE;
@@ -771,35 +1001,82 @@ static hal_disk_error_t ata_disk_reset(hal_disk_t *disk) {
 	return kDiskErrorNone;
 }
 
-static hal_disk_error_t ata_disk_read(hal_disk_t *disk, uint32_t lba, uint32_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
+static hal_disk_error_t ata_disk_read(hal_disk_t *disk, uint64_t lba, uint64_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
 	ata_driver_t *drv = (ata_driver_t *) disk->driver;
-	*id = drv->last_access_id++;
+	unsigned int access_id = drv->last_access_id++;
 
-	int r = ata_read(drv, (uint8_t) disk->drive_number, lba, (uint8_t) length, buffer);
+	if(id) {
+		*id = access_id;
+	}
+
+	int r = ata_read(drv, (uint8_t) disk->drive_number, lba, (uint32_t) length, buffer);
 
 	/*
-	 * If there's an error, set the buffer to NULL and instead of passing the
-	 * context, pass a pointer to the error.
+	 * PIO transfers complete synchronously, so the request is always accepted;
+	 * on error, the buffer passed to the callback is NULL.
 	 */
-	if(!r) {
-		callback(*id, buffer, ctx);
-	} else {
-		callback(*id, NULL, &r);
+	callback(access_id, r ? NULL : buffer, ctx, r);
+
+	return kDiskErrorNone;
+}
+
+static hal_disk_error_t ata_disk_write(hal_disk_t *disk, uint64_t lba, uint64_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
+	ata_driver_t *drv = (ata_driver_t *) disk->driver;
+	unsigned int access_id = drv->last_access_id++;
+
+	if(id) {
+		*id = access_id;
 	}
 
-	return r;
+	int r = ata_write(drv, (uint8_t) disk->drive_number, lba, (uint32_t) length, buffer);
+	callback(access_id, r ? NULL : buffer, ctx, r);
+
+	return kDiskErrorNone;
 }
 
-static hal_disk_error_t ata_disk_write(hal_disk_t *disk, uint32_t lba, uint32_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
+static hal_disk_error_t ata_disk_write_fua(hal_disk_t *disk, uint64_t lba, uint64_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
 	ata_driver_t *drv = (ata_driver_t *) disk->driver;
-	*id = drv->last_access_id++;
+	unsigned int access_id = drv->last_access_id++;
 
-	int r = ata_write(drv, (uint8_t) disk->drive_number, lba, (uint8_t) length, buffer);
-	if(!r) {
-		callback(*id, buffer, ctx);
-	} else {
-		callback(*id, NULL, &r);
+	if(id) {
+		*id = access_id;
+	}
+
+	int r = ata_write_fua(drv, (uint8_t) disk->drive_number, lba, (uint32_t) length, buffer);
+	callback(access_id, r ? NULL : buffer, ctx, r);
+
+	return kDiskErrorNone;
+}
+
+static hal_disk_error_t ata_disk_flush_cache(hal_disk_t *disk) {
+	ata_driver_t *drv = (ata_driver_t *) disk->driver;
+	return ata_flush_cache(drv, (uint8_t) disk->drive_number);
+}
+
+static hal_disk_error_t ata_disk_readv(hal_disk_t *disk, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
+	ata_driver_t *drv = (ata_driver_t *) disk->driver;
+	unsigned int access_id = drv->last_access_id++;
+
+	if(id) {
+		*id = access_id;
 	}
 
-	return r;
-}
\ No newline at end of file
+	int r = ata_readv(drv, (uint8_t) disk->drive_number, lba, iov, iovcnt);
+	callback(access_id, r ? NULL : iov, ctx, r);
+
+	return kDiskErrorNone;
+}
+
+static hal_disk_error_t ata_disk_writev(hal_disk_t *disk, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
+	ata_driver_t *drv = (ata_driver_t *) disk->driver;
+	unsigned int access_id = drv->last_access_id++;
+
+	if(id) {
+		*id = access_id;
+	}
+
+	int r = ata_writev(drv, (uint8_t) disk->drive_number, lba, iov, iovcnt);
+	callback(access_id, r ? NULL : iov, ctx, r);
+
+	return kDiskErrorNone;
+}
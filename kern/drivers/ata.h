@@ -2,6 +2,7 @@
 #define ATA_PIO_H
 
 #import <types.h>
+#import "hal/disk.h"
 
 #define ATA_PRIMARY						0x00
 #define ATA_SECONDARY					0x01
@@ -14,6 +15,7 @@
 
 #define	ATA_READ						0x00
 #define ATA_WRITE						0x01
+#define ATA_WRITE_FUA					0x02
 
 #define ATA_ERR_NONE					0x00 // great success, many good, very ATA
 #define ATA_ERR_MISC					0x01 // unexpected stuff
@@ -33,6 +35,10 @@
 #define ATA_ERR_NO_MEDIA				0x0F // no media present in removable media device
 #define ATA_ERR_INVALID					0xFF // invalid inputs to function
 
+// Largest number of sectors a single command can transfer
+#define ATA_MAX_SECTORS_LBA28			256
+#define ATA_MAX_SECTORS_LBA48			65536
+
 /*
  * DMA modes
  */
@@ -87,7 +93,11 @@ struct ata_device {
 	uint16_t capabilities; // features
 	uint32_t commandSets; // supported comamnd sets
 
-	uint32_t size; // size in sectors
+	uint64_t size; // size in sectors
+	bool lba48; // set if the device supports 48-bit addressing
+	bool fua; // set if the device supports Force Unit Access writes
+
+	uint8_t multiple_sectors; // sectors per DRQ block for READ/WRITE MULTIPLE (0 = disabled)
 	
 	char model[42]; // model name string
 
@@ -141,8 +151,13 @@ struct ata_driver {
 ata_driver_t* ata_init_pci(uint32_t BAR0, uint32_t BAR1, uint32_t BAR2, uint32_t BAR3, uint32_t BAR4);
 void ata_deinit(ata_driver_t *driver);
 
-int ata_read(ata_driver_t *drv, uint8_t drive, uint32_t lba, uint8_t sectors, void *buffer);
-int ata_write(ata_driver_t *drv, uint8_t drive, uint32_t lba, uint8_t sectors, void *buffer);
+int ata_read(ata_driver_t *drv, uint8_t drive, uint64_t lba, uint32_t sectors, void *buffer);
+int ata_write(ata_driver_t *drv, uint8_t drive, uint64_t lba, uint32_t sectors, void *buffer);
+int ata_write_fua(ata_driver_t *drv, uint8_t drive, uint64_t lba, uint32_t sectors, void *buffer);
+int ata_flush_cache(ata_driver_t *drv, uint8_t drive);
+
+int ata_readv(ata_driver_t *drv, uint8_t drive, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt);
+int ata_writev(ata_driver_t *drv, uint8_t drive, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt);
 
 void ata_irq_callback(ata_driver_t *drv);
 
@@ -0,0 +1,558 @@
+#import <types.h>
+#import "virtio_blk.h"
+#import "hal/hal.h"
+#import "bus/pci.h"
+#import "paging/paging.h"
+
+#define DRIVER_NAME "virtio Block Device"
+
+// Compiler barrier: x86 doesn't reorder stores, but gcc might
+#define virtio_barrier() __asm__ volatile("" : : : "memory")
+
+// Number of virtio block devices found so far
+static unsigned int virtio_blk_count = 0;
+
+// Private functions
+static bool virtio_blk_match(device_t *dev);
+static void *virtio_blk_init(device_t *dev);
+
+static bool virtio_blk_setup_queue(virtio_blk_t *vblk);
+static unsigned int virtio_blk_virt_to_phys(void *addr);
+
+static hal_disk_error_t virtio_blk_submit(virtio_blk_t *vblk, uint32_t type, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt, void *buffer, unsigned int *id, hal_disk_callback_t callback, void *ctx);
+static int virtio_blk_add_segment(virtio_blk_t *vblk, virtio_blk_request_t *req, int n, void *buffer, unsigned int phys, size_t length, uint16_t flags);
+static void virtio_blk_process_used(virtio_blk_t *vblk);
+static void virtio_blk_irq(void *ctx);
+
+static void virtio_blk_flush_callback(unsigned int id, void *buf, void *ctx, hal_disk_error_t err);
+
+// Disk manager functions
+static hal_disk_error_t virtio_blk_disk_init(hal_disk_t *disk);
+static hal_disk_error_t virtio_blk_disk_reset(hal_disk_t *disk);
+
+static hal_disk_error_t virtio_blk_disk_read(hal_disk_t *disk, uint64_t lba, uint64_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx);
+static hal_disk_error_t virtio_blk_disk_write(hal_disk_t *disk, uint64_t lba, uint64_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx);
+static hal_disk_error_t virtio_blk_disk_readv(hal_disk_t *disk, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *id, hal_disk_callback_t callback, void* ctx);
+static hal_disk_error_t virtio_blk_disk_writev(hal_disk_t *disk, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *id, hal_disk_callback_t callback, void* ctx);
+static hal_disk_error_t virtio_blk_disk_flush_cache(hal_disk_t *disk);
+static void virtio_blk_disk_poll(hal_disk_t *disk);
+
+// Function structs to access thingie
+static const hal_disk_functions_t virtio_blk_hal_disk_functions = {
+	.init = virtio_blk_disk_init,
+	.reset = virtio_blk_disk_reset,
+
+	.read = virtio_blk_disk_read,
+	.write = virtio_blk_disk_write,
+
+	.readv = virtio_blk_disk_readv,
+	.writev = virtio_blk_disk_writev,
+
+	.flush_cache = virtio_blk_disk_flush_cache,
+	.poll = virtio_blk_disk_poll
+};
+
+// Driver definition
+static const driver_t driver = {
+	.name = DRIVER_NAME,
+	.supportsDevice = virtio_blk_match,
+	.getDriverData = virtio_blk_init
+};
+
+/*
+ * Register the driver.
+ */
+static int virtio_blk_driver_register(void) {
+	hal_bus_register_driver((driver_t *) &driver, BUS_NAME_PCI);
+	return 0;
+}
+module_driver_init(virtio_blk_driver_register);
+
+/*
+ * Only legacy (transitional) block devices are supported, since those can be
+ * driven entirely through the I/O BAR.
+ */
+static bool virtio_blk_match(device_t *d) {
+	pci_device_t *dev = (pci_device_t *) d;
+
+	if(dev->ident.vendor == VIRTIO_PCI_VENDOR && dev->ident.device == VIRTIO_PCI_DEVICE_BLK) {
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Initialises a virtio block device: negotiates features, sets up the
+ * request queue and registers the disk with the HAL.
+ */
+static void *virtio_blk_init(device_t *d) {
+	pci_device_t *dev = (pci_device_t *) d;
+	pci_bar_t *bar = &dev->function[0].bar[0];
+
+	if(!(bar->flags & kPCIBARFlagsIOAddress)) {
+		KERROR("virtio-blk: BAR0 is not an I/O BAR");
+		return NULL;
+	}
+
+	virtio_blk_t *vblk = (virtio_blk_t *) kmalloc(sizeof(virtio_blk_t));
+	ASSERT(vblk);
+
+	memclr(vblk, sizeof(virtio_blk_t));
+	vblk->io_base = (uint16_t) bar->start;
+
+	// Enable I/O space access and bus mastering, and get the IRQ line
+	uint32_t addr = pci_config_address(dev->location.bus, dev->location.device, 0, 0x04);
+	pci_config_write_l(addr, pci_config_read_l(addr) | 0x05);
+
+	addr = pci_config_address(dev->location.bus, dev->location.device, 0, 0x3C);
+	vblk->irq = pci_config_read_l(addr) & 0xFF;
+
+	// Reset the device, then tell it we found it and know how to drive it
+	io_outb(vblk->io_base + VIRTIO_REG_DEVICE_STATUS, 0);
+	io_outb(vblk->io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	io_outb(vblk->io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	// Negotiate features
+	uint32_t features = io_inl(vblk->io_base + VIRTIO_REG_DEVICE_FEATURES);
+
+	if(!(features & VIRTIO_RING_F_INDIRECT_DESC)) {
+		KERROR("virtio-blk: device doesn't support indirect descriptors");
+		goto fail;
+	}
+
+	vblk->features = features & (VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_SEG_MAX);
+	io_outl(vblk->io_base + VIRTIO_REG_GUEST_FEATURES, vblk->features);
+
+	// Set up the request queue
+	if(!virtio_blk_setup_queue(vblk)) {
+		goto fail;
+	}
+
+	// Each request has room for this many data descriptors
+	vblk->max_segments = VIRTIO_BLK_INDIRECT_DESCS - 2;
+
+	if(vblk->features & VIRTIO_BLK_F_SEG_MAX) {
+		uint32_t seg_max = io_inl(vblk->io_base + VIRTIO_BLK_REG_SEG_MAX);
+
+		if(seg_max && seg_max < vblk->max_segments) {
+			vblk->max_segments = seg_max;
+		}
+	}
+
+	// Segments may be split at page boundaries, so a sector can take two
+	if(vblk->max_segments < 2) {
+		KERROR("virtio-blk: device only accepts %u segments", vblk->max_segments);
+		goto fail;
+	}
+
+	// Register the disk
+	hal_disk_t *disk = hal_disk_alloc();
+	ASSERT(disk);
+
+	disk->f = virtio_blk_hal_disk_functions;
+	disk->drive_number = virtio_blk_count++;
+	disk->driver = vblk;
+	disk->interface = kDiskInterfaceOther;
+	disk->type = kDiskTypeHardDrive;
+	disk->media_loaded = true;
+
+	disk->num_sectors = io_inl(vblk->io_base + VIRTIO_BLK_REG_CAPACITY);
+	disk->num_sectors |= ((uint64_t) io_inl(vblk->io_base + VIRTIO_BLK_REG_CAPACITY + 4)) << 32;
+
+	disk->max_transfer = vblk->max_segments / 2;
+
+	vblk->disk = disk;
+
+	// Requests complete from the IRQ
+	hal_register_irq_handler(vblk->irq, virtio_blk_irq, vblk);
+
+	io_outb(vblk->io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+	hal_disk_register(disk);
+
+	KDEBUG("virtio-blk: %u MiB, IRQ %u, %u requests of up to %u sectors%s", (unsigned int) (disk->num_sectors / 2048), vblk->irq, vblk->num_requests, disk->max_transfer, (vblk->features & VIRTIO_BLK_F_RO) ? " (read only)" : "");
+
+	return vblk;
+
+fail:
+	io_outb(vblk->io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+	return NULL;
+}
+
+/*
+ * Allocates the virtqueue and the per-request pages, and hands the queue to
+ * the device. The legacy interface requires the queue to be physically
+ * contiguous, and uses the size the device reports.
+ */
+static bool virtio_blk_setup_queue(virtio_blk_t *vblk) {
+	io_outw(vblk->io_base + VIRTIO_REG_QUEUE_SELECT, 0);
+	uint16_t size = io_inw(vblk->io_base + VIRTIO_REG_QUEUE_SIZE);
+
+	if(size == 0) {
+		KERROR("virtio-blk: queue 0 doesn't exist");
+		return false;
+	}
+
+	vblk->queue_size = size;
+
+	// Descriptors and available ring, then the used ring on the next page
+	size_t availEnd = (sizeof(virtq_desc_t) * size) + sizeof(virtq_avail_t) + (sizeof(uint16_t) * (size + 1));
+	size_t usedOffset = (availEnd + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1);
+	size_t usedSize = sizeof(virtq_used_t) + (sizeof(virtq_used_elem_t) * size) + sizeof(uint16_t);
+	size_t queueSize = (usedOffset + usedSize + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1);
+
+	vblk->queue = kmalloc_ap(queueSize, &vblk->queue_phys);
+
+	if(!vblk->queue) {
+		KERROR("virtio-blk: couldn't allocate queue (%u bytes)", queueSize);
+		return false;
+	}
+
+	memclr(vblk->queue, queueSize);
+
+	for(unsigned int off = 0; off < queueSize; off += 0x1000) {
+		if(virtio_blk_virt_to_phys(((uint8_t *) vblk->queue) + off) != (vblk->queue_phys + off)) {
+			// Aligned allocations can't be freed, so the memory is leaked
+			KERROR("virtio-blk: queue memory is not physically contiguous");
+			return false;
+		}
+	}
+
+	vblk->desc = (virtq_desc_t *) vblk->queue;
+	vblk->avail = (virtq_avail_t *) (((uint8_t *) vblk->queue) + (sizeof(virtq_desc_t) * size));
+	vblk->used = (volatile virtq_used_t *) (((uint8_t *) vblk->queue) + usedOffset);
+
+	// Allocate requests: each one permanently owns the descriptor of its index
+	vblk->num_requests = (size < VIRTIO_BLK_MAX_REQUESTS) ? size : VIRTIO_BLK_MAX_REQUESTS;
+	vblk->requests = (virtio_blk_request_t *) kmalloc(sizeof(virtio_blk_request_t) * vblk->num_requests);
+	ASSERT(vblk->requests);
+
+	for(unsigned int i = 0; i < vblk->num_requests; i++) {
+		virtio_blk_request_t *req = &vblk->requests[i];
+
+		req->page = (uint8_t *) kmalloc_ap(0x1000, &req->page_phys);
+		ASSERT(req->page);
+
+		req->hdr = (virtio_blk_req_hdr_t *) req->page;
+		req->status = req->page + sizeof(virtio_blk_req_hdr_t);
+		req->table = (virtq_desc_t *) (req->page + VIRTIO_BLK_INDIRECT_OFFSET);
+
+		vblk->desc[i].addr = req->page_phys + VIRTIO_BLK_INDIRECT_OFFSET;
+		vblk->desc[i].flags = VIRTQ_DESC_F_INDIRECT;
+		vblk->desc[i].next = 0;
+
+		req->next_free = (i + 1 < vblk->num_requests) ? (int) (i + 1) : -1;
+	}
+
+	vblk->free_head = 0;
+
+	// Hand the queue to the device
+	io_outl(vblk->io_base + VIRTIO_REG_QUEUE_ADDRESS, vblk->queue_phys / VIRTQ_ALIGN);
+
+	return true;
+}
+
+/*
+ * Translates a kernel virtual address to a physical address, or returns 0 if
+ * the address isn't mapped.
+ */
+static unsigned int virtio_blk_virt_to_phys(void *addr) {
+	unsigned int virt = (unsigned int) addr;
+	page_t *page = paging_get_page(virt & 0xFFFFF000, false, kernel_directory);
+
+	if(!page || !page->present) {
+		return 0;
+	}
+
+	return ((((unsigned int) page->frame) & 0xFFFFF) << 12) | (virt & 0x00000FFF);
+}
+
+// ! Requests
+/*
+ * Builds and submits a request. If no request slot is free, this waits for
+ * one of the outstanding requests to complete.
+ *
+ * Returns an error without invoking the callback if the request couldn't be
+ * submitted.
+ */
+static hal_disk_error_t virtio_blk_submit(virtio_blk_t *vblk, uint32_t type, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt, void *buffer, unsigned int *id, hal_disk_callback_t callback, void *ctx) {
+	virtio_blk_request_t *req = NULL;
+	int index;
+	uint32_t flags;
+
+	if(type == VIRTIO_BLK_T_OUT && (vblk->features & VIRTIO_BLK_F_RO)) {
+		return kDiskErrorUnknown;
+	}
+
+	// Get a free request
+	for(;;) {
+		flags = irq_save();
+
+		if((index = vblk->free_head) >= 0) {
+			req = &vblk->requests[index];
+			vblk->free_head = req->next_free;
+		}
+
+		irq_restore(flags);
+
+		if(req) {
+			break;
+		}
+
+		virtio_blk_process_used(vblk);
+	}
+
+	req->id = vblk->last_access_id++;
+	req->buffer = buffer ? buffer : (void *) iov;
+	req->callback = callback;
+	req->ctx = ctx;
+
+	if(id) {
+		*id = req->id;
+	}
+
+	// Header
+	req->hdr->type = type;
+	req->hdr->reserved = 0;
+	req->hdr->sector = lba;
+	*req->status = 0xFF;
+
+	req->table[0].addr = req->page_phys;
+	req->table[0].len = sizeof(virtio_blk_req_hdr_t);
+	req->table[0].flags = VIRTQ_DESC_F_NEXT;
+	req->table[0].next = 1;
+
+	// Data: the device writes into the buffers for reads
+	uint16_t dataFlags = (type == VIRTIO_BLK_T_IN) ? VIRTQ_DESC_F_WRITE : 0;
+	int n = 1;
+
+	for(unsigned int i = 0; i < iovcnt && n > 0; i++) {
+		n = virtio_blk_add_segment(vblk, req, n, iov[i].buffer, iov[i].phys, iov[i].length, dataFlags);
+	}
+
+	if(n < 0) {
+		flags = irq_save();
+		req->next_free = vblk->free_head;
+		vblk->free_head = index;
+		irq_restore(flags);
+
+		KERROR("virtio-blk: request at LBA %u can't be described", (unsigned int) lba);
+		return kDiskErrorUnknown;
+	}
+
+	// Status byte
+	req->table[n].addr = req->page_phys + sizeof(virtio_blk_req_hdr_t);
+	req->table[n].len = 1;
+	req->table[n].flags = VIRTQ_DESC_F_WRITE;
+	req->table[n].next = 0;
+
+	vblk->desc[index].len = (n + 1) * sizeof(virtq_desc_t);
+
+	// Make the request available to the device
+	flags = irq_save();
+
+	vblk->avail->ring[vblk->avail->idx % vblk->queue_size] = index;
+	virtio_barrier();
+	vblk->avail->idx++;
+	virtio_barrier();
+
+	if(!(vblk->used->flags & VIRTQ_USED_F_NO_NOTIFY)) {
+		io_outw(vblk->io_base + VIRTIO_REG_QUEUE_NOTIFY, 0);
+	}
+
+	irq_restore(flags);
+
+	return kDiskErrorNone;
+}
+
+/*
+ * Adds descriptors for a data segment to the request's indirect table,
+ * starting at index n. Segments without a physical address are split at page
+ * boundaries, though physically contiguous pages are merged again.
+ *
+ * Returns the index of the next free descriptor, or -1 if the segment doesn't
+ * fit or isn't mapped.
+ */
+static int virtio_blk_add_segment(virtio_blk_t *vblk, virtio_blk_request_t *req, int n, void *buffer, unsigned int phys, size_t length, uint16_t flags) {
+	uint8_t *ptr = (uint8_t *) buffer;
+	int first = n;
+
+	while(length) {
+		size_t chunk;
+		unsigned int addr;
+
+		if(phys) {
+			addr = phys;
+			chunk = length;
+		} else {
+			if(!(addr = virtio_blk_virt_to_phys(ptr))) {
+				return -1;
+			}
+
+			chunk = 0x1000 - (((unsigned int) ptr) & 0x00000FFF);
+
+			if(chunk > length) {
+				chunk = length;
+			}
+		}
+
+		// Merge with the previous descriptor if physically contiguous
+		virtq_desc_t *prev = &req->table[n - 1];
+
+		if(n > first && (prev->addr + prev->len) == addr) {
+			prev->len += chunk;
+		} else {
+			if((unsigned int) (n - 1) >= vblk->max_segments) {
+				return -1;
+			}
+
+			req->table[n].addr = addr;
+			req->table[n].len = chunk;
+			req->table[n].flags = flags | VIRTQ_DESC_F_NEXT;
+			req->table[n].next = n + 1;
+
+			n++;
+		}
+
+		ptr += chunk;
+		phys += phys ? chunk : 0;
+		length -= chunk;
+	}
+
+	return n;
+}
+
+/*
+ * Processes all requests the device has completed, and invokes their
+ * callbacks. Each request is returned to the free list before its callback
+ * runs, so the callback may submit new requests.
+ */
+static void virtio_blk_process_used(virtio_blk_t *vblk) {
+	for(;;) {
+		uint32_t flags = irq_save();
+
+		if(vblk->last_used == vblk->used->idx) {
+			irq_restore(flags);
+			break;
+		}
+
+		virtio_barrier();
+
+		unsigned int index = vblk->used->ring[vblk->last_used % vblk->queue_size].id;
+		vblk->last_used++;
+
+		virtio_blk_request_t *req = &vblk->requests[index];
+
+		unsigned int id = req->id;
+		void *buffer = req->buffer;
+		hal_disk_callback_t callback = req->callback;
+		void *ctx = req->ctx;
+		uint8_t status = *req->status;
+
+		req->next_free = vblk->free_head;
+		vblk->free_head = index;
+
+		irq_restore(flags);
+
+		// Notify the caller
+		hal_disk_error_t err = (status == VIRTIO_BLK_S_OK) ? kDiskErrorNone : kDiskErrorUnknown;
+
+#if PRINT_ERROR
+		if(err != kDiskErrorNone) {
+			KERROR("virtio-blk: request %u failed (status %u)", id, status);
+		}
+#endif
+
+		callback(id, err ? NULL : buffer, ctx, err);
+	}
+}
+
+/*
+ * Interrupt handler: reading the ISR status acknowledges the interrupt. The
+ * line may be shared, so check that the device actually raised it.
+ */
+static void virtio_blk_irq(void *ctx) {
+	virtio_blk_t *vblk = (virtio_blk_t *) ctx;
+
+	if(io_inb(vblk->io_base + VIRTIO_REG_ISR_STATUS) & 0x01) {
+		virtio_blk_process_used(vblk);
+	}
+}
+
+/*
+ * Completes a synchronous flush request.
+ */
+static void virtio_blk_flush_callback(unsigned int id, void *buf, void *ctx, hal_disk_error_t err) {
+	volatile hal_disk_error_t *result = (volatile hal_disk_error_t *) ctx;
+	*result = err;
+}
+
+// ! Disk manager functions
+static hal_disk_error_t virtio_blk_disk_init(hal_disk_t *disk) {
+	// do nothing
+	return kDiskErrorNone;
+}
+
+static hal_disk_error_t virtio_blk_disk_reset(hal_disk_t *disk) {
+	// also do nothing
+	return kDiskErrorNone;
+}
+
+static hal_disk_error_t virtio_blk_disk_read(hal_disk_t *disk, uint64_t lba, uint64_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
+	hal_disk_iovec_t iov = {
+		.buffer = buffer,
+		.phys = 0,
+		.length = (size_t) length * 512
+	};
+
+	// The iovec is only used while building the request
+	return virtio_blk_submit((virtio_blk_t *) disk->driver, VIRTIO_BLK_T_IN, lba, &iov, 1, buffer, id, callback, ctx);
+}
+
+static hal_disk_error_t virtio_blk_disk_write(hal_disk_t *disk, uint64_t lba, uint64_t length, void* buffer, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
+	hal_disk_iovec_t iov = {
+		.buffer = buffer,
+		.phys = 0,
+		.length = (size_t) length * 512
+	};
+
+	return virtio_blk_submit((virtio_blk_t *) disk->driver, VIRTIO_BLK_T_OUT, lba, &iov, 1, buffer, id, callback, ctx);
+}
+
+static hal_disk_error_t virtio_blk_disk_readv(hal_disk_t *disk, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
+	return virtio_blk_submit((virtio_blk_t *) disk->driver, VIRTIO_BLK_T_IN, lba, iov, iovcnt, NULL, id, callback, ctx);
+}
+
+static hal_disk_error_t virtio_blk_disk_writev(hal_disk_t *disk, uint64_t lba, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *id, hal_disk_callback_t callback, void* ctx) {
+	return virtio_blk_submit((virtio_blk_t *) disk->driver, VIRTIO_BLK_T_OUT, lba, iov, iovcnt, NULL, id, callback, ctx);
+}
+
+/*
+ * Flushes the device's write cache, waiting for the flush to complete. If the
+ * device doesn't support flushing, it has no volatile cache.
+ */
+static hal_disk_error_t virtio_blk_disk_flush_cache(hal_disk_t *disk) {
+	virtio_blk_t *vblk = (virtio_blk_t *) disk->driver;
+	volatile hal_disk_error_t result = -1;
+
+	if(!(vblk->features & VIRTIO_BLK_F_FLUSH)) {
+		return kDiskErrorNone;
+	}
+
+	hal_disk_error_t err = virtio_blk_submit(vblk, VIRTIO_BLK_T_FLUSH, 0, NULL, 0, NULL, NULL, virtio_blk_flush_callback, (void *) &result);
+
+	if(err != kDiskErrorNone) {
+		return err;
+	}
+
+	while(result == -1) {
+		virtio_blk_process_used(vblk);
+	}
+
+	return result;
+}
+
+static void virtio_blk_disk_poll(hal_disk_t *disk) {
+	virtio_blk_process_used((virtio_blk_t *) disk->driver);
+}
@@ -0,0 +1,160 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#import <types.h>
+#import "hal/disk.h"
+
+// PCI IDs of the legacy (transitional) virtio block device
+#define VIRTIO_PCI_VENDOR				0x1AF4
+#define VIRTIO_PCI_DEVICE_BLK			0x1001
+
+// Registers in the legacy I/O BAR
+#define VIRTIO_REG_DEVICE_FEATURES		0x00
+#define VIRTIO_REG_GUEST_FEATURES		0x04
+#define VIRTIO_REG_QUEUE_ADDRESS		0x08
+#define VIRTIO_REG_QUEUE_SIZE			0x0C
+#define VIRTIO_REG_QUEUE_SELECT			0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY			0x10
+#define VIRTIO_REG_DEVICE_STATUS		0x12
+#define VIRTIO_REG_ISR_STATUS			0x13
+
+// Block device configuration (follows the common registers)
+#define VIRTIO_BLK_REG_CAPACITY			0x14
+#define VIRTIO_BLK_REG_SIZE_MAX			0x1C
+#define VIRTIO_BLK_REG_SEG_MAX			0x20
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE		0x01
+#define VIRTIO_STATUS_DRIVER			0x02
+#define VIRTIO_STATUS_DRIVER_OK			0x04
+#define VIRTIO_STATUS_FAILED			0x80
+
+// Feature bits
+#define VIRTIO_BLK_F_SIZE_MAX			(1 << 1)
+#define VIRTIO_BLK_F_SEG_MAX			(1 << 2)
+#define VIRTIO_BLK_F_RO					(1 << 5)
+#define VIRTIO_BLK_F_FLUSH				(1 << 9)
+#define VIRTIO_RING_F_INDIRECT_DESC		(1 << 28)
+
+// Descriptor flags
+#define VIRTQ_DESC_F_NEXT				0x01
+#define VIRTQ_DESC_F_WRITE				0x02
+#define VIRTQ_DESC_F_INDIRECT			0x04
+
+// Set by the device in the used ring when it doesn't need to be notified
+#define VIRTQ_USED_F_NO_NOTIFY			0x01
+
+// Legacy rings are aligned to this boundary
+#define VIRTQ_ALIGN						0x1000
+
+// Request types
+#define VIRTIO_BLK_T_IN					0
+#define VIRTIO_BLK_T_OUT				1
+#define VIRTIO_BLK_T_FLUSH				4
+
+// Request status written by the device
+#define VIRTIO_BLK_S_OK					0
+#define VIRTIO_BLK_S_IOERR				1
+#define VIRTIO_BLK_S_UNSUPP				2
+
+// Most requests that may be outstanding at once (each takes a page)
+#define VIRTIO_BLK_MAX_REQUESTS			32
+
+/*
+ * Number of descriptors in each request's indirect table: the request page
+ * holds the header and status in the first 64 bytes, followed by the table.
+ */
+#define VIRTIO_BLK_INDIRECT_OFFSET		64
+#define VIRTIO_BLK_INDIRECT_DESCS		((0x1000 - VIRTIO_BLK_INDIRECT_OFFSET) / sizeof(virtq_desc_t))
+
+// Split virtqueue structures, as defined by the virtio specification
+typedef struct {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct {
+	uint32_t id;
+	uint32_t len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct {
+	uint16_t flags;
+	uint16_t idx;
+	virtq_used_elem_t ring[];
+} __attribute__((packed)) virtq_used_t;
+
+// Header preceding the data of every block request
+typedef struct {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+} __attribute__((packed)) virtio_blk_req_hdr_t;
+
+typedef struct virtio_blk_request virtio_blk_request_t;
+typedef struct virtio_blk virtio_blk_t;
+
+/*
+ * An outstanding request. Each request owns one descriptor in the ring, which
+ * points to the indirect table on its page.
+ */
+struct virtio_blk_request {
+	// Page holding the header, status byte and indirect descriptor table
+	uint8_t *page;
+	unsigned int page_phys;
+
+	virtio_blk_req_hdr_t *hdr;
+	volatile uint8_t *status;
+	virtq_desc_t *table;
+
+	// Completion
+	unsigned int id;
+	void *buffer;
+	hal_disk_callback_t callback;
+	void *ctx;
+
+	// Next free request
+	int next_free;
+};
+
+// Driver state for a single device
+struct virtio_blk {
+	uint16_t io_base;
+	uint8_t irq;
+
+	uint32_t features;
+
+	// Virtqueue
+	uint16_t queue_size;
+
+	void *queue;
+	unsigned int queue_phys;
+
+	virtq_desc_t *desc;
+	virtq_avail_t *avail;
+	volatile virtq_used_t *used;
+
+	uint16_t last_used;
+
+	// Requests (indexed by their descriptor) and the head of the free list
+	virtio_blk_request_t *requests;
+	unsigned int num_requests;
+	int free_head;
+
+	// Largest number of data descriptors per request
+	unsigned int max_segments;
+
+	unsigned int last_access_id;
+
+	hal_disk_t *disk;
+};
+
+#endif
@@ -0,0 +1,462 @@
+// Read-only filesystem exposing the files on the ramdisk
+extern "C" {
+	#import <types.h>
+	#import "driver_support/ramdisk.h"
+	#import "hal/path.h"
+	#import "hal/vfs.h"
+	#import "kconfig.h"
+}
+
+/*
+ * The whole tree is built when the ramdisk is mounted, from the paths of its
+ * entries. The items' userData holds the index of the entry in the ramdisk.
+ */
+typedef struct initrdfs {
+	fs_directory_t *root;
+} initrdfs_t;
+
+/*
+ * Gets the subdirectory of dir with the given name, creating it if needed.
+ */
+static fs_directory_t *initrdfs_make_directory(fs_directory_t *dir, char *name, size_t length) {
+	fs_item_t *item = hal_vfs_dir_lookupn(dir, name, length);
+
+	if(item) {
+		return (item->type == kFSItemTypeDirectory) ? (fs_directory_t *) item : NULL;
+	}
+
+	fs_directory_t *sub = hal_vfs_allocate_directory(true);
+
+	if(!sub) {
+		return NULL;
+	}
+
+	sub->i.name = (char *) kmalloc(length + 1);
+
+	if(!sub->i.name) {
+		kfree(sub);
+		return NULL;
+	}
+
+	memcpy(sub->i.name, name, length);
+	sub->i.name[length] = '\0';
+
+	sub->i.permissions = 0555;
+	sub->i.is_readonly = true;
+
+	sub->parent = &dir->i;
+	sub->populated = true;
+
+	list_add(dir->children, sub);
+
+	if(hal_vfs_dir_index_add(dir, sub->i.name, &sub->i)) {
+		hal_vfs_remove_child(dir, &sub->i);
+
+		hal_vfs_deallocate_directory(sub, NULL);
+		kfree(sub);
+
+		return NULL;
+	}
+
+	return sub;
+}
+
+/*
+ * Creates the item for an entry in the ramdisk, and the directories leading
+ * up to it.
+ */
+static bool initrdfs_add_entry(initrdfs_t *fs, unsigned int index) {
+	qrfs_file_entry_t *ent = ramdisk_get_file(index);
+	fs_directory_t *dir = fs->root;
+
+	size_t length;
+	char *path = ramdisk_file_name(ent, &length);
+
+	// Split off the last component of the path
+	size_t start = length;
+
+	while(start && path[start - 1] != '/') {
+		start--;
+	}
+
+	if(start == length) {
+		return false;
+	}
+
+	for(size_t i = 0; i < start; ) {
+		size_t end = i;
+
+		while(end < start && path[end] != '/') {
+			end++;
+		}
+
+		if(end > i && !(dir = initrdfs_make_directory(dir, path + i, end - i))) {
+			return false;
+		}
+
+		i = end + 1;
+	}
+
+	if(ramdisk_file_is_directory(ent)) {
+		dir = initrdfs_make_directory(dir, path + start, length - start);
+
+		if(dir) {
+			dir->i.userData = index;
+		}
+
+		return (dir != NULL);
+	}
+
+	if(hal_vfs_dir_lookupn(dir, path + start, length - start)) {
+		return false;
+	}
+
+	char *name = (char *) kmalloc(length - start + 1);
+	fs_file_t *file = name ? hal_vfs_allocate_file(dir) : NULL;
+
+	if(!file) {
+		if(name) kfree(name);
+		return false;
+	}
+
+	memcpy(name, path + start, length - start);
+	name[length - start] = '\0';
+
+	file->i.name = name;
+
+	file->i.is_readonly = true;
+	file->i.userData = index;
+
+	file->size = ramdisk_file_size(ent);
+
+	if(hal_vfs_dir_index_add(dir, file->i.name, &file->i)) {
+		hal_vfs_remove_child(dir, &file->i);
+		hal_vfs_deallocate_file(file);
+
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Creates the items for all files and directories on the ramdisk.
+ */
+static void *initrdfs_mount(char *options) {
+	if(!ramdisk_loaded()) {
+		return NULL;
+	}
+
+	initrdfs_t *fs = (initrdfs_t *) kmalloc(sizeof(initrdfs_t));
+
+	if(!fs) {
+		return NULL;
+	}
+
+	char *name = (char *) kmalloc(2);
+
+	if(!name) {
+		kfree(fs);
+		return NULL;
+	}
+
+	name[0] = '/';
+	name[1] = '\0';
+
+	if(!(fs->root = hal_vfs_allocate_directory(true))) {
+		kfree(name);
+		kfree(fs);
+		return NULL;
+	}
+
+	fs->root->i.name = name;
+
+	fs->root->i.permissions = 0555;
+	fs->root->i.is_readonly = true;
+	fs->root->populated = true;
+
+	for(unsigned int i = 0; i < ramdisk_num_files(); i++) {
+		if(!initrdfs_add_entry(fs, i)) {
+			#if PRINT_ERROR
+			KERROR("Couldn't add ramdisk entry %u", i);
+			#endif
+		}
+	}
+
+	return fs;
+}
+
+/*
+ * Gets the ramdisk entry of the file a handle is open on.
+ */
+static qrfs_file_entry_t *initrdfs_handle_entry(fs_file_handle_t *handle, fs_file_t **file) {
+	if(!handle->isOpen) {
+		return NULL;
+	}
+
+	fs_file_t *f = hal_vfs_handle_to_file(handle);
+
+	if(!f) {
+		return NULL;
+	}
+
+	if(file) {
+		*file = f;
+	}
+
+	return ramdisk_get_file((unsigned int) f->i.userData);
+}
+
+/*
+ * Copies data of a file straight out of the ramdisk.
+ *
+ * @return Number of bytes read, or 0 at the end of the file.
+ */
+static long long initrdfs_read_data(fs_file_handle_t *handle, void *buffer, size_t bytes, unsigned long long offset) {
+	fs_file_t *file;
+	qrfs_file_entry_t *ent = initrdfs_handle_entry(handle, &file);
+
+	if(!ent) {
+		return -1;
+	}
+
+	if(offset >= file->size) {
+		return 0;
+	}
+
+	if(bytes > (file->size - offset)) {
+		bytes = file->size - offset;
+	}
+
+	// Compressed files are decompressed on the first read
+	uint8_t *data = (uint8_t *) ramdisk_file_data(ent);
+
+	if(!data) {
+		return -1;
+	}
+
+	memcpy(buffer, data + offset, bytes);
+	return bytes;
+}
+
+/*
+ * Finds the item a path refers to.
+ */
+static fs_item_t *initrdfs_walk(initrdfs_t *fs, char *path) {
+	fs_item_t *item = &fs->root->i;
+
+	hal_path_iter_t it;
+	hal_path_init(&it, path);
+
+	while(hal_path_next(&it)) {
+		if(item->type != kFSItemTypeDirectory) {
+			return NULL;
+		}
+
+		fs_directory_t *dir = (fs_directory_t *) item;
+
+		// The root directory is its own parent
+		if(hal_path_is_parent(&it)) {
+			item = (dir == fs->root) ? item : dir->parent;
+		} else if(!(item = hal_vfs_dir_lookupn(dir, it.name, it.length))) {
+			return NULL;
+		}
+	}
+
+	return item;
+}
+
+// Gets a directory by its path.
+static fs_directory_t *initrdfs_list_directory(void *superblock, char *dirname) {
+	fs_item_t *item = initrdfs_walk((initrdfs_t *) superblock, dirname);
+
+	if(!item || item->type != kFSItemTypeDirectory) {
+		return NULL;
+	}
+
+	return (fs_directory_t *) item;
+}
+
+// The filesystem is read-only.
+static int initrdfs_create_directory(void *superblock, char *path) {
+	return -1;
+}
+
+static int initrdfs_unlink(void *superblock, char *path) {
+	return -1;
+}
+
+// Opens a handle for a file.
+static fs_file_handle_t *initrdfs_file_open_item(void *superblock, fs_file_t *file, fs_file_open_mode_t mode) {
+	if(!(mode & kFSFileModeReadOnly)) {
+		return NULL;
+	}
+
+	fs_file_handle_t *handle = (fs_file_handle_t *) kmalloc(sizeof(fs_file_handle_t));
+
+	if(!handle) {
+		return NULL;
+	}
+
+	file->handles_open++;
+	file->parent->handles_open++;
+
+	handle->file = file->i.handle;
+	handle->mode = mode;
+	handle->can_seek = true;
+	handle->position = 0;
+
+	handle->isOpen = true;
+
+	return handle;
+}
+
+// Looks up a file by its path, and opens it.
+static fs_file_handle_t *initrdfs_file_open(void *superblock, char *path, fs_file_open_mode_t mode) {
+	fs_item_t *item = initrdfs_walk((initrdfs_t *) superblock, path);
+
+	if(!item || item->type != kFSItemTypeFile) {
+		return NULL;
+	}
+
+	return initrdfs_file_open_item(superblock, (fs_file_t *) item, mode);
+}
+
+// Closes a file handle.
+static void initrdfs_file_close(void *superblock, fs_file_handle_t *handle) {
+	if(!handle->isOpen) return;
+
+	handle->isOpen = false;
+
+	fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+	if(file) {
+		file->handles_open--;
+		file->parent->handles_open--;
+	}
+}
+
+static void initrdfs_file_update(void *superblock, fs_file_t *file) {
+
+}
+
+// Reads from the file at the offset in the handle.
+static long long initrdfs_file_read(void *superblock, void *buffer, size_t bytes, fs_file_handle_t *handle) {
+	long long read = initrdfs_read_data(handle, buffer, bytes, handle->position);
+
+	if(read > 0) {
+		handle->position += read;
+	}
+
+	return read;
+}
+
+static long long initrdfs_file_write(void *superblock, void *buffer, size_t bytes, fs_file_handle_t *handle) {
+	return -1;
+}
+
+static int initrdfs_file_sync(void *superblock, fs_file_handle_t *handle) {
+	return 0;
+}
+
+static int initrdfs_file_allocate(void *superblock, fs_file_handle_t *handle, unsigned long long length) {
+	return -1;
+}
+
+// Reads from an offset in the file.
+static long long initrdfs_file_pread(void *superblock, void *buffer, size_t bytes, unsigned long long offset, fs_file_handle_t *handle) {
+	return initrdfs_read_data(handle, buffer, bytes, offset);
+}
+
+// Reads from an offset in the file into several buffers.
+static long long initrdfs_file_preadv(void *superblock, fs_iovec_t *iov, unsigned int iovcnt, unsigned long long offset, fs_file_handle_t *handle) {
+	long long total = 0;
+
+	for(unsigned int i = 0; i < iovcnt; i++) {
+		long long read = initrdfs_read_data(handle, iov[i].buffer, iov[i].length, offset + total);
+
+		if(read < 0) {
+			return total ? total : -1;
+		}
+
+		total += read;
+
+		if(read < (long long) iov[i].length) {
+			break;
+		}
+	}
+
+	return total;
+}
+
+// Moves the position of the handle.
+static int initrdfs_file_seek(void *superblock, fs_file_handle_t *handle, unsigned long long position) {
+	if(!initrdfs_handle_entry(handle, NULL)) {
+		return -1;
+	}
+
+	handle->position = position;
+	return 0;
+}
+
+// Gets a pointer to the file's data in the ramdisk (or its decompressed copy.)
+static void *initrdfs_file_map(void *superblock, fs_file_handle_t *handle, size_t *length) {
+	fs_file_t *file;
+	qrfs_file_entry_t *ent = initrdfs_handle_entry(handle, &file);
+
+	if(!ent) {
+		return NULL;
+	}
+
+	if(length) {
+		*length = file->size;
+	}
+
+	return ramdisk_file_data(ent);
+}
+
+static const hal_vfs_t initrdfs_vfs = {
+	/*.name = */ "initrd",
+	/*.supports_partition = */ NULL,
+	/*.create_superblock = */ NULL,
+	/*.list_directory = */ initrdfs_list_directory,
+	/*.create_directory = */ initrdfs_create_directory,
+	/*.unlink = */ initrdfs_unlink,
+	/*.file_open = */ initrdfs_file_open,
+	/*.file_close = */ initrdfs_file_close,
+	/*.file_update = */ initrdfs_file_update,
+	/*.file_read = */ initrdfs_file_read,
+	/*.file_write = */ initrdfs_file_write,
+	/*.file_sync = */ initrdfs_file_sync,
+	/*.file_allocate = */ initrdfs_file_allocate,
+	/*.file_open_item = */ initrdfs_file_open_item,
+	/*.readpage = */ NULL,
+	/*.writepage = */ NULL,
+	/*.readpages = */ NULL,
+	/*.file_pread = */ initrdfs_file_pread,
+	/*.file_pwrite = */ NULL,
+	/*.file_preadv = */ initrdfs_file_preadv,
+	/*.file_seek = */ initrdfs_file_seek,
+	/*.dir_open = */ NULL,
+	/*.dir_read = */ NULL,
+	/*.dir_close = */ NULL,
+	/*.populate_directory = */ NULL,
+	/*.mount = */ initrdfs_mount,
+	/*.file_map = */ initrdfs_file_map,
+	/*.max_file_size = */ NULL,
+	/*.map_data = */ NULL
+};
+
+/*
+ * Registers the ramdisk filesystem, and mounts the ramdisk at /initrd.
+ */
+static int initrdfs_init(void) {
+	hal_vfs_register((hal_vfs_t *) &initrdfs_vfs);
+
+	if(ramdisk_loaded() && hal_vfs_mount((char *) "initrd", (char *) __kcfg_initrd_mountpoint, NULL)) {
+		KERROR("Couldn't mount ramdisk at %s", __kcfg_initrd_mountpoint);
+	}
+
+	return 0;
+}
+module_init(initrdfs_init);
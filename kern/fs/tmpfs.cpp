@@ -0,0 +1,868 @@
+// In-memory filesystem for scratch files
+extern "C" {
+	#import <types.h>
+	#import "paging/paging.h"
+	#import "hal/config.h"
+	#import "hal/path.h"
+	#import "hal/vfs.h"
+	#import "kconfig.h"
+}
+
+// Size of the pages file data is stored in
+#define TMPFS_PAGE_SIZE			0x1000
+
+// Number of page slots a file's page array starts out with
+#define TMPFS_MIN_SLOTS			8
+
+// Largest number of items, unless set with the nr_inodes option
+#define TMPFS_DEFAULT_INODES	0x10000
+
+/*
+ * State of a mounted tmpfs. All items live in memory for as long as the
+ * filesystem is mounted; the limits keep it from eating all of it.
+ */
+typedef struct tmpfs {
+	fs_directory_t *root;
+
+	// Largest number of data pages and items, and how many are in use
+	unsigned int max_pages;
+	unsigned int pages_used;
+
+	unsigned int max_inodes;
+	unsigned int inodes_used;
+} tmpfs_t;
+
+/*
+ * Data of a file: a sparse array of pages, indexed by offset / page size.
+ * Holes (NULL slots) read as zeros and don't count against the size limit.
+ * It is stored in the fs_data field of the file, so the array is a single
+ * allocation the VFS can release; the pages are freed by tmpfs.
+ */
+typedef struct tmpfs_pages {
+	unsigned int slots;
+	void *pages[];
+} tmpfs_pages_t;
+
+/*
+ * Parses a size, with an optional k, m or g suffix, or % of memory.
+ *
+ * @return Size in pages, or 0 if it's invalid.
+ */
+static unsigned int tmpfs_parse_size(char *value, char *end) {
+	char *suffix;
+	unsigned long long size = strtoul(value, &suffix, 10);
+
+	if(suffix == value) {
+		return 0;
+	}
+
+	if(suffix != end) {
+		switch(*suffix) {
+			case 'g': case 'G':
+				size <<= 10;
+				// fall through
+			case 'm': case 'M':
+				size <<= 10;
+				// fall through
+			case 'k': case 'K':
+				size <<= 10;
+				break;
+
+			case '%':
+				size = (((unsigned long long) paging_get_stats().total_pages * size) / 100) * TMPFS_PAGE_SIZE;
+				break;
+
+			default:
+				return 0;
+		}
+
+		suffix++;
+	}
+
+	if(suffix != end) {
+		return 0;
+	}
+
+	unsigned long long pages = (size + (TMPFS_PAGE_SIZE - 1)) / TMPFS_PAGE_SIZE;
+
+	// Page counts have to fit in 32 bits
+	if(pages > 0xFFFFFFFFULL) {
+		return 0;
+	}
+
+	return pages;
+}
+
+/*
+ * Applies comma separated mount options: size (the largest amount of file
+ * data) and nr_inodes (the largest number of files and directories.)
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+static int tmpfs_parse_options(tmpfs_t *fs, char *options) {
+	while(options && *options) {
+		char *end = options;
+
+		while(*end && *end != ',') {
+			end++;
+		}
+
+		// Split the option into key and value
+		char *value = options;
+
+		while(value != end && *value != '=') {
+			value++;
+		}
+
+		size_t keyLength = value - options;
+
+		if(value != end) {
+			value++;
+		}
+
+		if(keyLength == 4 && !strncmp(options, "size", 4)) {
+			if(!(fs->max_pages = tmpfs_parse_size(value, end))) {
+				return -1;
+			}
+		} else if(keyLength == 9 && !strncmp(options, "nr_inodes", 9)) {
+			char *suffix;
+
+			if(!(fs->max_inodes = strtoul(value, &suffix, 10)) || suffix != end) {
+				return -1;
+			}
+		} else if(keyLength) {
+			#if PRINT_ERROR
+			KERROR("Unknown tmpfs option '%s'", options);
+			#endif
+
+			return -1;
+		}
+
+		options = *end ? (end + 1) : end;
+	}
+
+	return 0;
+}
+
+/*
+ * Creates a new tmpfs, with an empty root directory. By default, it may use
+ * up to half of memory.
+ */
+static void *tmpfs_mount(char *options) {
+	tmpfs_t *fs = (tmpfs_t *) kmalloc(sizeof(tmpfs_t));
+
+	if(!fs) {
+		return NULL;
+	}
+
+	fs->max_pages = paging_get_stats().total_pages / 2;
+	fs->max_inodes = TMPFS_DEFAULT_INODES;
+
+	if(tmpfs_parse_options(fs, options)) {
+		#if PRINT_ERROR
+		KERROR("Invalid tmpfs options '%s'", options);
+		#endif
+
+		kfree(fs);
+		return NULL;
+	}
+
+	char *name = (char *) kmalloc(2);
+
+	if(!name) {
+		kfree(fs);
+		return NULL;
+	}
+
+	name[0] = '/';
+	name[1] = '\0';
+
+	if(!(fs->root = hal_vfs_allocate_directory(true))) {
+		kfree(name);
+		kfree(fs);
+		return NULL;
+	}
+
+	fs->root->i.name = name;
+
+	fs->root->i.permissions = 01777;
+	fs->root->populated = true;
+
+	fs->inodes_used = 1;
+
+	return fs;
+}
+
+/*
+ * Gets the subdirectory of dir that the current component of the path
+ * iterator names.
+ */
+static fs_directory_t *tmpfs_enter_directory(tmpfs_t *fs, fs_directory_t *dir, hal_path_iter_t *it) {
+	fs_item_t *item;
+
+	// The root directory is its own parent
+	if(hal_path_is_parent(it)) {
+		item = (dir == fs->root) ? &dir->i : dir->parent;
+	} else {
+		item = hal_vfs_dir_lookupn(dir, it->name, it->length);
+	}
+
+	if(!item || item->type != kFSItemTypeDirectory) {
+		return NULL;
+	}
+
+	return (fs_directory_t *) item;
+}
+
+/*
+ * Finds the directory containing the item a path refers to. The name of the
+ * item is returned as a view of the path; it's NULL if the path names the
+ * root directory, or ends in "..".
+ */
+static fs_directory_t *tmpfs_walk(tmpfs_t *fs, char *path, char **name, size_t *length) {
+	fs_directory_t *dir = fs->root;
+
+	hal_path_iter_t it;
+	hal_path_init(&it, path);
+
+	*name = NULL;
+	*length = 0;
+
+	while(dir && hal_path_next(&it)) {
+		if(hal_path_is_last(&it) && !hal_path_is_parent(&it)) {
+			*name = it.name;
+			*length = it.length;
+
+			break;
+		}
+
+		dir = tmpfs_enter_directory(fs, dir, &it);
+	}
+
+	return dir;
+}
+
+/*
+ * Copies a name out of a path.
+ */
+static char *tmpfs_copy_name(char *name, size_t length) {
+	char *copy = (char *) kmalloc(length + 1);
+
+	if(copy) {
+		memcpy(copy, name, length);
+		copy[length] = 0x00;
+	}
+
+	return copy;
+}
+
+/*
+ * Gets the largest size a file can have. A file can't hold more pages than
+ * the filesystem, which also bounds the size of its page array.
+ */
+static inline unsigned long long tmpfs_max_size(tmpfs_t *fs) {
+	return ((unsigned long long) fs->max_pages) * TMPFS_PAGE_SIZE;
+}
+
+/*
+ * Frees the pages of a file at or past the given page index.
+ */
+static void tmpfs_free_pages(tmpfs_t *fs, fs_file_t *file, unsigned long long first) {
+	tmpfs_pages_t *data = (tmpfs_pages_t *) file->fs_data;
+
+	if(!data) {
+		return;
+	}
+
+	for(unsigned long long i = first; i < data->slots; i++) {
+		if(data->pages[i]) {
+			kfree(data->pages[i]);
+			data->pages[i] = NULL;
+
+			fs->pages_used--;
+		}
+	}
+}
+
+/*
+ * Changes the size of a file. Pages past the new end are freed, and the tail
+ * of the last page is cleared, so growing the file again reads zeros.
+ */
+static void tmpfs_truncate(tmpfs_t *fs, fs_file_t *file, unsigned long long length) {
+	tmpfs_pages_t *data = (tmpfs_pages_t *) file->fs_data;
+
+	if(data && length < file->size) {
+		unsigned long long index = length / TMPFS_PAGE_SIZE;
+		unsigned int offset = length % TMPFS_PAGE_SIZE;
+
+		if(offset && index < data->slots && data->pages[index]) {
+			memclr(((uint8_t *) data->pages[index]) + offset, TMPFS_PAGE_SIZE - offset);
+		}
+
+		tmpfs_free_pages(fs, file, index + (offset ? 1 : 0));
+	}
+
+	file->size = length;
+}
+
+/*
+ * Gets the page of a file with the given index, allocating it (and growing the
+ * page array) if it's a hole.
+ *
+ * @return The page, or NULL if the filesystem is full.
+ */
+static void *tmpfs_get_page(tmpfs_t *fs, fs_file_t *file, unsigned long long index) {
+	tmpfs_pages_t *data = (tmpfs_pages_t *) file->fs_data;
+
+	if(index >= fs->max_pages) {
+		return NULL;
+	}
+
+	// Grow the page array, at least doubling it, but not past the limit
+	if(!data || index >= data->slots) {
+		unsigned long long slots = data ? (((unsigned long long) data->slots) * 2) : TMPFS_MIN_SLOTS;
+
+		while(slots <= index) {
+			slots *= 2;
+		}
+
+		if(slots > fs->max_pages) {
+			slots = fs->max_pages;
+		}
+
+		if(slots > ((((size_t) -1) - sizeof(tmpfs_pages_t)) / sizeof(void *))) {
+			return NULL;
+		}
+
+		tmpfs_pages_t *grown = (tmpfs_pages_t *) kmalloc(sizeof(tmpfs_pages_t) + (((size_t) slots) * sizeof(void *)));
+
+		if(!grown) {
+			return NULL;
+		}
+
+		grown->slots = slots;
+
+		if(data) {
+			memcpy(grown->pages, data->pages, data->slots * sizeof(void *));
+			kfree(data);
+		}
+
+		file->fs_data = data = grown;
+	}
+
+	if(!data->pages[index]) {
+		if(fs->pages_used >= fs->max_pages) {
+			return NULL;
+		}
+
+		if(!(data->pages[index] = kmalloc(TMPFS_PAGE_SIZE))) {
+			return NULL;
+		}
+
+		fs->pages_used++;
+	}
+
+	return data->pages[index];
+}
+
+/*
+ * Reads from the file at offset.
+ *
+ * @return Number of bytes read, or 0 at the end of the file.
+ */
+static long long tmpfs_read_data(fs_file_t *file, void *buffer, size_t bytes, unsigned long long offset) {
+	tmpfs_pages_t *data = (tmpfs_pages_t *) file->fs_data;
+
+	if(offset >= file->size) {
+		return 0;
+	}
+
+	if(bytes > (file->size - offset)) {
+		bytes = file->size - offset;
+	}
+
+	uint8_t *out = (uint8_t *) buffer;
+	size_t remaining = bytes;
+
+	while(remaining) {
+		unsigned long long index = offset / TMPFS_PAGE_SIZE;
+		unsigned int pageOffset = offset % TMPFS_PAGE_SIZE;
+		size_t length = TMPFS_PAGE_SIZE - pageOffset;
+
+		if(length > remaining) {
+			length = remaining;
+		}
+
+		if(data && index < data->slots && data->pages[index]) {
+			memcpy(out, ((uint8_t *) data->pages[index]) + pageOffset, length);
+		} else {
+			memclr(out, length);
+		}
+
+		out += length;
+		offset += length;
+		remaining -= length;
+	}
+
+	return bytes;
+}
+
+/*
+ * Writes to the file at offset, growing it as needed. Writes that would take
+ * the file past the largest size it can have are rejected.
+ *
+ * @return Number of bytes written, or -1 if nothing could be written.
+ */
+static long long tmpfs_write_data(tmpfs_t *fs, fs_file_t *file, void *buffer, size_t bytes, unsigned long long offset) {
+	uint8_t *in = (uint8_t *) buffer;
+	size_t remaining = bytes;
+
+	if(offset > tmpfs_max_size(fs) || bytes > (tmpfs_max_size(fs) - offset)) {
+		return -1;
+	}
+
+	while(remaining) {
+		unsigned long long index = offset / TMPFS_PAGE_SIZE;
+		unsigned int pageOffset = offset % TMPFS_PAGE_SIZE;
+		size_t length = TMPFS_PAGE_SIZE - pageOffset;
+
+		if(length > remaining) {
+			length = remaining;
+		}
+
+		uint8_t *page = (uint8_t *) tmpfs_get_page(fs, file, index);
+
+		// The filesystem is full: report a short write
+		if(!page) {
+			break;
+		}
+
+		memcpy(page + pageOffset, in, length);
+
+		in += length;
+		offset += length;
+		remaining -= length;
+	}
+
+	if(offset > file->size) {
+		file->size = offset;
+	}
+
+	if(remaining == bytes && bytes) {
+		return -1;
+	}
+
+	return bytes - remaining;
+}
+
+/*
+ * Gets the file that a handle is open on, if the handle is usable.
+ */
+static fs_file_t *tmpfs_handle_file(fs_file_handle_t *handle) {
+	if(!handle->isOpen) {
+		return NULL;
+	}
+
+	fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+	// The file was deleted behind the handle's back
+	if(!file) {
+		handle->isOpen = false;
+	}
+
+	return file;
+}
+
+/*
+ * Opens a handle for a file, truncating it if requested.
+ */
+static fs_file_handle_t *tmpfs_open(tmpfs_t *fs, fs_file_t *file, fs_file_open_mode_t mode) {
+	fs_file_handle_t *handle = (fs_file_handle_t *) kmalloc(sizeof(fs_file_handle_t));
+
+	if(!handle) {
+		return NULL;
+	}
+
+	if((mode & kFSFileModeTruncate) && !(mode & kFSFileModeReadOnly)) {
+		tmpfs_truncate(fs, file, 0);
+	}
+
+	file->handles_open++;
+	file->parent->handles_open++;
+
+	handle->file = file->i.handle;
+	handle->mode = mode;
+	handle->can_seek = true;
+	handle->position = 0;
+
+	handle->isOpen = true;
+
+	return handle;
+}
+
+/*
+ * Creates an empty file in the directory.
+ */
+static fs_file_t *tmpfs_create_file(tmpfs_t *fs, fs_directory_t *dir, char *name, size_t length) {
+	if(fs->inodes_used >= fs->max_inodes) {
+		return NULL;
+	}
+
+	char *copy = tmpfs_copy_name(name, length);
+
+	if(!copy) {
+		return NULL;
+	}
+
+	fs_file_t *file = hal_vfs_allocate_file(dir);
+
+	if(!file) {
+		kfree(copy);
+		return NULL;
+	}
+
+	file->i.name = copy;
+	file->size = 0;
+
+	// Files that can't be looked up can't be kept
+	if(hal_vfs_dir_index_add(dir, copy, &file->i)) {
+		hal_vfs_remove_child(dir, &file->i);
+		hal_vfs_deallocate_file(file);
+
+		return NULL;
+	}
+
+	fs->inodes_used++;
+
+	return file;
+}
+
+// Gets a directory at the specified path.
+static fs_directory_t *tmpfs_list_directory(void *superblock, char *dirname) {
+	tmpfs_t *fs = (tmpfs_t *) superblock;
+	fs_directory_t *dir = fs->root;
+
+	hal_path_iter_t it;
+	hal_path_init(&it, dirname);
+
+	while(dir && hal_path_next(&it)) {
+		dir = tmpfs_enter_directory(fs, dir, &it);
+	}
+
+	return dir;
+}
+
+// Creates a directory.
+static int tmpfs_create_directory(void *superblock, char *path) {
+	tmpfs_t *fs = (tmpfs_t *) superblock;
+
+	char *name;
+	size_t length;
+
+	fs_directory_t *parent = tmpfs_walk(fs, path, &name, &length);
+
+	if(!parent || !name || hal_vfs_dir_lookupn(parent, name, length)) {
+		return -1;
+	}
+
+	if(fs->inodes_used >= fs->max_inodes) {
+		return -2;
+	}
+
+	char *copy = tmpfs_copy_name(name, length);
+	fs_directory_t *dir = hal_vfs_allocate_directory(true);
+
+	if(!copy || !dir) {
+		if(copy) kfree(copy);
+		if(dir) kfree(dir);
+
+		return -2;
+	}
+
+	dir->i.name = copy;
+	dir->i.owner = parent->i.owner;
+	dir->i.permissions = parent->i.permissions;
+
+	dir->parent = &parent->i;
+	dir->populated = true;
+
+	list_add(parent->children, dir);
+
+	if(hal_vfs_dir_index_add(parent, copy, &dir->i)) {
+		hal_vfs_remove_child(parent, &dir->i);
+
+		hal_vfs_deallocate_directory(dir, NULL);
+		kfree(dir);
+
+		return -2;
+	}
+
+	fs->inodes_used++;
+
+	return 0;
+}
+
+// Deletes a file, or an empty directory.
+static int tmpfs_unlink(void *superblock, char *path) {
+	tmpfs_t *fs = (tmpfs_t *) superblock;
+
+	char *name;
+	size_t length;
+
+	fs_directory_t *parent = tmpfs_walk(fs, path, &name, &length);
+
+	if(!parent || !name) {
+		return -1;
+	}
+
+	fs_item_t *item = hal_vfs_dir_lookupn(parent, name, length);
+
+	if(!item) {
+		return -1;
+	}
+
+	if(item->type == kFSItemTypeFile) {
+		fs_file_t *file = (fs_file_t *) item;
+
+		if(file->handles_open) {
+			return -2;
+		}
+
+		hal_vfs_remove_child(parent, item);
+
+		tmpfs_free_pages(fs, file, 0);
+		hal_vfs_deallocate_file(file);
+	} else if(item->type == kFSItemTypeDirectory) {
+		fs_directory_t *dir = (fs_directory_t *) item;
+
+		if(dir->children->num_entries) {
+			return -3;
+		}
+
+		hal_vfs_remove_child(parent, item);
+
+		hal_vfs_deallocate_directory(dir, NULL);
+		kfree(dir);
+	} else {
+		return -1;
+	}
+
+	fs->inodes_used--;
+
+	return 0;
+}
+
+// Opens a file, creating it if requested.
+static fs_file_handle_t *tmpfs_file_open(void *superblock, char *path, fs_file_open_mode_t mode) {
+	tmpfs_t *fs = (tmpfs_t *) superblock;
+
+	char *name;
+	size_t length;
+
+	fs_directory_t *dir = tmpfs_walk(fs, path, &name, &length);
+
+	if(!dir || !name) {
+		return NULL;
+	}
+
+	fs_item_t *item = hal_vfs_dir_lookupn(dir, name, length);
+
+	if(!item) {
+		fs_file_t *file = NULL;
+
+		if((mode & kFSFileModeCreate) && !(mode & kFSFileModeReadOnly)) {
+			file = tmpfs_create_file(fs, dir, name, length);
+		}
+
+		return file ? tmpfs_open(fs, file, mode) : NULL;
+	} else if(item->type != kFSItemTypeFile) {
+		return NULL;
+	}
+
+	return tmpfs_open(fs, (fs_file_t *) item, mode);
+}
+
+// Opens a file the VFS looked up.
+static fs_file_handle_t *tmpfs_file_open_item(void *superblock, fs_file_t *file, fs_file_open_mode_t mode) {
+	return tmpfs_open((tmpfs_t *) superblock, file, mode);
+}
+
+// Closes a file handle.
+static void tmpfs_file_close(void *superblock, fs_file_handle_t *handle) {
+	if(!handle->isOpen) return;
+
+	handle->isOpen = false;
+
+	// Decrement file handle counts (unless the file is already gone)
+	fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+	if(file) {
+		file->handles_open--;
+		file->parent->handles_open--;
+	}
+}
+
+// File metadata only exists in memory.
+static void tmpfs_file_update(void *superblock, fs_file_t *file) {
+
+}
+
+// Reads from the file at the offset in the handle.
+static long long tmpfs_file_read(void *superblock, void *buffer, size_t bytes, fs_file_handle_t *handle) {
+	fs_file_t *file = tmpfs_handle_file(handle);
+
+	if(!file) {
+		return -1;
+	}
+
+	long long read = tmpfs_read_data(file, buffer, bytes, handle->position);
+
+	if(read > 0) {
+		handle->position += read;
+	}
+
+	return read;
+}
+
+// Writes to the file at the offset in the handle.
+static long long tmpfs_file_write(void *superblock, void *buffer, size_t bytes, fs_file_handle_t *handle) {
+	fs_file_t *file = tmpfs_handle_file(handle);
+
+	if(!file || (handle->mode & kFSFileModeReadOnly)) {
+		return -1;
+	}
+
+	if(handle->mode & kFSFileModeAppend) {
+		handle->position = file->size;
+	}
+
+	long long written = tmpfs_write_data((tmpfs_t *) superblock, file, buffer, bytes, handle->position);
+
+	if(written > 0) {
+		handle->position += written;
+	}
+
+	return written;
+}
+
+// There is no stable storage to write to.
+static int tmpfs_file_sync(void *superblock, fs_file_handle_t *handle) {
+	return tmpfs_handle_file(handle) ? 0 : -1;
+}
+
+// Allocates pages for the holes in the first length bytes of the file.
+static int tmpfs_file_allocate(void *superblock, fs_file_handle_t *handle, unsigned long long length) {
+	tmpfs_t *fs = (tmpfs_t *) superblock;
+	fs_file_t *file = tmpfs_handle_file(handle);
+
+	if(!file || (handle->mode & kFSFileModeReadOnly) || length > tmpfs_max_size(fs)) {
+		return -1;
+	}
+
+	unsigned long long pages = (length + (TMPFS_PAGE_SIZE - 1)) / TMPFS_PAGE_SIZE;
+
+	for(unsigned long long i = 0; i < pages; i++) {
+		if(!tmpfs_get_page(fs, file, i)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Reads from an offset in the file.
+static long long tmpfs_file_pread(void *superblock, void *buffer, size_t bytes, unsigned long long offset, fs_file_handle_t *handle) {
+	fs_file_t *file = tmpfs_handle_file(handle);
+	return file ? tmpfs_read_data(file, buffer, bytes, offset) : -1;
+}
+
+// Writes to an offset in the file.
+static long long tmpfs_file_pwrite(void *superblock, void *buffer, size_t bytes, unsigned long long offset, fs_file_handle_t *handle) {
+	fs_file_t *file = tmpfs_handle_file(handle);
+
+	if(!file || (handle->mode & kFSFileModeReadOnly)) {
+		return -1;
+	}
+
+	return tmpfs_write_data((tmpfs_t *) superblock, file, buffer, bytes, offset);
+}
+
+// Reads from an offset in the file into several buffers.
+static long long tmpfs_file_preadv(void *superblock, fs_iovec_t *iov, unsigned int iovcnt, unsigned long long offset, fs_file_handle_t *handle) {
+	fs_file_t *file = tmpfs_handle_file(handle);
+
+	if(!file) {
+		return -1;
+	}
+
+	long long total = 0;
+
+	for(unsigned int i = 0; i < iovcnt; i++) {
+		long long read = tmpfs_read_data(file, iov[i].buffer, iov[i].length, offset + total);
+		total += read;
+
+		if(read < (long long) iov[i].length) {
+			break;
+		}
+	}
+
+	return total;
+}
+
+// Moves the position of the handle; it may be past the end of the file, but
+// not past the largest size a file can have.
+static int tmpfs_file_seek(void *superblock, fs_file_handle_t *handle, unsigned long long position) {
+	if(!tmpfs_handle_file(handle) || position > tmpfs_max_size((tmpfs_t *) superblock)) {
+		return -1;
+	}
+
+	handle->position = position;
+	return 0;
+}
+
+static const hal_vfs_t tmpfs_vfs = {
+	/*.name = */ "tmpfs",
+	/*.supports_partition = */ NULL,
+	/*.create_superblock = */ NULL,
+	/*.list_directory = */ tmpfs_list_directory,
+	/*.create_directory = */ tmpfs_create_directory,
+	/*.unlink = */ tmpfs_unlink,
+	/*.file_open = */ tmpfs_file_open,
+	/*.file_close = */ tmpfs_file_close,
+	/*.file_update = */ tmpfs_file_update,
+	/*.file_read = */ tmpfs_file_read,
+	/*.file_write = */ tmpfs_file_write,
+	/*.file_sync = */ tmpfs_file_sync,
+	/*.file_allocate = */ tmpfs_file_allocate,
+	/*.file_open_item = */ tmpfs_file_open_item,
+	/*.readpage = */ NULL,
+	/*.writepage = */ NULL,
+	/*.readpages = */ NULL,
+	/*.file_pread = */ tmpfs_file_pread,
+	/*.file_pwrite = */ tmpfs_file_pwrite,
+	/*.file_preadv = */ tmpfs_file_preadv,
+	/*.file_seek = */ tmpfs_file_seek,
+	/*.dir_open = */ NULL,
+	/*.dir_read = */ NULL,
+	/*.dir_close = */ NULL,
+	/*.populate_directory = */ NULL,
+	/*.mount = */ tmpfs_mount,
+	/*.file_map = */ NULL,
+	/*.max_file_size = */ NULL,
+	/*.map_data = */ NULL
+};
+
+/*
+ * Registers tmpfs, and mounts an instance of it at /tmp. Its options may be
+ * set with the tmpfs_options key of the kernel config.
+ */
+static int tmpfs_init(void) {
+	hal_vfs_register((hal_vfs_t *) &tmpfs_vfs);
+
+	if(hal_vfs_mount((char *) "tmpfs", (char *) __kcfg_tmpfs_mountpoint, hal_config_get("tmpfs_options"))) {
+		KERROR("Couldn't mount tmpfs at %s", __kcfg_tmpfs_mountpoint);
+	}
+
+	return 0;
+}
+module_init(tmpfs_init);
@@ -1,17 +1,71 @@
 #import <types.h>
 #import "hal.h"
 #import "disk.h"
+#import "x86_pc/x86_pc.h"
+
+// Kinds of requests that are tracked
+typedef enum {
+	kDiskRequestRead,
+	kDiskRequestWrite,
+	kDiskRequestWriteFUA,
+	kDiskRequestFlush
+} hal_disk_request_type_t;
+
+/*
+ * State of a single request, from the time it is submitted to the driver until
+ * the driver invokes the completion callback. Synchronous requests keep this
+ * on the stack; asynchronous ones allocate it, and it's freed on completion.
+ */
+typedef struct hal_disk_request {
+	hal_disk_t *disk;
+	hal_disk_partition_t *partition;
+
+	hal_disk_request_type_t type;
+	uint64_t sectors;
+	unsigned int segments;
+
+	// TSC value at submission
+	uint64_t start;
+
+	// Caller's callback and context (NULL callback for synchronous requests)
+	hal_disk_callback_t callback;
+	void *ctx;
+
+	// Completion state of synchronous requests
+	volatile bool done;
+	hal_disk_error_t error;
+
+	// Next record on the free list
+	struct hal_disk_request *next;
+} hal_disk_request_t;
 
 // Internal state
-static volatile bool hal_disk_null_callback_called = false;
-static unsigned int hal_disk_null_callback_error;
 static list_t *disks;
 
+/*
+ * Records of asynchronous requests that completed. They complete in interrupt
+ * context, where the heap can't be used, so they are kept here for reuse
+ * rather than freed.
+ */
+static hal_disk_request_t *free_requests;
+
 // Private functions
 static void hal_disk_read_ptables(void);
 
-static void hal_disk_register_mbr_read_callback(unsigned int id, void *buf, void *ctx);
-static void hal_disk_null_callback(unsigned int id, void* buf, void* ctx);
+static void hal_disk_scan_partitions(hal_disk_t *disk);
+static bool hal_disk_read_gpt(hal_disk_t *disk, uint64_t header_lba);
+static void hal_disk_read_mbr(hal_disk_t *disk, uint8_t *mbr);
+
+static hal_disk_error_t hal_disk_submit(hal_disk_t* disk, hal_disk_request_type_t type, uint64_t lba, uint64_t length, void* buffer, hal_disk_iovec_t* iov, unsigned int iovcnt, unsigned int* id, hal_disk_callback_t callback, void* ctx);
+static void hal_disk_request_callback(unsigned int id, void* buf, void* ctx, hal_disk_error_t err);
+
+static hal_disk_error_t hal_disk_split_transfer(hal_disk_t* disk, hal_disk_request_type_t type, uint64_t lba, uint64_t length, void* buffer, unsigned int* id, hal_disk_callback_t callback, void* ctx);
+static hal_disk_error_t hal_disk_transfer_v(hal_disk_t* disk, bool write, uint64_t lba, hal_disk_iovec_t* iov, unsigned int iovcnt, unsigned int* id, hal_disk_callback_t callback, void* ctx);
+
+static hal_disk_partition_t *hal_disk_partition_for_lba(hal_disk_t *disk, uint64_t lba);
+static void hal_disk_stats_begin(hal_disk_stats_t *stats, uint64_t now);
+static void hal_disk_stats_end(hal_disk_stats_t *stats, hal_disk_request_t *req, uint64_t now, hal_disk_error_t err);
+static void hal_disk_print_stats_one(const char *name, hal_disk_stats_t *stats);
 
 // A single MBR partition entry
 struct mbr_ent {
@@ -31,6 +85,51 @@ struct mbr_ent {
 	uint32_t length;
 } __attribute__((packed));
 
+// MBR partition type of a GPT protective MBR
+#define MBR_TYPE_GPT_PROTECTIVE		0xEE
+
+// GPT header ("EFI PART")
+#define GPT_SIGNATURE				0x5452415020494645ULL
+
+struct gpt_header {
+	uint64_t signature;
+	uint32_t revision;
+	uint32_t header_size;
+	uint32_t header_crc32;
+	uint32_t reserved;
+
+	uint64_t my_lba;
+	uint64_t alternate_lba;
+
+	uint64_t first_usable_lba;
+	uint64_t last_usable_lba;
+
+	uint8_t disk_guid[16];
+
+	uint64_t entries_lba;
+	uint32_t num_entries;
+	uint32_t entry_size;
+	uint32_t entries_crc32;
+} __attribute__((packed));
+
+// A single GPT partition entry
+struct gpt_ent {
+	uint8_t type_guid[16];
+	uint8_t guid[16];
+
+	uint64_t first_lba;
+	uint64_t last_lba;
+
+	uint64_t attributes;
+
+	uint16_t name[36];
+} __attribute__((packed));
+
+// Upper bound on the size of the GPT partition entry array we'll read
+#define GPT_MAX_ENTRIES_SIZE		(128 * 1024)
+// Largest size of a single partition entry that's accepted
+#define GPT_MAX_ENTRY_SIZE			4096
+
 /*
  * Initialises the disk HAL.
  */
@@ -74,63 +173,545 @@ C_FUNCTION void hal_disk_register(hal_disk_t *disk) {
 /*
  * Reads from the disk
  */
-C_FUNCTION hal_disk_error_t hal_disk_read(hal_disk_t* disk, uint32_t lba, uint32_t length, void* buffer, unsigned int* id, hal_disk_callback_t callback, void* ctx) {
-	if(callback) {
-		return disk->f.read(disk, lba, length, buffer, id, callback, ctx);
-	} else {
-		int r = disk->f.read(disk, lba, length, buffer, id, hal_disk_null_callback, NULL);
+C_FUNCTION hal_disk_error_t hal_disk_read(hal_disk_t* disk, uint64_t lba, uint64_t length, void* buffer, unsigned int* id, hal_disk_callback_t callback, void* ctx) {
+	// Split requests the driver can't handle in one go
+	if(disk->max_transfer && length > disk->max_transfer) {
+		return hal_disk_split_transfer(disk, kDiskRequestRead, lba, length, buffer, id, callback, ctx);
+	}
 
-		// If there was no errors, wait for the callback to be called
-		if(r == kDiskErrorNone) {
-			while(!hal_disk_null_callback_called) {
-				// Wait until the disk read happened
-			}
+	return hal_disk_submit(disk, kDiskRequestRead, lba, length, buffer, NULL, 0, id, callback, ctx);
+}
+
+/*
+ * Writes to the disk
+ */
+C_FUNCTION hal_disk_error_t hal_disk_write(hal_disk_t* disk, uint64_t lba, uint64_t length, void* buffer, unsigned int* id, hal_disk_callback_t callback, void* ctx) {
+	// Written data may sit in the drive's cache until the next flush
+	disk->write_cache_dirty = true;
+
+	// Split requests the driver can't handle in one go
+	if(disk->max_transfer && length > disk->max_transfer) {
+		return hal_disk_split_transfer(disk, kDiskRequestWrite, lba, length, buffer, id, callback, ctx);
+	}
 
-			hal_disk_null_callback_called = false;
+	return hal_disk_submit(disk, kDiskRequestWrite, lba, length, buffer, NULL, 0, id, callback, ctx);
+}
+
+/*
+ * Processes any requests the disk completed, for when its interrupts may not
+ * be delivered (or a caller is waiting on asynchronous requests.)
+ */
+C_FUNCTION void hal_disk_poll(hal_disk_t* disk) {
+	if(disk->f.poll) {
+		disk->f.poll(disk);
+	}
+}
+
+/*
+ * Reads a range of sectors into several buffers, which are filled in order.
+ * This completes synchronously.
+ */
+C_FUNCTION hal_disk_error_t hal_disk_readv(hal_disk_t* disk, uint64_t lba, hal_disk_iovec_t* iov, unsigned int iovcnt) {
+	return hal_disk_transfer_v(disk, false, lba, iov, iovcnt, NULL, NULL, NULL);
+}
+
+/*
+ * Reads a range of sectors into several buffers, invoking the callback once
+ * the read completes. The segments must stay around until then. If the
+ * driver can't take the request as a whole, it is performed synchronously
+ * before this returns, and the callback is invoked right away.
+ *
+ * The callback is only invoked if this returns success.
+ */
+C_FUNCTION hal_disk_error_t hal_disk_readv_async(hal_disk_t* disk, uint64_t lba, hal_disk_iovec_t* iov, unsigned int iovcnt, unsigned int* id, hal_disk_callback_t callback, void* ctx) {
+	return hal_disk_transfer_v(disk, false, lba, iov, iovcnt, id, callback, ctx);
+}
+
+/*
+ * Writes a range of sectors from several buffers. This completes
+ * synchronously.
+ */
+C_FUNCTION hal_disk_error_t hal_disk_writev(hal_disk_t* disk, uint64_t lba, hal_disk_iovec_t* iov, unsigned int iovcnt) {
+	disk->write_cache_dirty = true;
+
+	return hal_disk_transfer_v(disk, true, lba, iov, iovcnt, NULL, NULL, NULL);
+}
+
+/*
+ * Performs a vectored transfer. If the driver supports vectored requests and
+ * the request fits within its transfer limit, it is passed on as-is; the
+ * driver can then transfer straight into each segment. Otherwise, each
+ * segment is transferred with a separate request. Segments that aren't a
+ * whole number of sectors are rejected before anything is transferred.
+ *
+ * If a callback is given, requests passed on as-is complete asynchronously;
+ * otherwise, the callback is invoked once all segments were transferred.
+ */
+static hal_disk_error_t hal_disk_transfer_v(hal_disk_t* disk, bool write, uint64_t lba, hal_disk_iovec_t* iov, unsigned int iovcnt, unsigned int* id, hal_disk_callback_t callback, void* ctx) {
+	bool supported = write ? (disk->f.writev != NULL) : (disk->f.readv != NULL);
+
+	// Get the total length of the request; segments must be whole sectors
+	uint64_t sectors = 0;
+
+	for(unsigned int i = 0; i < iovcnt; i++) {
+		if(iov[i].length % 512) {
+			#if PRINT_ERROR
+			KERROR("Segment %u of %u bytes isn't a whole number of sectors", i, (unsigned int) iov[i].length);
+			#endif
+
+			return kDiskErrorUnknown;
+		}
+
+		sectors += iov[i].length / 512;
+	}
+
+	if(supported && (!disk->max_transfer || sectors <= disk->max_transfer)) {
+		return hal_disk_submit(disk, write ? kDiskRequestWrite : kDiskRequestRead, lba, sectors, NULL, iov, iovcnt, id, callback, ctx);
+	}
 
-			return hal_disk_null_callback_error;
+	// Fall back to a request per segment
+	unsigned int segmentId = 0;
+
+	for(unsigned int i = 0; i < iovcnt; i++) {
+		uint64_t length = iov[i].length / 512;
+		int r;
+
+		if(write) {
+			r = hal_disk_write(disk, lba, length, iov[i].buffer, &segmentId, NULL, NULL);
 		} else {
+			r = hal_disk_read(disk, lba, length, iov[i].buffer, &segmentId, NULL, NULL);
+		}
+
+		if(r != kDiskErrorNone) {
 			return r;
 		}
+
+		lba += length;
+	}
+
+	if(id) {
+		*id = segmentId;
+	}
+
+	// Notify the caller, if they asked for it
+	if(callback) {
+		callback(segmentId, iov, ctx, kDiskErrorNone);
 	}
+
+	return kDiskErrorNone;
 }
 
 /*
- * Writes to the disk
+ * Writes to the disk, returning only once the data is on stable media. This
+ * is meant for the few writes that must be ordered against everything that
+ * follows them, such as commit records; everything else should use regular
+ * writes and a single hal_disk_flush at the end of the transaction.
+ */
+C_FUNCTION hal_disk_error_t hal_disk_write_fua(hal_disk_t* disk, uint64_t lba, uint64_t length, void* buffer) {
+	// Use the drive's native FUA writes, if available
+	if(disk->f.write_fua && (!disk->max_transfer || length <= disk->max_transfer)) {
+		return hal_disk_submit(disk, kDiskRequestWriteFUA, lba, length, buffer, NULL, 0, NULL, NULL, NULL);
+	}
+
+	// Otherwise, emulate it with a write and flush
+	int r = hal_disk_write(disk, lba, length, buffer, NULL, NULL, NULL);
+
+	if(r != kDiskErrorNone) {
+		return r;
+	}
+
+	return hal_disk_flush(disk);
+}
+
+/*
+ * Flushes the disk's write cache. Flushes are skipped if nothing was written
+ * since the last one, so that several filesystems (or several sync points in
+ * a row) don't each pay for a round trip to the drive.
+ */
+C_FUNCTION hal_disk_error_t hal_disk_flush(hal_disk_t* disk) {
+	if(!disk->f.flush_cache || !disk->write_cache_dirty) {
+		return kDiskErrorNone;
+	}
+
+	disk->write_cache_dirty = false;
+
+	// Account for the flush as a request on the whole disk
+	hal_disk_request_t req;
+	memclr(&req, sizeof(req));
+
+	req.disk = disk;
+	req.type = kDiskRequestFlush;
+	req.start = x86_pc_read_tsc();
+
+	uint32_t flags = irq_save();
+	hal_disk_stats_begin(&disk->stats, req.start);
+	irq_restore(flags);
+
+	int r = disk->f.flush_cache(disk);
+
+	flags = irq_save();
+	hal_disk_stats_end(&disk->stats, &req, x86_pc_read_tsc(), r);
+	irq_restore(flags);
+
+	// If the flush failed, the data is still in the cache
+	if(r != kDiskErrorNone) {
+		disk->write_cache_dirty = true;
+	}
+
+	return r;
+}
+
+/*
+ * Puts the record of an asynchronous request on the free list. This may be
+ * called from interrupt context.
+ */
+static void hal_disk_request_release(hal_disk_request_t *req) {
+	uint32_t flags = irq_save();
+
+	req->next = free_requests;
+	free_requests = req;
+
+	irq_restore(flags);
+}
+
+/*
+ * Submits a request to the driver, and keeps track of it so statistics can be
+ * collected when it completes. If no callback is specified, this waits for
+ * the request to complete and returns its result.
+ *
+ * Either buffer/length or iov/iovcnt should be specified. In the latter case,
+ * length is the total number of sectors in the vector.
  */
-C_FUNCTION hal_disk_error_t hal_disk_write(hal_disk_t* disk, uint32_t lba, uint32_t length, void* buffer, unsigned int* id, hal_disk_callback_t callback, void* ctx) {
+static hal_disk_error_t hal_disk_submit(hal_disk_t* disk, hal_disk_request_type_t type, uint64_t lba, uint64_t length, void* buffer, hal_disk_iovec_t* iov, unsigned int iovcnt, unsigned int* id, hal_disk_callback_t callback, void* ctx) {
+	hal_disk_request_t syncReq;
+	hal_disk_request_t *req = &syncReq;
+	int r;
+
+	// Asynchronous requests outlive this function
 	if(callback) {
-		return disk->f.write(disk, lba, length, buffer, id, callback, ctx);
-	} else {
-		int r = disk->f.write(disk, lba, length, buffer, id, hal_disk_null_callback, NULL);
+		uint32_t flags = irq_save();
+		req = free_requests;
 
-		// If there was no errors, wait for the callback to be called
-		if(r == kDiskErrorNone) {
-			while(!hal_disk_null_callback_called) {
-				// Wait until the disk read happened
-			}
+		if(req) {
+			free_requests = req->next;
+		}
+		irq_restore(flags);
+
+		if(!req && !(req = (hal_disk_request_t *) kmalloc(sizeof(hal_disk_request_t)))) {
+			return kDiskErrorUnknown;
+		}
+	}
+
+	req->disk = disk;
+	req->partition = hal_disk_partition_for_lba(disk, lba);
+	req->type = type;
+	req->sectors = length;
+	req->segments = iov ? iovcnt : 1;
+	req->callback = callback;
+	req->ctx = ctx;
+	req->done = false;
+	req->error = kDiskErrorNone;
+
+	// Start accounting
+	req->start = x86_pc_read_tsc();
 
-			hal_disk_null_callback_called = false;
+	uint32_t flags = irq_save();
+	hal_disk_stats_begin(&disk->stats, req->start);
 
-			return hal_disk_null_callback_error;
+	if(req->partition) {
+		hal_disk_stats_begin(&req->partition->stats, req->start);
+	}
+	irq_restore(flags);
+
+	// Pass the request to the driver
+	if(iov) {
+		if(type == kDiskRequestRead) {
+			r = disk->f.readv(disk, lba, iov, iovcnt, id, hal_disk_request_callback, req);
 		} else {
-			return r;
+			r = disk->f.writev(disk, lba, iov, iovcnt, id, hal_disk_request_callback, req);
+		}
+	} else if(type == kDiskRequestRead) {
+		r = disk->f.read(disk, lba, length, buffer, id, hal_disk_request_callback, req);
+	} else if(type == kDiskRequestWrite) {
+		r = disk->f.write(disk, lba, length, buffer, id, hal_disk_request_callback, req);
+	} else {
+		r = disk->f.write_fua(disk, lba, length, buffer, id, hal_disk_request_callback, req);
+	}
+
+	// The driver didn't accept the request, so the callback won't be called
+	if(r != kDiskErrorNone) {
+		flags = irq_save();
+		hal_disk_stats_end(&disk->stats, req, x86_pc_read_tsc(), r);
+
+		if(req->partition) {
+			hal_disk_stats_end(&req->partition->stats, req, x86_pc_read_tsc(), r);
+		}
+		irq_restore(flags);
+
+		if(callback) {
+			hal_disk_request_release(req);
 		}
-	}		
+
+		return r;
+	}
+
+	// Asynchronous requests complete whenever the driver gets around to it
+	if(callback) {
+		return kDiskErrorNone;
+	}
+
+	// Wait until the disk access happened
+	while(!req->done) {
+		if(disk->f.poll) {
+			disk->f.poll(disk);
+		}
+	}
+
+	return req->error;
 }
 
 /*
- * Callback used when NULL is specified. Basically emulates the behaviour of a
- * synchronous disk access.
+ * Invoked by the driver when a request completes. This finishes accounting
+ * for the request, then either notifies the caller or wakes up the
+ * synchronous waiter.
  */
-static void hal_disk_null_callback(unsigned int id, void* buf, void* ctx) {
-	hal_disk_null_callback_called = true;
+static void hal_disk_request_callback(unsigned int id, void* buf, void* ctx, hal_disk_error_t err) {
+	hal_disk_request_t *req = (hal_disk_request_t *) ctx;
+	uint64_t now = x86_pc_read_tsc();
+
+	uint32_t flags = irq_save();
+	hal_disk_stats_end(&req->disk->stats, req, now, err);
 
-	if(!buf) {
-		hal_disk_null_callback_error = *((unsigned int *) ctx);
+	if(req->partition) {
+		hal_disk_stats_end(&req->partition->stats, req, now, err);
+	}
+	irq_restore(flags);
+
+	if(req->callback) {
+		req->callback(id, buf, req->ctx, err);
+		hal_disk_request_release(req);
+	} else {
+		req->error = err;
+
+		// The request is on the waiter's stack, so this must come last
+		req->done = true;
 	}
 }
 
+/*
+ * Performs a request that is larger than what the driver accepts as a series
+ * of chunks of at most max_transfer sectors. Each chunk is waited on before
+ * the next one is issued; once all of them are done, the caller's callback is
+ * invoked once for the whole request.
+ */
+static hal_disk_error_t hal_disk_split_transfer(hal_disk_t* disk, hal_disk_request_type_t type, uint64_t lba, uint64_t length, void* buffer, unsigned int* id, hal_disk_callback_t callback, void* ctx) {
+	hal_disk_error_t err = kDiskErrorNone;
+	unsigned int chunkId = 0;
+
+	uint8_t *ptr = (uint8_t *) buffer;
+
+	while(length) {
+		uint64_t chunk = (length > disk->max_transfer) ? disk->max_transfer : length;
+
+		if((err = hal_disk_submit(disk, type, lba, chunk, ptr, NULL, 0, &chunkId, NULL, NULL)) != kDiskErrorNone) {
+			break;
+		}
+
+		lba += chunk;
+		length -= chunk;
+		ptr += chunk * 512;
+	}
+
+	if(id) {
+		*id = chunkId;
+	}
+
+	// Notify the caller, if they asked for it
+	if(callback) {
+		callback(chunkId, (err == kDiskErrorNone) ? buffer : NULL, ctx, err);
+	}
+
+	return err;
+}
+
+/*
+ * Finds the partition containing the specified sector, if any.
+ */
+static hal_disk_partition_t *hal_disk_partition_for_lba(hal_disk_t *disk, uint64_t lba) {
+	for(unsigned int i = 0; i < disk->num_partitions; i++) {
+		hal_disk_partition_t *part = &disk->partitions[i];
+
+		if(lba >= part->lba_start && lba < (part->lba_start + part->size)) {
+			return part;
+		}
+	}
+
+	return NULL;
+}
+
+// ! Statistics
+/*
+ * Accounts for a request being submitted. Must be called with interrupts off.
+ */
+static void hal_disk_stats_begin(hal_disk_stats_t *stats, uint64_t now) {
+	// The disk becomes busy when the first request is submitted
+	if(stats->in_flight++ == 0) {
+		stats->busy_since = now;
+	}
+
+	if(stats->in_flight > stats->max_in_flight) {
+		stats->max_in_flight = stats->in_flight;
+	}
+}
+
+/*
+ * Accounts for a request having completed. Must be called with interrupts off.
+ */
+static void hal_disk_stats_end(hal_disk_stats_t *stats, hal_disk_request_t *req, uint64_t now, hal_disk_error_t err) {
+	uint64_t latency = now - req->start;
+
+	// Busy time ends when the last request in flight completes
+	if(--stats->in_flight == 0) {
+		stats->busy_cycles += now - stats->busy_since;
+	}
+
+	if(err != kDiskErrorNone) {
+		stats->errors++;
+		return;
+	}
+
+	// Latency histogram bucket: log2 of the number of cycles taken
+	unsigned int bucket = 63 - __builtin_clzll(latency | 1);
+
+	if(bucket >= HAL_DISK_LATENCY_BUCKETS) {
+		bucket = HAL_DISK_LATENCY_BUCKETS - 1;
+	}
+
+	switch(req->type) {
+		case kDiskRequestRead:
+			stats->reads++;
+			stats->read_sectors += req->sectors;
+			stats->read_merges += req->segments - 1;
+			stats->read_cycles += latency;
+			stats->read_latency[bucket]++;
+			break;
+
+		case kDiskRequestWrite:
+		case kDiskRequestWriteFUA:
+			stats->writes++;
+			stats->write_sectors += req->sectors;
+			stats->write_merges += req->segments - 1;
+			stats->write_cycles += latency;
+			stats->write_latency[bucket]++;
+			break;
+
+		case kDiskRequestFlush:
+			stats->flushes++;
+			stats->flush_cycles += latency;
+			break;
+	}
+}
+
+/*
+ * Copies the statistics of the specified disk, including a busy period that is
+ * still in progress.
+ */
+C_FUNCTION void hal_disk_get_stats(hal_disk_t *disk, hal_disk_stats_t *out) {
+	uint32_t flags = irq_save();
+	memcpy(out, &disk->stats, sizeof(hal_disk_stats_t));
+
+	if(out->in_flight) {
+		out->busy_cycles += x86_pc_read_tsc() - out->busy_since;
+	}
+	irq_restore(flags);
+}
+
+/*
+ * Copies the statistics of the specified partition.
+ */
+C_FUNCTION void hal_disk_partition_get_stats(hal_disk_partition_t *part, hal_disk_stats_t *out) {
+	uint32_t flags = irq_save();
+	memcpy(out, &part->stats, sizeof(hal_disk_stats_t));
+
+	if(out->in_flight) {
+		out->busy_cycles += x86_pc_read_tsc() - out->busy_since;
+	}
+	irq_restore(flags);
+}
+
+/*
+ * Resets the statistics of a disk and all of its partitions. Requests that are
+ * still in flight are kept track of.
+ */
+C_FUNCTION void hal_disk_reset_stats(hal_disk_t *disk) {
+	uint32_t flags = irq_save();
+	uint64_t now = x86_pc_read_tsc();
+
+	unsigned int in_flight = disk->stats.in_flight;
+	memclr(&disk->stats, sizeof(hal_disk_stats_t));
+	disk->stats.in_flight = disk->stats.max_in_flight = in_flight;
+	disk->stats.busy_since = now;
+
+	for(unsigned int i = 0; i < disk->num_partitions; i++) {
+		hal_disk_stats_t *stats = &disk->partitions[i].stats;
+
+		in_flight = stats->in_flight;
+		memclr(stats, sizeof(hal_disk_stats_t));
+		stats->in_flight = stats->max_in_flight = in_flight;
+		stats->busy_since = now;
+	}
+	irq_restore(flags);
+}
+
+/*
+ * Prints the statistics of all disks and their partitions to the console.
+ */
+C_FUNCTION void hal_disk_print_stats(void) {
+	char name[32];
+
+	for(unsigned int i = 0; i < disks->num_entries; i++) {
+		hal_disk_t *disk = (hal_disk_t *) list_get(disks, i);
+		hal_disk_stats_t stats;
+
+		hal_disk_get_stats(disk, &stats);
+
+		snprintf(name, sizeof(name), "disk%u", i);
+		hal_disk_print_stats_one(name, &stats);
+
+		for(unsigned int p = 0; p < disk->num_partitions; p++) {
+			hal_disk_partition_get_stats(&disk->partitions[p], &stats);
+
+			snprintf(name, sizeof(name), "disk%up%u", i, disk->partitions[p].index);
+			hal_disk_print_stats_one(name, &stats);
+		}
+	}
+}
+
+/*
+ * Prints a single set of statistics. Times are in thousands of TSC cycles,
+ * and the histograms only list buckets that aren't empty.
+ */
+static void hal_disk_print_stats_one(const char *name, hal_disk_stats_t *stats) {
+	kprintf("%s: rd %u (%u sect, %u merged, %u kcyc) wr %u (%u sect, %u merged, %u kcyc)\n",
+		name,
+		(unsigned int) stats->reads, (unsigned int) stats->read_sectors,
+		(unsigned int) stats->read_merges, (unsigned int) (stats->read_cycles / 1000),
+		(unsigned int) stats->writes, (unsigned int) stats->write_sectors,
+		(unsigned int) stats->write_merges, (unsigned int) (stats->write_cycles / 1000));
+
+	kprintf("%s: flush %u (%u kcyc) err %u in flight %u (max %u) busy %u kcyc\n",
+		name,
+		(unsigned int) stats->flushes, (unsigned int) (stats->flush_cycles / 1000),
+		(unsigned int) stats->errors, stats->in_flight, stats->max_in_flight,
+		(unsigned int) (stats->busy_cycles / 1000));
+
+	for(unsigned int b = 0; b < HAL_DISK_LATENCY_BUCKETS; b++) {
+		if(stats->read_latency[b] || stats->write_latency[b]) {
+			kprintf("%s:   2^%u cyc: rd %u wr %u\n", name, b,
+				(unsigned int) stats->read_latency[b], (unsigned int) stats->write_latency[b]);
+		}
+	}
+}
 
 /*
  * Reads the partition tables of all hard drives.
@@ -139,48 +720,267 @@ static void hal_disk_read_ptables(void) {
 	for(unsigned int i = 0; i < disks->num_entries; i++) {
 		hal_disk_t *disk = (hal_disk_t *) list_get(disks, i);
 
-		// Read MBR, only on hard drives
+		// Read partition tables, only on hard drives
 		if(hal_disk_setup(disk) == kDiskErrorNone && disk->type == kDiskTypeHardDrive) {
-			void *buffer = kmalloc(1024);
-			hal_disk_read(disk, 0, 1, buffer, NULL, hal_disk_register_mbr_read_callback, disk);
+			hal_disk_scan_partitions(disk);
 		}
 	}
 }
 
 /*
- * Callback for when the read of sector zero completes
+ * Reads the partition table of a disk, and tries to load a filesystem for each
+ * partition found on it.
+ *
+ * If the MBR is a GPT protective MBR, the primary GPT is used; if that is
+ * corrupted, the backup GPT at the end of the disk is tried instead. Disks
+ * without a (valid) GPT use the partitions in the MBR.
  */
-static void hal_disk_register_mbr_read_callback(unsigned int id, void *buf, void *ctx) {
-	if(!buf) {
+static void hal_disk_scan_partitions(hal_disk_t *disk) {
+	uint8_t *mbr = (uint8_t *) kmalloc(512);
+	bool isGPT = false;
+
+	if(hal_disk_read(disk, 0, 1, mbr, NULL, NULL, NULL) != kDiskErrorNone) {
 		KERROR("Error reading MBR");
-		return;
+		goto done;
+	}
+
+	// Valid MBR?
+	if(mbr[0x1FE] != 0x55 || mbr[0x1FF] != 0xAA) {
+		goto done;
+	}
+
+	// Check for a protective MBR
+	for(unsigned int p = 0; p < 4; p++) {
+		struct mbr_ent *mbr_entry = &((struct mbr_ent *) (mbr + 0x1BE))[p];
+
+		if(mbr_entry->partition_type == MBR_TYPE_GPT_PROTECTIVE) {
+			isGPT = true;
+			break;
+		}
 	}
 
-	hal_disk_t *disk = (hal_disk_t *) ctx;
-	uint8_t *readPtr = (uint8_t *) buf;
+	if(isGPT) {
+		if(hal_disk_read_gpt(disk, 1)) {
+			goto load;
+		}
 
-	// Valid MBR
-	if(readPtr[0x1FE] == 0x55 && readPtr[0x1FF] == 0xAA) {
-		// Process four partitions
-		struct mbr_ent *partitions = (struct mbr_ent *) (readPtr + 0x1BE);
+		// Try the backup header in the last sector of the disk
+		if(disk->num_sectors && hal_disk_read_gpt(disk, disk->num_sectors - 1)) {
+			KWARNING("hal_disk: Primary GPT on disk 0x%08X corrupt, using backup", (unsigned int) disk);
+			goto load;
+		}
 
-		for(unsigned int p = 0; p < 4; p++) {
-			struct mbr_ent *mbr_entry = &partitions[p];
+		KERROR("hal_disk: No valid GPT on disk 0x%08X", (unsigned int) disk);
+	}
 
-			// Is there a partition mapped here?
-			if(mbr_entry->partition_type) {
-				disk->partitions[p].type = mbr_entry->partition_type;
-				disk->partitions[p].lba_start = mbr_entry->lba_start;
-				disk->partitions[p].size = mbr_entry->length;
+	hal_disk_read_mbr(disk, mbr);
 
-				// Try to load a filesystem for this partition
-				if(!hal_vfs_load(&disk->partitions[p], disk)) {
-					KDEBUG("hal_disk: Ignoring partition %u on disk 0x%08X", p, (unsigned int) disk);
-				}
-			}
+	// Try to load a filesystem for each of the partitions
+	load: ;
+	for(unsigned int p = 0; p < disk->num_partitions; p++) {
+		if(!hal_vfs_load(&disk->partitions[p], disk)) {
+			KDEBUG("hal_disk: Ignoring partition %u on disk 0x%08X", p, (unsigned int) disk);
 		}
 	}
 
 	// Clean up read buffer
-	kfree(buf);
-}
\ No newline at end of file
+	done: ;
+	kfree(mbr);
+}
+
+/*
+ * Creates partitions from the four primary partitions in the MBR.
+ */
+static void hal_disk_read_mbr(hal_disk_t *disk, uint8_t *mbr) {
+	struct mbr_ent *partitions = (struct mbr_ent *) (mbr + 0x1BE);
+
+	disk->partition_scheme = kDiskPartitionSchemeMBR;
+	disk->partitions = (hal_disk_partition_t *) kmalloc(sizeof(hal_disk_partition_t) * 4);
+	disk->num_partitions = 0;
+
+	memclr(disk->partitions, sizeof(hal_disk_partition_t) * 4);
+
+	for(unsigned int p = 0; p < 4; p++) {
+		struct mbr_ent *mbr_entry = &partitions[p];
+
+		// Is there a partition mapped here?
+		if(mbr_entry->partition_type && mbr_entry->partition_type != MBR_TYPE_GPT_PROTECTIVE) {
+			hal_disk_partition_t *part = &disk->partitions[disk->num_partitions++];
+
+			part->disk = disk;
+			part->index = p;
+			part->type = mbr_entry->partition_type;
+			part->lba_start = mbr_entry->lba_start;
+			part->size = mbr_entry->length;
+		}
+	}
+}
+
+/*
+ * Checks whether a GPT entry describes a partition that can be used: it must
+ * be in use, and lie within both the usable range of the header and the disk.
+ */
+static bool hal_disk_gpt_entry_usable(hal_disk_t *disk, struct gpt_header *header, struct gpt_ent *ent) {
+	static const uint8_t unused_guid[16] = {0};
+
+	if(!memcmp(ent->type_guid, unused_guid, 16)) {
+		return false;
+	}
+
+	if(ent->last_lba < ent->first_lba || ent->first_lba < header->first_usable_lba || ent->last_lba > header->last_usable_lba) {
+		return false;
+	}
+
+	if(disk->num_sectors && ent->last_lba >= disk->num_sectors) {
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Reads the GPT whose header is in the given sector, and creates partitions for
+ * all used entries. Both the header and the partition entry array are verified
+ * against their checksums.
+ *
+ * @return true if the GPT was valid, false otherwise.
+ */
+static bool hal_disk_read_gpt(hal_disk_t *disk, uint64_t header_lba) {
+	bool success = false;
+	uint8_t *entries = NULL;
+	uint32_t numEntries = 0;
+
+	uint8_t *buffer = (uint8_t *) kmalloc(512);
+	struct gpt_header *header = (struct gpt_header *) buffer;
+
+	if(!buffer) {
+		return false;
+	}
+
+	if(hal_disk_read(disk, header_lba, 1, buffer, NULL, NULL, NULL) != kDiskErrorNone) {
+		goto done;
+	}
+
+	// Verify the header
+	if(header->signature != GPT_SIGNATURE || header->my_lba != header_lba) {
+		goto done;
+	}
+
+	if(header->header_size < sizeof(struct gpt_header) || header->header_size > 512) {
+		goto done;
+	}
+
+	{
+		// The checksum is calculated with the checksum field zeroed
+		uint32_t crc = header->header_crc32;
+		header->header_crc32 = 0;
+
+		if(std_crc32(0, header, header->header_size) != crc) {
+			goto done;
+		}
+	}
+
+	/*
+	 * Sanity check the entry array before allocating memory for it. Both
+	 * fields come off the disk, so check each of them, and do the product in
+	 * 64 bits so it can't wrap.
+	 */
+	if(header->entry_size < sizeof(struct gpt_ent) || (header->entry_size % 8) || header->entry_size > GPT_MAX_ENTRY_SIZE) {
+		goto done;
+	}
+
+	if(!header->num_entries || header->num_entries > (GPT_MAX_ENTRIES_SIZE / sizeof(struct gpt_ent))) {
+		goto done;
+	}
+
+	{
+		uint64_t entriesLength64 = ((uint64_t) header->num_entries) * header->entry_size;
+
+		if(entriesLength64 > GPT_MAX_ENTRIES_SIZE) {
+			goto done;
+		}
+
+		uint32_t entriesLength = (uint32_t) entriesLength64;
+
+		// Read the partition entry array
+		uint32_t entriesSectors = (entriesLength + 511) / 512;
+		entries = (uint8_t *) kmalloc(entriesSectors * 512);
+
+		if(!entries) {
+			goto done;
+		}
+
+		if(hal_disk_read(disk, header->entries_lba, entriesSectors, entries, NULL, NULL, NULL) != kDiskErrorNone) {
+			goto done;
+		}
+
+		if(std_crc32(0, entries, entriesLength) != header->entries_crc32) {
+			goto done;
+		}
+
+		// Only walk the entries that were actually read
+		numEntries = entriesLength / header->entry_size;
+	}
+
+	{
+		unsigned int used = 0;
+
+		// Count the usable entries, so the partition array can be allocated
+		for(uint32_t i = 0; i < numEntries; i++) {
+			struct gpt_ent *ent = (struct gpt_ent *) (entries + (i * header->entry_size));
+
+			if(hal_disk_gpt_entry_usable(disk, header, ent)) {
+				used++;
+			}
+		}
+
+		hal_disk_partition_t *partitions = (hal_disk_partition_t *) kmalloc(sizeof(hal_disk_partition_t) * (used ? used : 1));
+
+		if(!partitions) {
+			goto done;
+		}
+
+		memclr(partitions, sizeof(hal_disk_partition_t) * (used ? used : 1));
+
+		disk->partition_scheme = kDiskPartitionSchemeGPT;
+		disk->partitions = partitions;
+		disk->num_partitions = 0;
+
+		// Create partitions; entries outside the disk are corrupt, and skipped
+		for(uint32_t i = 0; i < numEntries; i++) {
+			struct gpt_ent *ent = (struct gpt_ent *) (entries + (i * header->entry_size));
+
+			if(!hal_disk_gpt_entry_usable(disk, header, ent)) {
+				continue;
+			}
+
+			hal_disk_partition_t *part = &disk->partitions[disk->num_partitions++];
+
+			part->disk = disk;
+			part->index = i;
+			part->type = 0;
+
+			memcpy(part->type_guid, ent->type_guid, 16);
+			memcpy(part->guid, ent->guid, 16);
+
+			part->lba_start = ent->first_lba;
+			part->size = (ent->last_lba - ent->first_lba) + 1;
+
+			// Convert the name (UTF-16) to ASCII
+			for(unsigned int c = 0; c < 36 && ent->name[c]; c++) {
+				part->name[c] = (ent->name[c] < 0x80) ? (char) ent->name[c] : '?';
+			}
+		}
+	}
+
+	success = true;
+
+	// Clean up
+	done: ;
+	if(entries) {
+		kfree(entries);
+	}
+
+	kfree(buffer);
+	return success;
+}
@@ -5,9 +5,17 @@ typedef int hal_disk_error_t;
 typedef struct hal_disk hal_disk_t;
 typedef struct hal_disk_functions hal_disk_functions_t;
 typedef struct hal_disk_partition hal_disk_partition_t;
+typedef struct hal_disk_iovec hal_disk_iovec_t;
 
-// Read/write callback (gets read ID, data ptr and context ptr)
-typedef void (*hal_disk_callback_t)(unsigned int, void*, void*);
+/*
+ * Read/write callback: gets the request ID, data pointer (NULL on error), the
+ * context pointer passed with the request, and the error code. Drivers invoke
+ * it exactly once for each request they accepted.
+ */
+typedef void (*hal_disk_callback_t)(unsigned int, void*, void*, hal_disk_error_t);
+
+// Number of buckets in the latency histograms
+#define HAL_DISK_LATENCY_BUCKETS	40
 
 // Interfaces a disk could be attached through
 typedef enum hal_disk_if {
@@ -36,12 +44,79 @@ typedef enum {
 	kDiskTypeOther = 0x7FFFFFFF
 } hal_disk_type_t;
 
+// Partitioning schemes a disk may use
+typedef enum {
+	kDiskPartitionSchemeNone = 0,
+	kDiskPartitionSchemeMBR,
+	kDiskPartitionSchemeGPT
+} hal_disk_partition_scheme_t;
+
+/*
+ * I/O statistics of a disk or partition. Times are measured in TSC cycles; the
+ * latency histograms are log2 scaled, so bucket n counts requests that took
+ * between 2^n and 2^(n+1) cycles.
+ */
+typedef struct {
+	// Completed requests, sectors transferred, and segments merged into them
+	uint64_t reads, writes, flushes;
+	uint64_t read_sectors, write_sectors;
+	uint64_t read_merges, write_merges;
+
+	// Requests that failed
+	uint64_t errors;
+
+	// Requests currently submitted to the driver
+	unsigned int in_flight, max_in_flight;
+
+	// Time spent with at least one request in flight, and when that started
+	uint64_t busy_cycles;
+	uint64_t busy_since;
+
+	// Total time spent by completed requests
+	uint64_t read_cycles, write_cycles, flush_cycles;
+
+	uint32_t read_latency[HAL_DISK_LATENCY_BUCKETS];
+	uint32_t write_latency[HAL_DISK_LATENCY_BUCKETS];
+} hal_disk_stats_t;
+
 // A single partition entry
 struct hal_disk_partition {
+	// Disk this partition is on
+	hal_disk_t *disk;
+
+	// Index of the partition in the partition table
+	unsigned int index;
+
+	// MBR partition type (0 for GPT partitions)
 	uint8_t type;
 
-	unsigned int lba_start;
-	unsigned int size;
+	// GPT partition type and unique partition GUID (zero for MBR partitions)
+	uint8_t type_guid[16];
+	uint8_t guid[16];
+
+	// GPT partition name, converted to ASCII
+	char name[37];
+
+	uint64_t lba_start;
+	uint64_t size;
+
+	// I/O statistics for requests within this partition
+	hal_disk_stats_t stats;
+};
+
+/*
+ * A single segment of a vectored request. Segments are transferred in order to
+ * consecutive sectors, and their length must be a multiple of the sector size.
+ *
+ * The virtual address must always be specified. Drivers that can perform DMA
+ * may use the physical address instead, if it is non-zero: the segment then
+ * must be physically contiguous.
+ */
+struct hal_disk_iovec {
+	void *buffer;
+	unsigned int phys;
+
+	size_t length;
 };
 
 // Function calls for interfacing with a disk
@@ -51,13 +126,39 @@ struct hal_disk_functions {
 	hal_disk_error_t (*reset)(hal_disk_t*);
 
 	// Disk, LBA start, length, destination buffer, ID assigned to read, callback, ctx to pass to callback
-	hal_disk_error_t (*read)(hal_disk_t*, uint32_t, uint32_t, void*, unsigned int*, hal_disk_callback_t, void*);
+	hal_disk_error_t (*read)(hal_disk_t*, uint64_t, uint64_t, void*, unsigned int*, hal_disk_callback_t, void*);
 
 	// Disk, LBA start, length, read buffer, ID assigned to write, callback, ctx to pass to callback
-	hal_disk_error_t (*write)(hal_disk_t*, uint32_t, uint32_t, void*, unsigned int*, hal_disk_callback_t, void*);
+	hal_disk_error_t (*write)(hal_disk_t*, uint64_t, uint64_t, void*, unsigned int*, hal_disk_callback_t, void*);
+
+	/*
+	 * Same as write, but the data is on stable media by the time the callback
+	 * is invoked (Force Unit Access). Optional: if not implemented, the HAL
+	 * performs a regular write followed by a cache flush.
+	 */
+	hal_disk_error_t (*write_fua)(hal_disk_t*, uint64_t, uint64_t, void*, unsigned int*, hal_disk_callback_t, void*);
+
+	/*
+	 * Vectored read/write: Disk, LBA start, segments, number of segments, ID
+	 * assigned to the request, callback, ctx to pass to callback. On success,
+	 * the callback receives the segment array as its buffer.
+	 *
+	 * Optional: if not implemented, the HAL issues a request per segment.
+	 */
+	hal_disk_error_t (*readv)(hal_disk_t*, uint64_t, hal_disk_iovec_t*, unsigned int, unsigned int*, hal_disk_callback_t, void*);
+	hal_disk_error_t (*writev)(hal_disk_t*, uint64_t, hal_disk_iovec_t*, unsigned int, unsigned int*, hal_disk_callback_t, void*);
+
+	// Writes all data in the drive's write cache to the media
+	hal_disk_error_t (*flush_cache)(hal_disk_t*);
+
+	/*
+	 * Processes any requests the device completed. Drivers that complete
+	 * requests from an interrupt should implement this, so that synchronous
+	 * requests also complete while interrupts are disabled.
+	 */
+	void (*poll)(hal_disk_t*);
 
 	// Miscellaneous
-	hal_disk_error_t (*flush_cache)(hal_disk_t*);
 
 	hal_disk_error_t (*sleep)(hal_disk_t*);
 	hal_disk_error_t (*wake)(hal_disk_t*);
@@ -78,12 +179,27 @@ struct hal_disk {
 
 	void *driver;
 
+	// Size of the disk, in sectors (0 if unknown)
+	uint64_t num_sectors;
+
+	// Largest number of sectors the driver accepts in one request (0 = no limit)
+	unsigned int max_transfer;
+
+	// Set when data was written since the last cache flush
+	volatile bool write_cache_dirty;
+
 	// Partitions on the disk
-	hal_disk_partition_t partitions[4];
+	hal_disk_partition_scheme_t partition_scheme;
+
+	hal_disk_partition_t *partitions;
+	unsigned int num_partitions;
 
 	// functions to interact with the drive
 	hal_disk_functions_t f;
 
+	// I/O statistics
+	hal_disk_stats_t stats;
+
 	// Disk sleeping
 	bool sleep_enabled;
 	unsigned int sleep_interval; // seconds
@@ -94,5 +210,19 @@ C_FUNCTION hal_disk_t *hal_disk_alloc();
 C_FUNCTION void hal_disk_register(hal_disk_t *disk);
 
 C_FUNCTION hal_disk_error_t hal_disk_setup(hal_disk_t* disk);
-C_FUNCTION hal_disk_error_t hal_disk_read(hal_disk_t* disk, uint32_t lba, uint32_t length, void* buffer, unsigned int* id, hal_disk_callback_t callback, void* ctx);
-C_FUNCTION hal_disk_error_t hal_disk_write(hal_disk_t* disk, uint32_t lba, uint32_t length, void* buffer, unsigned int* id, hal_disk_callback_t callback, void* ctx);
\ No newline at end of file
+C_FUNCTION hal_disk_error_t hal_disk_read(hal_disk_t* disk, uint64_t lba, uint64_t length, void* buffer, unsigned int* id, hal_disk_callback_t callback, void* ctx);
+C_FUNCTION hal_disk_error_t hal_disk_write(hal_disk_t* disk, uint64_t lba, uint64_t length, void* buffer, unsigned int* id, hal_disk_callback_t callback, void* ctx);
+
+C_FUNCTION void hal_disk_poll(hal_disk_t* disk);
+
+C_FUNCTION hal_disk_error_t hal_disk_readv(hal_disk_t* disk, uint64_t lba, hal_disk_iovec_t* iov, unsigned int iovcnt);
+C_FUNCTION hal_disk_error_t hal_disk_readv_async(hal_disk_t* disk, uint64_t lba, hal_disk_iovec_t* iov, unsigned int iovcnt, unsigned int* id, hal_disk_callback_t callback, void* ctx);
+C_FUNCTION hal_disk_error_t hal_disk_writev(hal_disk_t* disk, uint64_t lba, hal_disk_iovec_t* iov, unsigned int iovcnt);
+
+C_FUNCTION hal_disk_error_t hal_disk_write_fua(hal_disk_t* disk, uint64_t lba, uint64_t length, void* buffer);
+C_FUNCTION hal_disk_error_t hal_disk_flush(hal_disk_t* disk);
+
+C_FUNCTION void hal_disk_get_stats(hal_disk_t *disk, hal_disk_stats_t *out);
+C_FUNCTION void hal_disk_partition_get_stats(hal_disk_partition_t *part, hal_disk_stats_t *out);
+C_FUNCTION void hal_disk_reset_stats(hal_disk_t *disk);
+C_FUNCTION void hal_disk_print_stats(void);
@@ -17,8 +17,8 @@ hal_fs::hal_fs(hal_disk_partition_t *p, hal_disk_t *d) {
  * @return NULL if there was an error, start of the original buffer otherwise.
  */
 void *hal_fs::read_sectors(unsigned int start, unsigned int numSectors, void *buffer, unsigned int *error) {
-	start += partition->lba_start;
-	unsigned int err = hal_disk_read(disk, start, numSectors, buffer, NULL, NULL, NULL);
+	uint64_t lba = partition->lba_start + start;
+	unsigned int err = hal_disk_read(disk, lba, numSectors, buffer, NULL, NULL, NULL);
 
 	// Error reading disk?
 	if(err) {
@@ -38,8 +38,8 @@ void *hal_fs::read_sectors(unsigned int start, unsigned int numSectors, void *bu
  * start of the original buffer if success.
  */
 void *hal_fs::write_sectors(unsigned int start, unsigned int numSectors, void *buffer, unsigned int *error) {
-	start += partition->lba_start;
-	unsigned int err = hal_disk_write(disk, start, numSectors, buffer, NULL, NULL, NULL);
+	uint64_t lba = partition->lba_start + start;
+	unsigned int err = hal_disk_write(disk, lba, numSectors, buffer, NULL, NULL, NULL);
 
 	// Error writing to disk?
 	if(err) {
@@ -55,46 +55,72 @@ void *hal_fs::write_sectors(unsigned int start, unsigned int numSectors, void *b
 }
 
 /*
- * Splits a string with the slash ("/") character, and returns a string array
- * containing the individual pieces.
+ * Reads consecutive sectors, starting at the partition-relative sector start,
+ * into each of the segments in turn. This allows data to be read directly to
+ * its final destination, even if that isn't contiguous.
  *
- * Note: This function makes a copy of the path internally, as it is modified.
- * Therefore, to release its memory, you must free the first string, then the
- * array itself to relinquish all memory.
+ * @return true if successful, false otherwise.
  */
-list_t *hal_fs::split_path(char *in) {
-	// Copy string
-	size_t length = strlen(in) + 1;
-	char *path = (char *) kmalloc(length);
-	strncpy(path, in, length);
+bool hal_fs::read_sectors_v(unsigned int start, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *error) {
+	uint64_t lba = partition->lba_start + start;
+	unsigned int err = hal_disk_readv(disk, lba, iov, iovcnt);
 
-	// Allocate list
-	list_t *list = list_allocate();
-	ASSERT(list);
+	// Error reading disk?
+	if(err) {
+		// If the caller wants an error code, pass it.
+		if(error) {
+			*error = err;
+		}
 
-	// Perform separation by token
-	char *component = strtok(path, "/");
-	unsigned int i = 0;
+		return false;
+	}
 
-	while(component) {
-		// Allocate a buffer to copy this into
-		size_t bufSize = strlen(component) + 4;
-		char *newBuf = (char *) kmalloc(bufSize);
+	return true;
+}
 
-		// Clear buffer
-		memclr(newBuf, bufSize);
+/*
+ * Writes consecutive sectors from each of the segments in turn.
+ *
+ * @return true if successful, false otherwise.
+ */
+bool hal_fs::write_sectors_v(unsigned int start, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *error) {
+	uint64_t lba = partition->lba_start + start;
+	unsigned int err = hal_disk_writev(disk, lba, iov, iovcnt);
 
-		// Copy to buffer and add
-		memcpy(newBuf, component, strlen(component));
-		list_add(list, newBuf);
+	// Error writing to disk?
+	if(err) {
+		// If the caller wants an error code, pass it.
+		if(error) {
+			*error = err;
+		}
 
-		component = strtok(NULL, "/");
+		return false;
 	}
 
-	// Clean up
-	kfree(path);
+	return true;
+}
+
+/*
+ * Ensures all previous writes have made it to stable storage. Filesystems
+ * should call this at ordering points only (the end of a metadata update,
+ * fsync, or unmount) rather than after each write.
+ *
+ * @return true if successful, false otherwise.
+ */
+bool hal_fs::flush(unsigned int *error) {
+	unsigned int err = hal_disk_flush(disk);
+
+	// Error flushing the disk?
+	if(err) {
+		// If the caller wants an error code, pass it.
+		if(error) {
+			*error = err;
+		}
+
+		return false;
+	}
 
-	return list;
+	return true;
 }
 
 /*
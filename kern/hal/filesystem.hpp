@@ -2,7 +2,7 @@
 
 /*
  * Base class that filesystems should inherit from, which provides some common
- * functions for tasks such as reading sectors and splitting paths.
+ * functions for tasks such as reading and writing sectors.
  */
 class hal_fs {
 	public:
@@ -12,8 +12,12 @@ class hal_fs {
 		void *read_sectors(unsigned int start, unsigned int numSectors, void *buffer, unsigned int *error);
 		void *write_sectors(unsigned int start, unsigned int numSectors, void *buffer, unsigned int *error);
 
-		// Split path
-		list_t *split_path(char *in);
+		// Vectored sector read/write functions
+		bool read_sectors_v(unsigned int start, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *error);
+		bool write_sectors_v(unsigned int start, hal_disk_iovec_t *iov, unsigned int iovcnt, unsigned int *error);
+
+		// Write barrier: flushes the disk's write cache
+		bool flush(unsigned int *error);
 
 		// Return current time
 		time_components_t get_current_fs_time(void);
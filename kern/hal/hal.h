@@ -13,7 +13,10 @@ extern "C" {
 #import <hal/keyboard.h>
 #import <hal/disk.h>
 #import <hal/bus.h>
+#import <hal/path.h>
 #import <hal/vfs.h>
+#import <hal/pagecache.h>
+#import <hal/ioring.h>
 
 #import <acpi/acpi.h>
 
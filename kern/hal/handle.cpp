@@ -1,195 +1,215 @@
 #import <types.h>
 #import "handle.h"
 
-// Number of handles to allocate memory for when we run out
-#define HANDLE_TABLE_GROWTH		0x400
-// Number of handles to initially allocate memory for
-#define HANDLE_INITIAL_SIZE		0x800
+/*
+ * A handle consists of an index into the handle table, and the generation of
+ * the table entry at the time it was allocated. Entries get a new generation
+ * when they're released, so handles that outlived their object are detected
+ * rather than referring to whatever object reuses the entry.
+ */
+#define HANDLE_INDEX_BITS		20
+#define HANDLE_INDEX_MASK		((1 << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK	(0xFFFFFFFF >> HANDLE_INDEX_BITS)
 
-#define FREE_HANDLE_TABLE_LEN	32
+#define HANDLE_INDEX(h)			((h) & HANDLE_INDEX_MASK)
+#define HANDLE_GENERATION(h)	((h) >> HANDLE_INDEX_BITS)
+
+/*
+ * The table is made up of segments of this many handles. Segments are added
+ * as needed and never move, so growing the table doesn't touch live entries.
+ */
+#define HANDLE_SEGMENT_SHIFT	10
+#define HANDLE_SEGMENT_SIZE		(1 << HANDLE_SEGMENT_SHIFT)
+#define HANDLE_MAX_SEGMENTS		((1 << HANDLE_INDEX_BITS) / HANDLE_SEGMENT_SIZE)
+
+// Marks the end of the free list
+#define HANDLE_FREE_LIST_END	0
 
 /*
  * This is the private internal handle type: It points to some kind of object.
+ * Free entries instead hold the index of the next free entry.
  */
 struct khandle {
 	unsigned int type;
-	void *object;
-} __attribute__((packed));
+	unsigned int generation;
+
+	union {
+		void *object;
+		unsigned int next_free;
+	};
+};
 
-// Pointer to the handle array
-static unsigned int handle_array_size;
-static struct khandle *handle_array;
+// Segments of the handle table
+static struct khandle *handle_segments[HANDLE_MAX_SEGMENTS];
+static unsigned int handle_num_segments;
 
-// A shortlist of handles to allocate
-static hal_handle_t free_handles[FREE_HANDLE_TABLE_LEN];
+// Index of the first free entry
+static unsigned int handle_free_head;
 
 // Stats
 static unsigned int handles_allocated;
+static unsigned int handles_peak;
+static unsigned int handles_stale;
 
 /*
- * Initialise the handle allocator.
+ * Gets the table entry for a handle, or NULL if the handle is stale or was
+ * never allocated.
  */
-static int hal_handle_init(void) {
-	// Allocate the memory
-	handle_array_size = HANDLE_INITIAL_SIZE;
-	handle_array = (struct khandle *) kmalloc(handle_array_size * sizeof(struct khandle));
+static inline struct khandle *hal_handle_entry(hal_handle_t handle) {
+	unsigned int index = HANDLE_INDEX(handle);
+	struct khandle *segment = handle_segments[index >> HANDLE_SEGMENT_SHIFT];
 
-	// Fill handle 0 to an invalid handle
-	handle_array[0].type = 0xDEADBEEF;
-	handle_array[0].object = (void *) 0xFFFFFFFF;
-
-	// Initialise the remainder of the handle pool
-	for(unsigned int i = 1; i < HANDLE_INITIAL_SIZE; i++) {
-		handle_array[i].type = BAD_HANDLE_TYPE;
+	if(unlikely(!segment)) {
+		return NULL;
 	}
 
-	// Fill free handle table (speeds up allocation)
-	for(unsigned int i = 0; i < FREE_HANDLE_TABLE_LEN; i++) {
-		free_handles[i] = i + 1;
+	struct khandle *entry = &segment[index & (HANDLE_SEGMENT_SIZE - 1)];
+
+	if(unlikely(entry->generation != HANDLE_GENERATION(handle) || entry->type == BAD_HANDLE_TYPE)) {
+		handles_stale++;
+		return NULL;
 	}
 
-	return 0;
+	return entry;
 }
-module_early_init(hal_handle_init);
 
-extern "C" {
-	/*
-	 * Request the allocation of a new handle, pointing to obj.
-	 */
-	hal_handle_t hal_handle_allocate(void *obj, unsigned int type) {
-		hal_handle_t handle = 0;
+/*
+ * Adds a segment to the handle table, and puts its entries on the free list
+ * (lowest index first.)
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+static int hal_handle_grow(void) {
+	if(handle_num_segments == HANDLE_MAX_SEGMENTS) {
+		return -1;
+	}
 
-		// Try to get a handle from the handle table
-		for(unsigned int i = 0; i < FREE_HANDLE_TABLE_LEN; i++) {
-			if(likely(free_handles[i])) {
-				handle = free_handles[i];
+	struct khandle *segment = (struct khandle *) kmalloc(HANDLE_SEGMENT_SIZE * sizeof(struct khandle));
 
-				// Resort table
-				for(int x = i; x < (FREE_HANDLE_TABLE_LEN - 1); x++) {
-					free_handles[x] = free_handles[x+1];
-				}
+	if(!segment) {
+		return -1;
+	}
 
-				free_handles[FREE_HANDLE_TABLE_LEN-1] = 0;
- 			}
-		}
+	unsigned int base = handle_num_segments * HANDLE_SEGMENT_SIZE;
 
-		// If the handle is still zero, traverse the array for an empty slot.
-		if(!handle) {
-			for(unsigned int i = 0; i < handle_array_size; i++) {
-				// Found an empty handle
-				if(unlikely(!handle_array[i].object && handle_array[i].type == BAD_HANDLE_TYPE)) {
-					handle = i;
-
-					// Do a quick check if handles after this are free also
-					unsigned int offset = 0;
-					for(unsigned int x = 0; x < (FREE_HANDLE_TABLE_LEN / 4); x++) {
-						if(!handle_array[x + i].object && handle_array[x + i].type == BAD_HANDLE_TYPE) {
-							free_handles[offset++] = x + i;
-						}
-					}
-
-					break;
-				}
-			}
-		}
+	for(int i = (HANDLE_SEGMENT_SIZE - 1); i >= 0; i--) {
+		segment[i].type = BAD_HANDLE_TYPE;
+		segment[i].generation = 0;
+
+		// Handle 0 is never valid
+		if(!(base + i)) continue;
+
+		segment[i].next_free = handle_free_head;
+		handle_free_head = base + i;
+	}
 
-		// Once the entire handle table has been searched, resize it by a page.
-		if(unlikely(!handle)) {
-			unsigned int firstFreeHandle = handle_array_size;
-			handle = firstFreeHandle++;
+	handle_segments[handle_num_segments++] = segment;
 
-			// Add HANDLE_TABLE_GROWTH number of handles to the array
-			unsigned int newSize = sizeof(struct khandle) * handle_array_size;
-			newSize += sizeof(struct khandle) * HANDLE_TABLE_GROWTH;
+	KDEBUG("Handle table grown to %u entries", handle_num_segments * HANDLE_SEGMENT_SIZE);
+	return 0;
+}
 
-			// Reallocate memory
-			struct khandle *newPtr = (struct khandle*) krealloc(handle_array, newSize);
+/*
+ * Initialise the handle allocator.
+ */
+static int hal_handle_init(void) {
+	handle_free_head = HANDLE_FREE_LIST_END;
 
-			if(newPtr) {
-				KDEBUG("Resized handle array to %u (0x%08X)", handle_array_size + HANDLE_TABLE_GROWTH,
-					(unsigned int) newPtr);
+	return hal_handle_grow();
+}
+module_early_init(hal_handle_init);
 
-				handle_array = newPtr;
-			} else {
+extern "C" {
+	/*
+	 * Request the allocation of a new handle, pointing to obj.
+	 */
+	hal_handle_t hal_handle_allocate(void *obj, unsigned int type) {
+		// Add a segment if the table is full
+		if(unlikely(handle_free_head == HANDLE_FREE_LIST_END)) {
+			if(hal_handle_grow()) {
 				return 0;
 			}
+		}
 
-			// Fill in free handle table
-			for(unsigned int i = 0; i < FREE_HANDLE_TABLE_LEN; i++) {
-				free_handles[i] = firstFreeHandle++;
-			}
-
-			// Initialise the new handles
-			newSize = handle_array_size + HANDLE_TABLE_GROWTH;
-			for(unsigned int i = handle_array_size; i < newSize; i++) {
-				handle_array[i].type = BAD_HANDLE_TYPE;
-			}
+		// Take the first free entry
+		unsigned int index = handle_free_head;
+		struct khandle *entry = &handle_segments[index >> HANDLE_SEGMENT_SHIFT][index & (HANDLE_SEGMENT_SIZE - 1)];
 
-			// Increment the size.
-			handle_array_size = newSize;
+		// Ensure we only allocate valid handles
+		if(entry->type != BAD_HANDLE_TYPE) {
+			PANIC("Re-allocating handle for some reason");
 		}
 
-		// Ensure we only allocate valid handles
-		if(handle) {
-			if(handle_array[handle].type != BAD_HANDLE_TYPE) {
-				PANIC("Re-allocating handle for some reason");
-			}
+		handle_free_head = entry->next_free;
 
-			// Update stats
-			handles_allocated++;
+		// Actually save object in the handle
+		entry->object = obj;
+		entry->type = type;
 
-			// Actually save object in the handle
-			handle_array[handle].object = obj;
-			handle_array[handle].type = type;
+		// Update stats
+		if(++handles_allocated > handles_peak) {
+			handles_peak = handles_allocated;
 		}
 
-		return handle;
+		return (entry->generation << HANDLE_INDEX_BITS) | index;
 	}
 
 	// Retrieves the object pointed to by a handle.
 	void *hal_handle_get_object(hal_handle_t handle) {
-		return handle_array[handle].object;
+		struct khandle *entry = hal_handle_entry(handle);
+		return entry ? entry->object : NULL;
 	}
 
 	// Retrieves the type of the handle.
 	unsigned int hal_handle_get_type(hal_handle_t handle) {
-		return handle_array[handle].type;
+		struct khandle *entry = hal_handle_entry(handle);
+		return entry ? entry->type : BAD_HANDLE_TYPE;
 	}
 
 	// Updates the object pointed to by the handle, freeing the old if requested.
 	void hal_handle_update_object(hal_handle_t handle, void *obj, bool free) {
+		struct khandle *entry = hal_handle_entry(handle);
+
+		if(!entry) return;
+
 		// Deallocate object
 		if(free) {
-			kfree(handle_array[handle].object);
+			kfree(entry->object);
 		}
 
 		// Change the object pointed to by the handle
-		handle_array[handle].object = obj;
+		entry->object = obj;
 	}
 
 	// Releases an existing handle, freeing its object, if requested.
 	void hal_handle_release(hal_handle_t handle, bool free) {
 		// Make sure this handle isn't already deallocated
-		if(handle_array[handle].type == BAD_HANDLE_TYPE) return;
+		struct khandle *entry = hal_handle_entry(handle);
+
+		if(!entry) return;
 
 		// Deallocate object
 		if(free) {
-			kfree(handle_array[handle].object);
+			kfree(entry->object);
 		}
 
-		// Mark handle as free (pointer == NULL)
-		handle_array[handle].object = NULL;
-		handle_array[handle].type = BAD_HANDLE_TYPE;
+		// Mark handle as free, and invalidate any copies of it
+		entry->type = BAD_HANDLE_TYPE;
+		entry->generation = (entry->generation + 1) & HANDLE_GENERATION_MASK;
 
-		// Update handle
+		// Put it on the free list
+		entry->next_free = handle_free_head;
+		handle_free_head = HANDLE_INDEX(handle);
+
+		// Update stats
 		handles_allocated--;
+	}
 
-		// Optionally mark as free in the free handles table, if there's space
-		for(unsigned int i = 0; i < FREE_HANDLE_TABLE_LEN; i++) {
-			if(unlikely(!free_handles[i])) {
-				free_handles[i] = handle;
-				return;
-			}
-		}
+	// Gets statistics about handle allocation.
+	void hal_handle_get_stats(hal_handle_stats_t *stats) {
+		stats->allocated = handles_allocated;
+		stats->peak = handles_peak;
+		stats->capacity = (handle_num_segments * HANDLE_SEGMENT_SIZE) - 1;
+		stats->stale_lookups = handles_stale;
 	}
-}
\ No newline at end of file
+}
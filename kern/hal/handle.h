@@ -5,6 +5,19 @@ typedef unsigned int hal_handle_t;
 
 #define	BAD_HANDLE_TYPE		'BADH'
 
+// Statistics about handle allocation
+typedef struct hal_handle_stats {
+	// Handles currently allocated, and the most that ever were at once
+	unsigned int allocated;
+	unsigned int peak;
+
+	// Handles the table can hold without growing
+	unsigned int capacity;
+
+	// Lookups of handles that were released (or never allocated)
+	unsigned int stale_lookups;
+} hal_handle_stats_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -23,6 +36,9 @@ extern "C" {
 	// Releases an existing handle, freeing its object, if requested.
 	void hal_handle_release(hal_handle_t handle, bool free);
 
+	// Gets statistics about handle allocation.
+	void hal_handle_get_stats(hal_handle_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,386 @@
+// Submission/completion rings for asynchronous file and block I/O
+extern "C" {
+	#import <types.h>
+	#import "disk.h"
+	#import "vfs.h"
+	#import "ioring.h"
+}
+
+// Largest number of submission queue entries a ring may have
+#define IORING_MAX_ENTRIES		4096
+
+/*
+ * A block request that was passed to the disk, and hasn't completed yet. Each
+ * ring keeps a list of these, so waiting on the ring knows which disks to
+ * poll for completions.
+ *
+ * Requests complete in interrupt context, where the heap can't be used, so
+ * the records are preallocated with the ring: one for each completion queue
+ * entry, which bounds the operations in flight.
+ */
+typedef struct hal_ioring_request hal_ioring_request_t;
+struct hal_ioring_request {
+	hal_ioring_t *ring;
+	hal_disk_t *disk;
+
+	uint64_t user_data;
+
+	// Bytes transferred by the request, if it succeeds
+	int64_t length;
+
+	hal_ioring_request_t *prev, *next;
+};
+
+static void hal_ioring_disk_callback(unsigned int id, void *buf, void *ctx, hal_disk_error_t err);
+
+/*
+ * Takes a request record off the ring's free list.
+ */
+static hal_ioring_request_t *hal_ioring_request_get(hal_ioring_t *ring) {
+	uint32_t flags = irq_save();
+
+	hal_ioring_request_t *req = (hal_ioring_request_t *) ring->free_requests;
+
+	if(req) {
+		ring->free_requests = req->next;
+	}
+
+	irq_restore(flags);
+	return req;
+}
+
+/*
+ * Returns a request record to the ring's free list. Interrupts must be off.
+ */
+static void hal_ioring_request_put(hal_ioring_t *ring, hal_ioring_request_t *req) {
+	req->next = (hal_ioring_request_t *) ring->free_requests;
+	ring->free_requests = req;
+}
+
+/*
+ * Posts a completion for an operation that was in flight. Completions may be
+ * posted from interrupt context.
+ */
+static void hal_ioring_complete(hal_ioring_t *ring, uint64_t user_data, int64_t result) {
+	uint32_t flags = irq_save();
+
+	hal_ioring_cqe_t *cqe = &HAL_IORING_CQES(ring)[ring->cq_tail & (ring->cq_entries - 1)];
+	cqe->user_data = user_data;
+	cqe->result = result;
+
+	ring->cq_tail++;
+	ring->inflight--;
+
+	irq_restore(flags);
+}
+
+/*
+ * Polls the disk of the oldest block request in flight, so that completions
+ * come in even if the disk's interrupts are masked.
+ */
+static void hal_ioring_poll(hal_ioring_t *ring) {
+	uint32_t flags = irq_save();
+
+	hal_ioring_request_t *req = (hal_ioring_request_t *) ring->requests;
+	hal_disk_t *disk = req ? req->disk : NULL;
+
+	irq_restore(flags);
+
+	if(disk) {
+		hal_disk_poll(disk);
+	}
+}
+
+/*
+ * Creates a ring with (at least) the given number of submission queue
+ * entries. The completion queue is twice as large.
+ */
+C_FUNCTION hal_ioring_t *hal_ioring_create(unsigned int entries) {
+	if(!entries || entries > IORING_MAX_ENTRIES) {
+		return NULL;
+	}
+
+	// Round up to a power of two, so indices can be masked
+	unsigned int size = 1;
+
+	while(size < entries) {
+		size <<= 1;
+	}
+
+	// Lay out the header, then the submission and completion queues
+	uint32_t sqOffset = (sizeof(hal_ioring_t) + 7) & ~7;
+	uint32_t cqOffset = sqOffset + (size * sizeof(hal_ioring_sqe_t));
+	uint32_t reqOffset = (cqOffset + (size * 2 * sizeof(hal_ioring_cqe_t)) + 7) & ~7;
+
+	hal_ioring_t *ring = (hal_ioring_t *) kmalloc(reqOffset + (size * 2 * sizeof(hal_ioring_request_t)));
+
+	if(!ring) {
+		return NULL;
+	}
+
+	ring->sq_head = ring->sq_tail = 0;
+	ring->sq_entries = size;
+	ring->sq_offset = sqOffset;
+
+	ring->cq_head = ring->cq_tail = 0;
+	ring->cq_entries = size * 2;
+	ring->cq_offset = cqOffset;
+
+	ring->inflight = 0;
+	ring->requests = NULL;
+	ring->free_requests = NULL;
+
+	// Request records follow the queues
+	hal_ioring_request_t *reqs = (hal_ioring_request_t *) (((uint8_t *) ring) + reqOffset);
+
+	for(unsigned int i = 0; i < ring->cq_entries; i++) {
+		hal_ioring_request_put(ring, &reqs[i]);
+	}
+
+	return ring;
+}
+
+/*
+ * Destroys a ring, once all operations that are in flight have completed.
+ * Entries that were queued but not submitted are dropped.
+ */
+C_FUNCTION void hal_ioring_destroy(hal_ioring_t *ring) {
+	while(ring->inflight) {
+		hal_ioring_poll(ring);
+	}
+
+	kfree(ring);
+}
+
+/*
+ * Gets the next submission queue entry and queues it. The caller fills it in
+ * before entering the ring.
+ *
+ * @return The entry (zeroed), or NULL if the submission queue is full.
+ */
+C_FUNCTION hal_ioring_sqe_t *hal_ioring_get_sqe(hal_ioring_t *ring) {
+	if((ring->sq_tail - ring->sq_head) == ring->sq_entries) {
+		return NULL;
+	}
+
+	hal_ioring_sqe_t *sqe = &HAL_IORING_SQES(ring)[ring->sq_tail & (ring->sq_entries - 1)];
+	memclr(sqe, sizeof(hal_ioring_sqe_t));
+
+	ring->sq_tail++;
+	return sqe;
+}
+
+/*
+ * Starts a single operation. File operations go through the VFS, which is
+ * synchronous, so they complete right away; block requests are handed to the
+ * disk and complete whenever it's done with them.
+ */
+static void hal_ioring_issue(hal_ioring_t *ring, hal_ioring_sqe_t *sqe) {
+	int64_t result = 0;
+
+	switch(sqe->opcode) {
+		case kIoRingOpNop:
+			break;
+
+		case kIoRingOpRead:
+			if(sqe->offset == HAL_IORING_OFFSET_CURRENT) {
+				result = hal_vfs_fread(sqe->buffer, sqe->length, sqe->handle);
+			} else {
+				result = hal_vfs_pread(sqe->buffer, sqe->length, sqe->offset, sqe->handle);
+			}
+			break;
+
+		case kIoRingOpWrite:
+			if(sqe->offset == HAL_IORING_OFFSET_CURRENT) {
+				result = hal_vfs_fwrite(sqe->buffer, sqe->length, sqe->handle);
+			} else {
+				result = hal_vfs_pwrite(sqe->buffer, sqe->length, sqe->offset, sqe->handle);
+			}
+			break;
+
+		case kIoRingOpOpen: {
+			fs_file_handle_t *handle = hal_vfs_fopen(sqe->path, (fs_file_open_mode_t) sqe->mode);
+			result = handle ? (int64_t) (uint32_t) handle : -1;
+			break;
+		}
+
+		case kIoRingOpClose:
+			hal_vfs_fclose(sqe->handle);
+			break;
+
+		case kIoRingOpFsync:
+			result = hal_vfs_fsync(sqe->handle);
+			break;
+
+		case kIoRingOpDiskRead:
+		case kIoRingOpDiskWrite: {
+			hal_ioring_request_t *req = hal_ioring_request_get(ring);
+
+			if(!req) {
+				result = -1;
+				break;
+			}
+
+			req->ring = ring;
+			req->disk = sqe->disk;
+			req->user_data = sqe->user_data;
+			req->length = (int64_t) sqe->length * 512;
+
+			// Track it, before the disk can complete it
+			uint32_t flags = irq_save();
+
+			req->prev = NULL;
+			req->next = (hal_ioring_request_t *) ring->requests;
+
+			if(req->next) {
+				req->next->prev = req;
+			}
+
+			ring->requests = req;
+
+			irq_restore(flags);
+
+			hal_disk_error_t err;
+
+			if(sqe->opcode == kIoRingOpDiskRead) {
+				err = hal_disk_read(sqe->disk, sqe->offset, sqe->length, sqe->buffer, NULL, hal_ioring_disk_callback, req);
+			} else {
+				err = hal_disk_write(sqe->disk, sqe->offset, sqe->length, sqe->buffer, NULL, hal_ioring_disk_callback, req);
+			}
+
+			// The callback is invoked once the request completes
+			if(err == kDiskErrorNone) {
+				return;
+			}
+
+			// The disk didn't take the request
+			flags = irq_save();
+
+			if(req->prev) {
+				req->prev->next = req->next;
+			} else {
+				ring->requests = req->next;
+			}
+
+			if(req->next) {
+				req->next->prev = req->prev;
+			}
+
+			hal_ioring_request_put(ring, req);
+			irq_restore(flags);
+
+			result = -((int64_t) err);
+			break;
+		}
+
+		default:
+			#if PRINT_ERROR
+			KERROR("Unknown ring opcode %u", sqe->opcode);
+			#endif
+
+			result = -1;
+			break;
+	}
+
+	hal_ioring_complete(ring, sqe->user_data, result);
+}
+
+/*
+ * Invoked by the disk when a block request completes.
+ */
+static void hal_ioring_disk_callback(unsigned int id, void *buf, void *ctx, hal_disk_error_t err) {
+	hal_ioring_request_t *req = (hal_ioring_request_t *) ctx;
+	hal_ioring_t *ring = req->ring;
+
+	uint32_t flags = irq_save();
+
+	if(req->prev) {
+		req->prev->next = req->next;
+	} else {
+		ring->requests = req->next;
+	}
+
+	if(req->next) {
+		req->next->prev = req->prev;
+	}
+
+	hal_ioring_complete(ring, req->user_data, (err == kDiskErrorNone) ? req->length : -((int64_t) err));
+	hal_ioring_request_put(ring, req);
+
+	irq_restore(flags);
+}
+
+/*
+ * Submits all queued entries in one go, then waits until at least
+ * min_complete completions are available. Entries are only submitted while
+ * the completion queue has room for their completions; the rest stay queued
+ * until the ring is entered again.
+ *
+ * @return Number of entries that were submitted.
+ */
+C_FUNCTION int hal_ioring_enter(hal_ioring_t *ring, unsigned int min_complete) {
+	int submitted = 0;
+
+	while(ring->sq_head != ring->sq_tail) {
+		if(((ring->cq_tail - ring->cq_head) + ring->inflight) >= ring->cq_entries) {
+			break;
+		}
+
+		// Copy the entry, so the producer can reuse its slot right away
+		hal_ioring_sqe_t sqe = HAL_IORING_SQES(ring)[ring->sq_head & (ring->sq_entries - 1)];
+		ring->sq_head++;
+
+		uint32_t flags = irq_save();
+		ring->inflight++;
+		irq_restore(flags);
+
+		hal_ioring_issue(ring, &sqe);
+		submitted++;
+	}
+
+	// Wait for completions, as long as there are any to come
+	while((ring->cq_tail - ring->cq_head) < min_complete && ring->inflight) {
+		hal_ioring_poll(ring);
+	}
+
+	return submitted;
+}
+
+/*
+ * Gets the oldest completion that hasn't been reaped yet.
+ *
+ * @return The completion, or NULL if there is none.
+ */
+C_FUNCTION hal_ioring_cqe_t *hal_ioring_peek_cqe(hal_ioring_t *ring) {
+	if(ring->cq_head == ring->cq_tail) {
+		return NULL;
+	}
+
+	return &HAL_IORING_CQES(ring)[ring->cq_head & (ring->cq_entries - 1)];
+}
+
+/*
+ * Waits for a completion to become available.
+ *
+ * @return The completion, or NULL if there are no operations in flight.
+ */
+C_FUNCTION hal_ioring_cqe_t *hal_ioring_wait_cqe(hal_ioring_t *ring) {
+	hal_ioring_cqe_t *cqe;
+
+	while(!(cqe = hal_ioring_peek_cqe(ring))) {
+		if(!ring->inflight) {
+			return NULL;
+		}
+
+		hal_ioring_poll(ring);
+	}
+
+	return cqe;
+}
+
+/*
+ * Marks the completion returned by peek/wait as reaped, freeing its slot.
+ */
+C_FUNCTION void hal_ioring_cqe_seen(hal_ioring_t *ring) {
+	ring->cq_head++;
+}
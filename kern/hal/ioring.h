@@ -0,0 +1,108 @@
+#import <types.h>
+#import <hal/disk.h>
+#import <hal/vfs.h>
+
+// Offset of file reads/writes that use (and advance) the handle's position
+#define HAL_IORING_OFFSET_CURRENT	0xFFFFFFFFFFFFFFFFULL
+
+/*
+ * Operations that can be submitted to a ring
+ */
+typedef enum {
+	kIoRingOpNop = 0,
+
+	// File I/O, on an open handle
+	kIoRingOpRead = 1,
+	kIoRingOpWrite = 2,
+	kIoRingOpOpen = 3,
+	kIoRingOpClose = 4,
+	kIoRingOpFsync = 5,
+
+	// Block I/O: length is in sectors, offset is the LBA
+	kIoRingOpDiskRead = 6,
+	kIoRingOpDiskWrite = 7
+} hal_ioring_op_t;
+
+/*
+ * Submission queue entry: describes a single operation.
+ */
+typedef struct hal_ioring_sqe {
+	uint8_t opcode;
+	uint8_t reserved[3];
+
+	// Mode to open a file in
+	uint32_t mode;
+
+	// File handle, disk or path (for opens) that the operation works on
+	union {
+		fs_file_handle_t *handle;
+		hal_disk_t *disk;
+		char *path;
+	};
+
+	void *buffer;
+	uint32_t length;
+
+	// Offset into the file, or LBA
+	uint64_t offset;
+
+	// Passed back in the completion, untouched
+	uint64_t user_data;
+} hal_ioring_sqe_t;
+
+/*
+ * Completion queue entry: the result of an operation is the number of bytes
+ * transferred, the handle opened (cast to an integer), 0 for operations that
+ * don't return anything, or a negative error code.
+ */
+typedef struct hal_ioring_cqe {
+	uint64_t user_data;
+	int64_t result;
+} hal_ioring_cqe_t;
+
+/*
+ * An I/O ring. The producer fills in submission queue entries and advances
+ * sq_tail; the kernel consumes them, advancing sq_head, once the ring is
+ * entered. Completions are posted at cq_tail, and the consumer advances
+ * cq_head as it reaps them.
+ *
+ * The header and both queues are a single allocation, and the queues are
+ * found by their offset from the header, so that the ring can be shared with
+ * a task through a mapping later on.
+ */
+typedef struct hal_ioring {
+	// Submission queue
+	volatile uint32_t sq_head, sq_tail;
+	uint32_t sq_entries;
+	uint32_t sq_offset;
+
+	// Completion queue
+	volatile uint32_t cq_head, cq_tail;
+	uint32_t cq_entries;
+	uint32_t cq_offset;
+
+	// Operations that were submitted, but haven't completed yet
+	volatile uint32_t inflight;
+
+	// Kernel private: block requests that are in flight, and unused records
+	void *requests;
+	void *free_requests;
+} hal_ioring_t;
+
+#define HAL_IORING_SQES(r)	((hal_ioring_sqe_t *) (((uint8_t *) (r)) + (r)->sq_offset))
+#define HAL_IORING_CQES(r)	((hal_ioring_cqe_t *) (((uint8_t *) (r)) + (r)->cq_offset))
+
+// Creates and destroys rings
+C_FUNCTION hal_ioring_t *hal_ioring_create(unsigned int entries);
+C_FUNCTION void hal_ioring_destroy(hal_ioring_t *ring);
+
+// Gets the next free submission queue entry, and queues it
+C_FUNCTION hal_ioring_sqe_t *hal_ioring_get_sqe(hal_ioring_t *ring);
+
+// Submits queued entries, then waits for at least min_complete completions
+C_FUNCTION int hal_ioring_enter(hal_ioring_t *ring, unsigned int min_complete);
+
+// Reaps completions
+C_FUNCTION hal_ioring_cqe_t *hal_ioring_peek_cqe(hal_ioring_t *ring);
+C_FUNCTION hal_ioring_cqe_t *hal_ioring_wait_cqe(hal_ioring_t *ring);
+C_FUNCTION void hal_ioring_cqe_seen(hal_ioring_t *ring);
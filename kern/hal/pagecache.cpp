@@ -0,0 +1,1184 @@
+// Page cache for file data, shared by all filesystems
+extern "C" {
+	#import <types.h>
+	#import "paging/paging.h"
+	#import "vfs.h"
+	#import "pagecache.h"
+}
+
+// Number of hash buckets for looking up pages
+#define PAGECACHE_BUCKETS			1024
+
+// Number of pages allocated between checks of the amount of free memory
+#define PAGECACHE_PRESSURE_INTERVAL	32
+// The cache shrinks once less than 1/n of physical memory is free
+#define PAGECACHE_LOW_MEMORY		16
+
+// Once this many pages are dirty, the oldest ones are written back after writes
+#define PAGECACHE_DIRTY_MAX			256
+// Dirty pages left once that writeback is done
+#define PAGECACHE_DIRTY_TARGET		(PAGECACHE_DIRTY_MAX / 2)
+
+// Smallest and largest readahead window, in bytes
+#define PAGECACHE_READAHEAD_MIN		0x4000
+#define PAGECACHE_READAHEAD_MAX		0x80000
+
+// Most pages passed to the filesystem in a single readpages call
+#define PAGECACHE_READAHEAD_BATCH	(PAGECACHE_READAHEAD_MAX / HAL_PAGECACHE_PAGE_SIZE)
+
+typedef struct hal_pagecache_io hal_pagecache_io_t;
+
+/*
+ * A page of a file's data. Pages are found through a hash of the file and the
+ * page's index in it, and are kept on a list of all pages of the file, newest
+ * first, as well as on the global LRU list that eviction works from.
+ */
+struct hal_page {
+	fs_file_t *file;
+	unsigned long long index;
+
+	// Filesystem that the page is read from and written back to
+	hal_vfs_t *fs;
+	void *superblock;
+
+	// Set if the page contains data that hasn't been written back yet
+	bool dirty;
+
+	// Set if the page was read ahead, and hasn't been used yet
+	bool readahead;
+
+	// Set once the page holds the file's data
+	bool uptodate;
+
+	// Asynchronous read that's filling the page, if any
+	hal_pagecache_io_t *io;
+
+	// Pages that are pinned (such as while being filled) aren't evicted
+	unsigned int pins;
+
+	// Next page in the same hash bucket
+	hal_page_t *hash_next;
+
+	// Other pages of the same file
+	hal_page_t *file_prev, *file_next;
+
+	// LRU list, most recently used page first
+	hal_page_t *lru_prev, *lru_next;
+
+	uint8_t *data;
+};
+
+/*
+ * Pages that are read ahead straight from the disk, without waiting for the
+ * data. They stay pinned until all requests for them complete; since that may
+ * happen in interrupt context, the pages are only finished later, by a reader
+ * that needs one of them, or once the cache looks for completed reads.
+ */
+struct hal_pagecache_io {
+	hal_disk_t *disk;
+
+	// Requests in flight, plus one while they're being submitted
+	volatile unsigned int pending;
+	// Set if any of the requests failed
+	volatile bool failed;
+
+	// Size of the file, and the end of the data that was requested
+	unsigned long long size, end;
+
+	// Segments of all requests; the driver may use them until completion
+	hal_disk_iovec_t *iov;
+
+	// Other reads in flight
+	hal_pagecache_io_t *next;
+
+	unsigned int count;
+	hal_page_t *pages[];
+};
+
+static hal_page_t *pagecache_buckets[PAGECACHE_BUCKETS];
+static hal_page_t *pagecache_lru_head, *pagecache_lru_tail;
+
+// Asynchronous reads that haven't been finished yet
+static hal_pagecache_io_t *pagecache_ios;
+
+// Stats
+static unsigned int pages_cached;
+static unsigned int pages_dirty;
+
+static unsigned int cache_hits, cache_misses;
+static unsigned int readahead_pages, readahead_hits, readahead_waste;
+
+// Pages allocated since memory was last checked
+static unsigned int pages_since_check;
+
+/*
+ * Determines which hash bucket holds a page.
+ */
+static inline unsigned int hal_pagecache_bucket(fs_file_t *file, unsigned long long index) {
+	uint32_t hash = (((uint32_t) file) >> 4) ^ (((uint32_t) index) * 2654435761U);
+	return (hash ^ (hash >> 16)) & (PAGECACHE_BUCKETS - 1);
+}
+
+/*
+ * Finds a page of the file in the cache.
+ */
+static hal_page_t *hal_pagecache_find(fs_file_t *file, unsigned long long index) {
+	hal_page_t *page = pagecache_buckets[hal_pagecache_bucket(file, index)];
+
+	while(page) {
+		if(page->file == file && page->index == index) {
+			return page;
+		}
+
+		page = page->hash_next;
+	}
+
+	return NULL;
+}
+
+/*
+ * Moves a page to the head of the LRU list.
+ */
+static void hal_pagecache_touch(hal_page_t *page) {
+	if(pagecache_lru_head == page) return;
+
+	// Take it out of the list
+	page->lru_prev->lru_next = page->lru_next;
+
+	if(page->lru_next) {
+		page->lru_next->lru_prev = page->lru_prev;
+	} else {
+		pagecache_lru_tail = page->lru_prev;
+	}
+
+	// Insert it at the head
+	page->lru_prev = NULL;
+	page->lru_next = pagecache_lru_head;
+	pagecache_lru_head->lru_prev = page;
+	pagecache_lru_head = page;
+}
+
+/*
+ * Invoked by the disk as each request of an asynchronous read completes. This
+ * may be in interrupt context, so only the read's state is updated here.
+ */
+static void hal_pagecache_io_callback(unsigned int id, void *buf, void *ctx, hal_disk_error_t err) {
+	hal_pagecache_io_t *io = (hal_pagecache_io_t *) ctx;
+	uint32_t flags = irq_save();
+
+	if(err != kDiskErrorNone) {
+		io->failed = true;
+	}
+
+	io->pending--;
+	irq_restore(flags);
+}
+
+/*
+ * Finishes an asynchronous read once all of its requests completed, and
+ * unpins its pages. Pages whose data didn't arrive in full are left in the
+ * cache without data, and are read again once they're used.
+ */
+static void hal_pagecache_io_finish(hal_pagecache_io_t *io) {
+	hal_pagecache_io_t **link = &pagecache_ios;
+
+	while(*link != io) {
+		link = &(*link)->next;
+	}
+
+	*link = io->next;
+
+	for(unsigned int i = 0; i < io->count; i++) {
+		hal_page_t *page = io->pages[i];
+		unsigned long long start = page->index * HAL_PAGECACHE_PAGE_SIZE;
+
+		page->io = NULL;
+		page->pins--;
+
+		// The last page may have been requested only in part
+		bool complete = ((start + HAL_PAGECACHE_PAGE_SIZE) <= io->end) || (io->end == io->size);
+
+		if(io->failed || !complete) {
+			if(page->readahead) {
+				page->readahead = false;
+				readahead_pages--;
+			}
+
+			continue;
+		}
+
+		// Anything past the end of the file reads as zeroes
+		if((io->size - start) < HAL_PAGECACHE_PAGE_SIZE) {
+			unsigned int valid = io->size - start;
+			memclr(page->data + valid, HAL_PAGECACHE_PAGE_SIZE - valid);
+		}
+
+		page->uptodate = true;
+	}
+
+	if(io->failed) {
+		#if PRINT_ERROR
+		KERROR("Couldn't read ahead pages %u-%u of '%s'", (unsigned int) io->pages[0]->index, (unsigned int) io->pages[0]->index + io->count - 1, io->pages[0]->file->i.name);
+		#endif
+	}
+
+	kfree(io->iov);
+	kfree(io);
+}
+
+/*
+ * Waits for all requests of an asynchronous read to complete, then finishes
+ * it.
+ */
+static void hal_pagecache_io_wait(hal_pagecache_io_t *io) {
+	while(io->pending) {
+		hal_disk_poll(io->disk);
+	}
+
+	hal_pagecache_io_finish(io);
+}
+
+/*
+ * Finishes the asynchronous reads that completed, so their pages can be
+ * evicted again.
+ */
+static void hal_pagecache_io_reap(void) {
+	hal_pagecache_io_t *io = pagecache_ios;
+
+	while(io) {
+		hal_pagecache_io_t *next = io->next;
+
+		if(!io->pending) {
+			hal_pagecache_io_finish(io);
+		}
+
+		io = next;
+	}
+}
+
+/*
+ * Removes a page from the cache and releases its memory. Dirty data is lost.
+ */
+static void hal_pagecache_free(hal_page_t *page) {
+	// The disk may still be writing into the page
+	if(page->io) {
+		hal_pagecache_io_wait(page->io);
+	}
+
+	// Remove it from its hash bucket
+	hal_page_t **link = &pagecache_buckets[hal_pagecache_bucket(page->file, page->index)];
+
+	while(*link != page) {
+		link = &(*link)->hash_next;
+	}
+
+	*link = page->hash_next;
+
+	// Remove it from the file's list
+	if(page->file_prev) {
+		page->file_prev->file_next = page->file_next;
+	} else {
+		page->file->pages = page->file_next;
+	}
+
+	if(page->file_next) {
+		page->file_next->file_prev = page->file_prev;
+	}
+
+	// Remove it from the LRU list
+	if(page->lru_prev) {
+		page->lru_prev->lru_next = page->lru_next;
+	} else {
+		pagecache_lru_head = page->lru_next;
+	}
+
+	if(page->lru_next) {
+		page->lru_next->lru_prev = page->lru_prev;
+	} else {
+		pagecache_lru_tail = page->lru_prev;
+	}
+
+	pages_cached--;
+
+	if(page->dirty) {
+		pages_dirty--;
+	}
+
+	// Pages read ahead for nothing
+	if(page->readahead) {
+		readahead_waste++;
+	}
+
+	kfree(page->data);
+	kfree(page);
+}
+
+/*
+ * Writes a dirty page back through its filesystem. Only the part of the page
+ * that's inside the file is written.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+static int hal_pagecache_write_page(hal_page_t *page) {
+	if(!page->dirty) {
+		return 0;
+	}
+
+	unsigned long long offset = page->index * HAL_PAGECACHE_PAGE_SIZE;
+	unsigned long long size = hal_pagecache_size(page->file);
+
+	if(offset < size) {
+		size_t length = HAL_PAGECACHE_PAGE_SIZE;
+
+		if((size - offset) < length) {
+			length = size - offset;
+		}
+
+		if(page->fs->writepage(page->superblock, page->file, offset, page->data, length)) {
+			#if PRINT_ERROR
+			KERROR("Couldn't write back page %u of '%s'", (unsigned int) page->index, page->file->i.name);
+			#endif
+
+			return -1;
+		}
+	}
+
+	page->dirty = false;
+	pages_dirty--;
+
+	return 0;
+}
+
+/*
+ * Evicts up to the given number of pages, starting with the least recently
+ * used one. Dirty pages are written back first; if that fails, they stay
+ * cached, so their data isn't lost.
+ *
+ * @return Number of pages evicted.
+ */
+unsigned int hal_pagecache_shrink(unsigned int pages) {
+	unsigned int evicted = 0;
+
+	// Pages that were read ahead are pinned until their read is finished
+	hal_pagecache_io_reap();
+
+	hal_page_t *page = pagecache_lru_tail;
+
+	while(evicted < pages && page) {
+		hal_page_t *prev = page->lru_prev;
+
+		// Pages that are pinned are still in use
+		if(!page->pins && !hal_pagecache_write_page(page)) {
+			hal_pagecache_free(page);
+
+			evicted++;
+		}
+
+		page = prev;
+	}
+
+	return evicted;
+}
+
+/*
+ * Writes back dirty pages of any file, least recently used first, until no
+ * more than the given number are left dirty. Pages that can't be written back
+ * are skipped; they're tried again the next time around.
+ */
+static void hal_pagecache_writeback_oldest(unsigned int target) {
+	hal_page_t *page = pagecache_lru_tail;
+
+	while(pages_dirty > target && page) {
+		hal_page_t *prev = page->lru_prev;
+
+		hal_pagecache_write_page(page);
+
+		page = prev;
+	}
+}
+
+/*
+ * Shrinks the cache if physical memory is running low. This is checked every
+ * so often as pages are allocated, since counting free frames isn't free.
+ */
+static void hal_pagecache_check_pressure(void) {
+	if(++pages_since_check < PAGECACHE_PRESSURE_INTERVAL) return;
+	pages_since_check = 0;
+
+	paging_stats_t stats = paging_get_stats();
+
+	// Give back a quarter of the cache at a time
+	if(stats.pages_free < (stats.total_pages / PAGECACHE_LOW_MEMORY)) {
+		unsigned int evicted = hal_pagecache_shrink((pages_cached / 4) + 1);
+
+		#if DEBUG_PAGECACHE
+		KDEBUG("%u pages free, evicted %u cached pages", stats.pages_free, evicted);
+		#endif
+	}
+}
+
+/*
+ * Allocates a page for the file and inserts it into the cache. If memory is
+ * exhausted, other pages are evicted to make room.
+ */
+static hal_page_t *hal_pagecache_allocate(hal_vfs_t *fs, void *superblock, fs_file_t *file, unsigned long long index) {
+	hal_pagecache_check_pressure();
+
+	hal_page_t *page = NULL;
+	uint8_t *data = NULL;
+
+	for(int tries = 0; tries < 2; tries++) {
+		page = (hal_page_t *) kmalloc(sizeof(hal_page_t));
+		data = (uint8_t *) kmalloc(HAL_PAGECACHE_PAGE_SIZE);
+
+		if(page && data) break;
+
+		if(page) kfree(page);
+		if(data) kfree(data);
+
+		page = NULL;
+		data = NULL;
+
+		if(!hal_pagecache_shrink(PAGECACHE_PRESSURE_INTERVAL)) break;
+	}
+
+	if(!page) {
+		return NULL;
+	}
+
+	page->file = file;
+	page->index = index;
+	page->fs = fs;
+	page->superblock = superblock;
+	page->dirty = false;
+	page->readahead = false;
+	page->uptodate = false;
+	page->io = NULL;
+	page->pins = 0;
+	page->data = data;
+
+	// Insert into its hash bucket
+	unsigned int bucket = hal_pagecache_bucket(file, index);
+
+	page->hash_next = pagecache_buckets[bucket];
+	pagecache_buckets[bucket] = page;
+
+	// Insert at the head of the file's list
+	page->file_prev = NULL;
+	page->file_next = file->pages;
+
+	if(file->pages) {
+		file->pages->file_prev = page;
+	}
+
+	file->pages = page;
+
+	// Insert at the head of the LRU list
+	page->lru_prev = NULL;
+	page->lru_next = pagecache_lru_head;
+
+	if(pagecache_lru_head) {
+		pagecache_lru_head->lru_prev = page;
+	} else {
+		pagecache_lru_tail = page;
+	}
+
+	pagecache_lru_head = page;
+
+	pages_cached++;
+	return page;
+}
+
+/*
+ * Gets a page of the file, reading it in if it isn't cached. If fill is not
+ * set, a page that isn't cached is returned zeroed instead, for when it will
+ * be overwritten entirely (or lies past the end of the file.)
+ */
+static hal_page_t *hal_pagecache_get(hal_vfs_t *fs, void *superblock, fs_file_t *file, unsigned long long index, bool fill) {
+	hal_page_t *page = hal_pagecache_find(file, index);
+
+	// Wait for pages that are still being read ahead
+	if(page && page->io) {
+		hal_pagecache_io_wait(page->io);
+	}
+
+	if(page && page->uptodate) {
+		cache_hits++;
+
+		if(page->readahead) {
+			page->readahead = false;
+			readahead_hits++;
+		}
+
+		hal_pagecache_touch(page);
+		return page;
+	}
+
+	cache_misses++;
+
+	// Pages that couldn't be read ahead are read again
+	if(!page && !(page = hal_pagecache_allocate(fs, superblock, file, index))) {
+		return NULL;
+	}
+
+	int read = 0;
+
+	if(fill) {
+		page->pins++;
+		read = fs->readpage(superblock, file, index * HAL_PAGECACHE_PAGE_SIZE, page->data);
+		page->pins--;
+
+		if(read < 0) {
+			#if PRINT_ERROR
+			KERROR("Couldn't read page %u of '%s'", (unsigned int) index, file->i.name);
+			#endif
+
+			hal_pagecache_free(page);
+			return NULL;
+		}
+	}
+
+	// Anything past the end of the file reads as zeroes
+	if(read < HAL_PAGECACHE_PAGE_SIZE) {
+		memclr(page->data + read, HAL_PAGECACHE_PAGE_SIZE - read);
+	}
+
+	page->uptodate = true;
+	return page;
+}
+
+/*
+ * Fills a batch of consecutive pages that were just allocated, using the
+ * filesystem's readpages hook if it has one, so they're read with as few
+ * requests as possible.
+ *
+ * A read that stops short of the end of the file failed part way: the pages
+ * from there on that lie inside the file are released again, rather than
+ * being cached as zeroes. Only pages past the end of the file are zeroed.
+ *
+ * @return 0 if all pages were read, an error code otherwise.
+ */
+static int hal_pagecache_fill_batch(hal_vfs_t *fs, void *superblock, fs_file_t *file, hal_page_t **batch, unsigned int count) {
+	if(!count) return 0;
+
+	unsigned long long first = batch[0]->index;
+	unsigned long long offset = first * HAL_PAGECACHE_PAGE_SIZE;
+	unsigned long long size = hal_pagecache_size(file);
+	long long read = 0;
+
+	if(fs->readpages) {
+		void *data[PAGECACHE_READAHEAD_BATCH];
+
+		for(unsigned int i = 0; i < count; i++) {
+			data[i] = batch[i]->data;
+		}
+
+		read = fs->readpages(superblock, file, offset, data, count);
+	} else {
+		for(unsigned int i = 0; i < count; i++) {
+			int r = fs->readpage(superblock, file, offset + (i * HAL_PAGECACHE_PAGE_SIZE), batch[i]->data);
+
+			if(r < 0) break;
+
+			read += r;
+
+			if(r < HAL_PAGECACHE_PAGE_SIZE) break;
+		}
+	}
+
+	if(read < 0) {
+		read = 0;
+	}
+
+	int err = 0;
+
+	for(unsigned int i = 0; i < count; i++) {
+		hal_page_t *page = batch[i];
+		unsigned long long start = page->index * HAL_PAGECACHE_PAGE_SIZE;
+		long long valid = read - ((long long) i * HAL_PAGECACHE_PAGE_SIZE);
+
+		page->pins--;
+
+		if(valid < 0) {
+			valid = 0;
+		}
+
+		// Drop pages inside the file that the filesystem failed to read
+		if(start < size) {
+			unsigned long long expected = size - start;
+
+			if(expected > HAL_PAGECACHE_PAGE_SIZE) {
+				expected = HAL_PAGECACHE_PAGE_SIZE;
+			}
+
+			if((unsigned long long) valid < expected) {
+				if(page->readahead) {
+					page->readahead = false;
+					readahead_pages--;
+				}
+
+				hal_pagecache_free(page);
+				err = -1;
+
+				continue;
+			}
+		}
+
+		// Anything past the end of the file reads as zeroes
+		if(valid < HAL_PAGECACHE_PAGE_SIZE) {
+			memclr(page->data + valid, HAL_PAGECACHE_PAGE_SIZE - valid);
+		}
+
+		page->uptodate = true;
+	}
+
+	if(err) {
+		#if PRINT_ERROR
+		KERROR("Couldn't read pages %u-%u of '%s'", (unsigned int) first, (unsigned int) first + count - 1, file->i.name);
+		#endif
+	}
+
+	return err;
+}
+
+/*
+ * Starts reading a batch of consecutive pages that were just allocated
+ * straight from the disk, if the filesystem can tell where their data is
+ * stored. Each run of contiguous sectors is read with one request, and the
+ * pages stay pinned until the read is finished.
+ *
+ * @return Number of pages being read; the rest of the batch isn't touched.
+ */
+static unsigned int hal_pagecache_read_async(hal_vfs_t *fs, void *superblock, fs_file_t *file, hal_page_t **batch, unsigned int count) {
+	if(!fs->map_data || !count) return 0;
+
+	unsigned long long offset = batch[0]->index * HAL_PAGECACHE_PAGE_SIZE;
+
+	// Data that was only written into the cache isn't on disk
+	if(offset >= file->size) {
+		return 0;
+	}
+
+	unsigned long long length = (unsigned long long) count * HAL_PAGECACHE_PAGE_SIZE;
+
+	if((file->size - offset) < length) {
+		length = file->size - offset;
+	}
+
+	unsigned int pages = (length + (HAL_PAGECACHE_PAGE_SIZE - 1)) / HAL_PAGECACHE_PAGE_SIZE;
+
+	// Each run adds at most one segment to one per page
+	unsigned int maxSegments = pages * 2;
+
+	hal_pagecache_io_t *io = (hal_pagecache_io_t *) kmalloc(sizeof(hal_pagecache_io_t) + (sizeof(hal_page_t *) * pages));
+	hal_disk_iovec_t *iov = (hal_disk_iovec_t *) kmalloc(sizeof(hal_disk_iovec_t) * maxSegments);
+
+	if(!io || !iov) {
+		if(io) kfree(io);
+		if(iov) kfree(iov);
+
+		return 0;
+	}
+
+	io->disk = NULL;
+	io->pending = 1;
+	io->failed = false;
+	io->size = file->size;
+	io->iov = iov;
+
+	/*
+	 * Read whole sectors: pages are sector aligned, so the rest of the last
+	 * sector still falls into the last page.
+	 */
+	unsigned long long total = (length + 511) & ~511ULL;
+	unsigned long long done = 0;
+	unsigned int segments = 0;
+
+	while(done < total) {
+		hal_disk_t *disk;
+		uint64_t lba;
+		unsigned long long run;
+
+		if(fs->map_data(superblock, file, offset + done, &disk, &lba, &run) || !run) break;
+		if(io->disk && io->disk != disk) break;
+
+		if(run > (total - done)) {
+			run = total - done;
+		}
+
+		// Stay within what the driver accepts in one request
+		if(disk->max_transfer && run > ((unsigned long long) disk->max_transfer * 512)) {
+			run = (unsigned long long) disk->max_transfer * 512;
+		}
+
+		// Split the run at page boundaries
+		unsigned int first = segments;
+		unsigned int needed = ((done + run - 1) / HAL_PAGECACHE_PAGE_SIZE) - (done / HAL_PAGECACHE_PAGE_SIZE) + 1;
+
+		if((segments + needed) > maxSegments) break;
+
+		for(unsigned long long filled = 0; filled < run; ) {
+			unsigned long long at = done + filled;
+			unsigned int in = at % HAL_PAGECACHE_PAGE_SIZE;
+
+			size_t piece = HAL_PAGECACHE_PAGE_SIZE - in;
+
+			if(piece > (run - filled)) {
+				piece = run - filled;
+			}
+
+			iov[segments].buffer = batch[at / HAL_PAGECACHE_PAGE_SIZE]->data + in;
+			iov[segments].phys = 0;
+			iov[segments++].length = piece;
+
+			filled += piece;
+		}
+
+		uint32_t flags = irq_save();
+		io->pending++;
+		irq_restore(flags);
+
+		io->disk = disk;
+
+		// The callback isn't invoked for requests the disk didn't take
+		if(hal_disk_readv_async(disk, lba, &iov[first], segments - first, NULL, hal_pagecache_io_callback, io) != kDiskErrorNone) {
+			flags = irq_save();
+			io->pending--;
+			irq_restore(flags);
+
+			break;
+		}
+
+		done += run;
+	}
+
+	if(!done) {
+		kfree(iov);
+		kfree(io);
+
+		return 0;
+	}
+
+	io->end = offset + done;
+
+	if(io->end > io->size) {
+		io->end = io->size;
+	}
+
+	// Pages that were requested at all belong to the read
+	io->count = (done + (HAL_PAGECACHE_PAGE_SIZE - 1)) / HAL_PAGECACHE_PAGE_SIZE;
+
+	for(unsigned int i = 0; i < io->count; i++) {
+		io->pages[i] = batch[i];
+		batch[i]->io = io;
+	}
+
+	io->next = pagecache_ios;
+	pagecache_ios = io;
+
+	// Requests may complete from here on
+	uint32_t flags = irq_save();
+	io->pending--;
+	irq_restore(flags);
+
+	return io->count;
+}
+
+/*
+ * Reads a batch of consecutive pages that were just allocated: as much of it
+ * as possible is read asynchronously, and the rest through the filesystem.
+ *
+ * @return 0 if no errors occurred, an error code otherwise.
+ */
+static int hal_pagecache_read_batch(hal_vfs_t *fs, void *superblock, fs_file_t *file, hal_page_t **batch, unsigned int count) {
+	unsigned int started = hal_pagecache_read_async(fs, superblock, file, batch, count);
+
+	return hal_pagecache_fill_batch(fs, superblock, file, batch + started, count - started);
+}
+
+/*
+ * Reads the pages covering [start, end) of the file into the cache, skipping
+ * those that are already cached. Pages at or past marker are counted as read
+ * ahead; the ones before it are about to be read. Reading stops at the first
+ * error; the reader will get it when it reaches the page itself.
+ */
+static void hal_pagecache_prefetch(hal_vfs_t *fs, void *superblock, fs_file_t *file, unsigned long long start, unsigned long long end, unsigned long long marker) {
+	hal_page_t *batch[PAGECACHE_READAHEAD_BATCH];
+	unsigned int count = 0;
+
+	unsigned long long first = start / HAL_PAGECACHE_PAGE_SIZE;
+	unsigned long long last = (end + (HAL_PAGECACHE_PAGE_SIZE - 1)) / HAL_PAGECACHE_PAGE_SIZE;
+
+	for(unsigned long long index = first; index < last; index++) {
+		// Batches consist of consecutive pages only
+		if(hal_pagecache_find(file, index)) {
+			if(hal_pagecache_read_batch(fs, superblock, file, batch, count)) return;
+			count = 0;
+
+			continue;
+		}
+
+		hal_page_t *page = hal_pagecache_allocate(fs, superblock, file, index);
+
+		if(!page) break;
+
+		page->pins++;
+
+		if((index * HAL_PAGECACHE_PAGE_SIZE) >= marker) {
+			page->readahead = true;
+			readahead_pages++;
+		}
+
+		batch[count++] = page;
+
+		if(count == PAGECACHE_READAHEAD_BATCH) {
+			if(hal_pagecache_read_batch(fs, superblock, file, batch, count)) return;
+			count = 0;
+		}
+	}
+
+	hal_pagecache_read_batch(fs, superblock, file, batch, count);
+}
+
+/*
+ * Reads ahead of a read of bytes bytes at offset through the handle.
+ *
+ * Each handle tracks where a sequential read would continue. Sequential reads
+ * open a window of PAGECACHE_READAHEAD_MIN bytes past the read; once a read
+ * gets into the second half of the window, the next window is read, twice as
+ * large (up to PAGECACHE_READAHEAD_MAX.) Reading ahead of time means that
+ * the reader mostly finds its data cached, and the data is read in large
+ * requests. Random reads shrink the window, and eventually turn it off.
+ *
+ * If the filesystem can map the file's data to sectors, the window is read
+ * asynchronously: the reader continues while the disk fills the pages, and
+ * only waits if it gets to a page whose data hasn't arrived yet. Otherwise,
+ * the window is read synchronously through the filesystem.
+ */
+void hal_pagecache_readahead(hal_vfs_t *fs, void *superblock, fs_file_t *file, fs_file_handle_t *handle, unsigned long long offset, size_t bytes) {
+	unsigned long long size = hal_pagecache_size(file);
+	unsigned long long end = offset + bytes;
+
+	// Release the pages of reads that completed since
+	hal_pagecache_io_reap();
+
+	if(offset >= size) {
+		return;
+	}
+
+	// Random access shrinks the window
+	if(offset != handle->ra_next) {
+		handle->ra_window /= 4;
+		handle->ra_end = 0;
+
+		if(handle->ra_window < PAGECACHE_READAHEAD_MIN) {
+			handle->ra_window = 0;
+		}
+	} else if(!handle->ra_window) {
+		handle->ra_window = PAGECACHE_READAHEAD_MIN;
+	}
+
+	handle->ra_next = end;
+
+	if(!handle->ra_window) {
+		return;
+	}
+
+	unsigned long long start = offset;
+
+	// Continuing in a window: wait until the read gets into its second half
+	if(handle->ra_end > offset) {
+		if((end + (handle->ra_window / 2)) < handle->ra_end) {
+			return;
+		}
+
+		start = handle->ra_end;
+
+		handle->ra_window *= 2;
+
+		if(handle->ra_window > PAGECACHE_READAHEAD_MAX) {
+			handle->ra_window = PAGECACHE_READAHEAD_MAX;
+		}
+	}
+
+	unsigned long long stop = start + handle->ra_window;
+
+	if(stop < end) {
+		stop = end;
+	}
+
+	if(stop > size) {
+		stop = size;
+	}
+
+	handle->ra_end = stop;
+
+	if(start < stop) {
+		hal_pagecache_prefetch(fs, superblock, file, start, stop, end);
+	}
+}
+
+/*
+ * Pins a page of the file in the cache, reading it in if needed, so that its
+ * data can be used in place (for example, written straight to another file or
+ * a disk) without being evicted in the meantime.
+ *
+ * @return The page's data, or NULL on error.
+ */
+void *hal_pagecache_pin(hal_vfs_t *fs, void *superblock, fs_file_t *file, unsigned long long index, hal_page_t **page) {
+	hal_page_t *p = hal_pagecache_get(fs, superblock, file, index, true);
+
+	if(!p) {
+		return NULL;
+	}
+
+	p->pins++;
+
+	*page = p;
+	return p->data;
+}
+
+/*
+ * Releases a page pinned by hal_pagecache_pin.
+ */
+void hal_pagecache_unpin(hal_page_t *page) {
+	page->pins--;
+}
+
+/*
+ * Drops the cached pages overlapping a range of the file, for when the range
+ * is about to be written without going through the cache. Dirty pages are
+ * written back first, so the parts outside the range are preserved.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+int hal_pagecache_invalidate(fs_file_t *file, unsigned long long offset, unsigned long long length) {
+	int err = 0;
+
+	unsigned long long first = offset / HAL_PAGECACHE_PAGE_SIZE;
+	unsigned long long last = (offset + length + (HAL_PAGECACHE_PAGE_SIZE - 1)) / HAL_PAGECACHE_PAGE_SIZE;
+
+	hal_page_t *page = file->pages;
+
+	while(page) {
+		hal_page_t *next = page->file_next;
+
+		// Pages being read ahead would get the old data
+		if(page->io && page->index >= first && page->index < last) {
+			hal_pagecache_io_wait(page->io);
+		}
+
+		if(page->index >= first && page->index < last && !page->pins) {
+			if(hal_pagecache_write_page(page)) {
+				err = -1;
+			} else {
+				hal_pagecache_free(page);
+			}
+		}
+
+		page = next;
+	}
+
+	return err;
+}
+
+/*
+ * Gets statistics about the page cache, such as how well readahead works.
+ */
+void hal_pagecache_get_stats(hal_pagecache_stats_t *stats) {
+	stats->pages_cached = pages_cached;
+	stats->pages_dirty = pages_dirty;
+
+	stats->hits = cache_hits;
+	stats->misses = cache_misses;
+
+	stats->readahead_pages = readahead_pages;
+	stats->readahead_hits = readahead_hits;
+	stats->readahead_waste = readahead_waste;
+}
+
+/*
+ * Gets the size of the file, including data that's been written into the
+ * cache but not yet to the filesystem.
+ */
+unsigned long long hal_pagecache_size(fs_file_t *file) {
+	return (file->cached_size > file->size) ? file->cached_size : file->size;
+}
+
+/*
+ * Reads from the file at the given offset through the page cache. Pages that
+ * aren't cached are read in with the filesystem's readpage hook.
+ *
+ * @return Number of bytes read (0 at end-of-file), or -1 on error.
+ */
+long long hal_pagecache_read(hal_vfs_t *fs, void *superblock, fs_file_t *file, unsigned long long offset, void *buf, size_t bytes) {
+	unsigned long long size = hal_pagecache_size(file);
+
+	if(offset >= size) {
+		return 0;
+	}
+
+	if((size - offset) < bytes) {
+		bytes = size - offset;
+	}
+
+	uint8_t *out = (uint8_t *) buf;
+	long long done = 0;
+
+	while(bytes) {
+		unsigned long long index = offset / HAL_PAGECACHE_PAGE_SIZE;
+		unsigned int in = offset % HAL_PAGECACHE_PAGE_SIZE;
+
+		size_t chunk = HAL_PAGECACHE_PAGE_SIZE - in;
+
+		if(chunk > bytes) {
+			chunk = bytes;
+		}
+
+		hal_page_t *page = hal_pagecache_get(fs, superblock, file, index, true);
+
+		if(!page) {
+			return done ? done : -1;
+		}
+
+		memcpy(out, page->data + in, chunk);
+
+		out += chunk;
+		offset += chunk;
+		bytes -= chunk;
+		done += chunk;
+	}
+
+	return done;
+}
+
+/*
+ * Writes to the file at the given offset through the page cache. The data is
+ * written back later, when the file is synced or closed, or when the pages are
+ * evicted, which lets the filesystem allocate space for it in one go.
+ *
+ * @return Number of bytes written, or -1 on error.
+ */
+long long hal_pagecache_write(hal_vfs_t *fs, void *superblock, fs_file_t *file, unsigned long long offset, void *buf, size_t bytes) {
+	uint8_t *in = (uint8_t *) buf;
+	long long done = 0;
+
+	while(bytes) {
+		unsigned long long size = hal_pagecache_size(file);
+
+		unsigned long long index = offset / HAL_PAGECACHE_PAGE_SIZE;
+		unsigned int pageOffset = offset % HAL_PAGECACHE_PAGE_SIZE;
+
+		size_t chunk = HAL_PAGECACHE_PAGE_SIZE - pageOffset;
+
+		if(chunk > bytes) {
+			chunk = bytes;
+		}
+
+		// Partially overwritten pages must be read in, unless past the end
+		bool partial = (chunk != HAL_PAGECACHE_PAGE_SIZE);
+		bool fill = partial && (index * HAL_PAGECACHE_PAGE_SIZE) < size;
+
+		hal_page_t *page = hal_pagecache_get(fs, superblock, file, index, fill);
+
+		if(!page) {
+			return done ? done : -1;
+		}
+
+		memcpy(page->data + pageOffset, in, chunk);
+
+		if(!page->dirty) {
+			page->dirty = true;
+			pages_dirty++;
+		}
+
+		in += chunk;
+		offset += chunk;
+		bytes -= chunk;
+		done += chunk;
+
+		if(offset > size) {
+			file->cached_size = offset;
+		}
+	}
+
+	// Don't let too much unwritten data pile up, no matter which files it's in
+	if(pages_dirty >= PAGECACHE_DIRTY_MAX) {
+		hal_pagecache_writeback_oldest(PAGECACHE_DIRTY_TARGET);
+	}
+
+	return done;
+}
+
+/*
+ * Writes all dirty pages of the file back to the filesystem. Pages are
+ * written oldest first, which is in order of offset for files that were
+ * written sequentially.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+int hal_pagecache_writeback(fs_file_t *file) {
+	int err = 0;
+	hal_page_t *page = file->pages;
+
+	if(!page) {
+		return 0;
+	}
+
+	// Find the oldest page of the file
+	while(page->file_next) {
+		page = page->file_next;
+	}
+
+	for(; page; page = page->file_prev) {
+		if(hal_pagecache_write_page(page)) {
+			err = -1;
+		}
+	}
+
+	return err;
+}
+
+/*
+ * Drops cached data of the file past length, for when it was truncated by the
+ * filesystem: pages entirely past it are released, and the rest of the page
+ * containing the new end is zeroed.
+ */
+void hal_pagecache_truncate(fs_file_t *file, unsigned long long length) {
+	hal_page_t *page = file->pages;
+
+	while(page) {
+		hal_page_t *next = page->file_next;
+		unsigned long long offset = page->index * HAL_PAGECACHE_PAGE_SIZE;
+
+		// The read would undo the truncation
+		if(page->io) {
+			hal_pagecache_io_wait(page->io);
+		}
+
+		if(offset >= length) {
+			hal_pagecache_free(page);
+		} else if((length - offset) < HAL_PAGECACHE_PAGE_SIZE) {
+			unsigned int valid = length - offset;
+			memclr(page->data + valid, HAL_PAGECACHE_PAGE_SIZE - valid);
+		}
+
+		page = next;
+	}
+
+	if(file->cached_size > length) {
+		file->cached_size = length;
+	}
+}
+
+/*
+ * Releases all cached pages of the file, such as when it is deallocated.
+ * Changes that weren't written back are discarded.
+ */
+void hal_pagecache_release(fs_file_t *file) {
+	while(file->pages) {
+		hal_pagecache_free(file->pages);
+	}
+
+	file->cached_size = 0;
+}
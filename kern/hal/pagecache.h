@@ -0,0 +1,49 @@
+#import <types.h>
+#import <hal/vfs.h>
+
+// Size of a page of file data in the page cache
+#define HAL_PAGECACHE_PAGE_SIZE		0x1000
+
+// Statistics about the page cache
+typedef struct hal_pagecache_stats {
+	unsigned int pages_cached;
+	unsigned int pages_dirty;
+
+	// Lookups of pages that were (or weren't) cached
+	unsigned int hits;
+	unsigned int misses;
+
+	// Pages read ahead, and how many of them were used or evicted unused
+	unsigned int readahead_pages;
+	unsigned int readahead_hits;
+	unsigned int readahead_waste;
+} hal_pagecache_stats_t;
+
+// Copies file data through the cache
+long long hal_pagecache_read(hal_vfs_t *fs, void *superblock, fs_file_t *file, unsigned long long offset, void *buf, size_t bytes);
+long long hal_pagecache_write(hal_vfs_t *fs, void *superblock, fs_file_t *file, unsigned long long offset, void *buf, size_t bytes);
+
+// Reads ahead of a read through the handle, if it's sequential
+void hal_pagecache_readahead(hal_vfs_t *fs, void *superblock, fs_file_t *file, fs_file_handle_t *handle, unsigned long long offset, size_t bytes);
+
+// Size of the file, including data that only exists in the cache
+unsigned long long hal_pagecache_size(fs_file_t *file);
+
+// Writes the file's dirty pages back to the filesystem
+int hal_pagecache_writeback(fs_file_t *file);
+
+// Drops cached data past length (or all of it), discarding any changes
+void hal_pagecache_truncate(fs_file_t *file, unsigned long long length);
+void hal_pagecache_release(fs_file_t *file);
+
+// Uses a page's data in place
+void *hal_pagecache_pin(hal_vfs_t *fs, void *superblock, fs_file_t *file, unsigned long long index, hal_page_t **page);
+void hal_pagecache_unpin(hal_page_t *page);
+
+// Drops pages overlapping a range that's written without the cache
+int hal_pagecache_invalidate(fs_file_t *file, unsigned long long offset, unsigned long long length);
+
+// Evicts up to the given number of least recently used pages
+unsigned int hal_pagecache_shrink(unsigned int pages);
+
+void hal_pagecache_get_stats(hal_pagecache_stats_t *stats);
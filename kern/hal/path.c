@@ -0,0 +1,83 @@
+#import <types.h>
+#import "path.h"
+
+/*
+ * Finds the next component at or after str, skipping separators and ".".
+ *
+ * @return Start of the component, or NULL if there are no more.
+ */
+static char *hal_path_find(char *str, size_t *length) {
+	while(*str) {
+		// Skip separators
+		if(*str == '/') {
+			str++;
+			continue;
+		}
+
+		size_t len = 0;
+
+		while(str[len] && str[len] != '/') {
+			len++;
+		}
+
+		// "." refers to the same directory
+		if(len == 1 && str[0] == '.') {
+			str += len;
+			continue;
+		}
+
+		*length = len;
+		return str;
+	}
+
+	return NULL;
+}
+
+/*
+ * Prepares an iterator for the path. It points before the first component, so
+ * hal_path_next must be called first.
+ */
+void hal_path_init(hal_path_iter_t *it, char *path) {
+	it->next = path;
+	it->name = NULL;
+	it->length = 0;
+}
+
+/*
+ * Advances the iterator to the next component.
+ *
+ * @return true if there is a component, false at the end of the path.
+ */
+bool hal_path_next(hal_path_iter_t *it) {
+	size_t length = 0;
+	char *name = hal_path_find(it->next, &length);
+
+	if(!name) {
+		it->next += strlen(it->next);
+		it->name = NULL;
+		it->length = 0;
+
+		return false;
+	}
+
+	it->name = name;
+	it->length = length;
+	it->next = name + length;
+
+	return true;
+}
+
+/*
+ * Checks whether any components follow the current one.
+ */
+bool hal_path_is_last(hal_path_iter_t *it) {
+	size_t length;
+	return (hal_path_find(it->next, &length) == NULL);
+}
+
+/*
+ * Checks whether the current component refers to the parent directory.
+ */
+bool hal_path_is_parent(hal_path_iter_t *it) {
+	return (it->length == 2 && it->name[0] == '.' && it->name[1] == '.');
+}
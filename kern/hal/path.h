@@ -0,0 +1,28 @@
+#import <types.h>
+
+/*
+ * Walks the components of a path without copying it: each component is a view
+ * of the original string (a pointer and a length, not NUL terminated.) Empty
+ * components (from duplicate or trailing slashes) and "." are skipped; ".." is
+ * returned like any other component, since only the caller knows what the
+ * parent of the current directory is.
+ */
+typedef struct hal_path_iter {
+	// Rest of the path, after the current component
+	char *next;
+
+	// Current component
+	char *name;
+	size_t length;
+} hal_path_iter_t;
+
+void hal_path_init(hal_path_iter_t *it, char *path);
+
+// Advances to the next component; returns false at the end of the path
+bool hal_path_next(hal_path_iter_t *it);
+
+// Whether the current component is the last one
+bool hal_path_is_last(hal_path_iter_t *it);
+
+// Whether the current component is ".."
+bool hal_path_is_parent(hal_path_iter_t *it);
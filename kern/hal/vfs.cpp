@@ -1,7 +1,9 @@
 // C component of VFS support
 extern "C" {
 	#import <types.h>
+	#import "path.h"
 	#import "vfs.h"
+	#import "pagecache.h"
 }
 
 // This keeps track of a superblock, VFS and mountpoint
@@ -10,11 +12,96 @@ typedef struct vfs_ptr {
 	hal_vfs_t *fs;
 
 	char *mountpoint;
+
+	// Root directory of the filesystem
+	fs_directory_t *root;
 } vfs_ptr_t;
 
+/*
+ * Cursor of a directory being read. If the filesystem can't read directories
+ * entry by entry, the VFS walks the children of the directory instead.
+ */
+struct fs_dir_cursor {
+	vfs_ptr_t *fs;
+
+	// Cursor of the filesystem, or the next child to return
+	void *fs_cursor;
+	list_entry_t *next;
+
+	// Entry returned by the last read
+	fs_dirent_t entry;
+};
+
 // Turning a path into the filesystem it's on
 static vfs_ptr_t *mount_to_vfs(char *mount);
 
+/*
+ * Slot of a directory's name index. Empty slots have a NULL item; slots whose
+ * item was removed are marked with FS_DIR_INDEX_DELETED, so probe sequences
+ * running through them aren't cut short.
+ */
+typedef struct fs_dir_index_entry {
+	uint32_t hash;
+	char *name;
+
+	fs_item_t *item;
+} fs_dir_index_entry_t;
+
+/*
+ * Open addressed hash table of the names in a directory, used for case
+ * insensitive lookups. An item may be in it under several names (such as the
+ * 8.3 alias of a long filename.)
+ */
+struct fs_dir_index {
+	// Number of slots (a power of two)
+	unsigned int size;
+
+	// Slots holding an item, and those that are not empty (incl. deleted)
+	unsigned int count;
+	unsigned int used;
+
+	fs_dir_index_entry_t entries[];
+};
+
+#define FS_DIR_INDEX_MIN_SIZE	16
+#define FS_DIR_INDEX_DELETED	((fs_item_t *) 1)
+
+// Number of entries in the dentry cache, and of its hash buckets
+#define VFS_DCACHE_ENTRIES		512
+#define VFS_DCACHE_BUCKETS		256
+
+// Names that are this long or longer aren't cached
+#define VFS_DCACHE_NAME_MAX		64
+
+/*
+ * Entry of the dentry cache, which maps a name in a directory to the item it
+ * refers to. Negative entries (with a NULL item) remember that the directory
+ * has no item by that name. Unused entries have a NULL parent.
+ */
+typedef struct vfs_dentry vfs_dentry_t;
+struct vfs_dentry {
+	fs_directory_t *parent;
+	fs_item_t *item;
+
+	uint32_t hash;
+	char name[VFS_DCACHE_NAME_MAX];
+
+	// Next entry in the same hash bucket
+	vfs_dentry_t *next;
+
+	// LRU list, most recently used entry first
+	vfs_dentry_t *lru_prev, *lru_next;
+};
+
+static vfs_dentry_t dcache[VFS_DCACHE_ENTRIES];
+static vfs_dentry_t *dcache_buckets[VFS_DCACHE_BUCKETS];
+static vfs_dentry_t *dcache_lru_head, *dcache_lru_tail;
+
+static uint32_t hal_vfs_name_hash(char *name, size_t length);
+
+static void hal_vfs_dir_index_build(fs_directory_t *d);
+static void hal_vfs_dir_index_release(fs_dir_index_t *index);
+
 // Data structure to keep track of registered filesystems
 static list_t *registered_vfs;
 static list_t *filesystem_superblocks;
@@ -26,6 +113,15 @@ static int hal_vfs_init(void) {
 	registered_vfs = list_allocate();
 	filesystem_superblocks = list_allocate();
 
+	// All dentry cache entries start out unused, on the LRU list
+	for(unsigned int i = 0; i < VFS_DCACHE_ENTRIES; i++) {
+		dcache[i].lru_prev = i ? &dcache[i - 1] : NULL;
+		dcache[i].lru_next = (i < (VFS_DCACHE_ENTRIES - 1)) ? &dcache[i + 1] : NULL;
+	}
+
+	dcache_lru_head = &dcache[0];
+	dcache_lru_tail = &dcache[VFS_DCACHE_ENTRIES - 1];
+
 	return 0;
 }
 module_early_init(hal_vfs_init);
@@ -48,6 +144,9 @@ bool hal_vfs_load(hal_disk_partition_t *partition, hal_disk_t *disk) {
 	for(unsigned int i = 0; i < registered_vfs->num_entries; i++) {
 		hal_vfs_t *fs = (hal_vfs_t *) list_get(registered_vfs, i);
 
+		// Filesystems that aren't stored on disks can't be loaded from one
+		if(!fs->supports_partition) continue;
+
 		// Does FS support this partition type
 		if(fs->supports_partition(partition)) {
 			// Set up this VFS and such
@@ -61,16 +160,13 @@ bool hal_vfs_load(hal_disk_partition_t *partition, hal_disk_t *disk) {
 
 			// Check if the root directory contains "kernel.elf"
 			fs_directory_t *dir = fs->list_directory(thingie->superblock, (char *) "/");
+			thingie->root = dir;
 
 			if(dir) {
-				for(unsigned int i = 0; i < dir->children->num_entries; i++) {
-					fs_item_t *item = (fs_item_t *) list_get(dir->children, i);
-
-					if(item->type == kFSItemTypeFile) {
-						if(!strcmp("bootvol.txt", item->name)) {
-							thingie->mountpoint = (char *) "/";
-						}
-					}
+				fs_item_t *item = hal_vfs_dir_lookup(dir, (char *) "bootvol.txt");
+
+				if(item && item->type == kFSItemTypeFile) {
+					thingie->mountpoint = (char *) "/";
 				}
 			}
 		
@@ -81,6 +177,48 @@ bool hal_vfs_load(hal_disk_partition_t *partition, hal_disk_t *disk) {
 	return false;
 }
 
+/*
+ * Mounts a filesystem that isn't stored on a disk (such as tmpfs) at the given
+ * mountpoint. The options are interpreted by the filesystem.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+int hal_vfs_mount(char *type, char *mountpoint, char *options) {
+	for(unsigned int i = 0; i < registered_vfs->num_entries; i++) {
+		hal_vfs_t *fs = (hal_vfs_t *) list_get(registered_vfs, i);
+
+		if(strcmp((char *) fs->name, type)) continue;
+
+		// The filesystem must be able to create a superblock by itself
+		if(!fs->mount) {
+			return -1;
+		}
+
+		vfs_ptr_t *thingie = (vfs_ptr_t *) kmalloc(sizeof(vfs_ptr_t));
+		char *path = (char *) kmalloc(strlen(mountpoint) + 1);
+
+		if(!thingie || !path || !(thingie->superblock = fs->mount(options))) {
+			if(thingie) kfree(thingie);
+			if(path) kfree(path);
+
+			return -2;
+		}
+
+		strncpy(path, mountpoint, strlen(mountpoint) + 1);
+
+		thingie->fs = fs;
+		thingie->mountpoint = path;
+		thingie->root = fs->list_directory(thingie->superblock, (char *) "/");
+
+		list_add(filesystem_superblocks, thingie);
+
+		KDEBUG("Mounted %s at %s", type, mountpoint);
+		return 0;
+	}
+
+	return -1;
+}
+
 /*
  * Checks if the root filesystem has been mounted
  */
@@ -108,6 +246,7 @@ fs_directory_t *hal_vfs_allocate_directory(bool createHandle) {
 	// Handle out of memory conditions
 	if(dir) {
 		dir->children = list_allocate();
+		dir->index = NULL;
 		dir->i.type = kFSItemTypeDirectory;
 
 		// Create a handle for this directory, if requested
@@ -144,6 +283,10 @@ fs_file_t *hal_vfs_allocate_file(fs_directory_t *d) {
 
 		// Set parent
 		file->parent = d;
+		file->fs_data = NULL;
+
+		file->pages = NULL;
+		file->cached_size = 0;
 
 		// Add as a child of the parent
 		list_add(d->children, file);
@@ -195,6 +338,12 @@ void hal_vfs_deallocate_directory(fs_directory_t *d, fs_directory_t *n) {
 
 	// Free children list
 	list_destroy(d->children, false);
+
+	hal_vfs_dcache_forget(&d->i);
+
+	if(d->index) {
+		hal_vfs_dir_index_release(d->index);
+	}
 }
 
 /*
@@ -204,69 +353,236 @@ void hal_vfs_deallocate_file(fs_file_t *f) {
 	// Release memory for the name
 	kfree(f->i.name);
 
+	if(f->fs_data) {
+		kfree(f->fs_data);
+	}
+
+	// Cached data of the file is no longer reachable
+	hal_pagecache_release(f);
+
+	hal_vfs_dcache_forget(&f->i);
+
 	// Release handle (and memory associated with the file struct)
 	hal_handle_release(f->i.handle, true);
 }
 
+/*
+ * Hashes a filename, ignoring case (FNV-1a)
+ */
+static uint32_t hal_vfs_name_hash(char *name, size_t length) {
+	uint32_t hash = 2166136261U;
+
+	for(; length; name++, length--) {
+		hash ^= (uint8_t) tolower(*name);
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/*
+ * Allocates an empty name index with the given number of slots.
+ */
+static fs_dir_index_t *hal_vfs_dir_index_allocate(unsigned int size) {
+	size_t bytes = sizeof(fs_dir_index_t) + (sizeof(fs_dir_index_entry_t) * size);
+	fs_dir_index_t *index = (fs_dir_index_t *) kmalloc(bytes);
+
+	if(index) {
+		memclr(index, bytes);
+		index->size = size;
+	}
+
+	return index;
+}
 
 /*
- * Translates a mountpoint into the filesystem it represents. If no filesystem
- * matches, the root filesystem is returned.
+ * Releases a name index, and the names stored in it.
  */
-static vfs_ptr_t *mount_to_vfs(char *path, char **relPath) {
-	unsigned int longestMount = 0;
-	unsigned int longestMountIdx = 0; // array index
+static void hal_vfs_dir_index_release(fs_dir_index_t *index) {
+	for(unsigned int i = 0; i < index->size; i++) {
+		if(index->entries[i].item && index->entries[i].item != FS_DIR_INDEX_DELETED) {
+			kfree(index->entries[i].name);
+		}
+	}
 
-	// Variables used inside loop
-	size_t mntLen;
-	int cmp;
+	kfree(index);
+}
 
-	// Check each filesystem
-	for(unsigned int fs = 0; fs < filesystem_superblocks->num_entries; fs++) {
-		vfs_ptr_t *filesystem = (vfs_ptr_t *) list_get(filesystem_superblocks, fs);
+/*
+ * Places a name in the first free slot of its probe sequence. The index must
+ * have at least one empty slot.
+ */
+static void hal_vfs_dir_index_insert(fs_dir_index_t *index, uint32_t hash, char *name, fs_item_t *item) {
+	unsigned int mask = index->size - 1;
 
-		// Is this filesystem mounted?
-		if(!filesystem->mountpoint) continue;
+	for(unsigned int i = hash & mask; ; i = (i + 1) & mask) {
+		fs_dir_index_entry_t *entry = &index->entries[i];
 
-		// Is this shorter than the longest matching mountpoint so far?
-		mntLen = strlen(filesystem->mountpoint);
-		if(mntLen < longestMount) continue;
+		if(!entry->item || entry->item == FS_DIR_INDEX_DELETED) {
+			if(!entry->item) {
+				index->used++;
+			}
 
-		// String compare
-		cmp = strncmp(path, filesystem->mountpoint, mntLen);
+			entry->hash = hash;
+			entry->name = name;
+			entry->item = item;
 
-		// Not a match
-		if(cmp != 0) continue;
+			index->count++;
+			return;
+		}
+	}
+}
 
-		// It's the longest so far, so save it
-		longestMount = mntLen;
-		longestMountIdx = fs;
+/*
+ * Adds a name for an item to the directory's index, creating the index if the
+ * directory doesn't have one yet. Filesystems call this as they read in a
+ * directory, and when they create an item in it.
+ *
+ * @return 0 on success, or an error code if out of memory; the name was not
+ * added then, and the caller should undo the creation of the item.
+ */
+int hal_vfs_dir_index_add(fs_directory_t *d, char *name, fs_item_t *item) {
+	fs_dir_index_t *index = d->index;
+
+	// The index keeps its own copy of the name
+	size_t length = strlen(name);
+	char *copy = (char *) kmalloc(length + 1);
+
+	if(!copy) {
+		return -1;
 	}
 
-	// Get the filesystem that matched
-	vfs_ptr_t *matchedFS = (vfs_ptr_t *) list_get(filesystem_superblocks, longestMountIdx);
+	memcpy(copy, name, length + 1);
 
-	// If requested, get the path relative to the root of the filesystem
-	if(relPath) {
-		size_t pathLen = strlen(path);
+	/*
+	 * Grow the index (which also drops deleted slots) before it's 3/4 full.
+	 * If that fails, the name isn't added, so there is always an empty slot
+	 * to end probe sequences.
+	 */
+	if(!index || ((index->used + 1) * 4) > (index->size * 3)) {
+		unsigned int size = FS_DIR_INDEX_MIN_SIZE;
+		unsigned int count = index ? index->count : 0;
+
+		while(size < ((count + 1) * 2)) {
+			size *= 2;
+		}
+
+		fs_dir_index_t *grown = hal_vfs_dir_index_allocate(size);
+
+		if(!grown) {
+			kfree(copy);
+			return -1;
+		}
+
+		if(index) {
+			for(unsigned int i = 0; i < index->size; i++) {
+				fs_dir_index_entry_t *entry = &index->entries[i];
+
+				if(entry->item && entry->item != FS_DIR_INDEX_DELETED) {
+					hal_vfs_dir_index_insert(grown, entry->hash, entry->name, entry->item);
+				}
+			}
+
+			kfree(index);
+		}
 
-		*relPath = (char *) kmalloc(pathLen + 1);
-		strncpy(*relPath, path + longestMountIdx, pathLen);
+		d->index = index = grown;
 	}
 
-	return matchedFS;
+	// A negative dentry for the name is no longer correct
+	hal_vfs_dcache_invalidate(d, name);
+
+	hal_vfs_dir_index_insert(index, hal_vfs_name_hash(name, length), copy, item);
+	return 0;
 }
 
 /*
- * Gets the file that a file handle points to.
+ * Removes all names of an item from the directory's index.
  */
-fs_file_t *hal_vfs_handle_to_file(fs_file_handle_t *handle) {
-	// Verify type
-	if(hal_handle_get_type(handle->file) == kFSItemTypeFile) {
-		fs_file_t *file = (fs_file_t *) hal_handle_get_object(handle->file);
+void hal_vfs_dir_index_remove(fs_directory_t *d, fs_item_t *item) {
+	fs_dir_index_t *index = d->index;
 
-		if(file->i.type == kFSItemTypeFile) {
-			return file;
+	if(!index) {
+		return;
+	}
+
+	for(unsigned int i = 0; i < index->size; i++) {
+		fs_dir_index_entry_t *entry = &index->entries[i];
+
+		if(entry->item == item) {
+			kfree(entry->name);
+
+			entry->name = NULL;
+			entry->item = FS_DIR_INDEX_DELETED;
+
+			index->count--;
+		}
+	}
+}
+
+/*
+ * Indexes all children of a directory by their names. This is used for
+ * directories whose filesystem didn't populate the index itself. If memory
+ * runs out, the incomplete index is dropped again.
+ */
+static void hal_vfs_dir_index_build(fs_directory_t *d) {
+	// Walk the list directly: list_get() is linear in the index
+	for(list_entry_t *e = d->children->first; e; e = e->next) {
+		fs_item_t *item = (fs_item_t *) e->data;
+
+		if(item->name && hal_vfs_dir_index_add(d, item->name, item)) {
+			if(d->index) {
+				hal_vfs_dir_index_release(d->index);
+				d->index = NULL;
+			}
+
+			return;
+		}
+	}
+}
+
+/*
+ * Finds the child of a directory with the given name, ignoring case.
+ *
+ * @return The item, or NULL if there is no child by that name.
+ */
+fs_item_t *hal_vfs_dir_lookup(fs_directory_t *d, char *name) {
+	return hal_vfs_dir_lookupn(d, name, strlen(name));
+}
+
+/*
+ * Finds the child of a directory whose name matches the first length bytes of
+ * name (which doesn't need to be NUL terminated), ignoring case.
+ */
+fs_item_t *hal_vfs_dir_lookupn(fs_directory_t *d, char *name, size_t length) {
+	if(!d->index) {
+		hal_vfs_dir_index_build(d);
+
+		// Without an index, search the children one by one
+		if(!d->index) {
+			for(list_entry_t *e = d->children->first; e; e = e->next) {
+				fs_item_t *item = (fs_item_t *) e->data;
+
+				if(item->name && !strncasecmp(item->name, name, length) && !item->name[length]) {
+					return item;
+				}
+			}
+
+			return NULL;
+		}
+	}
+
+	fs_dir_index_t *index = d->index;
+	uint32_t hash = hal_vfs_name_hash(name, length);
+	unsigned int mask = index->size - 1;
+
+	for(unsigned int i = hash & mask, probes = 0; probes < index->size; i = (i + 1) & mask, probes++) {
+		fs_dir_index_entry_t *entry = &index->entries[i];
+
+		if(!entry->item) {
+			return NULL;
+		} else if(entry->item != FS_DIR_INDEX_DELETED && entry->hash == hash && !strncasecmp(entry->name, name, length) && !entry->name[length]) {
+			return entry->item;
 		}
 	}
 
@@ -274,95 +590,1121 @@ fs_file_t *hal_vfs_handle_to_file(fs_file_handle_t *handle) {
 }
 
 /*
- * Returns a list of fs_item_t objects that can be used to enumerate the files
- * inside the directory.
+ * Removes an item from the directory's children and name index. The item is
+ * not deallocated.
  */
-C_FUNCTION list_t *hal_vfs_list_directory(char *dir) {
-	char *relPath;
-	vfs_ptr_t *fs = mount_to_vfs(dir, &relPath);
+void hal_vfs_remove_child(fs_directory_t *d, fs_item_t *item) {
+	unsigned int i = 0;
 
-	fs_directory_t *d = fs->fs->list_directory(fs->superblock, relPath);
-	kfree(relPath);
-	return d->children;
+	for(list_entry_t *e = d->children->first; e; e = e->next, i++) {
+		if(e->data == item) {
+			list_delete(d->children, i, false);
+			break;
+		}
+	}
+
+	hal_vfs_dir_index_remove(d, item);
+	hal_vfs_dcache_forget(item);
 }
 
 /*
- * Creates the specified directory.
+ * Gets the hash bucket of the dentry cache for a name in a directory.
  */
-C_FUNCTION int hal_vfs_create_directory(char *dir) {
-	char *relPath;
-	vfs_ptr_t *fs = mount_to_vfs(dir, &relPath);
+static inline unsigned int hal_vfs_dcache_bucket(fs_directory_t *parent, uint32_t hash) {
+	return (hash ^ (((unsigned int) parent) * 2654435761U)) & (VFS_DCACHE_BUCKETS - 1);
+}
 
-	int r = fs->fs->create_directory(fs->superblock, relPath);
-	kfree(relPath);
-	return r;
+/*
+ * Moves a dentry to the head of the LRU list.
+ */
+static void hal_vfs_dcache_touch(vfs_dentry_t *d) {
+	if(d == dcache_lru_head) {
+		return;
+	}
+
+	// Unlink it
+	d->lru_prev->lru_next = d->lru_next;
+
+	if(d->lru_next) {
+		d->lru_next->lru_prev = d->lru_prev;
+	} else {
+		dcache_lru_tail = d->lru_prev;
+	}
+
+	// Insert it at the head
+	d->lru_prev = NULL;
+	d->lru_next = dcache_lru_head;
+
+	dcache_lru_head->lru_prev = d;
+	dcache_lru_head = d;
 }
 
 /*
- * Deletes a file.
+ * Removes a dentry from its hash bucket, and marks it unused. It is moved to
+ * the tail of the LRU list, so it's reused first.
  */
-C_FUNCTION int hal_vfs_unlink(char *path) {
-	char *relPath;
-	vfs_ptr_t *fs = mount_to_vfs(path, &relPath);
+static void hal_vfs_dcache_drop(vfs_dentry_t *d) {
+	vfs_dentry_t **link = &dcache_buckets[hal_vfs_dcache_bucket(d->parent, d->hash)];
 
-	int r = fs->fs->unlink(fs->superblock, relPath);
-	kfree(relPath);
-	return r;
+	while(*link && *link != d) {
+		link = &(*link)->next;
+	}
+
+	if(*link) {
+		*link = d->next;
+	}
+
+	d->parent = NULL;
+	d->item = NULL;
+	d->next = NULL;
+
+	if(d == dcache_lru_tail) {
+		return;
+	}
+
+	// Unlink it
+	if(d->lru_prev) {
+		d->lru_prev->lru_next = d->lru_next;
+	} else {
+		dcache_lru_head = d->lru_next;
+	}
+
+	d->lru_next->lru_prev = d->lru_prev;
+
+	// Insert it at the tail
+	d->lru_next = NULL;
+	d->lru_prev = dcache_lru_tail;
+
+	dcache_lru_tail->lru_next = d;
+	dcache_lru_tail = d;
 }
 
 /*
- * Opens a file in the specified mode.
+ * Looks up a name in a directory in the dentry cache.
  */
-C_FUNCTION fs_file_handle_t *hal_vfs_fopen(char *path, fs_file_open_mode_t mode) {
-	char *relPath;
-	vfs_ptr_t *fs = mount_to_vfs(path, &relPath);
+static vfs_dentry_t *hal_vfs_dcache_lookup(fs_directory_t *parent, char *name, size_t length, uint32_t hash) {
+	if(length >= VFS_DCACHE_NAME_MAX) {
+		return NULL;
+	}
 
-	fs_file_handle_t *handle = fs->fs->file_open(fs->superblock, relPath, mode);
-	handle->fs = fs;
+	vfs_dentry_t *d = dcache_buckets[hal_vfs_dcache_bucket(parent, hash)];
 
-	kfree(relPath);
-	return handle;
+	for(; d; d = d->next) {
+		if(d->parent == parent && d->hash == hash && !strncasecmp(d->name, name, length) && !d->name[length]) {
+			return d;
+		}
+	}
+
+	return NULL;
 }
 
 /*
- * Closes a previously-opened file handle.
+ * Adds an entry to the dentry cache, replacing the least recently used one. If
+ * item is NULL, a negative entry is created.
  */
-C_FUNCTION void hal_vfs_fclose(fs_file_handle_t *handle) {
-	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
-	ASSERT(ptr);
+static void hal_vfs_dcache_add(fs_directory_t *parent, char *name, size_t length, uint32_t hash, fs_item_t *item) {
+	if(length >= VFS_DCACHE_NAME_MAX) {
+		return;
+	}
 
-	ptr->fs->file_close(ptr->superblock, handle);
+	vfs_dentry_t *d = dcache_lru_tail;
+
+	if(d->parent) {
+		hal_vfs_dcache_drop(d);
+	}
+
+	d->parent = parent;
+	d->item = item;
+	d->hash = hash;
+
+	memcpy(d->name, name, length);
+	d->name[length] = 0x00;
+
+	unsigned int bucket = hal_vfs_dcache_bucket(parent, hash);
+	d->next = dcache_buckets[bucket];
+	dcache_buckets[bucket] = d;
+
+	hal_vfs_dcache_touch(d);
 }
 
 /*
- * Synchronises the filesystem's state with the state of the file: The exact
- * implementation is up to the filesystem.
+ * Removes the cached entry for a name in a directory, or all of the
+ * directory's entries if name is NULL. Filesystems call this when an item is
+ * created, renamed or deleted behind the VFS's back.
  */
-C_FUNCTION void hal_vfs_fupdate(fs_file_t *file) {
-	UNIMPLEMENTED_WARNING();
+void hal_vfs_dcache_invalidate(fs_directory_t *parent, char *name) {
+	if(name) {
+		size_t length = strlen(name);
+		vfs_dentry_t *d = hal_vfs_dcache_lookup(parent, name, length, hal_vfs_name_hash(name, length));
+
+		if(d) {
+			hal_vfs_dcache_drop(d);
+		}
+	} else {
+		for(unsigned int i = 0; i < VFS_DCACHE_ENTRIES; i++) {
+			if(dcache[i].parent == parent) {
+				hal_vfs_dcache_drop(&dcache[i]);
+			}
+		}
+	}
 }
 
 /*
- * Reads from the current position in the file into buffer.
- *
- * @return Number of bytes read, or 0 if end-of-file was encountered.
+ * Removes all cached entries that refer to an item, or (if it's a directory)
+ * that are inside of it. This must be called before the item is deallocated.
  */
-C_FUNCTION long long hal_vfs_fread(void *buf, size_t bytes, fs_file_handle_t *handle) {
-	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
-	ASSERT(ptr);
+void hal_vfs_dcache_forget(fs_item_t *item) {
+	for(unsigned int i = 0; i < VFS_DCACHE_ENTRIES; i++) {
+		vfs_dentry_t *d = &dcache[i];
 
-	return ptr->fs->file_read(ptr->superblock, buf, bytes, handle);
+		if(d->parent && (d->item == item || &d->parent->i == item)) {
+			hal_vfs_dcache_drop(d);
+		}
+	}
 }
 
 /*
- * Writes to the file that the handle represents. This increments the offset
- * in the file handle.
+ * Resolves a path, relative to the root of the filesystem, to the item it
+ * names. Each component is looked up in the dentry cache first; on a miss the
+ * directory's name index is used, and the result (including its absence) is
+ * cached. The filesystem is only called to read in directories that aren't
+ * in memory yet.
  *
- * @return Number of bytes read, or 0 if end-of-file was encountered.
+ * @return The item, or NULL if it doesn't exist.
  */
-C_FUNCTION long long hal_vfs_fwrite(void *buf, size_t bytes, fs_file_handle_t *handle) {
-	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
-	ASSERT(ptr);
+static fs_item_t *hal_vfs_resolve(vfs_ptr_t *fs, char *path) {
+	if(!fs->root) {
+		return NULL;
+	}
+
+	fs_item_t *item = &fs->root->i;
+
+	hal_path_iter_t it;
+	hal_path_init(&it, path);
+
+	while(hal_path_next(&it)) {
+		if(item->type != kFSItemTypeDirectory) {
+			return NULL;
+		}
 
-	return ptr->fs->file_write(ptr->superblock, buf, bytes, handle);
-}
\ No newline at end of file
+		fs_directory_t *dir = (fs_directory_t *) item;
+
+		// The parent of the root is outside of this filesystem
+		if(hal_path_is_parent(&it)) {
+			if(dir != fs->root) {
+				item = dir->parent;
+			}
+
+			continue;
+		}
+
+		// Have the filesystem read in the directory, if needed
+		if(!dir->populated) {
+			if(fs->fs->populate_directory) {
+				if(fs->fs->populate_directory(fs->superblock, dir)) {
+					return NULL;
+				}
+			} else {
+				size_t prefixLength = it.name - path;
+				char *prefix = (char *) kmalloc(prefixLength + 1);
+
+				if(!prefix) {
+					return NULL;
+				}
+
+				memcpy(prefix, path, prefixLength);
+				prefix[prefixLength] = 0x00;
+
+				dir = fs->fs->list_directory(fs->superblock, prefix);
+				kfree(prefix);
+
+				if(!dir) {
+					return NULL;
+				}
+			}
+		}
+
+		uint32_t hash = hal_vfs_name_hash(it.name, it.length);
+		vfs_dentry_t *d = hal_vfs_dcache_lookup(dir, it.name, it.length, hash);
+
+		if(d) {
+			hal_vfs_dcache_touch(d);
+			item = d->item;
+		} else {
+			item = hal_vfs_dir_lookupn(dir, it.name, it.length);
+			hal_vfs_dcache_add(dir, it.name, it.length, hash, item);
+		}
+
+		if(!item) {
+			return NULL;
+		}
+	}
+
+	return item;
+}
+
+
+/*
+ * Translates a mountpoint into the filesystem it represents. If no filesystem
+ * matches, the root filesystem is returned.
+ *
+ * The path relative to the root of the filesystem points into the original
+ * path, rather than being a copy of it.
+ */
+static vfs_ptr_t *mount_to_vfs(char *path, char **relPath) {
+	size_t longestMount = 0;
+	unsigned int longestMountIdx = 0; // array index
+	bool matched = false;
+
+	// Check each filesystem
+	for(unsigned int fs = 0; fs < filesystem_superblocks->num_entries; fs++) {
+		vfs_ptr_t *filesystem = (vfs_ptr_t *) list_get(filesystem_superblocks, fs);
+
+		// Is this filesystem mounted?
+		if(!filesystem->mountpoint) continue;
+
+		// Ignore the trailing slash, so "/" has a length of 0
+		size_t mntLen = strlen(filesystem->mountpoint);
+
+		if(mntLen && filesystem->mountpoint[mntLen - 1] == '/') {
+			mntLen--;
+		}
+
+		// Is this shorter than the longest matching mountpoint so far?
+		if(matched && mntLen < longestMount) continue;
+
+		// It must match entire components: "/tmp" doesn't contain "/tmpfile"
+		if(strncmp(path, filesystem->mountpoint, mntLen)) continue;
+		if(path[mntLen] && path[mntLen] != '/') continue;
+
+		// It's the longest so far, so save it
+		longestMount = mntLen;
+		longestMountIdx = fs;
+		matched = true;
+	}
+
+	// Get the filesystem that matched
+	vfs_ptr_t *matchedFS = (vfs_ptr_t *) list_get(filesystem_superblocks, longestMountIdx);
+
+	// If requested, get the path relative to the root of the filesystem
+	if(relPath) {
+		*relPath = path[longestMount] ? (path + longestMount) : (char *) "/";
+	}
+
+	return matchedFS;
+}
+
+/*
+ * Gets the file that a file handle points to.
+ */
+fs_file_t *hal_vfs_handle_to_file(fs_file_handle_t *handle) {
+	// Verify type
+	if(hal_handle_get_type(handle->file) == kFSItemTypeFile) {
+		fs_file_t *file = (fs_file_t *) hal_handle_get_object(handle->file);
+
+		if(file->i.type == kFSItemTypeFile) {
+			return file;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns a list of fs_item_t objects that can be used to enumerate the files
+ * inside the directory.
+ */
+C_FUNCTION list_t *hal_vfs_list_directory(char *dir) {
+	char *relPath;
+	vfs_ptr_t *fs = mount_to_vfs(dir, &relPath);
+
+	fs_directory_t *d = fs->fs->list_directory(fs->superblock, relPath);
+	return d ? d->children : NULL;
+}
+
+/*
+ * Opens a directory for reading its entries one at a time. Filesystems that
+ * support it decode the entries as they're read, so even huge directories
+ * can be enumerated with little memory, and without waiting for all of them
+ * to be read first.
+ *
+ * @return Cursor for the directory, or NULL on error.
+ */
+C_FUNCTION fs_dir_cursor_t *hal_vfs_opendir(char *dir) {
+	char *relPath;
+	vfs_ptr_t *fs = mount_to_vfs(dir, &relPath);
+
+	fs_dir_cursor_t *cursor = (fs_dir_cursor_t *) kmalloc(sizeof(fs_dir_cursor_t));
+
+	if(!cursor) {
+		goto fail;
+	}
+
+	cursor->fs = fs;
+	cursor->fs_cursor = NULL;
+	cursor->next = NULL;
+
+	if(fs->fs->dir_open) {
+		// Only the directories leading up to this one are read in
+		fs_item_t *item = hal_vfs_resolve(fs, relPath);
+
+		if(!item || item->type != kFSItemTypeDirectory) {
+			goto fail;
+		}
+
+		if(!(cursor->fs_cursor = fs->fs->dir_open(fs->superblock, (fs_directory_t *) item))) {
+			goto fail;
+		}
+	} else {
+		fs_directory_t *d = fs->fs->list_directory(fs->superblock, relPath);
+
+		if(!d) {
+			goto fail;
+		}
+
+		cursor->next = d->children->first;
+	}
+
+	return cursor;
+
+	fail: ;
+	if(cursor) {
+		kfree(cursor);
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads the next entry of a directory. The entry stays valid until the next
+ * read from (or closing of) the cursor.
+ *
+ * @return The entry, or NULL once all entries were read.
+ */
+C_FUNCTION fs_dirent_t *hal_vfs_readdir(fs_dir_cursor_t *cursor) {
+	fs_dirent_t *entry = &cursor->entry;
+
+	if(cursor->fs_cursor) {
+		vfs_ptr_t *fs = cursor->fs;
+		return (fs->fs->dir_read(fs->superblock, cursor->fs_cursor, entry) > 0) ? entry : NULL;
+	}
+
+	if(!cursor->next) {
+		return NULL;
+	}
+
+	fs_item_t *item = (fs_item_t *) cursor->next->data;
+	cursor->next = cursor->next->next;
+
+	entry->type = item->type;
+
+	strncpy(entry->name, item->name, sizeof(entry->name) - 1);
+	entry->name[sizeof(entry->name) - 1] = 0x00;
+
+	entry->size = (item->type == kFSItemTypeFile) ? ((fs_file_t *) item)->size : 0;
+
+	entry->is_hidden = item->is_hidden;
+	entry->is_system = item->is_system;
+	entry->is_readonly = item->is_readonly;
+
+	entry->time_written = item->time_written;
+
+	return entry;
+}
+
+/*
+ * Closes a directory cursor.
+ */
+C_FUNCTION void hal_vfs_closedir(fs_dir_cursor_t *cursor) {
+	if(cursor->fs_cursor) {
+		cursor->fs->fs->dir_close(cursor->fs->superblock, cursor->fs_cursor);
+	}
+
+	kfree(cursor);
+}
+
+/*
+ * Creates the specified directory.
+ */
+C_FUNCTION int hal_vfs_create_directory(char *dir) {
+	char *relPath;
+	vfs_ptr_t *fs = mount_to_vfs(dir, &relPath);
+
+	int r = fs->fs->create_directory(fs->superblock, relPath);
+	return r;
+}
+
+/*
+ * Deletes a file.
+ */
+C_FUNCTION int hal_vfs_unlink(char *path) {
+	char *relPath;
+	vfs_ptr_t *fs = mount_to_vfs(path, &relPath);
+
+	int r = fs->fs->unlink(fs->superblock, relPath);
+	return r;
+}
+
+/*
+ * Opens a file in the specified mode.
+ */
+C_FUNCTION fs_file_handle_t *hal_vfs_fopen(char *path, fs_file_open_mode_t mode) {
+	char *relPath;
+	vfs_ptr_t *fs = mount_to_vfs(path, &relPath);
+
+	fs_file_handle_t *handle = NULL;
+
+	/*
+	 * If the filesystem can open files the VFS looked up, resolve the path
+	 * through the dentry cache. The filesystem then only has to resolve paths
+	 * of files that are to be created.
+	 */
+	if(fs->fs->file_open_item) {
+		fs_item_t *item = hal_vfs_resolve(fs, relPath);
+
+		if(item) {
+			if(item->type == kFSItemTypeFile) {
+				handle = fs->fs->file_open_item(fs->superblock, (fs_file_t *) item, mode);
+			}
+
+			goto done;
+		} else if(!(mode & kFSFileModeCreate)) {
+			goto done;
+		}
+	}
+
+	handle = fs->fs->file_open(fs->superblock, relPath, mode);
+
+	done: ;
+	if(handle) {
+		handle->fs = fs;
+
+		handle->ra_next = 0;
+		handle->ra_window = 0;
+		handle->ra_end = 0;
+
+		// Cached data of a truncated file is stale
+		if((mode & kFSFileModeTruncate) && !(mode & kFSFileModeReadOnly)) {
+			fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+			if(file) {
+				hal_pagecache_truncate(file, 0);
+			}
+		}
+	}
+
+	return handle;
+}
+
+/*
+ * Closes a previously-opened file handle.
+ */
+C_FUNCTION void hal_vfs_fclose(fs_file_handle_t *handle) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
+	ASSERT(ptr);
+
+	// Write back cached data, so the filesystem can update metadata on close
+	if(handle->isOpen && !(handle->mode & kFSFileModeReadOnly)) {
+		fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+		if(file && hal_pagecache_writeback(file)) {
+			#if PRINT_ERROR
+			KERROR("Couldn't write back '%s' on close", file->i.name);
+			#endif
+		}
+	}
+
+	ptr->fs->file_close(ptr->superblock, handle);
+}
+
+/*
+ * Synchronises the filesystem's state with the state of the file: The exact
+ * implementation is up to the filesystem.
+ */
+C_FUNCTION void hal_vfs_fupdate(fs_file_t *file) {
+	UNIMPLEMENTED_WARNING();
+}
+
+/*
+ * Checks whether the file can be written through the handle.
+ */
+static bool hal_vfs_handle_writable(fs_file_handle_t *handle, fs_file_t *file) {
+	if(!file || !handle->isOpen) {
+		return false;
+	}
+
+	return !(handle->mode & kFSFileModeReadOnly) && !file->i.is_readonly;
+}
+
+/*
+ * Shortens a write at offset so that the file doesn't grow past the largest
+ * size the filesystem supports.
+ *
+ * @return Number of bytes that may be written, or -1 if none can.
+ */
+static long long hal_vfs_write_limit(vfs_ptr_t *ptr, unsigned long long offset, size_t bytes) {
+	if(!ptr->fs->max_file_size || !bytes) {
+		return bytes;
+	}
+
+	unsigned long long max = ptr->fs->max_file_size(ptr->superblock);
+
+	if(offset >= max) {
+		return -1;
+	}
+
+	if(bytes > (max - offset)) {
+		return (long long) (max - offset);
+	}
+
+	return bytes;
+}
+
+/*
+ * Reads from the current position in the file into buffer. If the filesystem
+ * supports it, the data is copied out of the page cache.
+ *
+ * @return Number of bytes read, or 0 if end-of-file was encountered.
+ */
+C_FUNCTION long long hal_vfs_fread(void *buf, size_t bytes, fs_file_handle_t *handle) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
+	ASSERT(ptr);
+
+	if(!ptr->fs->readpage) {
+		return ptr->fs->file_read(ptr->superblock, buf, bytes, handle);
+	}
+
+	fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+	if(!file || !handle->isOpen) {
+		return -1;
+	}
+
+	// Sequential readers get the data ahead of time
+	hal_pagecache_readahead(ptr->fs, ptr->superblock, file, handle, handle->position, bytes);
+
+	long long read = hal_pagecache_read(ptr->fs, ptr->superblock, file, handle->position, buf, bytes);
+
+	if(read > 0) {
+		handle->position += read;
+	}
+
+	return read;
+}
+
+/*
+ * Writes to the file that the handle represents. This increments the offset
+ * in the file handle. If the filesystem supports it, the data goes into the
+ * page cache, and is written back later.
+ *
+ * @return Number of bytes read, or 0 if end-of-file was encountered.
+ */
+C_FUNCTION long long hal_vfs_fwrite(void *buf, size_t bytes, fs_file_handle_t *handle) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
+	ASSERT(ptr);
+
+	fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+	// Writes bypassing the page cache make any cached data stale
+	if(!ptr->fs->writepage) {
+		if(file) {
+			hal_pagecache_release(file);
+		}
+
+		return ptr->fs->file_write(ptr->superblock, buf, bytes, handle);
+	}
+
+	if(!hal_vfs_handle_writable(handle, file)) {
+		return -1;
+	}
+
+	// Appends go to the end of the file, including data that's only cached
+	if(handle->mode & kFSFileModeAppend) {
+		handle->position = hal_pagecache_size(file);
+	}
+
+	long long allowed = hal_vfs_write_limit(ptr, handle->position, bytes);
+
+	if(allowed < 0) {
+		return -1;
+	}
+
+	long long written = hal_pagecache_write(ptr->fs, ptr->superblock, file, handle->position, buf, (size_t) allowed);
+
+	if(written > 0) {
+		handle->position += written;
+	}
+
+	return written;
+}
+
+/*
+ * Reads from the file at the given offset, without using or changing the
+ * position of the handle, so that several readers can share a handle.
+ *
+ * @return Number of bytes read, or 0 if end-of-file was encountered.
+ */
+C_FUNCTION long long hal_vfs_pread(void *buf, size_t bytes, unsigned long long offset, fs_file_handle_t *handle) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
+	ASSERT(ptr);
+
+	if(ptr->fs->readpage) {
+		fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+		if(!file || !handle->isOpen) {
+			return -1;
+		}
+
+		return hal_pagecache_read(ptr->fs, ptr->superblock, file, offset, buf, bytes);
+	}
+
+	if(ptr->fs->file_pread) {
+		return ptr->fs->file_pread(ptr->superblock, buf, bytes, offset, handle);
+	}
+
+	// Otherwise, read at the offset and put the handle back where it was
+	unsigned long long position = handle->position;
+	handle->position = offset;
+
+	long long read = ptr->fs->file_read(ptr->superblock, buf, bytes, handle);
+	handle->position = position;
+
+	return read;
+}
+
+/*
+ * Writes to the file at the given offset, without using or changing the
+ * position of the handle.
+ *
+ * @return Number of bytes written, or -1 on error.
+ */
+C_FUNCTION long long hal_vfs_pwrite(void *buf, size_t bytes, unsigned long long offset, fs_file_handle_t *handle) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
+	ASSERT(ptr);
+
+	fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+	if(ptr->fs->writepage) {
+		if(!hal_vfs_handle_writable(handle, file)) {
+			return -1;
+		}
+
+		long long allowed = hal_vfs_write_limit(ptr, offset, bytes);
+
+		if(allowed < 0) {
+			return -1;
+		}
+
+		return hal_pagecache_write(ptr->fs, ptr->superblock, file, offset, buf, (size_t) allowed);
+	}
+
+	// Writes bypassing the page cache make any cached data stale
+	if(file) {
+		hal_pagecache_release(file);
+	}
+
+	if(ptr->fs->file_pwrite) {
+		return ptr->fs->file_pwrite(ptr->superblock, buf, bytes, offset, handle);
+	}
+
+	unsigned long long position = handle->position;
+	handle->position = offset;
+
+	long long written = ptr->fs->file_write(ptr->superblock, buf, bytes, handle);
+	handle->position = position;
+
+	return written;
+}
+
+/*
+ * Reads from the file at the given offset into each of the buffers in turn,
+ * without using or changing the position of the handle.
+ *
+ * @return Number of bytes read, or 0 if end-of-file was encountered.
+ */
+C_FUNCTION long long hal_vfs_preadv(fs_iovec_t *iov, unsigned int iovcnt, unsigned long long offset, fs_file_handle_t *handle) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
+	ASSERT(ptr);
+
+	if(!ptr->fs->readpage && ptr->fs->file_preadv) {
+		return ptr->fs->file_preadv(ptr->superblock, iov, iovcnt, offset, handle);
+	}
+
+	long long total = 0;
+
+	for(unsigned int i = 0; i < iovcnt; i++) {
+		long long read = hal_vfs_pread(iov[i].buffer, iov[i].length, offset + total, handle);
+
+		if(read < 0) {
+			return total ? total : -1;
+		}
+
+		total += read;
+
+		// Stop at the end of the file
+		if(((unsigned long long) read) < iov[i].length) {
+			break;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * Gets a pointer to the data of a file that's already in memory (such as on
+ * the ramdisk), so it can be used in place rather than read into a buffer.
+ * The data stays valid for as long as the filesystem is mounted.
+ *
+ * @return Pointer to the data, or NULL if the file can't be mapped.
+ */
+C_FUNCTION void *hal_vfs_map_file(fs_file_handle_t *handle, size_t *length) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
+	ASSERT(ptr);
+
+	if(!ptr->fs->file_map || !handle->isOpen) {
+		return NULL;
+	}
+
+	return ptr->fs->file_map(ptr->superblock, handle, length);
+}
+
+/*
+ * Moves the position of the handle to offset, relative to the start of the
+ * file, the current position or the end of the file.
+ *
+ * @return The new position, or -1 on error.
+ */
+C_FUNCTION long long hal_vfs_seek(fs_file_handle_t *handle, long long offset, fs_seek_whence_t whence) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
+	ASSERT(ptr);
+
+	fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+	if(!file || !handle->isOpen || !handle->can_seek) {
+		return -1;
+	}
+
+	unsigned long long base;
+
+	switch(whence) {
+		case kFSSeekSet:
+			base = 0;
+			break;
+
+		case kFSSeekCurrent:
+			base = handle->position;
+			break;
+
+		case kFSSeekEnd:
+			base = hal_pagecache_size(file);
+			break;
+
+		default:
+			return -1;
+	}
+
+	// Can't seek before the start of the file
+	if(offset < 0 && ((unsigned long long) -offset) > base) {
+		return -1;
+	}
+
+	unsigned long long position = base + offset;
+
+	if(ptr->fs->file_seek) {
+		if(ptr->fs->file_seek(ptr->superblock, handle, position)) {
+			return -1;
+		}
+	} else {
+		handle->position = position;
+	}
+
+	return position;
+}
+
+// Size of the bounce buffer used by transfers from files that aren't cached
+#define VFS_TRANSFER_BOUNCE_SIZE	0x10000
+
+/*
+ * Receives each chunk of data of a transfer, along with its offset from the
+ * start of the transfer.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+typedef int (*vfs_transfer_sink_t)(void *ctx, void *data, size_t length, unsigned long long done);
+
+/*
+ * Moves count bytes from offset in the file to a sink. If the filesystem uses
+ * the page cache, the sink gets the cached pages themselves, so the data isn't
+ * copied at all; otherwise, it's read into a bounce buffer once.
+ *
+ * @return Number of bytes transferred, or -1 on error.
+ */
+static long long hal_vfs_transfer(fs_file_handle_t *in, unsigned long long offset, size_t count, bool bounce, vfs_transfer_sink_t sink, void *ctx) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) in->fs;
+	ASSERT(ptr);
+
+	fs_file_t *file = hal_vfs_handle_to_file(in);
+
+	if(!file || !in->isOpen) {
+		return -1;
+	}
+
+	unsigned long long done = 0;
+
+	// Hand over cached pages by reference
+	if(ptr->fs->readpage && !bounce) {
+		unsigned long long size = hal_pagecache_size(file);
+
+		if(offset >= size) {
+			return 0;
+		}
+
+		if((size - offset) < count) {
+			count = size - offset;
+		}
+
+		// Large transfers are sequential, so read ahead for them
+		hal_pagecache_readahead(ptr->fs, ptr->superblock, file, in, offset, count);
+
+		while(done < count) {
+			unsigned long long pos = offset + done;
+			unsigned int pageOffset = pos % HAL_PAGECACHE_PAGE_SIZE;
+
+			size_t chunk = HAL_PAGECACHE_PAGE_SIZE - pageOffset;
+
+			if(chunk > (count - done)) {
+				chunk = count - done;
+			}
+
+			hal_page_t *page;
+			uint8_t *data = (uint8_t *) hal_pagecache_pin(ptr->fs, ptr->superblock, file, pos / HAL_PAGECACHE_PAGE_SIZE, &page);
+
+			if(!data) {
+				break;
+			}
+
+			int err = sink(ctx, data + pageOffset, chunk, done);
+			hal_pagecache_unpin(page);
+
+			if(err) {
+				break;
+			}
+
+			done += chunk;
+		}
+
+		return (done || !count) ? done : -1;
+	}
+
+	// Otherwise, go through a bounce buffer
+	uint8_t *buffer = (uint8_t *) kmalloc(VFS_TRANSFER_BOUNCE_SIZE);
+
+	if(!buffer) {
+		return -1;
+	}
+
+	while(done < count) {
+		size_t chunk = VFS_TRANSFER_BOUNCE_SIZE;
+
+		if(chunk > (count - done)) {
+			chunk = count - done;
+		}
+
+		long long read = hal_vfs_pread(buffer, chunk, offset + done, in);
+
+		if(read <= 0) {
+			break;
+		}
+
+		// Sinks may round up to whole sectors
+		memclr(buffer + read, VFS_TRANSFER_BOUNCE_SIZE - read);
+
+		if(sink(ctx, buffer, read, done)) {
+			break;
+		}
+
+		done += read;
+
+		if(((size_t) read) < chunk) {
+			break;
+		}
+	}
+
+	kfree(buffer);
+	return (done || !count) ? done : -1;
+}
+
+// State of a transfer into a file
+typedef struct vfs_file_sink {
+	vfs_ptr_t *fs;
+	fs_file_handle_t *handle;
+	fs_file_t *file;
+
+	// Offset in the file that the transfer starts at
+	unsigned long long offset;
+} vfs_file_sink_t;
+
+/*
+ * Writes a chunk of a transfer into a file. Filesystems using the page cache
+ * get the data with their writepage hook, bypassing the destination's cache;
+ * its pages in the range are dropped, after writing back any changes.
+ */
+static int hal_vfs_file_sink(void *ctx, void *data, size_t length, unsigned long long done) {
+	vfs_file_sink_t *s = (vfs_file_sink_t *) ctx;
+	unsigned long long offset = s->offset + done;
+
+	if(s->fs->fs->writepage) {
+		if(hal_pagecache_invalidate(s->file, offset, length)) {
+			return -1;
+		}
+
+		return s->fs->fs->writepage(s->fs->superblock, s->file, offset, data, length);
+	}
+
+	long long written = hal_vfs_pwrite(data, length, offset, s->handle);
+	return (written == (long long) length) ? 0 : -1;
+}
+
+// State of a transfer onto a disk
+typedef struct vfs_disk_sink {
+	hal_disk_t *disk;
+	uint64_t lba;
+} vfs_disk_sink_t;
+
+/*
+ * Writes a chunk of a transfer to a disk. Chunks start on a sector boundary;
+ * only the chunk at the end of the file may end in a partial sector, which is
+ * padded with the zeroes following the data.
+ */
+static int hal_vfs_disk_sink(void *ctx, void *data, size_t length, unsigned long long done) {
+	vfs_disk_sink_t *s = (vfs_disk_sink_t *) ctx;
+
+	uint64_t lba = s->lba + (done / 512);
+	uint64_t sectors = (length + 511) / 512;
+
+	return (hal_disk_write(s->disk, lba, sectors, data, NULL, NULL, NULL) == kDiskErrorNone) ? 0 : -1;
+}
+
+/*
+ * Copies count bytes from the in handle to the current position of the out
+ * handle. If offset is given, the data is read from there, and it's updated
+ * to point past the data read; otherwise, the in handle's position is used
+ * (and advanced.) Data that's cached is passed to the destination filesystem
+ * without being copied.
+ *
+ * @return Number of bytes transferred, or -1 on error.
+ */
+C_FUNCTION long long hal_vfs_sendfile(fs_file_handle_t *out, fs_file_handle_t *in, unsigned long long *offset, size_t count) {
+	vfs_file_sink_t sink;
+
+	sink.fs = (vfs_ptr_t *) out->fs;
+	sink.handle = out;
+	sink.file = hal_vfs_handle_to_file(out);
+
+	ASSERT(sink.fs);
+
+	if(!hal_vfs_handle_writable(out, sink.file)) {
+		return -1;
+	}
+
+	// Appends go to the end of the file
+	if(out->mode & kFSFileModeAppend) {
+		out->position = hal_pagecache_size(sink.file);
+	}
+
+	sink.offset = out->position;
+
+	// Copying within a file can't use its pages in place
+	bool bounce = (sink.file == hal_vfs_handle_to_file(in));
+
+	unsigned long long from = offset ? *offset : in->position;
+	long long transferred = hal_vfs_transfer(in, from, count, bounce, hal_vfs_file_sink, &sink);
+
+	if(transferred > 0) {
+		out->position += transferred;
+
+		if(offset) {
+			*offset += transferred;
+		} else {
+			in->position += transferred;
+		}
+	}
+
+	return transferred;
+}
+
+/*
+ * Writes count bytes from the in handle to a disk, starting at the given LBA.
+ * The file offset works as for hal_vfs_sendfile. Both it and count must be a
+ * multiple of the sector size; if the file ends first, its last sector is
+ * padded with zeroes.
+ *
+ * @return Number of bytes transferred, or -1 on error.
+ */
+C_FUNCTION long long hal_vfs_sendfile_disk(hal_disk_t *disk, uint64_t lba, fs_file_handle_t *in, unsigned long long *offset, size_t count) {
+	vfs_disk_sink_t sink;
+
+	sink.disk = disk;
+	sink.lba = lba;
+
+	unsigned long long from = offset ? *offset : in->position;
+
+	if((from % 512) || (count % 512)) {
+		return -1;
+	}
+
+	long long transferred = hal_vfs_transfer(in, from, count, false, hal_vfs_disk_sink, &sink);
+
+	if(transferred > 0) {
+		if(offset) {
+			*offset += transferred;
+		} else {
+			in->position += transferred;
+		}
+	}
+
+	return transferred;
+}
+
+/*
+ * Ensures that all data written to the file, as well as its metadata, is on
+ * stable storage.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+C_FUNCTION int hal_vfs_fsync(fs_file_handle_t *handle) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
+	ASSERT(ptr);
+
+	// Write back cached data first, so it's covered by the sync
+	fs_file_t *file = hal_vfs_handle_to_file(handle);
+
+	if(file && hal_pagecache_writeback(file)) {
+		return -1;
+	}
+
+	// Filesystems that don't cache anything needn't implement this
+	if(!ptr->fs->file_sync) {
+		return 0;
+	}
+
+	return ptr->fs->file_sync(ptr->superblock, handle);
+}
+
+/*
+ * Reserves space on the filesystem for the first length bytes of the file,
+ * without changing its size. Later writes into that range don't need to
+ * allocate, and the filesystem can lay the space out contiguously up front.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+C_FUNCTION int hal_vfs_fallocate(fs_file_handle_t *handle, unsigned long long length) {
+	vfs_ptr_t *ptr = (vfs_ptr_t *) handle->fs;
+	ASSERT(ptr);
+
+	if(!ptr->fs->file_allocate) {
+		return -1;
+	}
+
+	return ptr->fs->file_allocate(ptr->superblock, handle, length);
+}
@@ -25,6 +25,23 @@ typedef enum {
 	kFSFileModeAppend = (1 << 3)
 } fs_file_open_mode_t;
 
+/*
+ * Positions that a seek offset is relative to
+ */
+typedef enum {
+	kFSSeekSet = 0,
+	kFSSeekCurrent = 1,
+	kFSSeekEnd = 2
+} fs_seek_whence_t;
+
+/*
+ * A buffer for vectored reads
+ */
+typedef struct fs_iovec {
+	void *buffer;
+	size_t length;
+} fs_iovec_t;
+
 /*
  * Abstract type representing an object on a filesystem
  */
@@ -78,6 +95,8 @@ struct fs_item {
  * reading its type member.
  */
 typedef struct fs_directory fs_directory_t;
+typedef struct fs_dir_index fs_dir_index_t;
+
 struct fs_directory {
 	fs_item_t i;
 
@@ -89,6 +108,12 @@ struct fs_directory {
 
 	// Number of file handles open for this directory and the files within
 	unsigned int handles_open;
+
+	// Hashed index of the children's names (built on first lookup)
+	fs_dir_index_t *index;
+
+	// Set once the filesystem has read all children into memory
+	bool populated;
 };
 
 /*
@@ -97,6 +122,8 @@ struct fs_directory {
  * The directory member points to the directory that the file is contained in.
  */
 typedef struct fs_file fs_file_t;
+typedef struct hal_page hal_page_t;
+
 struct fs_file {
 	fs_item_t i;
 
@@ -108,6 +135,13 @@ struct fs_file {
 
 	// Size (in bytes)
 	unsigned long long size;
+
+	// Private data of the filesystem driver (released with kfree)
+	void *fs_data;
+
+	// Pages of the file in the page cache, and the size including their data
+	hal_page_t *pages;
+	unsigned long long cached_size;
 };
 
 /*
@@ -132,8 +166,36 @@ struct fs_file_handle {
 
 	// Filesystem this handle is open on
 	void *fs;
+
+	/*
+	 * Readahead state: the offset a sequential read would continue at, the
+	 * size of the readahead window, and the end of the data read ahead.
+	 */
+	unsigned long long ra_next;
+	unsigned int ra_window;
+	unsigned long long ra_end;
 };
 
+/*
+ * An entry of a directory, as returned by hal_vfs_readdir.
+ */
+typedef struct fs_dirent {
+	fs_item_type_t type;
+	char name[256];
+
+	// Size of files (in bytes)
+	unsigned long long size;
+
+	bool is_hidden;
+	bool is_system;
+	bool is_readonly;
+
+	time_t time_written;
+} fs_dirent_t;
+
+// Cursor of a directory that's being read
+typedef struct fs_dir_cursor fs_dir_cursor_t;
+
 // Structure defining a VFS driver
 typedef struct hal_vfs hal_vfs_t;
 struct hal_vfs {
@@ -177,6 +239,90 @@ struct hal_vfs {
 
 	// Writes to the specified offset in the file.
 	long long (*file_write)(void *superblock, void* buffer, size_t bytes, fs_file_handle_t *file);
+
+	// Writes all data and metadata of the file to stable storage.
+	int (*file_sync)(void *superblock, fs_file_handle_t *file);
+
+	// Reserves space for the first length bytes of the file (optional)
+	int (*file_allocate)(void *superblock, fs_file_handle_t *file, unsigned long long length);
+
+	/*
+	 * Opens a file that the VFS looked up itself (optional.) Filesystems that
+	 * implement this must mark directories as populated once their children
+	 * are in memory, and keep items around until they're deallocated.
+	 */
+	fs_file_handle_t* (*file_open_item)(void *superblock, fs_file_t *file, fs_file_open_mode_t mode);
+
+	/*
+	 * Page cache hooks (optional.) readpage fills a page with the file's data
+	 * at offset, and returns how many bytes of the page are inside the file.
+	 * writepage writes length bytes of a page to the file at offset, growing
+	 * it if needed. If implemented, reads (and writes) go through the page
+	 * cache rather than file_read (and file_write.)
+	 */
+	int (*readpage)(void *superblock, fs_file_t *file, unsigned long long offset, void *page);
+	int (*writepage)(void *superblock, fs_file_t *file, unsigned long long offset, void *page, size_t length);
+
+	/*
+	 * Reads count consecutive pages starting at offset, for readahead
+	 * (optional.) Returns the number of bytes inside the file that were read.
+	 */
+	int (*readpages)(void *superblock, fs_file_t *file, unsigned long long offset, void **pages, unsigned int count);
+
+	/*
+	 * Reads or writes at the given offset, without using or changing the
+	 * position of the handle (optional.) These are only used if the matching
+	 * page cache hook isn't implemented, since the page cache comes first.
+	 */
+	long long (*file_pread)(void *superblock, void *buffer, size_t bytes, unsigned long long offset, fs_file_handle_t *file);
+	long long (*file_pwrite)(void *superblock, void *buffer, size_t bytes, unsigned long long offset, fs_file_handle_t *file);
+	long long (*file_preadv)(void *superblock, fs_iovec_t *iov, unsigned int iovcnt, unsigned long long offset, fs_file_handle_t *file);
+
+	// Validates a new position of the handle, and moves it there (optional)
+	int (*file_seek)(void *superblock, fs_file_handle_t *file, unsigned long long position);
+
+	/*
+	 * Reads a directory entry by entry, without reading all of it into memory
+	 * (optional.) dir_open returns a cursor for the directory; dir_read fills
+	 * in the next entry and returns 1, or 0 once there are no more entries.
+	 */
+	void* (*dir_open)(void *superblock, fs_directory_t *dir);
+	int (*dir_read)(void *superblock, void *cursor, fs_dirent_t *entry);
+	void (*dir_close)(void *superblock, void *cursor);
+
+	/*
+	 * Reads the children of a directory the VFS looked up into memory, and
+	 * marks it as populated (optional.) This lets paths be resolved without
+	 * passing the path of each directory to list_directory.
+	 */
+	int (*populate_directory)(void *superblock, fs_directory_t *dir);
+
+	/*
+	 * Creates a superblock for a filesystem that isn't stored on a disk, such
+	 * as tmpfs, from a string of mount options (optional.)
+	 */
+	void* (*mount)(char *options);
+
+	/*
+	 * Gets a pointer to the file's data in memory, and its length, for
+	 * filesystems whose files are already in memory (optional.)
+	 */
+	void* (*file_map)(void *superblock, fs_file_handle_t *file, size_t *length);
+
+	/*
+	 * Returns the largest size a file on the filesystem may have (optional.)
+	 * Writes that go through the page cache are shortened to fit, since the
+	 * filesystem couldn't write back pages past it.
+	 */
+	unsigned long long (*max_file_size)(void *superblock);
+
+	/*
+	 * Finds where the file's data at offset (a multiple of the sector size) is
+	 * stored on disk, so the page cache can read it ahead asynchronously
+	 * (optional.) Returns 0 with the disk, the first sector, and the number of
+	 * bytes stored contiguously from there, or -1 if the data isn't on disk.
+	 */
+	int (*map_data)(void *superblock, fs_file_t *file, unsigned long long offset, hal_disk_t **disk, uint64_t *lba, unsigned long long *length);
 };
 
 // Include filesystem root class
@@ -192,6 +338,9 @@ bool hal_vfs_load(hal_disk_partition_t *partition, hal_disk_t *disk);
 
 bool hal_vfs_root_mounted(void);
 
+// Mounts a filesystem that isn't stored on a disk
+int hal_vfs_mount(char *type, char *mountpoint, char *options);
+
 // Allocates memory for various structures
 fs_directory_t *hal_vfs_allocate_directory(bool createHandle);
 fs_file_t *hal_vfs_allocate_file(fs_directory_t *d);
@@ -200,11 +349,28 @@ fs_file_t *hal_vfs_allocate_file(fs_directory_t *d);
 void hal_vfs_deallocate_directory(fs_directory_t *d, fs_directory_t *n);
 void hal_vfs_deallocate_file(fs_file_t *f);
 
+// Name index of a directory's children
+int hal_vfs_dir_index_add(fs_directory_t *d, char *name, fs_item_t *item);
+void hal_vfs_dir_index_remove(fs_directory_t *d, fs_item_t *item);
+fs_item_t *hal_vfs_dir_lookup(fs_directory_t *d, char *name);
+fs_item_t *hal_vfs_dir_lookupn(fs_directory_t *d, char *name, size_t length);
+
+// Removes an item from its directory, without deallocating it
+void hal_vfs_remove_child(fs_directory_t *d, fs_item_t *item);
+
+// Dentry cache invalidation
+void hal_vfs_dcache_invalidate(fs_directory_t *parent, char *name);
+void hal_vfs_dcache_forget(fs_item_t *item);
+
 // Gets the file that a file handle points to
 fs_file_t *hal_vfs_handle_to_file(fs_file_handle_t *handle);
 
 // FS Access
 C_FUNCTION list_t *hal_vfs_list_directory(char *dir);
+
+C_FUNCTION fs_dir_cursor_t *hal_vfs_opendir(char *dir);
+C_FUNCTION fs_dirent_t *hal_vfs_readdir(fs_dir_cursor_t *cursor);
+C_FUNCTION void hal_vfs_closedir(fs_dir_cursor_t *cursor);
 C_FUNCTION int hal_vfs_create_directory(char *dir);
 
 C_FUNCTION int hal_vfs_unlink(char *path);
@@ -215,4 +381,18 @@ C_FUNCTION void hal_vfs_fclose(fs_file_handle_t *handle);
 C_FUNCTION void hal_vfs_fupdate(fs_file_t *file);
 
 C_FUNCTION long long hal_vfs_fread(void *buf, size_t bytes, fs_file_handle_t *handle);
-C_FUNCTION long long hal_vfs_fwrite(void *buf, size_t bytes, fs_file_handle_t *handle);
\ No newline at end of file
+C_FUNCTION long long hal_vfs_fwrite(void *buf, size_t bytes, fs_file_handle_t *handle);
+
+C_FUNCTION long long hal_vfs_pread(void *buf, size_t bytes, unsigned long long offset, fs_file_handle_t *handle);
+C_FUNCTION long long hal_vfs_pwrite(void *buf, size_t bytes, unsigned long long offset, fs_file_handle_t *handle);
+C_FUNCTION long long hal_vfs_preadv(fs_iovec_t *iov, unsigned int iovcnt, unsigned long long offset, fs_file_handle_t *handle);
+
+C_FUNCTION long long hal_vfs_seek(fs_file_handle_t *handle, long long offset, fs_seek_whence_t whence);
+
+C_FUNCTION void *hal_vfs_map_file(fs_file_handle_t *handle, size_t *length);
+
+C_FUNCTION long long hal_vfs_sendfile(fs_file_handle_t *out, fs_file_handle_t *in, unsigned long long *offset, size_t count);
+C_FUNCTION long long hal_vfs_sendfile_disk(hal_disk_t *disk, uint64_t lba, fs_file_handle_t *in, unsigned long long *offset, size_t count);
+
+C_FUNCTION int hal_vfs_fsync(fs_file_handle_t *handle);
+C_FUNCTION int hal_vfs_fallocate(fs_file_handle_t *handle, unsigned long long length);
\ No newline at end of file
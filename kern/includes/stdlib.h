@@ -71,5 +71,7 @@ unsigned int std_popCnt(uint32_t x);
 
 unsigned int std_strcnt(const char *str, char character);
 
+uint32_t std_crc32(uint32_t crc, const void *buf, size_t len);
+
 // Miscallenous math stuff
 #define DIV_ROUND_UP(n, d) ((n < 0) ^ (d < 0)) ? ((n - d/2)/d) : ((n + d/2)/d);
\ No newline at end of file
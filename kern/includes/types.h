@@ -124,6 +124,20 @@ static inline uint32_t io_inl(uint16_t port) {
 	return ret;
 }
 
+/*
+ * Read a number of words from a system IO port into memory
+ */
+static inline void io_insw(uint16_t port, void *buf, uint32_t count) {
+	__asm__ volatile("cld; rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+/*
+ * Write a number of words from memory to a system IO port
+ */
+static inline void io_outsw(uint16_t port, const void *buf, uint32_t count) {
+	__asm__ volatile("cld; rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
 /*
  * Wait for a system IO operation to complete.
  */
@@ -133,6 +147,24 @@ static inline void io_wait(void) {
 	__asm__ volatile("outb %%al, $0x80" : : "a"(0));
 }
 
+/*
+ * Disables interrupts, returning the previous state of EFLAGS so it can later
+ * be restored with irq_restore. Unlike IRQ_OFF/IRQ_RES, this nests properly
+ * and can be used by code that may run with interrupts already off.
+ */
+static inline uint32_t irq_save(void) {
+	uint32_t flags;
+	__asm__ volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+	return flags;
+}
+
+/*
+ * Restores the interrupt state saved by irq_save.
+ */
+static inline void irq_restore(uint32_t flags) {
+	__asm__ volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
 #endif
 
 #ifdef __cplusplus
@@ -2,4 +2,6 @@
  * Various kernel configuration options
  */
 static const char *__kcfg_modules_path = "/etc/modules/";
-static const char *__kcfg_modules_list_path = "/etc/modules/modules.cfg";
\ No newline at end of file
+static const char *__kcfg_modules_list_path = "/etc/modules/modules.cfg";
+static const char *__kcfg_tmpfs_mountpoint = "/tmp";
+static const char *__kcfg_initrd_mountpoint = "/initrd";
\ No newline at end of file
@@ -170,4 +170,6 @@ void list_delete(list_t *list, unsigned int index, bool free_ptr) {
 
 	// Clear memory allocated to entry
 	kfree(entry);
+
+	list->num_entries--;
 }
\ No newline at end of file
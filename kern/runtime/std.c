@@ -702,4 +702,30 @@ unsigned int std_strcnt(const char *str, char character) {
 	} while (*(p++));
 
 	return count;
-}
\ No newline at end of file
+}
+
+/*
+ * Calculates the CRC32 (IEEE 802.3 polynomial, as used by GPT, zlib, etc) of
+ * the given buffer. To calculate the CRC over several buffers, pass the result
+ * of the previous call as crc; otherwise, pass 0.
+ */
+uint32_t std_crc32(uint32_t crc, const void *buf, size_t len) {
+	// CRCs of all nibble values, so only 2 lookups per byte are needed
+	static const uint32_t table[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+		0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+		0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+
+	const uint8_t *p = (const uint8_t *) buf;
+	crc = ~crc;
+
+	while(len--) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ table[crc & 0x0F];
+		crc = (crc >> 4) ^ table[crc & 0x0F];
+	}
+
+	return ~crc;
+}
@@ -14,10 +14,10 @@
 void x86_pc_init_multiboot(void);
 void x86_pc_init(void);
 
-void x86_pc_read_msr(uint32_t msr, uint32_t *lo, uint32_t *hi);
-void x86_pc_write_msr(uint32_t msr, uint32_t lo, uint32_t hi);
+C_FUNCTION void x86_pc_read_msr(uint32_t msr, uint32_t *lo, uint32_t *hi);
+C_FUNCTION void x86_pc_write_msr(uint32_t msr, uint32_t lo, uint32_t hi);
 
-uint64_t x86_pc_read_tsc(void);
+C_FUNCTION uint64_t x86_pc_read_tsc(void);
 
 void x86_flush_cpu_caches(void);
 
@@ -53,6 +53,9 @@ fs_fat32::fs_fat32(hal_disk_partition_t *p, hal_disk_t *d) : hal_fs::hal_fs(p, d
 	}
 
 	// Verify FSInfo struct
+	fsInfoValid = false;
+	fsInfoDirty = false;
+
 	if(fs_info.signature != 0x41615252 || fs_info.signature2 != 0x61417272 || fs_info.trailSig != 0xAA550000) {
 		KWARNING("Corrupted FSInfo: 0x%08X 0x%08X 0x%08X", 
 			(unsigned int) fs_info.signature, (unsigned int) fs_info.signature2,
@@ -63,7 +66,7 @@ fs_fat32::fs_fat32(hal_disk_partition_t *p, hal_disk_t *d) : hal_fs::hal_fs(p, d
 			(unsigned int) fs_info.last_known_free_sec_cnt,
 			(unsigned int) fs_info.free_cluster_search_start);
 
-		fs_info.free_cluster_search_start = 0;
+		fsInfoValid = true;
 
 		// Set up pointer to legacy volume label
 		volumeLabel = (char *) kmalloc(16);
@@ -80,26 +83,100 @@ fs_fat32::fs_fat32(hal_disk_partition_t *p, hal_disk_t *d) : hal_fs::hal_fs(p, d
 	}
 
 	// Allocate more memory for the filesystem
-	fatBuffer = (uint32_t *) kmalloc(cluster_size);
-	freeClusterBuffer = (uint32_t *) kmalloc(cluster_size);
 	clusterBuffer = kmalloc(cluster_size);
+	sectorBuffer = (uint8_t *) kmalloc(bpb.bytes_per_sector * 2);
 
-	dirHandleCache = hashmap_allocate();
+	// Files with pending directory entry updates
+	maxDirtyFiles = 8;
+	numDirtyFiles = 0;
+	dirtyFiles = (fs_file_t **) kmalloc(sizeof(fs_file_t *) * maxDirtyFiles);
 
-	// Read FAT sector 0 to get dirty flags
-	if(!this->hal_fs::read_sectors(bpb.reserved_sector_count, 1, fatBuffer, &err)) {
-		#if PRINT_ERROR
-		KERROR("%s: Error reading FAT: %u", __PRETTY_FUNCTION__, err);
-		#endif
+	// Set up the FAT cache
+	fatCache = (fat32_fat_cache_entry_t *) kmalloc(sizeof(fat32_fat_cache_entry_t) * FAT32_FAT_CACHE_SIZE);
+	uint8_t *fatCacheData = (uint8_t *) kmalloc(bpb.bytes_per_sector * FAT32_FAT_CACHE_SIZE);
+
+	for(unsigned int i = 0; i < FAT32_FAT_CACHE_SIZE; i++) {
+		fatCache[i].sector = FAT32_FAT_CACHE_EMPTY;
+		fatCache[i].dirty = false;
+		fatCache[i].lastUse = 0;
+		fatCache[i].data = (uint32_t *) (fatCacheData + (i * bpb.bytes_per_sector));
+	}
+
+	fatCacheLast = NULL;
+	fatCacheClock = 0;
+
+	// Read FAT entry 1 to get dirty flags
+	unsigned int flags;
+
+	if(!this->readFatEntry(1, &flags)) {
 		return;
 	} else {
-		fs_clealyUnmounted = (fatBuffer[1] & FAT32_VOLUME_DIRTY_MASK);
+		fs_clealyUnmounted = (flags & FAT32_VOLUME_DIRTY_MASK);
 
 		if(!fs_clealyUnmounted) {
 			KWARNING("Filesystem not cleanly unmounted after last use!");
 		}
 	}
 
+	// Set up the free cluster bitmap
+	unsigned int totalClusters = num_data_clusters + 2;
+
+	clusterBitmapChunks = (totalClusters + (FAT32_BITMAP_CHUNK - 1)) / FAT32_BITMAP_CHUNK;
+	clusterBitmapChunksLoaded = 0;
+
+	clusterBitmap = (uint32_t *) kmalloc(clusterBitmapChunks * (FAT32_BITMAP_CHUNK / 8));
+	clusterBitmapLoaded = (uint8_t *) kmalloc(clusterBitmapChunks);
+
+	if(!clusterBitmap || !clusterBitmapLoaded) {
+		KWARNING("Couldn't allocate cluster bitmap, allocations will be slow");
+
+		if(clusterBitmap) {
+			kfree(clusterBitmap);
+		}
+
+		if(clusterBitmapLoaded) {
+			kfree(clusterBitmapLoaded);
+		}
+
+		clusterBitmap = NULL;
+		clusterBitmapLoaded = NULL;
+	} else {
+		memclr(clusterBitmapLoaded, clusterBitmapChunks);
+	}
+
+	/*
+	 * The free cluster count in FSInfo is only a hint: if it's implausible, or
+	 * the volume wasn't cleanly unmounted, scan the entire FAT now to get the
+	 * exact count. Otherwise, chunks are loaded as they're needed.
+	 */
+	if(fsInfoValid && fs_clealyUnmounted && fs_info.last_known_free_sec_cnt <= num_data_clusters) {
+		freeClusterCount = fs_info.last_known_free_sec_cnt;
+	} else if(!clusterBitmap) {
+		freeClusterCount = 0;
+
+		for(unsigned int c = 2; c < totalClusters; c++) {
+			bool inUse;
+
+			if(!this->clusterInUse(c, &inUse)) {
+				return;
+			} else if(!inUse) {
+				freeClusterCount++;
+			}
+		}
+
+		fsInfoDirty = true;
+		KDEBUG("%u free clusters", freeClusterCount);
+	} else {
+		for(unsigned int i = 0; i < clusterBitmapChunks; i++) {
+			if(!this->loadBitmapChunk(i)) {
+				return;
+			}
+		}
+
+		fsInfoDirty = true;
+		KDEBUG("%u free clusters", freeClusterCount);
+	}
+
 	// Read root directory
 	this->read_root_dir();
 
@@ -110,7 +187,61 @@ fs_fat32::fs_fat32(hal_disk_partition_t *p, hal_disk_t *d) : hal_fs::hal_fs(p, d
  * Clean up the filesystem's internal data structures, and cleanly unmount it.
  */
 fs_fat32::~fs_fat32() {
+	this->sync();
+
+	kfree(fatCache[0].data);
+	kfree(fatCache);
+
+	if(clusterBitmap) {
+		kfree(clusterBitmap);
+		kfree(clusterBitmapLoaded);
+	}
+
+	kfree(dirtyFiles);
+}
+
+/*
+ * Makes sure everything written to the filesystem so far is on stable storage.
+ * Metadata updates are issued as regular cached writes, so this is the write
+ * barrier that orders them against whatever comes after.
+ */
+int fs_fat32::sync(void) {
+	unsigned int err = 0;
+
+	// Write back modified FAT sectors
+	if(this->flushFatCache()) {
+		return -1;
+	}
+
+	// Then the directory entries of files that changed size
+	if(this->writeDirtyDirents(NULL)) {
+		return -1;
+	}
+
+	// Update the free cluster count and allocation hint
+	if(fsInfoValid && fsInfoDirty) {
+		fs_info.last_known_free_sec_cnt = freeClusterCount;
+
+		if(!this->hal_fs::write_sectors(bpb.fat_info, 1, &fs_info, &err)) {
+			#if PRINT_ERROR
+			KERROR("Error writing FSInfo: %u", err);
+			#endif
+
+			return -1;
+		}
+
+		fsInfoDirty = false;
+	}
+
+	if(!this->hal_fs::flush(&err)) {
+		#if PRINT_ERROR
+		KERROR("Error flushing disk cache: %u", err);
+		#endif
 
+		return -1;
+	}
+
+	return 0;
 }
 
 /*
@@ -169,6 +300,7 @@ void fs_fat32::read_root_dir(void) {
 
 	// Set root directory's cluster
 	root_directory->i.userData = bpb.root_cluster & FAT32_MASK;
+	root_directory->populated = true;
 
 	// Clean up temporary buffers needed to read root directory
 	kfree(root_clusters);
@@ -178,167 +310,151 @@ void fs_fat32::read_root_dir(void) {
 /*
  * Reads the directory file (index of files in the directory) of a directory.
  */
-fat_dirent_t *fs_fat32::read_dir_file(fs_directory_t *parent, char *childName, unsigned int *entries) {
-	fs_directory_t *target = NULL;
+fat_dirent_t *fs_fat32::read_dir_file(fs_directory_t *dir, unsigned int *entries) {
+	unsigned int err = 0;
 
-	// Locate the child
-	for(unsigned int i = 0; i < parent->children->num_entries; i++) {
-		fs_directory_t *dir = (fs_directory_t *) list_get(parent->children, i);
+	// Read cluster chain
+	unsigned int *chain = this->clusterChainForCluster(dir->i.userData & FAT32_MASK);
+	unsigned int cnt = 0;
 
-		// Ignore non-directory files
-		if(dir->i.type == kFSItemTypeDirectory) {
-			if(!strcasecmp(childName, dir->i.name)) {
-				target = dir;
-				break;
-			}
-		}
+	if(!chain) {
+		return NULL;
 	}
 
-	if(target) {
-		// Read cluster chain
-		unsigned int *chain = this->clusterChainForCluster(target->i.userData & FAT32_MASK);
-		unsigned int cnt = 0;
-		unsigned int err = 0;
-
-		while(chain[cnt] != FAT32_END_CHAIN) {
-			cnt++;
-		}
+	while(chain[cnt] != FAT32_END_CHAIN) {
+		cnt++;
+	}
 
-		// Allocate required buffer
-		unsigned int dir_length = cnt * cluster_size;
-		*entries = dir_length / sizeof(fat_dirent_t);
+	// Allocate required buffer
+	unsigned int dir_length = cnt * cluster_size;
+	*entries = dir_length / sizeof(fat_dirent_t);
 
-		fat_dirent_t *buffer = (fat_dirent_t *) kmalloc(dir_length);
+	fat_dirent_t *buffer = (fat_dirent_t *) kmalloc(dir_length);
 
-		// Perform read
-		cnt = 0;
+	// Perform read
+	for(cnt = 0; chain[cnt] != FAT32_END_CHAIN; cnt++) {
+		unsigned int cluster = chain[cnt];
 
-		while(true) {
-			if(chain[cnt] != FAT32_END_CHAIN) {
-				unsigned int cluster = chain[cnt];
+		if(!this->readCluster(cluster, ((uint8_t *) buffer) + (cnt * cluster_size), &err)) {
+			#if PRINT_ERROR
+			KERROR("Error reading directory file %u: %u", cluster, err);
+			#endif
 
-				if(!this->readCluster(cluster, ((uint8_t *) buffer) + (cnt * cluster_size), &err)) {
-					#if PRINT_ERROR
-					KERROR("Error reading directory file %u: %u", cluster, err);
-					#endif
-					return NULL;
-				}
-			} else {
-				break;
-			}
+			kfree(buffer);
+			kfree(chain);
 
-			cnt++;
+			return NULL;
 		}
-
-		return buffer;
 	}
 
-	// Directory not found
-	#if DEBUG_FILE_NOT_FOUND
-	KERROR("Could not find directory %s", childName);
-	#endif
-
-	return NULL;
+	kfree(chain);
+	return buffer;
 }
 
 /*
- * Reads a directory, and constructs an fs_directory_t object for it.
+ * Reads the entries of a directory from disk, if that hasn't happened yet.
+ * They're added to the directory object that's already in the tree, so every
+ * directory is read only once, and the objects stay valid for as long as the
+ * filesystem is mounted.
  */
-fs_directory_t *fs_fat32::read_directory(fs_directory_t *dir, char *name, bool cache, char *fullpath) {
-	ASSERT(dir);
+bool fs_fat32::populate_directory(fs_directory_t *directory) {
+	if(!directory->populated) {
+		fat_dirent_t *dirBuf = NULL;
+		unsigned int dirBufEntries = 0;
 
-	fs_directory_t *directory = NULL;
-	fat_dirent_t *dirBuf = NULL;
-	unsigned int dirBufEntries = 0;
+		if(!(dirBuf = this->read_dir_file(directory, &dirBufEntries))) {
+			return false;
+		}
 
-	// If caching is enabled, check if this directory's been read
-	hal_handle_t handle = (hal_handle_t) hashmap_get(dirHandleCache, fullpath);
+		this->processFATDirEnt(dirBuf, dirBufEntries, directory);
+		directory->populated = true;
 
-	// Verify the handle is valid
-	if(handle) {
-		if(hal_handle_get_type(handle) != kFSItemTypeDirectory) {
-			handle = 0;
-			goto processHandle;
-		}
+		kfree(dirBuf);
 
-		// Get object from the handle and verify it is good
-		directory = (fs_directory_t *) hal_handle_get_object(handle);
-		if(directory->i.type != kFSItemTypeDirectory) {
-			handle = 0;
-		}
+		#if DEBUG_DIRECTORY_CACHING
+		KDEBUG("Read directory %s: %u entries", directory->i.name, directory->children->num_entries);
+		#endif
 	}
 
-	processHandle: ;
-
-	// No handle? Perform directory read.	
-	if(!handle) {
-		// Could we read the child dir?
-		if(!(dirBuf = this->read_dir_file(dir, name, &dirBufEntries))) {
-			return NULL;
-		}
+	// Increment cache count
+	directory->i.cache_accesses++;
 
-		// Convert to directory handle
-		fs_directory_t *currentDir = hal_vfs_allocate_directory(true);
-		this->processFATDirEnt(dirBuf, dirBufEntries, currentDir);
+	return true;
+}
 
-		kfree(dirBuf);
+/*
+ * Gets the directory named by the current component of the path iterator,
+ * relative to dir, and reads its entries if needed.
+ */
+fs_directory_t *fs_fat32::read_directory(fs_directory_t *dir, hal_path_iter_t *it) {
+	ASSERT(dir);
 
-		currentDir->parent = &dir->i;
+	fs_directory_t *directory;
 
-		if(cache) {
-			hashmap_insert(dirHandleCache, fullpath, (void *) currentDir->i.handle);
+	// The root directory is its own parent
+	if(hal_path_is_parent(it)) {
+		directory = (dir == root_directory) ? dir : (fs_directory_t *) dir->parent;
+	} else {
+		directory = (fs_directory_t *) hal_vfs_dir_lookupn(dir, it->name, it->length);
+	}
 
-			#if DEBUG_DIRECTORY_CACHING
-			KDEBUG("dir_cache add: %s: 0x%08X", fullpath, (unsigned int) currentDir->i.handle);
-			#endif
-		}
+	// Ignore non-directory files
+	if(!directory || directory->i.type != kFSItemTypeDirectory) {
+		#if DEBUG_FILE_NOT_FOUND
+		KERROR("Could not find directory in %s", dir->i.name);
+		#endif
 
-		directory = currentDir;
+		return NULL;
+	}
 
-		// Increment cache count
-		directory->i.cache_accesses++;
+	if(!this->populate_directory(directory)) {
+		return NULL;
 	}
 
-	// Return directory
 	return directory;
 }
 
 /*
  * Gets a directory at the specified path, so its contents may be enumerated.
  */
-fs_directory_t* fs_fat32::list_directory(char* dirname, bool cache) {
+fs_directory_t* fs_fat32::list_directory(char* dirname) {
 	fs_directory_t *directory = root_directory;
 
-	// Handle the case of "/"
-	if(!strcmp("/", dirname)) return directory;
+	hal_path_iter_t it;
+	hal_path_init(&it, dirname);
+
+	// Iterate over each component
+	while(directory && hal_path_next(&it)) {
+		directory = this->read_directory(directory, &it);
+	}
 
-	char *currentPath = (char *) kmalloc(strlen(dirname) + 2);
-	unsigned int currentPathOffset = 0;
+	return directory;
+}
 
-	currentPath[currentPathOffset++] = '/';
+/*
+ * Finds the directory containing the item a path refers to. The name of the
+ * item is returned as a view of the path; it's NULL if the path names the
+ * root directory, or ends in "..".
+ */
+fs_directory_t *fs_fat32::walkPath(char *path, char **name, size_t *length) {
+	fs_directory_t *directory = root_directory;
 
-	// Separate path string
-	list_t *components = this->split_path(dirname);
+	hal_path_iter_t it;
+	hal_path_init(&it, path);
 
-	// Iterate over each component
-	for(unsigned int i = 0; i < components->num_entries; i++) {
-		// Append path name
-		char *component = (char *) list_get(components, i);
+	*name = NULL;
+	*length = 0;
 
-		strcat(currentPath + currentPathOffset, component);
-		currentPathOffset += strlen(component);
-		currentPath[currentPathOffset++] = '/';
+	while(directory && hal_path_next(&it)) {
+		if(hal_path_is_last(&it) && !hal_path_is_parent(&it)) {
+			*name = it.name;
+			*length = it.length;
 
-		// Get the directoryn
-		if(!(directory = this->read_directory(directory, component, cache, currentPath))) {
-			return NULL;
+			break;
 		}
-	}
 
-	// Clean up
-	kfree(currentPath);
-	kfree(list_get(components, 0));
-	list_destroy(components, false);
+		directory = this->read_directory(directory, &it);
+	}
 
 	return directory;
 }
@@ -536,9 +652,22 @@ void fs_fat32::processFATDirEnt(fat_dirent_t *entries, unsigned int number, fs_d
 
 				/*
 				 * To speed up file reads, store the first cluster of this file
-				 * in the low 32 bits of the userData field of the item.
+				 * in the low 32 bits of the userData field of the item. The
+				 * high 32 bits hold the index of the directory entry, so it
+				 * can be updated without searching the directory.
 				 */
-				item->userData = (entry->cluster_high << 16) | (entry->cluster_low);
+				item->userData = ((unsigned long long) i << 32) | (entry->cluster_high << 16) | (entry->cluster_low);
+
+				// Index the item by its name, as well as its 8.3 alias
+				hal_vfs_dir_index_add(root, item->name, item);
+
+				char *shortName = fs_fat32::dirent_get_8_3_name(entry);
+
+				if(strcasecmp(shortName, item->name)) {
+					hal_vfs_dir_index_add(root, shortName, item);
+				}
+
+				kfree(shortName);
 			}
 		} else if(entry->name[0] == 0x00) {
 			// Byte 0 being 0x00 indicates the entry is free.
@@ -550,6 +679,212 @@ void fs_fat32::processFATDirEnt(fat_dirent_t *entries, unsigned int number, fs_d
 	done: ;
 }
 
+/*
+ * Opens a cursor to read the entries of a directory one at a time. Unlike
+ * list_directory, this only ever keeps a single cluster of the directory in
+ * memory, and doesn't create items for the entries.
+ */
+fat32_dir_cursor_t *fs_fat32::open_dir(fs_directory_t *dir) {
+	fat32_dir_cursor_t *cursor = (fat32_dir_cursor_t *) kmalloc(sizeof(fat32_dir_cursor_t));
+
+	if(!cursor) {
+		return NULL;
+	}
+
+	cursor->entries = (fat_dirent_t *) kmalloc(cluster_size);
+
+	if(!cursor->entries) {
+		kfree(cursor);
+		return NULL;
+	}
+
+	// Cluster 0 refers to the root directory (as in dotdot entries)
+	cursor->cluster = dir->i.userData & FAT32_MASK;
+
+	if(!cursor->cluster) {
+		cursor->cluster = bpb.root_cluster & FAT32_MASK;
+	}
+
+	cursor->entry = 0;
+	cursor->end = false;
+	cursor->lfnNext = 0;
+
+	// Read the first cluster
+	unsigned int err = 0;
+
+	if(!this->readCluster(cursor->cluster, cursor->entries, &err)) {
+		#if PRINT_ERROR
+		KERROR("Error reading directory file %u: %u", cursor->cluster, err);
+		#endif
+
+		this->close_dir(cursor);
+		return NULL;
+	}
+
+	return cursor;
+}
+
+/*
+ * Decodes the next entry of the directory. Long names are reassembled as the
+ * entries are read; if they don't form a proper sequence, or don't match the
+ * short entry following them, the short name is used instead.
+ *
+ * @return 1 if an entry was read, 0 at the end of the directory, -1 on error.
+ */
+int fs_fat32::read_dir_entry(fat32_dir_cursor_t *cursor, fs_dirent_t *out) {
+	unsigned int perCluster = cluster_size / sizeof(fat_dirent_t);
+	unsigned int err = 0;
+
+	while(!cursor->end) {
+		// Move on to the next cluster of the directory
+		if(cursor->entry == perCluster) {
+			unsigned int next;
+
+			if(!this->readFatEntry(cursor->cluster, &next)) {
+				return -1;
+			}
+
+			next &= FAT32_MASK;
+
+			if(next >= FAT32_END_CHAIN || next < 2) {
+				cursor->end = true;
+				break;
+			}
+
+			if(!this->readCluster(next, cursor->entries, &err)) {
+				#if PRINT_ERROR
+				KERROR("Error reading directory file %u: %u", next, err);
+				#endif
+
+				return -1;
+			}
+
+			cursor->cluster = next;
+			cursor->entry = 0;
+		}
+
+		fat_dirent_t *entry = &cursor->entries[cursor->entry++];
+
+		// Byte 0 being 0x00 indicates no entries follow
+		if(entry->name[0] == 0x00) {
+			cursor->end = true;
+			break;
+		} else if(entry->name[0] == 0xE5) {
+			cursor->lfnNext = 0;
+			continue;
+		}
+
+		// Long names: stored last part first, counting down to 1
+		if((entry->attributes & FAT_ATTR_LFN) == FAT_ATTR_LFN) {
+			fat_longname_dirent_t *ln = (fat_longname_dirent_t *) entry;
+			uint8_t order = ln->order & 0x3F;
+
+			if(ln->type != 0 || !order || order > 20) {
+				cursor->lfnNext = 0;
+				continue;
+			}
+
+			if(ln->order & 0x40) {
+				cursor->lfnChecksum = ln->checksum;
+				cursor->lfn[order * 13] = 0x00;
+			} else if(order != cursor->lfnNext || ln->checksum != cursor->lfnChecksum) {
+				cursor->lfnNext = 0;
+				continue;
+			}
+
+			// Copy the characters (only the low byte of UCS-2 is kept)
+			char *name = &cursor->lfn[(order - 1) * 13];
+			unsigned int c;
+
+			for(c = 0; c < 5; c++) {
+				*name++ = ln->name1[c];
+			}
+
+			for(c = 0; c < 6; c++) {
+				*name++ = ln->name2[c];
+			}
+
+			for(c = 0; c < 2; c++) {
+				*name++ = ln->name3[c];
+			}
+
+			cursor->lfnNext = order - 1;
+			continue;
+		}
+
+		// The volume label isn't an entry of the directory
+		if(entry->attributes & FAT_ATTR_VOLUME_ID) {
+			cursor->lfnNext = 0;
+			continue;
+		}
+
+		// Skip dot and dotdot
+		if(entry->name[0] == '.' && (entry->name[1] == ' ' || (entry->name[1] == '.' && entry->name[2] == ' '))) {
+			cursor->lfnNext = 0;
+			continue;
+		}
+
+		// Use the long name if it's complete, and belongs to this entry
+		bool haveLongName = false;
+
+		if(cursor->lfnNext == 0 && cursor->lfn[0] && cursor->lfnChecksum == this->lfnCheckSum((unsigned char *) &entry->name)) {
+			strncpy(out->name, cursor->lfn, sizeof(out->name) - 1);
+			out->name[sizeof(out->name) - 1] = 0x00;
+
+			haveLongName = true;
+		}
+
+		cursor->lfn[0] = 0x00;
+		cursor->lfnNext = 0;
+
+		// Otherwise, format the short name
+		if(!haveLongName) {
+			unsigned int c = 0;
+
+			for(unsigned int i = 0; i < 8 && entry->name[i] != ' '; i++) {
+				out->name[c++] = (entry->nt_reserved & 0x08) ? tolower(entry->name[i]) : entry->name[i];
+			}
+
+			if(entry->ext[0] != ' ') {
+				out->name[c++] = '.';
+
+				for(unsigned int i = 0; i < 3 && entry->ext[i] != ' '; i++) {
+					out->name[c++] = (entry->nt_reserved & 0x10) ? tolower(entry->ext[i]) : entry->ext[i];
+				}
+			}
+
+			out->name[c] = 0x00;
+		}
+
+		// Fill in the rest of the entry
+		if(entry->attributes & FAT_ATTR_DIRECTORY) {
+			out->type = kFSItemTypeDirectory;
+			out->size = 0;
+		} else {
+			out->type = kFSItemTypeFile;
+			out->size = entry->filesize;
+		}
+
+		out->is_hidden = (entry->attributes & FAT_ATTR_HIDDEN);
+		out->is_system = (entry->attributes & FAT_ATTR_SYSTEM);
+		out->is_readonly = (entry->attributes & FAT_ATTR_READ_ONLY);
+
+		out->time_written = this->convert_timestamp(entry->write_date, entry->write_time, 0);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Releases a directory cursor.
+ */
+void fs_fat32::close_dir(fat32_dir_cursor_t *cursor) {
+	kfree(cursor->entries);
+	kfree(cursor);
+}
+
 /*
  * Calculates the checksum for a long name.
  */
@@ -595,63 +930,331 @@ time_t fs_fat32::convert_timestamp(uint16_t date, uint16_t time, uint8_t millis)
 }
 
 /*
- * Calculates a cluster's offset into the FAT. The returned structure indicates
- * the sector to read, and the dword offset into that sector. In other words,
- * if the sector is read as an array of bytes, the offset must be multiplied
- * by four.
+ * Gets the current time in the format used by directory entries. tenths may be
+ * NULL if the fine resolution creation time isn't needed.
  */
-fat32_secoff_t fs_fat32::fatEntryOffsetForCluster(unsigned int cluster) {
-	fat32_secoff_t offset;
+void fs_fat32::currentFatTimestamp(uint16_t *date, uint16_t *time, uint8_t *tenths) {
+	time_components_t currentTime = this->hal_fs::get_current_fs_time();
+	currentTime.year -= 1980;
 
-	// Number of FAT entries per cluster
-	unsigned int entries_per_cluster = cluster_size / 4;
+	*date = (currentTime.day & 0x1F);
+	*date |= (currentTime.month & 0x1F) << 5;
+	*date |= (currentTime.year & 0x7F) << 9;
 
-	// Determine size of FAT and normalise cluster
-	offset.sector = bpb.reserved_sector_count + (cluster / entries_per_cluster);
-	offset.offset = cluster % entries_per_cluster;
+	*time = (currentTime.second >> 1) & 0x1F;
+	*time |= (currentTime.minute & 0x3F) << 5;
+	*time |= (currentTime.hour & 0x1F) << 11;
 
-	return offset;
+	if(tenths) {
+		*tenths = (currentTime.second & 1) * 100;
+	}
 }
 
 /*
- * Follows the cluster chain to find all clusters on which the specified
- * starting cluster has data. This *can* be slow.
- *
- * Note that the array returned is terminated by FAT32_END_CHAIN.
+ * Notes that the file's size or first cluster changed. Rather than rewriting
+ * the directory entry on every write, it is written back on sync, or when the
+ * last handle to the file is closed.
  */
-unsigned int *fs_fat32::clusterChainForCluster(unsigned int cluster) {
-	unsigned int chain_len = 32;
-	unsigned int chain_offset = 0;
-	unsigned int *chain = (unsigned int *) kmalloc(sizeof(unsigned int) * chain_len);
-	unsigned int err;
-
-	fat32_secoff_t off;
+void fs_fat32::markDirentDirty(fs_file_t *file) {
+	for(unsigned int i = 0; i < numDirtyFiles; i++) {
+		if(dirtyFiles[i] == file) {
+			return;
+		}
+	}
 
-	// Guard against broken FS implementations
-	if(cluster == 0) {
-		cluster = 2;
+	if(numDirtyFiles == maxDirtyFiles) {
+		maxDirtyFiles *= 2;
+		dirtyFiles = (fs_file_t **) krealloc(dirtyFiles, sizeof(fs_file_t *) * maxDirtyFiles);
 	}
 
-	// Place the initial cluster as the first entry in the chain.
-	chain[chain_offset++] = cluster;
+	dirtyFiles[numDirtyFiles++] = file;
+}
 
-	// Repeat until the end is reached (marked by FAT32_END_CHAIN)
-	unsigned int nextCluster = cluster;
-	while(nextCluster != FAT32_END_CHAIN) {
-		// Read the FAT for this sector
-		off = this->fatEntryOffsetForCluster(nextCluster);
+/*
+ * Writes the size, first cluster and modification time of the file into its
+ * directory entry. The entry is located through the index stored in the high
+ * 32 bits of the file's userData.
+ */
+bool fs_fat32::writeDirent(fs_file_t *file, unsigned int *error) {
+	unsigned int entriesPerCluster = cluster_size / sizeof(fat_dirent_t);
+	unsigned int entriesPerSector = bpb.bytes_per_sector / sizeof(fat_dirent_t);
 
-		// Read out cluster
-		if(this->hal_fs::read_sectors(off.sector, bpb.sectors_per_cluster, fatBuffer, &err)) {
-			nextCluster = fatBuffer[off.offset];
-		} else { // read error?
-			#if PRINT_ERROR
-			KERROR("Couldn't read sector %u for FAT", off.sector);
+	unsigned int index = (unsigned int) (file->i.userData >> 32);
+	unsigned int cluster = file->parent->i.userData & FAT32_MASK;
+
+	// Find the cluster of the directory that holds the entry
+	for(unsigned int i = 0; i < (index / entriesPerCluster); i++) {
+		if(!this->readFatEntry(cluster, &cluster)) {
+			return false;
+		}
+
+		cluster &= FAT32_MASK;
+
+		if(cluster < 2 || cluster >= FAT32_BAD_CLUSTER) {
+			#if PRINT_ERROR
+			KERROR("Entry %u of '%s' is past the end of its directory", index, file->i.name);
+			#endif
+
+			return false;
+		}
+	}
+
+	unsigned int sector = ((cluster - 2) * bpb.sectors_per_cluster) + first_data_sector;
+	sector += (index % entriesPerCluster) / entriesPerSector;
+
+	if(!this->hal_fs::read_sectors(sector, 1, sectorBuffer, error)) {
+		return false;
+	}
+
+	fat_dirent_t *entry = ((fat_dirent_t *) sectorBuffer) + (index % entriesPerSector);
+
+	// Make sure the entry wasn't deleted or moved in the meantime
+	if(entry->name[0] == 0x00 || entry->name[0] == 0xE5 || (entry->attributes & FAT_ATTR_LFN) == FAT_ATTR_LFN) {
+		#if PRINT_ERROR
+		KERROR("Entry %u of '%s' is no longer in use", index, file->i.name);
+		#endif
+
+		return false;
+	}
+
+	unsigned int firstCluster = file->i.userData & FAT32_MASK;
+
+	entry->filesize = (uint32_t) file->size;
+	entry->cluster_low = firstCluster & 0x0000FFFF;
+	entry->cluster_high = (firstCluster & 0xFFFF0000) >> 16;
+	entry->attributes |= FAT_ATTR_ARCHIVE;
+
+	// Batched updates all get the time they're written back at
+	uint16_t date, time;
+	this->currentFatTimestamp(&date, &time, NULL);
+
+	entry->write_date = date;
+	entry->write_time = time;
+	entry->accessed_date = date;
+
+	file->i.time_written = this->convert_timestamp(date, time, 0);
+
+	if(!this->hal_fs::write_sectors(sector, 1, sectorBuffer, error)) {
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Writes back the pending directory entry update of the given file, or those
+ * of all files if it is NULL.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+int fs_fat32::writeDirtyDirents(fs_file_t *file) {
+	unsigned int err = 0;
+
+	for(unsigned int i = 0; i < numDirtyFiles; ) {
+		fs_file_t *dirty = dirtyFiles[i];
+
+		if(file && dirty != file) {
+			i++;
+			continue;
+		}
+
+		if(!this->writeDirent(dirty, &err)) {
+			#if PRINT_ERROR
+			KERROR("Error writing directory entry of '%s': %u", dirty->i.name, err);
+			#endif
+
+			return -1;
+		}
+
+		// Order of the list doesn't matter
+		dirtyFiles[i] = dirtyFiles[--numDirtyFiles];
+	}
+
+	return 0;
+}
+
+/*
+ * Calculates a cluster's offset into the FAT. The returned structure indicates
+ * the sector of the FAT to read (relative to the start of the FAT), and the
+ * dword offset into that sector. In other words, if the sector is read as an
+ * array of bytes, the offset must be multiplied by four.
+ */
+fat32_secoff_t fs_fat32::fatEntryOffsetForCluster(unsigned int cluster) {
+	fat32_secoff_t offset;
+
+	// Number of FAT entries per sector
+	unsigned int entries_per_sector = bpb.bytes_per_sector / 4;
+
+	offset.sector = cluster / entries_per_sector;
+	offset.offset = cluster % entries_per_sector;
+
+	return offset;
+}
+
+/*
+ * Gets a sector of the FAT from the FAT cache, reading it from disk if it
+ * isn't cached. When the cache is full, the least recently used sector is
+ * evicted, and written back first if it was modified.
+ *
+ * If FAT mirroring is disabled, the active FAT is read; otherwise, the first.
+ */
+uint32_t *fs_fat32::fatCacheGet(unsigned int sector, unsigned int *error) {
+	fat32_fat_cache_entry_t *victim = NULL;
+
+	// Chain walks hit the same sector many times in a row
+	if(fatCacheLast && fatCacheLast->sector == sector) {
+		fatCacheLast->lastUse = ++fatCacheClock;
+		return fatCacheLast->data;
+	}
+
+	for(unsigned int i = 0; i < FAT32_FAT_CACHE_SIZE; i++) {
+		fat32_fat_cache_entry_t *entry = &fatCache[i];
+
+		if(entry->sector == sector) {
+			entry->lastUse = ++fatCacheClock;
+			fatCacheLast = entry;
+
+			return entry->data;
+		}
+
+		// Prefer empty entries, then the least recently used one
+		if(!victim || (victim->sector != FAT32_FAT_CACHE_EMPTY && (entry->sector == FAT32_FAT_CACHE_EMPTY || entry->lastUse < victim->lastUse))) {
+			victim = entry;
+		}
+	}
+
+	// Write back the victim if needed
+	if(victim->dirty && !this->writeFatSector(victim, error)) {
+		return NULL;
+	}
+
+	// Read the sector
+	unsigned int active = (bpb.extended_flags & 0x80) ? (bpb.extended_flags & 0x0F) : 0;
+	unsigned int lba = bpb.reserved_sector_count + (active * bpb.table_size_32) + sector;
+
+	victim->sector = FAT32_FAT_CACHE_EMPTY;
+
+	if(!this->hal_fs::read_sectors(lba, 1, victim->data, error)) {
+		#if PRINT_ERROR
+		KERROR("Couldn't read sector %u for FAT", lba);
+		#endif
+
+		return NULL;
+	}
+
+	victim->sector = sector;
+	victim->lastUse = ++fatCacheClock;
+	fatCacheLast = victim;
+
+	return victim->data;
+}
+
+/*
+ * Reads the FAT entry of the specified cluster.
+ */
+bool fs_fat32::readFatEntry(unsigned int cluster, unsigned int *value) {
+	unsigned int err = 0;
+	fat32_secoff_t off = this->fatEntryOffsetForCluster(cluster);
+
+	uint32_t *sector = this->fatCacheGet(off.sector, &err);
+
+	if(!sector) {
+		return false;
+	}
+
+	*value = sector[off.offset];
+	return true;
+}
+
+/*
+ * Writes the FAT entry of the specified cluster. The reserved upper four bits
+ * of the entry are preserved. The change is only written to disk when the
+ * sector is evicted from the cache, or on sync.
+ */
+bool fs_fat32::writeFatEntry(unsigned int cluster, unsigned int value) {
+	unsigned int err = 0;
+	fat32_secoff_t off = this->fatEntryOffsetForCluster(cluster);
+
+	uint32_t *sector = this->fatCacheGet(off.sector, &err);
+
+	if(!sector) {
+		return false;
+	}
+
+	sector[off.offset] = (sector[off.offset] & ~FAT32_MASK) | (value & FAT32_MASK);
+	fatCacheLast->dirty = true;
+
+	return true;
+}
+
+/*
+ * Writes a modified FAT sector to every copy of the FAT (or only the active
+ * one, if mirroring is disabled.)
+ */
+bool fs_fat32::writeFatSector(fat32_fat_cache_entry_t *entry, unsigned int *error) {
+	unsigned int tables = (bpb.extended_flags & 0x80) ? 1 : bpb.table_count;
+	unsigned int first = (bpb.extended_flags & 0x80) ? (bpb.extended_flags & 0x0F) : 0;
+
+	for(unsigned int t = first; t < first + tables; t++) {
+		unsigned int lba = bpb.reserved_sector_count + (t * bpb.table_size_32) + entry->sector;
+
+		if(!this->hal_fs::write_sectors(lba, 1, entry->data, error)) {
+			#if PRINT_ERROR
+			KERROR("Couldn't write FAT sector %u: %u", lba, *error);
 			#endif
 
+			return false;
+		}
+	}
+
+	entry->dirty = false;
+	return true;
+}
+
+/*
+ * Writes all modified FAT sectors back to the disk.
+ */
+int fs_fat32::flushFatCache(void) {
+	unsigned int err = 0;
+
+	for(unsigned int i = 0; i < FAT32_FAT_CACHE_SIZE; i++) {
+		if(fatCache[i].dirty && !this->writeFatSector(&fatCache[i], &err)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Follows the cluster chain to find all clusters on which the specified
+ * starting cluster has data.
+ *
+ * Note that the array returned is terminated by FAT32_END_CHAIN.
+ */
+unsigned int *fs_fat32::clusterChainForCluster(unsigned int cluster) {
+	unsigned int chain_len = 32;
+	unsigned int chain_offset = 0;
+	unsigned int *chain = (unsigned int *) kmalloc(sizeof(unsigned int) * chain_len);
+
+	// Guard against broken FS implementations
+	if(cluster == 0) {
+		cluster = 2;
+	}
+
+	// Place the initial cluster as the first entry in the chain.
+	chain[chain_offset++] = cluster;
+
+	// Repeat until the end is reached (marked by FAT32_END_CHAIN)
+	unsigned int nextCluster = cluster;
+	while(nextCluster != FAT32_END_CHAIN) {
+		// Read out cluster
+		if(!this->readFatEntry(nextCluster, &nextCluster)) {
 			goto error;
 		}
 
+		nextCluster &= FAT32_MASK;
+
 		// Is this the end of the chain?
 		if(nextCluster >= FAT32_END_CHAIN) {
 			nextCluster = FAT32_END_CHAIN;
@@ -663,341 +1266,1423 @@ unsigned int *fs_fat32::clusterChainForCluster(unsigned int cluster) {
 			chain = (unsigned int *) krealloc(chain, sizeof(unsigned int) * chain_len);
 		}
 
-		// Write into chain array
-		chain[chain_offset++] = nextCluster & FAT32_MASK;
-	}
+		// Write into chain array
+		chain[chain_offset++] = nextCluster;
+	}
+
+	return chain;
+
+	// Handle an error condition
+	error: ;
+	kfree(chain);
+	return NULL;
+}
+
+/*
+ * Gets the extent map of the file, building it by following the file's cluster
+ * chain if it doesn't exist or is stale.
+ */
+fat32_extent_map_t *fs_fat32::extentMapForFile(fs_file_t *file) {
+	unsigned int cluster = file->i.userData & FAT32_MASK;
+	fat32_extent_map_t *map = (fat32_extent_map_t *) file->fs_data;
+
+	if(map && map->firstCluster == cluster) {
+		return map;
+	}
+
+	// Get rid of the stale map
+	if(map) {
+		kfree(map);
+		file->fs_data = NULL;
+	}
+
+	unsigned int maxExtents = 8;
+	map = (fat32_extent_map_t *) kmalloc(sizeof(fat32_extent_map_t) + (sizeof(fat32_extent_t) * maxExtents));
+
+	if(!map) {
+		return NULL;
+	}
+
+	map->firstCluster = cluster;
+	map->numClusters = 0;
+	map->numExtents = 0;
+
+	// Empty files have no clusters
+	while(cluster >= 2 && cluster < FAT32_BAD_CLUSTER) {
+		// Guard against corrupted chains that loop
+		if(map->numClusters > num_data_clusters || cluster >= (num_data_clusters + 2)) {
+			#if PRINT_ERROR
+			KERROR("Corrupted cluster chain at cluster %u", cluster);
+			#endif
+
+			kfree(map);
+			return NULL;
+		}
+
+		fat32_extent_t *last = map->numExtents ? &map->extents[map->numExtents - 1] : NULL;
+
+		// Extend the last run, or start a new one
+		if(last && (last->cluster + last->length) == cluster) {
+			last->length++;
+		} else {
+			if(map->numExtents == maxExtents) {
+				maxExtents *= 2;
+				fat32_extent_map_t *newMap = (fat32_extent_map_t *) krealloc(map, sizeof(fat32_extent_map_t) + (sizeof(fat32_extent_t) * maxExtents));
+
+				if(!newMap) {
+					kfree(map);
+					return NULL;
+				}
+
+				map = newMap;
+			}
+
+			fat32_extent_t *extent = &map->extents[map->numExtents++];
+			extent->fileCluster = map->numClusters;
+			extent->cluster = cluster;
+			extent->length = 1;
+		}
+
+		map->numClusters++;
+
+		if(!this->readFatEntry(cluster, &cluster)) {
+			kfree(map);
+			return NULL;
+		}
+
+		cluster &= FAT32_MASK;
+	}
+
+	file->fs_data = map;
+	return map;
+}
+
+/*
+ * Looks up the disk cluster holding the specified cluster of a file. The
+ * number of clusters that follow it on disk (including the cluster itself)
+ * until the end of the run is written into run.
+ */
+bool fs_fat32::clusterForFileCluster(fat32_extent_map_t *map, unsigned int index, unsigned int *cluster, unsigned int *run) {
+	if(index >= map->numClusters) {
+		return false;
+	}
+
+	// Binary search for the extent containing this cluster
+	unsigned int low = 0, high = map->numExtents;
+
+	while(high - low > 1) {
+		unsigned int mid = (low + high) / 2;
+
+		if(map->extents[mid].fileCluster <= index) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+
+	fat32_extent_t *extent = &map->extents[low];
+	unsigned int offset = index - extent->fileCluster;
+
+	*cluster = extent->cluster + offset;
+	*run = extent->length - offset;
+
+	return true;
+}
+
+/*
+ * Allocates count clusters and appends them to the file's chain, keeping its
+ * extent map up to date. The allocator is asked to continue the last run of
+ * the file first, so files that grow piecemeal stay contiguous where possible.
+ *
+ * Returns the updated extent map, or NULL if there isn't enough space.
+ */
+fat32_extent_map_t *fs_fat32::extendFile(fs_file_t *file, unsigned int count) {
+	fat32_extent_map_t *map = this->extentMapForFile(file);
+
+	if(!map) {
+		return NULL;
+	}
+
+	while(count) {
+		/*
+		 * Make room for another extent before touching the FAT, so the map
+		 * still describes the chain if this fails.
+		 */
+		fat32_extent_map_t *newMap = (fat32_extent_map_t *) krealloc(map, sizeof(fat32_extent_map_t) + (sizeof(fat32_extent_t) * (map->numExtents + 1)));
+
+		if(!newMap) {
+			return NULL;
+		}
+
+		map = newMap;
+		file->fs_data = map;
+
+		fat32_extent_t *last = map->numExtents ? &map->extents[map->numExtents - 1] : NULL;
+		unsigned int lastCluster = last ? (last->cluster + last->length - 1) : 0;
+
+		unsigned int allocated;
+		unsigned int first = this->allocateClusters(count, last ? (lastCluster + 1) : 0, &allocated);
+
+		if(!first) {
+			return NULL;
+		}
+
+		// Link the new clusters to the end of the chain
+		if(last) {
+			if(!this->writeFatEntry(lastCluster, first)) {
+				return NULL;
+			}
+		} else {
+			file->i.userData = (file->i.userData & ~((unsigned long long) FAT32_MASK)) | first;
+			map->firstCluster = first;
+
+			this->markDirentDirty(file);
+		}
+
+		// Extend the last run, or start a new one
+		if(last && (lastCluster + 1) == first) {
+			last->length += allocated;
+		} else {
+			fat32_extent_t *extent = &map->extents[map->numExtents++];
+			extent->fileCluster = map->numClusters;
+			extent->cluster = first;
+			extent->length = allocated;
+		}
+
+		map->numClusters += allocated;
+		count -= allocated;
+	}
+
+	return map;
+}
+
+/*
+ * Releases all clusters of the file, leaving it empty.
+ */
+bool fs_fat32::truncateFile(fs_file_t *file) {
+	unsigned int cluster = file->i.userData & FAT32_MASK;
+
+	if(cluster >= 2 && !this->freeClusterChain(cluster)) {
+		return false;
+	}
+
+	file->i.userData &= ~((unsigned long long) FAT32_MASK);
+	file->size = 0;
+
+	// The extent map describes the old chain
+	if(file->fs_data) {
+		kfree(file->fs_data);
+		file->fs_data = NULL;
+	}
+
+	this->markDirentDirty(file);
+	return true;
+}
+
+/*
+ * Reads the specified cluster.
+ */
+void *fs_fat32::readCluster(unsigned int cluster, void *buffer, unsigned int *error) {
+	unsigned int sector = ((cluster - 2) * bpb.sectors_per_cluster) + first_data_sector;
+
+	if(!this->hal_fs::read_sectors(sector, bpb.sectors_per_cluster, buffer, error)) {
+		return NULL;
+	}
+
+	return buffer;
+}
+
+/*
+ * Reads length bytes, starting offset bytes into the cluster, into buffer. The
+ * range may extend past the end of the cluster, as long as the clusters that
+ * follow it on disk belong to the same run.
+ *
+ * Sectors that are entirely covered by the range are read directly into the
+ * destination buffer. Only the partial sectors at the start and end of the
+ * range (if any) go through the sector bounce buffer, and the entire range is
+ * read with a single vectored request.
+ */
+void *fs_fat32::readClusterRange(unsigned int cluster, unsigned int offset, size_t length, void *buffer, unsigned int *error) {
+	unsigned int bps = bpb.bytes_per_sector;
+	uint8_t *out = (uint8_t *) buffer;
+
+	// Sectors of the cluster that contain the range
+	unsigned int firstSector = offset / bps;
+	unsigned int lastSector = (offset + length - 1) / bps;
+
+	unsigned int headSkip = offset % bps;
+	unsigned int tailLength = (offset + length) % bps;
+
+	// Build the IO vector: at most head, body and tail
+	hal_disk_iovec_t iov[3];
+	unsigned int iovcnt = 0;
+
+	bool headBounced = false, tailBounced = false;
+	unsigned int sector = firstSector;
+
+	// Partial first sector
+	if(headSkip || (firstSector == lastSector && tailLength)) {
+		iov[iovcnt].buffer = sectorBuffer;
+		iov[iovcnt].phys = 0;
+		iov[iovcnt++].length = bps;
+
+		headBounced = true;
+		sector++;
+	}
+
+	// Whole sectors go directly into the output buffer
+	unsigned int bodyEnd = tailLength ? lastSector : (lastSector + 1);
+
+	if(sector < bodyEnd) {
+		iov[iovcnt].buffer = out + ((sector * bps) - offset);
+		iov[iovcnt].phys = 0;
+		iov[iovcnt++].length = (bodyEnd - sector) * bps;
+
+		sector = bodyEnd;
+	}
+
+	// Partial last sector
+	if(sector <= lastSector) {
+		iov[iovcnt].buffer = sectorBuffer + bps;
+		iov[iovcnt].phys = 0;
+		iov[iovcnt++].length = bps;
+
+		tailBounced = true;
+	}
+
+	// Perform the read
+	unsigned int start = ((cluster - 2) * bpb.sectors_per_cluster) + first_data_sector + firstSector;
+
+	if(!this->hal_fs::read_sectors_v(start, iov, iovcnt, error)) {
+		return NULL;
+	}
+
+	// Copy the bits of the partial sectors that were requested
+	if(headBounced) {
+		size_t headLength = bps - headSkip;
+
+		if(headLength > length) {
+			headLength = length;
+		}
+
+		memcpy(out, sectorBuffer + headSkip, headLength);
+	}
+
+	if(tailBounced) {
+		memcpy(out + ((lastSector * bps) - offset), sectorBuffer + bps, tailLength);
+	}
+
+	return buffer;
+}
+
+/*
+ * Writes length bytes from buffer into a run of consecutive clusters, starting
+ * offset bytes into its first cluster.
+ *
+ * Whole sectors are written directly from the source buffer. Partial sectors
+ * at either end are merged with their current contents in the sector bounce
+ * buffer first; valid is the number of bytes at the start of the run that hold
+ * file data, so sectors past it are zero filled rather than read.
+ */
+bool fs_fat32::writeClusterRange(unsigned int cluster, unsigned int offset, size_t length, void *buffer, unsigned long long valid, unsigned int *error) {
+	unsigned int bps = bpb.bytes_per_sector;
+	uint8_t *in = (uint8_t *) buffer;
+
+	unsigned int start = ((cluster - 2) * bpb.sectors_per_cluster) + first_data_sector;
+
+	// Sectors of the cluster that contain the range
+	unsigned int firstSector = offset / bps;
+	unsigned int lastSector = (offset + length - 1) / bps;
+
+	unsigned int headSkip = offset % bps;
+	unsigned int tailLength = (offset + length) % bps;
+
+	// Build the IO vector: at most head, body and tail
+	hal_disk_iovec_t iov[3];
+	unsigned int iovcnt = 0;
+
+	unsigned int sector = firstSector;
+
+	// Partial first sector
+	if(headSkip || (firstSector == lastSector && tailLength)) {
+		if((firstSector * bps) < valid) {
+			if(!this->hal_fs::read_sectors(start + firstSector, 1, sectorBuffer, error)) {
+				return false;
+			}
+		} else {
+			memclr(sectorBuffer, bps);
+		}
+
+		size_t headLength = bps - headSkip;
+
+		if(headLength > length) {
+			headLength = length;
+		}
+
+		memcpy(sectorBuffer + headSkip, in, headLength);
+
+		iov[iovcnt].buffer = sectorBuffer;
+		iov[iovcnt].phys = 0;
+		iov[iovcnt++].length = bps;
+
+		sector++;
+	}
+
+	// Whole sectors come directly from the input buffer
+	unsigned int bodyEnd = tailLength ? lastSector : (lastSector + 1);
+
+	if(sector < bodyEnd) {
+		iov[iovcnt].buffer = in + ((sector * bps) - offset);
+		iov[iovcnt].phys = 0;
+		iov[iovcnt++].length = (bodyEnd - sector) * bps;
+
+		sector = bodyEnd;
+	}
+
+	// Partial last sector
+	if(sector <= lastSector) {
+		if((lastSector * bps) < valid) {
+			if(!this->hal_fs::read_sectors(start + lastSector, 1, sectorBuffer + bps, error)) {
+				return false;
+			}
+		} else {
+			memclr(sectorBuffer + bps, bps);
+		}
+
+		memcpy(sectorBuffer + bps, in + ((lastSector * bps) - offset), tailLength);
+
+		iov[iovcnt].buffer = sectorBuffer + bps;
+		iov[iovcnt].phys = 0;
+		iov[iovcnt++].length = bps;
+	}
+
+	return this->hal_fs::write_sectors_v(start + firstSector, iov, iovcnt, error);
+}
+
+/*
+ * Reads the specified cluster.
+ */
+void *fs_fat32::writeCluster(unsigned int cluster, void *buffer, unsigned int *error) {
+	unsigned int sector = ((cluster - 2) * bpb.sectors_per_cluster) + first_data_sector;
+
+	if(!this->hal_fs::write_sectors(sector, bpb.sectors_per_cluster, buffer, error)) {
+		return NULL;
+	}
+
+	return buffer;
+}
+
+/*
+ * Gets a pointer to a VFS file object
+ */
+fs_file_handle_t* fs_fat32::get_file_handle(char *path, fs_file_open_mode_t mode) {
+	fs_file_t *file = NULL;
+
+	// Find the directory the file is in
+	char *name;
+	size_t nameLength;
+
+	fs_directory_t *dir = this->walkPath(path, &name, &nameLength);
+
+	if(!dir || !name) {
+		goto notFound;
+	}
+
+	// Directory found, search for file.
+	file = (fs_file_t *) hal_vfs_dir_lookupn(dir, name, nameLength);
+
+	// Ignore directories
+	if(file && file->i.type == kFSItemTypeFile) {
+		return this->open_file(file, mode);
+	}
+
+	// We need to create the file if requested and it didn't exist
+	if(!file && (mode & kFSFileModeCreate)) {
+		char fileName[256];
+
+		if(nameLength >= sizeof(fileName)) {
+			goto notFound;
+		}
+
+		memcpy(fileName, name, nameLength);
+		fileName[nameLength] = 0x00;
+
+		int crtErr = 0;
+
+		if(!(crtErr = this->createEmptyFile(dir, fileName))) {
+			file = (fs_file_t *) hal_vfs_dir_lookupn(dir, name, nameLength);
+
+			if(file && file->i.type == kFSItemTypeFile) {
+				return this->open_file(file, mode);
+			}
+		} else {
+			#if PRINT_ERROR
+			KERROR("Could not create %s: %i", path, crtErr);
+			#endif
+		}
+	}
+
+	// File not found
+	notFound: ;
+	#if DEBUG_FILE_NOT_FOUND
+	KERROR("Couldn't find '%s'", path);
+	#endif
+
+	return NULL;
+}
+
+/*
+ * Opens a handle for the specified file, truncating it if requested.
+ */
+fs_file_handle_t* fs_fat32::open_file(fs_file_t *file, fs_file_open_mode_t mode) {
+	fs_directory_t *dir = file->parent;
+
+	// Open handles counter
+	dir->handles_open++;
+	file->handles_open++;
+
+	// Truncating releases all of the file's clusters
+	if((mode & kFSFileModeTruncate) && !(mode & kFSFileModeReadOnly)) {
+		if(!this->truncateFile(file)) {
+			#if PRINT_ERROR
+			KERROR("Couldn't truncate %s", file->i.name);
+			#endif
+
+			dir->handles_open--;
+			file->handles_open--;
+
+			return NULL;
+		}
+	}
+
+	// Open a file handle object
+	fs_file_handle_t *handle = (fs_file_handle_t *) kmalloc(sizeof(fs_file_handle_t));
+
+	handle->file = file->i.handle;
+	handle->mode = mode;
+	handle->can_seek = true;
+	handle->position = 0;
+
+	handle->isOpen = true;
+
+	// Increment file's cache reference
+	file->i.cache_accesses++;
+
+	return handle;
+}
+
+/*
+ * Closes a file handle that was previously opened. This will cause caches to be
+ * flushed.
+ */
+void fs_fat32::close_file_handle(fs_file_handle_t *handle) {
+	// Don't close already closed handles
+	if(!handle->isOpen) return;
+
+	// Mark as closed
+	handle->isOpen = false;
+
+	// Decrement file handle counts (unless the file is already gone)
+	fs_file_t *file = (fs_file_t *) hal_handle_get_object(handle->file);
+
+	if(!file) return;
+
+	file->handles_open--;
+
+	file->parent->handles_open--;
+
+	// Once the last handle is closed, write back the file's metadata
+	if(!file->handles_open) {
+		if(this->flushFatCache() || this->writeDirtyDirents(file)) {
+			#if PRINT_ERROR
+			KERROR("Couldn't update metadata of '%s'", file->i.name);
+			#endif
+		}
+	}
+}
+
+/*
+ * Deletes a file: its directory entry, as well as any long name entries that
+ * belong to it, are marked as free, and its clusters are released. Files that
+ * are open can't be deleted, and neither can directories (yet.)
+ */
+int fs_fat32::unlink(char *path) {
+	unsigned int err = 0;
+	int ret = 0;
+
+	// Find the directory and the name of the item
+	char *name;
+	size_t nameLength;
+
+	fs_directory_t *dir = this->walkPath(path, &name, &nameLength);
+
+	if(!dir || !name) {
+		return -1;
+	}
+
+	fs_item_t *item = hal_vfs_dir_lookupn(dir, name, nameLength);
+
+	if(!item) {
+		return -1;
+	} else if(item->type != kFSItemTypeFile) {
+		UNIMPLEMENTED_WARNING();
+		return -1;
+	}
+
+	fs_file_t *file = (fs_file_t *) item;
+
+	if(file->handles_open) {
+		#if PRINT_ERROR
+		KERROR("Can't delete '%s': file is open", path);
+		#endif
+
+		return -2;
+	}
+
+	// Pending updates of the directory entry no longer matter
+	for(unsigned int i = 0; i < numDirtyFiles; i++) {
+		if(dirtyFiles[i] == file) {
+			dirtyFiles[i] = dirtyFiles[--numDirtyFiles];
+			break;
+		}
+	}
+
+	// Read the directory
+	unsigned int *chain = this->clusterChainForCluster(dir->i.userData & FAT32_MASK);
+	unsigned int chainLength = 0;
+
+	if(!chain) {
+		return -3;
+	}
+
+	while(chain[chainLength] != FAT32_END_CHAIN) {
+		chainLength++;
+	}
+
+	unsigned int entriesPerCluster = cluster_size / sizeof(fat_dirent_t);
+	unsigned int index = (unsigned int) (file->i.userData >> 32);
+	unsigned int first = index;
+
+	fat_dirent_t *dirBuf = NULL;
+
+	if(index >= (chainLength * entriesPerCluster)) {
+		ret = -3;
+		goto done;
+	}
+
+	dirBuf = (fat_dirent_t *) kmalloc(chainLength * cluster_size);
+
+	if(!dirBuf) {
+		ret = -255;
+		goto done;
+	}
+
+	for(unsigned int c = 0; c < chainLength; c++) {
+		if(!this->readCluster(chain[c], ((uint8_t *) dirBuf) + (c * cluster_size), &err)) {
+			#if PRINT_ERROR
+			KERROR("Error reading directory cluster %u: %u", chain[c], err);
+			#endif
+
+			ret = -4;
+			goto done;
+		}
+	}
+
+	// Mark the short name entry and its long name entries (which precede it) free
+	{
+		uint8_t checksum = this->lfnCheckSum((unsigned char *) &dirBuf[index].name);
+		dirBuf[index].name[0] = 0xE5;
+
+		while(first > 0) {
+			fat_longname_dirent_t *ln = (fat_longname_dirent_t *) &dirBuf[first - 1];
+
+			if((ln->attributes & FAT_ATTR_LFN) != FAT_ATTR_LFN || ln->order == 0xE5 || ln->checksum != checksum) {
+				break;
+			}
+
+			first--;
+
+			bool isLast = (ln->order & 0x40);
+			ln->order = 0xE5;
+
+			if(isLast) {
+				break;
+			}
+		}
+	}
+
+	// Write back the clusters that changed
+	for(unsigned int c = (first / entriesPerCluster); c <= (index / entriesPerCluster); c++) {
+		if(!this->writeCluster(chain[c], ((uint8_t *) dirBuf) + (c * cluster_size), &err)) {
+			#if PRINT_ERROR
+			KERROR("Error writing directory cluster %u: %u", chain[c], err);
+			#endif
+
+			ret = -4;
+			goto done;
+		}
+	}
+
+	// Release the clusters (if the entry was written, they're lost at worst)
+	if((file->i.userData & FAT32_MASK) >= 2 && !this->freeClusterChain(file->i.userData & FAT32_MASK)) {
+		ret = -5;
+	}
+
+	hal_vfs_remove_child(dir, &file->i);
+	hal_vfs_deallocate_file(file);
+
+	if(this->sync()) {
+		ret = -6;
+	}
+
+	done: ;
+	if(dirBuf) {
+		kfree(dirBuf);
+	}
+
+	kfree(chain);
+
+	return ret;
+}
+
+/*
+ * Performs a read operation from the file this file handle is opened on,
+ * reading num_bytes bytes into buffer, starting at the current location of
+ * the file handle.
+ *
+ * This function returns between zero and LONG_LONG_MAX 
+ */
+long long fs_fat32::read_handle(fs_file_handle_t *h, size_t bytes, void *buffer) {
+	fs_file_t *fileObj = this->fileForHandle(h);
+
+	if(!fileObj) {
+		return -1;
+	}
+
+	long long bytes_read = this->readData(fileObj, h->position, bytes, buffer);
+
+	// Adjust file pointer
+	if(bytes_read > 0) {
+		h->position += bytes_read;
+	}
+
+	return bytes_read;
+}
+
+/*
+ * Gets the file that a handle is open on, if the handle is still usable.
+ */
+fs_file_t *fs_fat32::fileForHandle(fs_file_handle_t *h) {
+	// Get the file object associated with it
+	fs_file_t *fileObj = (fs_file_t *) hal_handle_get_object(h->file);
+
+	// Verify the file object is still valid (its handle may be stale)
+	if(!fileObj || fileObj->i.type != kFSItemTypeFile) {
+		h->isOpen = false;
+		return NULL;
+	}
+
+	// Is the file open?
+	if(!h->isOpen) {
+		return NULL;
+	}
+
+	return fileObj;
+}
+
+/*
+ * Moves the handle to the given position. Positions past the end of the file
+ * are allowed (writing there leaves a zero-filled gap), as long as they're
+ * within the largest size a file can have.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+int fs_fat32::seek_handle(fs_file_handle_t *h, unsigned long long position) {
+	if(!this->fileForHandle(h) || position > FAT32_MAX_FILE_SIZE) {
+		return -1;
+	}
+
+	h->position = position;
+	return 0;
+}
+
+/*
+ * Fills a page of the page cache with the file's data at offset.
+ *
+ * @return Number of bytes of the page that are inside the file, or -1.
+ */
+int fs_fat32::read_page(fs_file_t *file, unsigned long long offset, void *page) {
+	return (int) this->readData(file, offset, HAL_PAGECACHE_PAGE_SIZE, page);
+}
+
+/*
+ * Reads count consecutive pages of the file, starting at offset, for
+ * readahead. The pages of each run of consecutive clusters are read with a
+ * single vectored request.
+ *
+ * @return Number of bytes of the pages that are inside the file, or -1.
+ */
+int fs_fat32::read_pages(fs_file_t *file, unsigned long long offset, void **pages, unsigned int count) {
+	unsigned int err = 0;
+	unsigned int bps = bpb.bytes_per_sector;
+
+	if(offset >= file->size) {
+		return 0;
+	}
+
+	// Bytes of the file covered by the pages
+	unsigned long long length = (unsigned long long) count * HAL_PAGECACHE_PAGE_SIZE;
+
+	if((file->size - offset) < length) {
+		length = file->size - offset;
+	}
+
+	fat32_extent_map_t *map = this->extentMapForFile(file);
+
+	if(!map) {
+		return -1;
+	}
+
+	// A run never contains more than one piece of each page
+	hal_disk_iovec_t *iov = (hal_disk_iovec_t *) kmalloc(sizeof(hal_disk_iovec_t) * count);
+
+	if(!iov) {
+		return -1;
+	}
+
+	/*
+	 * Read whole sectors: pages are sector aligned, so the rest of the last
+	 * sector still falls into the last page.
+	 */
+	unsigned long long total = ((length + (bps - 1)) / bps) * bps;
+	unsigned long long done = 0;
+
+	while(done < total) {
+		unsigned long long pos = offset + done;
+
+		unsigned int cluster, run;
+		unsigned int cluster_offset = pos % cluster_size;
+
+		if(!this->clusterForFileCluster(map, pos / cluster_size, &cluster, &run)) {
+			#if PRINT_ERROR
+			KERROR("Cluster chain of '%s' ends early", file->i.name);
+			#endif
+
+			goto done;
+		}
+
+		unsigned long long run_bytes = (run * cluster_size) - cluster_offset;
+
+		if(run_bytes > (total - done)) {
+			run_bytes = total - done;
+		}
+
+		// Split the run at page boundaries
+		unsigned int iovcnt = 0;
+
+		for(unsigned long long filled = 0; filled < run_bytes; ) {
+			unsigned long long at = done + filled;
+			unsigned int in = at % HAL_PAGECACHE_PAGE_SIZE;
+
+			size_t piece = HAL_PAGECACHE_PAGE_SIZE - in;
+
+			if(piece > (run_bytes - filled)) {
+				piece = run_bytes - filled;
+			}
+
+			iov[iovcnt].buffer = ((uint8_t *) pages[at / HAL_PAGECACHE_PAGE_SIZE]) + in;
+			iov[iovcnt].phys = 0;
+			iov[iovcnt++].length = piece;
+
+			filled += piece;
+		}
+
+		unsigned int start = ((cluster - 2) * bpb.sectors_per_cluster) + first_data_sector + (cluster_offset / bps);
+
+		if(!this->hal_fs::read_sectors_v(start, iov, iovcnt, &err)) {
+			#if PRINT_ERROR
+			KERROR("Error reading pages: %u", err);
+			#endif
+
+			goto done;
+		}
+
+		done += run_bytes;
+	}
+
+	done: ;
+	kfree(iov);
+
+	if(!done) {
+		return -1;
+	}
+
+	return (done > length) ? length : done;
+}
+
+/*
+ * Finds the sectors holding the file's data at offset, and how many bytes
+ * from there on are stored contiguously, using the file's extent map. The
+ * run may end past the end of the file, where its last cluster does.
+ *
+ * @return 0 on success, -1 if the offset isn't inside the file's clusters.
+ */
+int fs_fat32::map_data(fs_file_t *file, unsigned long long offset, hal_disk_t **disk, uint64_t *lba, unsigned long long *length) {
+	unsigned int bps = bpb.bytes_per_sector;
+
+	if(offset >= file->size || (offset % bps)) {
+		return -1;
+	}
+
+	fat32_extent_map_t *map = this->extentMapForFile(file);
+
+	if(!map) {
+		return -1;
+	}
+
+	unsigned int cluster, run;
+	unsigned int cluster_offset = offset % cluster_size;
+
+	if(!this->clusterForFileCluster(map, offset / cluster_size, &cluster, &run)) {
+		return -1;
+	}
+
+	unsigned int start = ((cluster - 2) * bpb.sectors_per_cluster) + first_data_sector + (cluster_offset / bps);
+
+	*disk = this->disk;
+	*lba = this->partition->lba_start + start;
+	*length = ((unsigned long long) run * cluster_size) - cluster_offset;
+
+	return 0;
+}
+
+/*
+ * Writes length bytes of a page from the page cache into the file at offset.
+ * Clusters are allocated only now, as the page is written back.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+int fs_fat32::write_page(fs_file_t *file, unsigned long long offset, void *page, size_t length) {
+	unsigned int err = 0;
+
+	// FAT can't store files of 4G or more
+	if((offset + length) > FAT32_MAX_FILE_SIZE) {
+		return -1;
+	}
+
+	if(!this->writeData(file, offset, page, length, &err)) {
+		#if PRINT_ERROR
+		KERROR("Error writing page at 0x%08X: %u", (unsigned int) offset, err);
+		#endif
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads up to bytes bytes of the file, starting at offset, into buffer.
+ *
+ * @return Number of bytes read (0 at the end of the file), or -1 on error.
+ */
+long long fs_fat32::readData(fs_file_t *fileObj, unsigned long long offset, size_t bytes, void *buffer) {
+	unsigned int err = 0;
+
+	// Is there any data available? (not EOF)
+	if(offset >= fileObj->size) {
+		return 0;
+	}
+
+	// Get the number of clusters into the file to read
+	unsigned int clusters_in = offset / cluster_size;
+	unsigned int cluster_offset = offset % cluster_size;
+
+	// Get the file's extent map, so offsets can be mapped without the FAT
+	fat32_extent_map_t *map = this->extentMapForFile(fileObj);
+
+	if(!map) {
+		return -1;
+	}
+
+	#if DEBUG_READ
+	KDEBUG("File size %u, %u clusters in %u extents", (unsigned int) fileObj->size, map->numClusters, map->numExtents);
+	#endif
+
+	// Calculate how many bytes we can actually read
+	size_t bytes_to_read = 0;
+	long long bytes_read = 0;
+
+	// Reading more than the file has?
+	if(fileObj->size - offset < bytes) {
+		bytes_to_read = fileObj->size - offset;
+	} else {
+		bytes_to_read = bytes;
+	}
+
+	// Pointer to the current location in the outbuf
+	uint8_t *outbuf = (uint8_t *) buffer;
+
+	/*
+	 * Begin the process of reading. Each run of consecutive clusters is read
+	 * with a single request straight into the caller's buffer; only partial
+	 * sectors at either end go through a bounce buffer.
+	 */
+	for(unsigned int c = clusters_in; bytes_to_read; ) {
+		unsigned int cluster, run;
+
+		// Chain is shorter than the file size indicates
+		if(!this->clusterForFileCluster(map, c, &cluster, &run)) {
+			#if PRINT_ERROR
+			KERROR("Cluster chain ends at %u, file is %u bytes", c, (unsigned int) fileObj->size);
+			#endif
+
+			goto done;
+		}
+
+		// Number of bytes to read from this run
+		size_t run_bytes = (run * cluster_size) - cluster_offset;
+
+		if(run_bytes > bytes_to_read) {
+			run_bytes = bytes_to_read;
+		}
+
+		#if DEBUG_READ
+		KDEBUG("Cluster %u: 0x%08X (run of %u), %u bytes left", c, cluster, run, (unsigned int) bytes_to_read);
+		#endif
+
+		if(!this->readClusterRange(cluster, cluster_offset, run_bytes, outbuf, &err)) {
+			#if PRINT_ERROR
+			KERROR("Cluster read error: %u", err);
+			#endif
+
+			goto done;
+		}
+
+		// Account for the amount of bytes read
+		bytes_to_read -= run_bytes;
+		bytes_read += run_bytes;
+		outbuf += run_bytes;
+
+		// Subsequent runs are read from the start of their first cluster
+		c += run;
+		cluster_offset = 0;
+	}
+
+	done: ;
+	#if DEBUG_READ
+	KDEBUG("Total bytes read: %u", (unsigned int) bytes_read);
+	#endif
+
+	return bytes_read;
+}
+
+/*
+ * Reserves clusters for the first length bytes of the file, so that they're
+ * laid out contiguously ahead of time and later writes don't allocate. The
+ * size of the file doesn't change, and the clusters stay part of the chain
+ * until the file is truncated.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+int fs_fat32::allocate_handle(fs_file_handle_t *h, unsigned long long length) {
+	fs_file_t *fileObj = (fs_file_t *) hal_handle_get_object(h->file);
+
+	// Verify the file object is still valid (its handle may be stale)
+	if(!fileObj || fileObj->i.type != kFSItemTypeFile) {
+		h->isOpen = false;
+		return -1;
+	}
+
+	if(!h->isOpen || (h->mode & kFSFileModeReadOnly) || length > FAT32_MAX_FILE_SIZE) {
+		return -1;
+	}
+
+	fat32_extent_map_t *map = this->extentMapForFile(fileObj);
+
+	if(!map) {
+		return -1;
+	}
+
+	unsigned int needed = (length + (cluster_size - 1)) / cluster_size;
+
+	if(needed > map->numClusters && !this->extendFile(fileObj, needed - map->numClusters)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes length bytes of data into the file, starting at offset. Clusters are
+ * allocated for any part of the range past the end of the file's chain, and a
+ * gap between the end of the file and the offset is filled with zeroes.
+ */
+bool fs_fat32::writeData(fs_file_t *file, unsigned long long offset, void *data, size_t length, unsigned int *error) {
+	// Fill the gap between the end of the file and the write
+	while(file->size < offset) {
+		unsigned long long fill = offset - file->size;
+
+		if(fill > cluster_size) {
+			fill = cluster_size;
+		}
+
+		memclr(clusterBuffer, fill);
+
+		if(!this->writeData(file, file->size, clusterBuffer, fill, error)) {
+			return false;
+		}
+	}
+
+	fat32_extent_map_t *map = this->extentMapForFile(file);
+
+	if(!map) {
+		return false;
+	}
+
+	// Allocate all missing clusters at once, so they're (ideally) one run
+	unsigned int needed = (offset + length + (cluster_size - 1)) / cluster_size;
+
+	if(needed > map->numClusters) {
+		unsigned int missing = needed - map->numClusters;
+
+		if(!(map = this->extendFile(file, missing))) {
+			#if PRINT_ERROR
+			KERROR("Couldn't allocate %u clusters", missing);
+			#endif
+
+			return false;
+		}
+	}
+
+	// Write each run of consecutive clusters with a single request
+	unsigned int c = offset / cluster_size;
+	unsigned int cluster_offset = offset % cluster_size;
+
+	uint8_t *in = (uint8_t *) data;
+	size_t left = length;
+
+	while(left) {
+		unsigned int cluster, run;
+
+		if(!this->clusterForFileCluster(map, c, &cluster, &run)) {
+			return false;
+		}
+
+		size_t run_bytes = (run * cluster_size) - cluster_offset;
+
+		if(run_bytes > left) {
+			run_bytes = left;
+		}
+
+		// Bytes of the run (from its first cluster) that hold file data
+		unsigned long long runStart = (unsigned long long) c * cluster_size;
+		unsigned long long valid = (file->size > runStart) ? (file->size - runStart) : 0;
 
-	return chain;
+		if(!this->writeClusterRange(cluster, cluster_offset, run_bytes, in, valid, error)) {
+			return false;
+		}
 
-	// Handle an error condition
-	error: ;
-	kfree(chain);
-	return NULL;
-}
+		left -= run_bytes;
+		in += run_bytes;
 
-/*
- * Reads the specified cluster.
- */
-void *fs_fat32::readCluster(unsigned int cluster, void *buffer, unsigned int *error) {
-	unsigned int sector = ((cluster - 2) * bpb.sectors_per_cluster) + first_data_sector;
+		c += run;
+		cluster_offset = 0;
+	}
 
-	if(!this->hal_fs::read_sectors(sector, bpb.sectors_per_cluster, buffer, error)) {
-		return NULL;
+	// Grow the file, if the write went past its end
+	if((offset + length) > file->size) {
+		file->size = offset + length;
 	}
 
-	return buffer;
+	this->markDirentDirty(file);
+	return true;
 }
 
 /*
- * Reads the specified cluster.
+ * Fills in a chunk of the free cluster bitmap from the FAT. FAT sectors that
+ * are cached take precedence over what's on disk, since they may have been
+ * modified.
  */
-void *fs_fat32::writeCluster(unsigned int cluster, void *buffer, unsigned int *error) {
-	unsigned int sector = ((cluster - 2) * bpb.sectors_per_cluster) + first_data_sector;
+bool fs_fat32::loadBitmapChunk(unsigned int chunk) {
+	unsigned int err = 0;
+	unsigned int entriesPerSector = bpb.bytes_per_sector / 4;
 
-	if(!this->hal_fs::write_sectors(sector, bpb.sectors_per_cluster, buffer, error)) {
-		return NULL;
+	// Clusters covered by this chunk
+	unsigned int firstCluster = chunk * FAT32_BITMAP_CHUNK;
+	unsigned int numClusters = (num_data_clusters + 2) - firstCluster;
+
+	if(numClusters > FAT32_BITMAP_CHUNK) {
+		numClusters = FAT32_BITMAP_CHUNK;
 	}
 
-	return buffer;
-}
+	// Read the FAT sectors for the chunk with a single request
+	unsigned int firstSector = firstCluster / entriesPerSector;
+	unsigned int numSectors = (numClusters + (entriesPerSector - 1)) / entriesPerSector;
 
-/*
- * Gets a pointer to a VFS file object
- */
-fs_file_handle_t* fs_fat32::get_file_handle(char *name, fs_file_open_mode_t mode) {
-	searchAgain: ;
-	// Store address of final file
-	fs_file_t *file = NULL;
-	fs_directory_t *dir = NULL;
-	char *fileName = NULL;
+	unsigned int active = (bpb.extended_flags & 0x80) ? (bpb.extended_flags & 0x0F) : 0;
+	unsigned int lba = bpb.reserved_sector_count + (active * bpb.table_size_32) + firstSector;
 
-	// Allocate memory for directory
-	char *dirName = (char *) kmalloc(strlen(name));
-	unsigned int dirNameOffset = 0;
+	uint32_t *buffer = (uint32_t *) kmalloc(numSectors * bpb.bytes_per_sector);
 
-	dirName[dirNameOffset++] = '/';
+	if(!buffer) {
+		return false;
+	}
 
-	// Separate path string
-	list_t *components = this->split_path(name);
+	if(!this->hal_fs::read_sectors(lba, numSectors, buffer, &err)) {
+		#if PRINT_ERROR
+		KERROR("Error reading FAT sectors %u-%u: %u", lba, lba + numSectors - 1, err);
+		#endif
 
-	// If only one element exists, it's at the root level
-	if(components->num_entries > 1) {
-		// Get the base directory name
-		for(unsigned int i = 0; i < components->num_entries-1; i++) {
-			char *component = (char *) list_get(components, i);
+		kfree(buffer);
+		return false;
+	}
 
-			strcat(dirName, component);
-			dirNameOffset += strlen(component);
-			dirName[dirNameOffset++] = '/';
-		}
+	for(unsigned int s = 0; s < numSectors; s++) {
+		uint32_t *entries = buffer + (s * entriesPerSector);
 
-		fileName = (char *) list_get(components, components->num_entries - 1);
+		// Use the cached copy of the sector, if there is one
+		for(unsigned int i = 0; i < FAT32_FAT_CACHE_SIZE; i++) {
+			if(fatCache[i].sector == firstSector + s) {
+				entries = fatCache[i].data;
+				break;
+			}
+		}
 
-		// Try to get directory
-		dir = this->list_directory(dirName, true);
-	} else {
-		fileName = (char *) list_get(components, 0);
-		dir = root_directory;
-	}
+		for(unsigned int e = 0; e < entriesPerSector; e++) {
+			unsigned int cluster = ((firstSector + s) * entriesPerSector) + e;
 
-	// Directory found, search for file.
-	if(dir) {
-		// Locate the child
-		for(unsigned int i = 0; i < dir->children->num_entries; i++) {
-			file = (fs_file_t *) list_get(dir->children, i);
-
-			// Ignore non-directory files
-			if(file->i.type == kFSItemTypeFile) {
-				if(!strcasecmp(fileName, file->i.name)) {
-					goto fileFound;
-				}
+			if(cluster < firstCluster) {
+				continue;
+			} else if(cluster >= firstCluster + numClusters) {
+				break;
 			}
-		}
 
-		// We need to create the file if requested and it didn't exist
-		if(mode & kFSFileModeCreate) {
-			int crtErr = 0;
-			if(!(crtErr = this->createEmptyFile(dir, fileName))) {
-				goto searchAgain;
+			// The first two clusters are reserved
+			if(cluster < 2 || (entries[e] & FAT32_MASK)) {
+				clusterBitmap[cluster / 32] |= (1 << (cluster & 31));
 			} else {
-				#if PRINT_ERROR
-				KERROR("Could not create %s: %i", name, crtErr);
-				#endif
+				clusterBitmap[cluster / 32] &= ~(1 << (cluster & 31));
 			}
 		}
-
-		goto notFound;
-	} else {
-		goto notFound;
 	}
 
-	// File not found
-	notFound: ;
-	#if DEBUG_FILE_NOT_FOUND
-	KERROR("Couldn't find '%s' in dir '%s'", fileName, dirName);
-	#endif
+	kfree(buffer);
 
-	kfree(dirName);
-	list_destroy(components, true);
+	clusterBitmapLoaded[chunk] = 1;
 
-	return NULL;
+	// Once the entire FAT was seen, the free cluster count is exact
+	if(++clusterBitmapChunksLoaded == clusterBitmapChunks) {
+		freeClusterCount = 0;
 
-	// File found
-	fileFound: ;
+		for(unsigned int c = 2; c < (num_data_clusters + 2); c++) {
+			if(!(clusterBitmap[c / 32] & (1 << (c & 31)))) {
+				freeClusterCount++;
+			}
+		}
+	}
 
-	// Open handles counter
-	dir->handles_open++;
-	file->handles_open++;
+	return true;
+}
 
-	// Clean up
-	kfree(dirName);
-	list_destroy(components, true);
+/*
+ * Checks whether a cluster is in use, loading the bitmap chunk that covers it
+ * if needed. Without a bitmap, the cluster's FAT entry is read instead.
+ */
+bool fs_fat32::clusterInUse(unsigned int cluster, bool *inUse) {
+	if(!clusterBitmap) {
+		unsigned int entry;
 
-	// Open a file handle object
-	fs_file_handle_t *handle = (fs_file_handle_t *) kmalloc(sizeof(fs_file_handle_t));
+		if(!this->readFatEntry(cluster, &entry)) {
+			return false;
+		}
 
-	handle->file = file->i.handle;
-	handle->can_seek = true;
-	handle->position = 0;
+		*inUse = (cluster < 2 || (entry & FAT32_MASK));
+		return true;
+	}
 
-	handle->isOpen = true;
+	unsigned int chunk = cluster / FAT32_BITMAP_CHUNK;
 
-	// Increment file's cache reference
-	file->i.cache_accesses++;
+	if(!clusterBitmapLoaded[chunk] && !this->loadBitmapChunk(chunk)) {
+		return false;
+	}
 
-	return handle;
+	*inUse = (clusterBitmap[cluster / 32] & (1 << (cluster & 31)));
+	return true;
 }
 
 /*
- * Closes a file handle that was previously opened. This will cause caches to be
- * flushed.
+ * Allocates up to count free clusters, and links them into a chain that is
+ * terminated with an end-of-chain marker. The search starts where the last
+ * allocation ended (next fit), and looks for a run of free clusters that is
+ * long enough; if there is none, the longest run found is used instead.
+ *
+ * If goal is non-zero, the free clusters starting at it are used if there are
+ * any, even if they're fewer than requested: this is used to extend an existing
+ * chain in place.
+ *
+ * Returns the first cluster of the chain, and writes the number of clusters in
+ * it into allocated. Returns 0 if the volume is full.
  */
-void fs_fat32::close_file_handle(fs_file_handle_t *handle) {
-	// Don't close already closed handles
-	if(!handle->isOpen) return;
+unsigned int fs_fat32::allocateClusters(unsigned int count, unsigned int goal, unsigned int *allocated) {
+	unsigned int end = num_data_clusters + 2;
+	unsigned int start = fs_info.free_cluster_search_start;
 
-	// Mark as closed
-	handle->isOpen = false;
+	unsigned int bestStart = 0, bestLength = 0;
+	unsigned int runStart = 0, runLength = 0;
 
-	// Decrement file handle counts
-	fs_file_t *file = (fs_file_t *) hal_handle_get_object(handle->file);
-	file->handles_open--;
+	unsigned int cluster, length;
+	bool wrapped = false;
 
-	file->parent->handles_open--;
-}
+	// Try to continue from the goal cluster first
+	if(goal >= 2 && goal < end) {
+		for(cluster = goal; cluster < end && bestLength < count; cluster++) {
+			bool inUse;
 
-/*
- * Performs a read operation from the file this file handle is opened on,
- * reading num_bytes bytes into buffer, starting at the current location of
- * the file handle.
- *
- * This function returns between zero and LONG_LONG_MAX 
- */
-long long fs_fat32::read_handle(fs_file_handle_t *h, size_t bytes, void *buffer) {
-	unsigned int err = 0;
+			if(!this->clusterInUse(cluster, &inUse)) {
+				return 0;
+			} else if(inUse) {
+				break;
+			}
 
-	// Get the file object associated with it
-	fs_file_t *fileObj = (fs_file_t *) hal_handle_get_object(h->file);
+			bestLength++;
+		}
 
-	// Verify the file object is still valid
-	if(fileObj->i.type != kFSItemTypeFile) {
-		h->isOpen = false;
-		return -1;
+		if(bestLength) {
+			bestStart = goal;
+			goto allocate;
+		}
 	}
 
-	// Is the file open?
-	if(!h->isOpen) {
-		return -1;
+	if(start < 2 || start >= end) {
+		start = 2;
 	}
 
-	// Is there any data available? (not EOF)
-	if(h->position == fileObj->size) {
-		return 0;
-	}
+	cluster = start;
 
-	// Determine starting cluster for this file (from userData)
-	unsigned int start_cluster = (fileObj->i.userData & FAT32_MASK);
+	while(true) {
+		bool inUse;
 
-	// Get the number of clusters into the file to read
-	unsigned int clusters_in = h->position / cluster_size;
-	unsigned int cluster_offset = h->position % cluster_size;
+		if(!this->clusterInUse(cluster, &inUse)) {
+			return 0;
+		}
 
-	// Read cluster chain
-	unsigned int *chain = this->clusterChainForCluster(start_cluster);
-	unsigned int chain_len = (fileObj->size + (cluster_size - 1)) / cluster_size;
+		if(clusterBitmap && !runLength && !(cluster & 31) && clusterBitmap[cluster / 32] == 0xFFFFFFFF) {
+			// Skip over groups of 32 clusters that are all in use
+			cluster += 32;
+		} else {
+			if(!inUse) {
+				if(!runLength++) {
+					runStart = cluster;
+				}
 
-	#if DEBUG_READ
-	KDEBUG("File size %u, chain %u entries", (unsigned int) fileObj->size, chain_len);
-	#endif
+				// Found a run that's long enough
+				if(runLength == count) {
+					break;
+				}
+			} else {
+				if(runLength > bestLength) {
+					bestStart = runStart;
+					bestLength = runLength;
+				}
 
-	// Calculate how many bytes we can actually read
-	size_t bytes_to_read = 0;
-	long long bytes_read = 0;
+				runLength = 0;
+			}
 
-	// Reading more than the file has?
-	if(fileObj->size - h->position < bytes) {
-		bytes_to_read = fileObj->size - h->position;
-	} else {
-		bytes_to_read = bytes;
-	}
+			cluster++;
+		}
 
-	// Get number of clusters to read
-	unsigned int clusters_to_read = (bytes_to_read + (cluster_size - 1)) / cluster_size;
+		// Runs don't wrap around the end of the volume
+		if(cluster >= end) {
+			if(runLength > bestLength) {
+				bestStart = runStart;
+				bestLength = runLength;
+			}
 
-	// Pointer to the current location in the outbuf
-	uint8_t *outbuf = (uint8_t *) buffer;
+			runLength = 0;
 
-	// Begin the process of reading
-	for(unsigned int c = cluster_offset; c < clusters_to_read + cluster_offset; c++) {
-		// Read cluster
-		unsigned int cluster = chain[c];
+			cluster = 2;
+			wrapped = true;
+		}
 
-		#if DEBUG_READ
-		KDEBUG("Cluster %u: 0x%08X, %u bytes left", c, cluster, (unsigned int) bytes_to_read);
-		#endif
+		if(wrapped && cluster >= start) {
+			break;
+		}
+	}
 
-		if(!this->readCluster(cluster, clusterBuffer, &err)) {
-			#if PRINT_ERROR
-			KERROR("Cluster read error: %u", err);
-			#endif
+	if(runLength > bestLength) {
+		bestStart = runStart;
+		bestLength = runLength;
+	}
 
-			goto done;
-		}
+	if(!bestLength) {
+		#if PRINT_ERROR
+		KERROR("Couldn't find free cluster");
+		#endif
 
-		// We needn't read any more clusters
-		if(bytes_to_read <= cluster_size) {
-			#if DEBUG_READ
-			KDEBUG("Read %u bytes", (unsigned int) bytes_to_read);
-			#endif
+		return 0;
+	}
 
-			bytes_read += bytes_to_read;
-			memcpy(outbuf, clusterBuffer, bytes_to_read);
+	// Mark the clusters as used, and link them
+	allocate: ;
+	length = (bestLength < count) ? bestLength : count;
 
-			bytes_to_read = 0;
-			goto done;
-		} else {
-			#if DEBUG_READ
-			KDEBUG("Read %u bytes", (unsigned int) cluster_size);
-			#endif
+	for(unsigned int i = 0; i < length; i++) {
+		unsigned int c = bestStart + i;
 
-			// We read an entire cluster
-			bytes_to_read -= cluster_size;
-			memcpy(outbuf, clusterBuffer, cluster_size);	
+		if(!this->writeFatEntry(c, (i == length - 1) ? FAT32_END_CHAIN : (c + 1))) {
+			return 0;
+		}
 
-			// Account for the amount of bytes read
-			bytes_read += cluster_size;
-			outbuf += cluster_size;
+		if(clusterBitmap) {
+			clusterBitmap[c / 32] |= (1 << (c & 31));
 		}
 	}
 
-	done: ;
-	#if DEBUG_READ
-	KDEBUG("Total bytes read: %u", (unsigned int) bytes_read);
-	#endif
+	freeClusterCount -= length;
 
-	// Adjust file pointer
-	h->position += bytes_read;
+	fs_info.free_cluster_search_start = bestStart + length;
+	fsInfoDirty = true;
 
-	return bytes_read;
+	*allocated = length;
+	return bestStart;
 }
 
 /*
- * Finds the a single free cluster.
+ * Marks every cluster of the chain starting at cluster as free.
  */
-unsigned int fs_fat32::findFreeCluster() {
-	unsigned int err = 0;
-
-	// Begin search at the offset in the FSInfo structure
-	unsigned int currentCluster = fs_info.free_cluster_search_start;
-	fat32_secoff_t off = this->fatEntryOffsetForCluster(currentCluster);
+bool fs_fat32::freeClusterChain(unsigned int cluster) {
+	unsigned int freed = 0;
 
-	unsigned int currentFATSector = off.sector;
-	unsigned int currentFATOffset = off.offset;
+	while(cluster >= 2 && cluster < FAT32_BAD_CLUSTER) {
+		// Guard against corrupted chains that loop
+		if(freed > num_data_clusters || cluster >= (num_data_clusters + 2)) {
+			#if PRINT_ERROR
+			KERROR("Corrupted cluster chain at cluster %u", cluster);
+			#endif
 
-	// Read the initial sector
-	if(!this->hal_fs::read_sectors(currentFATSector, 1, freeClusterBuffer, &err)) {
-		#if PRINT_ERROR
-		KERROR("%s: Error reading FAT: %u", __PRETTY_FUNCTION__, err);
-		#endif
+			return false;
+		}
 
-		return 0;
-	}
+		unsigned int next;
 
-	while(true) {
-		// Crossed the cluster boundary?
-		if(currentFATOffset++ > (cluster_size / 4)) {
-			currentFATSector++;
-			currentFATOffset = 0;
-
-			// Check we're not past the end of the FAT
-			if(currentFATSector >= (bpb.table_count * bpb.table_size_32)) {
-				goto error;
-			} else {
-				// Read the new FAT cluster otherwise
-				if(!this->hal_fs::read_sectors(currentFATSector, 1, freeClusterBuffer, &err)) {
-					#if PRINT_ERROR
-					KERROR("%s: Error reading FAT: %u", __PRETTY_FUNCTION__, err);
-					#endif
+		if(!this->readFatEntry(cluster, &next) || !this->writeFatEntry(cluster, 0)) {
+			return false;
+		}
 
-					return 0;
-				}
-			}
+		// Chunks that aren't loaded yet pick up the change from the FAT cache
+		if(clusterBitmap && clusterBitmapLoaded[cluster / FAT32_BITMAP_CHUNK]) {
+			clusterBitmap[cluster / 32] &= ~(1 << (cluster & 31));
 		}
 
-		// Is this cluster free?
-		if(!(freeClusterBuffer[currentFATOffset] & FAT32_MASK)) {
-			currentCluster = ((currentFATSector - bpb.reserved_sector_count) * (cluster_size / 4)) + currentFATOffset;
+		freeClusterCount++;
+		freed++;
 
-			return currentCluster;
-		}
+		cluster = next & FAT32_MASK;
 	}
 
-	error: ;
-	#if PRINT_ERROR
-	KERROR("Couldn't find free cluster");
-	#endif
-
-	return 0;
+	fsInfoDirty = true;
+	return true;
 }
 
 /*
@@ -1016,23 +2701,21 @@ unsigned int fs_fat32::findFreeCluster() {
  * the function to recognise the end of the chain.
  */
 int fs_fat32::update_fat(unsigned int cluster, unsigned int nextCluster) {
-	unsigned int err = 0;
+	unsigned int entry;
 
 	// Read first_cluster's FAT entry
-	fat32_secoff_t off = this->fatEntryOffsetForCluster(cluster);
-	
-	if(!this->hal_fs::read_sectors(off.sector, 1, fatBuffer, &err)) {
+	if(!this->readFatEntry(cluster, &entry)) {
 		#if PRINT_ERROR
-		KERROR("%s: Error reading FAT 1: %u (sector %u, cluster 0x%08X)", __PRETTY_FUNCTION__, err, off.sector, cluster);
+		KERROR("%s: Error reading FAT entry for cluster 0x%08X", __PRETTY_FUNCTION__, cluster);
 		#endif
 		return -2;
 	}
 
 	// Is it an end-of-file marker or zero?
-	if((fatBuffer[off.offset] & FAT32_MASK) < FAT32_END_CHAIN && (fatBuffer[off.offset] & FAT32_MASK)) {
+	if((entry & FAT32_MASK) < FAT32_END_CHAIN && (entry & FAT32_MASK)) {
 		#if PRINT_ERROR
 		KERROR("%u is not the end of a chain nor 0, cannot append cluster %u (Read 0x%08X)", 
-			cluster, (unsigned int) nextCluster, (unsigned int) fatBuffer[off.offset]);
+			cluster, (unsigned int) nextCluster, (unsigned int) entry);
 		#endif
 
 		return -3;
@@ -1040,41 +2723,26 @@ int fs_fat32::update_fat(unsigned int cluster, unsigned int nextCluster) {
 
 	// Next cluster is specified, so don't terminate the chain
 	if(nextCluster) {
-		// Process first chain entry
-		unsigned int chain_off = 0;
-		fatBuffer[off.offset] = nextCluster;
-
-		// Write back to device
-		if(!this->hal_fs::write_sectors(off.sector, 1, fatBuffer, &err)) {
-			#if PRINT_ERROR
-			KERROR("%s: Error writing FAT 1: %u (sector %u)", __PRETTY_FUNCTION__, err, off.sector);
-			#endif
+		if(!this->writeFatEntry(cluster, nextCluster)) {
 			return -2;
 		}
 
 		// Terminate cluster chain
-		this->update_fat(nextCluster, 0);
+		return this->update_fat(nextCluster, 0);
 	} else {
 		// Just terminate the chain if 0 is passed in
-		fatBuffer[off.offset] = FAT32_END_CHAIN;
-
-		// Write back to device
-		if(!this->hal_fs::write_sectors(off.sector, 1, fatBuffer, &err)) {
-			#if PRINT_ERROR
-			KERROR("%s: Error writing FAT 3: %u (sector %u)", __PRETTY_FUNCTION__, err, off.sector);
-			#endif
+		if(!this->writeFatEntry(cluster, FAT32_END_CHAIN)) {
 			return -2;
 		}
 	}
 
-
 	return 0;
 }
 
 /*
- * Creates an empty file in the specified directory. A single cluster of data
- * is reserved, but zeroed, and a directory entry (and, if required, LFN
- * entries) is created.
+ * Creates an empty file in the specified directory. Only a directory entry
+ * (and, if required, LFN entries) is created: the file has no clusters until
+ * data is written to it.
  */
 int fs_fat32::createEmptyFile(fs_directory_t *dir, char *in_name) {
 	KDEBUG("Creating file '%s'", in_name);
@@ -1132,7 +2800,7 @@ int fs_fat32::createEmptyFile(fs_directory_t *dir, char *in_name) {
 	// Find the clusters this directory occupies
 	unsigned int directory_cluster = dir->i.userData & FAT32_MASK;
 	
-	unsigned int *dir_chain = this->clusterChainForCluster(bpb.root_cluster & FAT32_MASK);
+	unsigned int *dir_chain = this->clusterChainForCluster(directory_cluster);
 	unsigned int dir_chain_len = 0;
 
 	while(dir_chain[dir_chain_len] != FAT32_END_CHAIN) {
@@ -1277,12 +2945,8 @@ int fs_fat32::createEmptyFile(fs_directory_t *dir, char *in_name) {
 	extendDirectory: ;
 
 	needsChainFix = true;
-	dirBuf = (fat_dirent_t *) krealloc(dirBuf, (dir_chain_len++ * cluster_size) + 512);
-
-	start_dirent_offset = dirBufEntries - 1;
-	start_dirent = &dirBuf[start_dirent_offset];
-
-	dirBufEntries += (cluster_size / sizeof(fat_dirent_t));
+	dir_chain_len++;
+	dirBuf = (fat_dirent_t *) krealloc(dirBuf, (dir_chain_len * cluster_size) + 512);
 
 	if(!dirBuf) {
 		#if PRINT_ERROR
@@ -1296,8 +2960,18 @@ int fs_fat32::createEmptyFile(fs_directory_t *dir, char *in_name) {
 		return -255;
 	}
 
-	// Find an empty cluster
-	if(!(dirChainAppend = this->findFreeCluster())) {
+	// The new cluster of the directory starts out empty
+	memclr(((uint8_t *) dirBuf) + ((dir_chain_len - 1) * cluster_size), cluster_size);
+
+	start_dirent_offset = dirBufEntries - 1;
+	start_dirent = &dirBuf[start_dirent_offset];
+
+	dirBufEntries += (cluster_size / sizeof(fat_dirent_t));
+
+	// Find an empty cluster, preferably right after the directory's last one
+	unsigned int allocated;
+
+	if(!(dirChainAppend = this->allocateClusters(1, dir_chain[dir_chain_len - 2] + 1, &allocated))) {
 		#if PRINT_ERROR
 		KERROR("%s: Could not frind free clusters", __PRETTY_FUNCTION__);
 		#endif
@@ -1309,8 +2983,6 @@ int fs_fat32::createEmptyFile(fs_directory_t *dir, char *in_name) {
 		return -6;
 	}
 
-	fs_info.last_known_free_sec_cnt--;
-
 	#if DEBUG_FILE_CREATE
 	KDEBUG("Extended directory to cluster %u", dirChainAppend);
 	#endif
@@ -1342,7 +3014,8 @@ int fs_fat32::createEmptyFile(fs_directory_t *dir, char *in_name) {
 	}
 
 	// Re-read chain
-	dir_chain = this->clusterChainForCluster(bpb.root_cluster & FAT32_MASK);
+	kfree(dir_chain);
+	dir_chain = this->clusterChainForCluster(directory_cluster);
 
 	while(dir_chain[dir_chain_len] != FAT32_END_CHAIN) {
 		dir_chain_len++;
@@ -1452,67 +3125,25 @@ int fs_fat32::createEmptyFile(fs_directory_t *dir, char *in_name) {
 		kfree(shortName);
 	}
 
-	/*
-	 * This is kind of shitty, since FAT does not actually support files whose
-	 * size is zero, so we instead just give it the size of a cluster, which
-	 * we previously allocated.
-	 *
-	 * NOTE: This is kind of a hack since the VFS structs show this file's size
-	 * as zero bytes. Hehe.
-	 */
-	start_dirent[shortNameOffset].filesize = cluster_size;
-
-	// Allocate a cluster
-	unsigned int fileCluster;
-	if(!(fileCluster = this->findFreeCluster())) {
-		#if PRINT_ERROR
-		KERROR("%s: Could not frind free clusters", __PRETTY_FUNCTION__);
-		#endif
-
-		kfree(dirBuf);
-		kfree(dir_chain);
-		kfree(name);
-
-		return -6;
-	}
-
-	fs_info.last_known_free_sec_cnt--;
-
-	// Mark that cluster as being the only one in the chain.
-	if((err = this->update_fat(fileCluster, 0))) {
-		#if PRINT_ERROR
-		KERROR("%s: Error updating FAT: %i", __PRETTY_FUNCTION__, (int) err);
-		#endif
-
-		kfree(dirBuf);
-		kfree(dir_chain);
-		kfree(name);
-
-		return -7;
-	}
+	// Empty files have no clusters
+	start_dirent[shortNameOffset].filesize = 0;
 
-	start_dirent[shortNameOffset].cluster_low = fileCluster & 0x0000FFFF;
-	start_dirent[shortNameOffset].cluster_high = (fileCluster & 0xFFFF0000) >> 16;
+	start_dirent[shortNameOffset].cluster_low = 0;
+	start_dirent[shortNameOffset].cluster_high = 0;
 
 	start_dirent[shortNameOffset].attributes = FAT_ATTR_ARCHIVE;
 
 	// Get MSDOS-format timestamps
-	time_components_t currentTime = this->hal_fs::get_current_fs_time();
-	currentTime.year -= 1980;
+	uint16_t date, time;
+	uint8_t tenths;
 
-	uint16_t date = (currentTime.day & 0x1F);
-	date |= (currentTime.month & 0x1F) << 5;
-	date |= (currentTime.year & 0x7F) << 9;
-
-	uint16_t time = (currentTime.second >> 1) & 0x1F;
-	time |= (currentTime.minute & 0x3F) << 5;
-	time |= (currentTime.hour & 0x1F) << 11;
+	this->currentFatTimestamp(&date, &time, &tenths);
 
 	// Set them on the directory entry
 	start_dirent[shortNameOffset].created_date = date;
 	start_dirent[shortNameOffset].created_time = time;
 
-	start_dirent[shortNameOffset].time_created_seconds = (currentTime.second & 1) * 100;
+	start_dirent[shortNameOffset].time_created_seconds = tenths;
 
 	start_dirent[shortNameOffset].write_date = date;
 	start_dirent[shortNameOffset].write_time = time;
@@ -1591,7 +3222,10 @@ int fs_fat32::createEmptyFile(fs_directory_t *dir, char *in_name) {
 				}
 			}
 		}
+	}
 
+	// LFN entries may span clusters, and a new cluster must be written whole
+	if(lfnNeeded || needsChainFix) {
 		// Write back the entire directory buffer
 		for(unsigned int c = 0; c < dir_chain_len; c++) {
 			// Write back to device
@@ -1636,34 +3270,30 @@ int fs_fat32::createEmptyFile(fs_directory_t *dir, char *in_name) {
 	file->i.time_written = this->convert_timestamp(start_dirent[shortNameOffset].write_date, start_dirent[shortNameOffset].write_time, 0);
 	file->i.time_created = this->convert_timestamp(start_dirent[shortNameOffset].accessed_date, 0, 0);
 
-	/*
-	 * To speed up file reads, store the first cluster of this file
-	 * in the low 32 bits of the userData field of the item.
-	 */
-	file->i.userData = (start_dirent[shortNameOffset].cluster_high << 16) | (start_dirent[shortNameOffset].cluster_low);
+	// The file has no clusters yet; store the index of its directory entry
+	file->i.userData = ((unsigned long long) (start_dirent_offset + shortNameOffset)) << 32;
 
 	// Create a copy of the input name for the file struct
 	file->i.name = (char *) kmalloc(strlen(in_name) + 2);
 	strncpy(file->i.name, in_name, strlen(in_name) + 2);
 
-	// Perform cleanup
-	kfree(dir_chain);
-	kfree(name);
-
-	// Zero out the cluster we allocated to the file
-	void *nullBuf = (void *) dirBuf;
-	memclr(nullBuf, cluster_size);
+	// Make it visible to lookups, under its 8.3 alias too
+	hal_vfs_dir_index_add(dir, file->i.name, &file->i);
 
-	// Write zeroes to device: a write error won't cause problems here.
-	if(!this->writeCluster(fileCluster, nullBuf, &err)) {
-		#if PRINT_ERROR
-		KERROR("Error zeroing cluster: %u", err);
-		#endif
+	if(lfnNeeded) {
+		char *shortName = fs_fat32::dirent_get_8_3_name(&start_dirent[shortNameOffset]);
+		hal_vfs_dir_index_add(dir, shortName, &file->i);
+		kfree(shortName);
 	}
 
-	// Clean up directory buffer too
+	// Perform cleanup
+	kfree(dir_chain);
+	kfree(name);
 	kfree(dirBuf);
 
+	// The file is fully created, so end the metadata transaction
+	this->sync();
+
 	return 0;
 }
 
@@ -1,10 +1,81 @@
 #import "fat.hpp"
 
+// Number of FAT sectors kept in memory
+#define FAT32_FAT_CACHE_SIZE		64
+
+// Marks an unused FAT cache entry
+#define FAT32_FAT_CACHE_EMPTY		0xFFFFFFFF
+
+// Number of clusters whose free state is read from the FAT at once
+#define FAT32_BITMAP_CHUNK			4096
+
+// Bytes of written data a file handle buffers before writing it out
+
+// Largest size of a file
+#define FAT32_MAX_FILE_SIZE			0xFFFFFFFFULL
+
+// Location of a FAT entry: sector index into the FAT, and dword offset
 typedef struct fat32_secoff {
 	unsigned int sector;
 	unsigned int offset;
 } fat32_secoff_t;
 
+// A sector of the FAT that is cached in memory
+typedef struct fat32_fat_cache_entry {
+	unsigned int sector;
+	bool dirty;
+
+	// Value of the access counter when the entry was last used
+	unsigned int lastUse;
+
+	uint32_t *data;
+} fat32_fat_cache_entry_t;
+
+// A run of consecutive clusters belonging to a file
+typedef struct fat32_extent {
+	// Index of the run's first cluster in the file
+	unsigned int fileCluster;
+
+	unsigned int cluster;
+	unsigned int length;
+} fat32_extent_t;
+
+/*
+ * Extent map of a file: its cluster chain, compressed into runs of consecutive
+ * clusters. It is stored in the fs_data field of the file, and is a single
+ * allocation so the VFS can release it.
+ */
+typedef struct fat32_extent_map {
+	// Cluster the chain starts at, to detect stale maps
+	unsigned int firstCluster;
+
+	unsigned int numClusters;
+	unsigned int numExtents;
+
+	fat32_extent_t extents[];
+} fat32_extent_map_t;
+
+/*
+ * State of a directory that's read entry by entry: only the cluster being
+ * decoded is in memory, and a long name that's being reassembled carries over
+ * into the next cluster.
+ */
+typedef struct fat32_dir_cursor {
+	// Cluster being decoded, and index of the next entry in it
+	unsigned int cluster;
+	unsigned int entry;
+
+	// Set once the end of the directory was reached
+	bool end;
+
+	// Long name being reassembled; lfnNext is the order of the entry expected next
+	char lfn[261];
+	uint8_t lfnChecksum;
+	uint8_t lfnNext;
+
+	fat_dirent_t *entries;
+} fat32_dir_cursor_t;
+
 typedef enum {
 	kStringCaseUpper,
 	kStringCaseLower,
@@ -55,21 +126,47 @@ class fs_fat32 : public hal_fs {
 		}
 
 		// Lists a directory, the Fun Way™.
-		fs_directory_t* list_directory(char* dirname, bool cache);
+		fs_directory_t* list_directory(char* dirname);
+
+		// Reads the entries of a directory that was already looked up
+		bool populate_directory(fs_directory_t *dir);
+
+		// Reads a directory entry by entry
+		fat32_dir_cursor_t* open_dir(fs_directory_t *dir);
+		int read_dir_entry(fat32_dir_cursor_t *cursor, fs_dirent_t *entry);
+		void close_dir(fat32_dir_cursor_t *cursor);
 
 		// Gets the file requested
 		fs_file_handle_t* get_file_handle(char *name, fs_file_open_mode_t mode);
 
+		// Opens a handle for a file that was already looked up
+		fs_file_handle_t* open_file(fs_file_t *file, fs_file_open_mode_t mode);
+
 		// Closes a previously opened file handle
 		void close_file_handle(fs_file_handle_t *handle);
 
+		// Deletes a file
+		int unlink(char *path);
+
 		// Performs a file read
 		long long read_handle(fs_file_handle_t *h, size_t bytes, void *buffer);
 
-	private:
-		// Small cache for directory handles
-		hashmap_t *dirHandleCache;
+		// Moves the position of a handle
+		int seek_handle(fs_file_handle_t *h, unsigned long long position);
+
+		// Page cache hooks
+		int read_page(fs_file_t *file, unsigned long long offset, void *page);
+		int read_pages(fs_file_t *file, unsigned long long offset, void **pages, unsigned int count);
+		int write_page(fs_file_t *file, unsigned long long offset, void *page, size_t length);
+		int map_data(fs_file_t *file, unsigned long long offset, hal_disk_t **disk, uint64_t *lba, unsigned long long *length);
+
+		// Reserves clusters for the first length bytes of the file
+		int allocate_handle(fs_file_handle_t *h, unsigned long long length);
+
+		// Writes all outstanding changes to stable storage
+		int sync(void);
 
+	private:
 		// Structures read from disk
 		fat_fs_bpb32_t bpb;
 		fat_fs_fsinfo32_t fs_info;
@@ -83,30 +180,91 @@ class fs_fat32 : public hal_fs {
 
 		unsigned int cluster_size;
 
-		// Buffer for a single cluster of FAT data
-		uint32_t *fatBuffer;
-		uint32_t *freeClusterBuffer;
+		// FAT sector cache (written back on sync)
+		fat32_fat_cache_entry_t *fatCache;
+		fat32_fat_cache_entry_t *fatCacheLast;
+		unsigned int fatCacheClock;
+
+		/*
+		 * Free cluster bitmap: a set bit indicates the cluster is in use. It is
+		 * filled in from the FAT in chunks, as the allocator reaches them. If
+		 * it couldn't be allocated, the FAT is searched directly instead.
+		 */
+		uint32_t *clusterBitmap;
+		uint8_t *clusterBitmapLoaded;
+		unsigned int clusterBitmapChunks, clusterBitmapChunksLoaded;
+
+		// Number of free clusters (exact once all chunks are loaded)
+		unsigned int freeClusterCount;
+
+		// Whether FSInfo is valid, and needs to be written back on sync
+		bool fsInfoValid;
+		bool fsInfoDirty;
+
+		// Files whose directory entry needs to be written back
+		fs_file_t **dirtyFiles;
+		unsigned int numDirtyFiles, maxDirtyFiles;
 
 		// Buffer for one cluster of data
 		void *clusterBuffer;
 
+		// Bounce buffers for partially read sectors (two sectors)
+		uint8_t *sectorBuffer;
+
 		void read_root_dir(void);
 
 		// Calcualtes FAT entry location for a cluster
 		fat32_secoff_t fatEntryOffsetForCluster(unsigned int cluster);
 
+		// FAT access through the FAT sector cache
+		uint32_t *fatCacheGet(unsigned int sector, unsigned int *error);
+		bool readFatEntry(unsigned int cluster, unsigned int *value);
+		bool writeFatEntry(unsigned int cluster, unsigned int value);
+		bool writeFatSector(fat32_fat_cache_entry_t *entry, unsigned int *error);
+		int flushFatCache(void);
+
 		// Follows a cluster chain
 		unsigned int *clusterChainForCluster(unsigned int cluster);
 
+		// Gets (building it, if needed) the extent map of a file
+		fat32_extent_map_t *extentMapForFile(fs_file_t *file);
+
+		// Maps a cluster index in the file to a cluster on disk
+		bool clusterForFileCluster(fat32_extent_map_t *map, unsigned int index, unsigned int *cluster, unsigned int *run);
+
+		// Appends newly allocated clusters to the file's chain
+		fat32_extent_map_t *extendFile(fs_file_t *file, unsigned int count);
+
+		// Frees all clusters of the file, making it empty
+		bool truncateFile(fs_file_t *file);
+
+		// Gets the file a handle is open on
+		fs_file_t *fileForHandle(fs_file_handle_t *h);
+
+		// Reads data from the file
+		long long readData(fs_file_t *file, unsigned long long offset, size_t bytes, void *buffer);
+
+		// Writes data into the file, allocating clusters as needed
+		bool writeData(fs_file_t *file, unsigned long long offset, void *data, size_t length, unsigned int *error);
+
 		// Cluster read/write
 		void *readCluster(unsigned int cluster, void* buffer, unsigned int* error);
 		void *writeCluster(unsigned int cluster, void *buffer, unsigned int *error);
 
+		// Reads part of a run of consecutive clusters straight into the destination buffer
+		void *readClusterRange(unsigned int cluster, unsigned int offset, size_t length, void *buffer, unsigned int *error);
+
+		// Writes part of a run of consecutive clusters straight from the source buffer
+		bool writeClusterRange(unsigned int cluster, unsigned int offset, size_t length, void *buffer, unsigned long long valid, unsigned int *error);
+
 		// Reads an entire directory table into memory.
-		fat_dirent_t *read_dir_file(fs_directory_t *parent, char *childName, unsigned int *entries);
+		fat_dirent_t *read_dir_file(fs_directory_t *dir, unsigned int *entries);
 
-		// Reads a directory and converts it
-		fs_directory_t *read_directory(fs_directory_t *dir, char *name, bool cache, char *fullpath);
+		// Gets a subdirectory, reading its entries if needed
+		fs_directory_t *read_directory(fs_directory_t *dir, hal_path_iter_t *it);
+
+		// Finds the directory containing the item a path refers to
+		fs_directory_t *walkPath(char *path, char **name, size_t *length);
 
 		// Takes an input buffer of FAT directory entries and "prettifies" them.
 		void processFATDirEnt(fat_dirent_t *entries, unsigned int number, fs_directory_t *dir);
@@ -117,9 +275,26 @@ class fs_fat32 : public hal_fs {
 		// Converts a FAT timestamp to a UNIX timestamp
 		time_t convert_timestamp(uint16_t date, uint16_t time, uint8_t millis);
 
+		// Gets the current time as a FAT timestamp
+		void currentFatTimestamp(uint16_t *date, uint16_t *time, uint8_t *tenths);
+
+		// Directory entry updates, which are batched until sync
+		void markDirentDirty(fs_file_t *file);
+		bool writeDirent(fs_file_t *file, unsigned int *error);
+		int writeDirtyDirents(fs_file_t *file);
+
+
+		// Fills in a chunk of the free cluster bitmap
+		bool loadBitmapChunk(unsigned int chunk);
+
+		// Checks whether a cluster is in use
+		bool clusterInUse(unsigned int cluster, bool *inUse);
+
+		// Allocates a chain of (preferably) contiguous free clusters
+		unsigned int allocateClusters(unsigned int count, unsigned int goal, unsigned int *allocated);
 
-		// Finds clusters that are free
-		unsigned int findFreeCluster();
+		// Frees all clusters in a chain
+		bool freeClusterChain(unsigned int cluster);
 
 		// Updates a cluster chain
 		int update_fat(unsigned int cluster, unsigned int nextCluster);
@@ -6,6 +6,7 @@
 
 // Static functions
 static bool fat32_part_verify(hal_disk_partition_t *);
+static bool fat32_boot_sector_verify(hal_disk_partition_t *);
 static void *fat32_create_superblock(hal_disk_partition_t *part, hal_disk_t *disk);
 
 // FAT32 interface wrappers
@@ -16,11 +17,29 @@ static fs_file_handle_t *fat32_file_open(void *superblock, char *path, fs_file_o
 static void fat32_file_close(void *superblock, fs_file_handle_t *file);
 static void fat32_file_update(void *superblock, fs_file_t *file);
 static long long fat32_file_read(void *superblock, void* buffer, size_t bytes, fs_file_handle_t *file);
-static long long fat32_file_write(void *superblock, void* buffer, size_t bytes, fs_file_handle_t *file);
+static int fat32_file_sync(void *superblock, fs_file_handle_t *file);
+static int fat32_file_allocate(void *superblock, fs_file_handle_t *file, unsigned long long length);
+static fs_file_handle_t *fat32_file_open_item(void *superblock, fs_file_t *file, fs_file_open_mode_t mode);
+static int fat32_readpage(void *superblock, fs_file_t *file, unsigned long long offset, void *page);
+static int fat32_writepage(void *superblock, fs_file_t *file, unsigned long long offset, void *page, size_t length);
+static int fat32_readpages(void *superblock, fs_file_t *file, unsigned long long offset, void **pages, unsigned int count);
+static int fat32_file_seek(void *superblock, fs_file_handle_t *file, unsigned long long position);
+static void *fat32_dir_open(void *superblock, fs_directory_t *dir);
+static int fat32_dir_read(void *superblock, void *cursor, fs_dirent_t *entry);
+static void fat32_dir_close(void *superblock, void *cursor);
+static int fat32_populate_directory(void *superblock, fs_directory_t *dir);
+static unsigned long long fat32_max_file_size(void *superblock);
+static int fat32_map_data(void *superblock, fs_file_t *file, unsigned long long offset, hal_disk_t **disk, uint64_t *lba, unsigned long long *length);
 
 // Initialisers
 extern "C" void _init(void);
 
+// GPT "Basic Data" partition type (EBD0A0A2-B9E5-4433-87C0-68B6B72699C7)
+static const uint8_t gpt_basic_data_guid[16] = {
+	0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+	0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7
+};
+
 // Module definition
 static const module_t mod = {
 	/*.name = */ MODULE_NAME
@@ -38,7 +57,25 @@ static const hal_vfs_t vfs = {
 	/*.file_close = */ fat32_file_close,
 	/*.file_update = */ fat32_file_update,
 	/*.file_read = */ fat32_file_read,
-	/*.file_write = */ fat32_file_write
+	/*.file_write = */ NULL,
+	/*.file_sync = */ fat32_file_sync,
+	/*.file_allocate = */ fat32_file_allocate,
+	/*.file_open_item = */ fat32_file_open_item,
+	/*.readpage = */ fat32_readpage,
+	/*.writepage = */ fat32_writepage,
+	/*.readpages = */ fat32_readpages,
+	/*.file_pread = */ NULL,
+	/*.file_pwrite = */ NULL,
+	/*.file_preadv = */ NULL,
+	/*.file_seek = */ fat32_file_seek,
+	/*.dir_open = */ fat32_dir_open,
+	/*.dir_read = */ fat32_dir_read,
+	/*.dir_close = */ fat32_dir_close,
+	/*.populate_directory = */ fat32_populate_directory,
+	/*.mount = */ NULL,
+	/*.file_map = */ NULL,
+	/*.max_file_size = */ fat32_max_file_size,
+	/*.map_data = */ fat32_map_data
 };
 
 /*
@@ -63,9 +100,33 @@ static bool fat32_part_verify(hal_disk_partition_t *part) {
 		return true;
 	}
 
+	// Basic data partitions could have any filesystem, so check the boot sector
+	if(!memcmp(part->type_guid, gpt_basic_data_guid, 16)) {
+		return fat32_boot_sector_verify(part);
+	}
+
 	return false;
 }
 
+/*
+ * Reads the first sector of the partition, and checks whether it's a FAT32
+ * boot sector.
+ */
+static bool fat32_boot_sector_verify(hal_disk_partition_t *part) {
+	bool isFAT32 = false;
+	uint8_t *buf = (uint8_t *) kmalloc(512);
+
+	if(hal_disk_read(part->disk, part->lba_start, 1, buf, NULL, NULL, NULL) == kDiskErrorNone) {
+		// Check signature and the filesystem type string in the extended BPB
+		if(buf[0x1FE] == 0x55 && buf[0x1FF] == 0xAA && !memcmp(buf + 82, "FAT32   ", 8)) {
+			isFAT32 = true;
+		}
+	}
+
+	kfree(buf);
+	return isFAT32;
+}
+
 /*
  * Creates a superblock (in this case, the fat32/fat16 classes) for the
  * appropriate partition.
@@ -73,14 +134,10 @@ static bool fat32_part_verify(hal_disk_partition_t *part) {
  * This code assumes it's only called if it's a FAT fs, which is usually true.
  */
 static void *fat32_create_superblock(hal_disk_partition_t *part, hal_disk_t *disk) {
-	// FAT32
-	if(part->type == 0x0C) {
-		fs_fat32 *fs = new fs_fat32(part, disk);
+	// FAT32 (either MBR type 0x0C, or a GPT basic data partition)
+	fs_fat32 *fs = new fs_fat32(part, disk);
 
-		return (void *) fs;
-	}
-
-	return NULL;
+	return (void *) fs;
 }
 
 // List a directory.
@@ -88,7 +145,7 @@ static fs_directory_t *fat32_list_directory(void *superblock, char *dirname) {
 	// Validate input
 	if(dirname) {
 		fs_fat32 *fs = (fs_fat32 *) superblock;
-		return fs->list_directory(dirname, true);
+		return fs->list_directory(dirname);
 	}
 
 	return NULL;
@@ -102,7 +159,12 @@ static int fat32_create_directory(void *superblock, char *path) {
 
 // Deletes an item
 static int fat32_unlink(void *superblock, char *path) {
-	UNIMPLEMENTED_WARNING();
+	// Validate input
+	if(path && path[0] == '/') {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->unlink(path);
+	}
+
 	return -1;
 }
 
@@ -123,7 +185,9 @@ static fs_file_handle_t *fat32_file_open(void *superblock, char *path, fs_file_o
 		fs_file_handle_t *handle = fs->get_file_handle(path, mode);
 
 		// Set the file mode
-		handle->mode = mode;
+		if(handle) {
+			handle->mode = mode;
+		}
 
 		return handle;
 	}
@@ -131,6 +195,17 @@ static fs_file_handle_t *fat32_file_open(void *superblock, char *path, fs_file_o
 	return NULL;
 }
 
+// Opens a file the VFS already looked up.
+static fs_file_handle_t *fat32_file_open_item(void *superblock, fs_file_t *file, fs_file_open_mode_t mode) {
+	// Validate input
+	if(file) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->open_file(file, mode);
+	}
+
+	return NULL;
+}
+
 // Closes a file handle
 static void fat32_file_close(void *superblock, fs_file_handle_t *file) {
 	if(file) {
@@ -155,9 +230,126 @@ static long long fat32_file_read(void *superblock, void* buffer, size_t bytes, f
 	return -1;
 }
 
-// Writes to the specified offset in the file.
-static long long fat32_file_write(void *superblock, void* buffer, size_t bytes, fs_file_handle_t *file) {
-	UNIMPLEMENTED_WARNING();
+// Writes the file's data and metadata to disk.
+static int fat32_file_sync(void *superblock, fs_file_handle_t *file) {
+	// Validate input
+	if(file) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->sync();
+	}
+
+	return -1;
+}
+
+// Reserves space for the file, without changing its size.
+static int fat32_file_allocate(void *superblock, fs_file_handle_t *file, unsigned long long length) {
+	// Validate input
+	if(file) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->allocate_handle(file, length);
+	}
+
+	return -1;
+}
+
+// Reads a page of the file into the page cache.
+static int fat32_readpage(void *superblock, fs_file_t *file, unsigned long long offset, void *page) {
+	// Validate input
+	if(file && page) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->read_page(file, offset, page);
+	}
+
+	return -1;
+}
+
+// Writes a page from the page cache back to the file.
+static int fat32_writepage(void *superblock, fs_file_t *file, unsigned long long offset, void *page, size_t length) {
+	// Validate input
+	if(file && page) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->write_page(file, offset, page, length);
+	}
+
+	return -1;
+}
+
+// Reads consecutive pages of the file ahead of time.
+static int fat32_readpages(void *superblock, fs_file_t *file, unsigned long long offset, void **pages, unsigned int count) {
+	// Validate input
+	if(file && pages && count) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->read_pages(file, offset, pages, count);
+	}
+
+	return -1;
+}
+
+// Moves the position of the file handle.
+static int fat32_file_seek(void *superblock, fs_file_handle_t *file, unsigned long long position) {
+	// Validate input
+	if(file) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->seek_handle(file, position);
+	}
+
+	return -1;
+}
+
+// Opens a cursor to read the directory's entries.
+static void *fat32_dir_open(void *superblock, fs_directory_t *dir) {
+	// Validate input
+	if(dir) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->open_dir(dir);
+	}
+
+	return NULL;
+}
+
+// Reads the next entry of a directory.
+static int fat32_dir_read(void *superblock, void *cursor, fs_dirent_t *entry) {
+	// Validate input
+	if(cursor && entry) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->read_dir_entry((fat32_dir_cursor_t *) cursor, entry);
+	}
 
 	return -1;
-}
\ No newline at end of file
+}
+
+// Releases a directory cursor.
+static void fat32_dir_close(void *superblock, void *cursor) {
+	// Validate input
+	if(cursor) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		fs->close_dir((fat32_dir_cursor_t *) cursor);
+	}
+}
+
+// Reads the entries of a directory the VFS looked up.
+static int fat32_populate_directory(void *superblock, fs_directory_t *dir) {
+	// Validate input
+	if(dir) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->populate_directory(dir) ? 0 : -1;
+	}
+
+	return -1;
+}
+
+// Returns the largest size a file may have; sizes are stored in 32 bits.
+static unsigned long long fat32_max_file_size(void *superblock) {
+	return FAT32_MAX_FILE_SIZE;
+}
+
+// Finds where the file's data is on disk, for asynchronous readahead.
+static int fat32_map_data(void *superblock, fs_file_t *file, unsigned long long offset, hal_disk_t **disk, uint64_t *lba, unsigned long long *length) {
+	// Validate input
+	if(file && disk && lba && length) {
+		fs_fat32 *fs = (fs_fat32 *) superblock;
+		return fs->map_data(file, offset, disk, lba, length);
+	}
+
+	return -1;
+}
@@ -101,6 +101,20 @@ static inline uint32_t io_inl(uint16_t port) {
 	return ret;
 }
 
+/*
+ * Read a number of words from a system IO port into memory
+ */
+static inline void io_insw(uint16_t port, void *buf, uint32_t count) {
+	__asm__ volatile("cld; rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+/*
+ * Write a number of words from memory to a system IO port
+ */
+static inline void io_outsw(uint16_t port, const void *buf, uint32_t count) {
+	__asm__ volatile("cld; rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
 /*
  * Wait for a system IO operation to complete.
  */
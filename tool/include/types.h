@@ -0,0 +1,13 @@
+/*
+ * Stand-in for the kernel's types.h, so kernel sources that only need the C
+ * library (such as the LZFX compressor) can be built into host tools.
+ */
+#ifndef TYPES_H
+#define TYPES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#endif
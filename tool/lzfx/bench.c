@@ -0,0 +1,243 @@
+/*
+ * Measures the throughput of the LZFX codec over a corpus of files, grouped
+ * into binaries (modules), configs and text. Each file is compressed and
+ * decompressed repeatedly, until enough time has passed to time it reliably;
+ * the fastest of several rounds counts, to filter out noise.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "ramdisk_compression.h"
+
+#ifndef LZFX_HLOG
+#define LZFX_HLOG 16
+#endif
+
+// Minimum time to spend on each round, and number of rounds
+#define MIN_TIME		0.005
+#define ROUNDS			5
+
+typedef enum {
+	kCategoryBinary,
+	kCategoryConfig,
+	kCategoryText,
+
+	kCategoryCount
+} category_t;
+
+static const char *category_names[kCategoryCount] = {
+	"binary", "config", "text"
+};
+
+// Totals for a category
+typedef struct {
+	unsigned int files;
+
+	uint64_t bytes;
+	uint64_t packed;
+
+	// Time taken for one pass over all files
+	double compress_time;
+	double decompress_time;
+} totals_t;
+
+static totals_t totals[kCategoryCount];
+
+/*
+ * Gets the current time, in seconds.
+ */
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ * Reads a whole file.
+ */
+static uint8_t *read_file(const char *path, unsigned int *size) {
+	FILE *fp = fopen(path, "rb");
+
+	if(!fp) {
+		return NULL;
+	}
+
+	fseek(fp, 0L, SEEK_END);
+	long length = ftell(fp);
+	fseek(fp, 0L, SEEK_SET);
+
+	uint8_t *buf = malloc(length ? length : 1);
+
+	if(!buf || fread(buf, 1, length, fp) != (size_t) length) {
+		free(buf);
+		fclose(fp);
+		return NULL;
+	}
+
+	fclose(fp);
+
+	*size = length;
+	return buf;
+}
+
+/*
+ * Works out which category a file belongs in.
+ */
+static category_t classify(const char *path, const uint8_t *data, unsigned int size) {
+	size_t length = strlen(path);
+
+	if(length > 4 && !strcmp(path + length - 4, ".cfg")) {
+		return kCategoryConfig;
+	}
+
+	// Anything with control characters in it is a binary
+	for(unsigned int i = 0; i < size; i++) {
+		if(data[i] < 0x20 && data[i] != '\n' && data[i] != '\r' && data[i] != '\t') {
+			return kCategoryBinary;
+		}
+	}
+
+	return kCategoryText;
+}
+
+/*
+ * Benchmarks one file.
+ *
+ * @return 0 if the data made it through the round trip intact.
+ */
+static int bench_file(const char *path) {
+	unsigned int size;
+	uint8_t *data = read_file(path, &size);
+
+	if(!data) {
+		fprintf(stderr, "Couldn't read '%s'\n", path);
+		return 0;
+	}
+
+	if(!size) {
+		free(data);
+		return 0;
+	}
+
+	// Incompressible data grows by one byte for each 32
+	unsigned int capacity = size + (size / 32) + 16;
+	uint8_t *packed = malloc(capacity);
+	uint8_t *unpacked = malloc(size);
+
+	unsigned int packed_size = 0;
+	double compress_time = 0, decompress_time = 0;
+
+	for(int round = 0; round < ROUNDS; round++) {
+		unsigned int iterations = 0;
+		double start = now(), elapsed;
+
+		do {
+			packed_size = capacity;
+
+			if(lzfx_compress(data, size, packed, &packed_size) < 0) {
+				fprintf(stderr, "Couldn't compress '%s'\n", path);
+
+				free(data); free(packed); free(unpacked);
+				return -1;
+			}
+
+			iterations++;
+		} while((elapsed = now() - start) < MIN_TIME);
+
+		if(!round || (elapsed / iterations) < compress_time) {
+			compress_time = elapsed / iterations;
+		}
+	}
+
+	for(int round = 0; round < ROUNDS; round++) {
+		unsigned int iterations = 0;
+		double start = now(), elapsed;
+
+		do {
+			unsigned int unpacked_size = size;
+
+			if(lzfx_decompress(packed, packed_size, unpacked, &unpacked_size) < 0 || unpacked_size != size) {
+				fprintf(stderr, "Couldn't decompress '%s'\n", path);
+
+				free(data); free(packed); free(unpacked);
+				return -1;
+			}
+
+			iterations++;
+		} while((elapsed = now() - start) < MIN_TIME);
+
+		if(!round || (elapsed / iterations) < decompress_time) {
+			decompress_time = elapsed / iterations;
+		}
+	}
+
+	int result = 0;
+
+	if(memcmp(data, unpacked, size)) {
+		fprintf(stderr, "Round trip of '%s' doesn't match\n", path);
+		result = -1;
+	}
+
+	totals_t *t = &totals[classify(path, data, size)];
+
+	t->files++;
+	t->bytes += size;
+	t->packed += packed_size;
+	t->compress_time += compress_time;
+	t->decompress_time += decompress_time;
+
+	free(data);
+	free(packed);
+	free(unpacked);
+
+	return result;
+}
+
+/*
+ * Main entry point
+ */
+int main(int argc, char *argv[]) {
+	if(argc < 2) {
+		printf("usage: %s file...\n", argv[0]);
+		return -1;
+	}
+
+	for(int i = 1; i < argc; i++) {
+		if(bench_file(argv[i])) {
+			return -1;
+		}
+	}
+
+	printf("LZFX_HLOG=%d\n", LZFX_HLOG);
+	printf("\t%-8s %6s %12s %7s %14s %14s\n", "corpus", "files", "bytes", "ratio", "compress MB/s", "decompress MB/s");
+
+	totals_t all;
+	memset(&all, 0, sizeof(all));
+
+	for(int c = 0; c <= kCategoryCount; c++) {
+		totals_t *t = (c < kCategoryCount) ? &totals[c] : &all;
+
+		if(!t->files) {
+			continue;
+		}
+
+		printf("\t%-8s %6u %12llu %6.1f%% %14.1f %14.1f\n", (c < kCategoryCount) ? category_names[c] : "all",
+				t->files, (unsigned long long) t->bytes, (100.0 * t->packed) / t->bytes,
+				(t->bytes / t->compress_time) / 1e6, (t->bytes / t->decompress_time) / 1e6);
+
+		if(c < kCategoryCount) {
+			all.files += t->files;
+			all.bytes += t->bytes;
+			all.packed += t->packed;
+			all.compress_time += t->compress_time;
+			all.decompress_time += t->decompress_time;
+		}
+	}
+
+	return 0;
+}
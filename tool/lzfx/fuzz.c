@@ -0,0 +1,221 @@
+/*
+ * Round-trip fuzzer for the LZFX codec. Generates inputs that exercise long
+ * literal runs, short and long back references and overlapping copies, and
+ * checks that they decompress to what was compressed; then feeds corrupted
+ * streams to the decompressor, which must fail cleanly. Buffers are allocated
+ * to their exact size, so build with SANITIZE=1 to catch overruns.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "ramdisk_compression.h"
+
+// Largest input to generate
+#define MAX_SIZE		(1 << 17)
+
+static uint32_t rng_state;
+
+/*
+ * Gets a pseudo-random number (xorshift32)
+ */
+static uint32_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+
+	return rng_state;
+}
+
+/*
+ * Fills a buffer with data made of random bytes, runs, text, and copies of
+ * earlier parts of the buffer at all sorts of distances.
+ */
+static void generate(uint8_t *buf, unsigned int size) {
+	static const char alphabet[] = "etaoin shrdlu\n";
+	unsigned int i = 0;
+
+	while(i < size) {
+		unsigned int length = 1 + (rng() % ((rng() & 1) ? 16 : 600));
+
+		if(length > (size - i)) {
+			length = size - i;
+		}
+
+		switch(rng() % 4) {
+			// Random bytes
+			case 0:
+				for(unsigned int j = 0; j < length; j++) {
+					buf[i + j] = rng();
+				}
+				break;
+
+			// A run of one byte
+			case 1:
+				memset(buf + i, rng(), length);
+				break;
+
+			// Text-like data
+			case 2:
+				for(unsigned int j = 0; j < length; j++) {
+					buf[i + j] = alphabet[rng() % (sizeof(alphabet) - 1)];
+				}
+				break;
+
+			// A copy of earlier data, which may overlap
+			case 3:
+				if(!i) {
+					continue;
+				}
+
+				unsigned int distance = 1 + (rng() % ((rng() & 1) ? 8 : (i < 10000 ? i : 10000)));
+
+				if(distance > i) {
+					distance = i;
+				}
+
+				for(unsigned int j = 0; j < length; j++) {
+					buf[i + j] = buf[i + j - distance];
+				}
+				break;
+		}
+
+		i += length;
+	}
+}
+
+/*
+ * Copies a buffer into an allocation of exactly its size.
+ */
+static uint8_t *exact_copy(const uint8_t *buf, unsigned int size) {
+	uint8_t *copy = malloc(size ? size : 1);
+	memcpy(copy, buf, size);
+
+	return copy;
+}
+
+/*
+ * Runs one round trip, and then feeds corrupted versions of the compressed
+ * data to the decompressor.
+ *
+ * @return 0 if all checks passed.
+ */
+static int fuzz_one(unsigned int iteration) {
+	static uint8_t input[MAX_SIZE];
+	static uint8_t packed[MAX_SIZE + (MAX_SIZE / 32) + 16];
+
+	unsigned int size = rng() % ((rng() % 4) ? 4096 : MAX_SIZE);
+	generate(input, size);
+
+	uint8_t *data = exact_copy(input, size);
+
+	// Compress, then decompress into a buffer of exactly the right size
+	unsigned int packed_size = sizeof(packed);
+
+	if(lzfx_compress(data, size, packed, &packed_size) < 0) {
+		fprintf(stderr, "%u: couldn't compress %u bytes\n", iteration, size);
+		return -1;
+	}
+
+	uint8_t *stream = exact_copy(packed, packed_size);
+	uint8_t *out = malloc(size ? size : 1);
+	unsigned int out_size = size;
+	int err;
+
+	if((err = lzfx_decompress(stream, packed_size, out, &out_size)) < 0 || out_size != size || memcmp(out, data, size)) {
+		fprintf(stderr, "%u: round trip of %u bytes failed (%d, got %u bytes)\n", iteration, size, err, out_size);
+		return -1;
+	}
+
+	// Ask for the size only
+	out_size = 0;
+
+	if((err = lzfx_decompress(stream, packed_size, NULL, &out_size)) < 0 || out_size != size) {
+		fprintf(stderr, "%u: size of %u bytes reported as %u (%d)\n", iteration, size, out_size, err);
+		return -1;
+	}
+
+	// Decompress into a buffer that's too small
+	if(size) {
+		unsigned int short_size = rng() % size;
+		uint8_t *short_out = malloc(short_size ? short_size : 1);
+
+		out_size = short_size;
+		err = lzfx_decompress(stream, packed_size, short_out, &out_size);
+
+		if(err != LZFX_ESIZE || out_size != size) {
+			fprintf(stderr, "%u: decompressing %u bytes into %u gave %d, %u bytes\n", iteration, size, short_size, err, out_size);
+			return -1;
+		}
+
+		free(short_out);
+	}
+
+	// Compress into a buffer that's too small
+	if(packed_size > 1) {
+		unsigned int short_size = rng() % packed_size;
+		uint8_t *short_out = malloc(short_size ? short_size : 1);
+
+		out_size = short_size;
+		err = lzfx_compress(data, size, short_out, &out_size);
+
+		if(err != LZFX_ESIZE) {
+			fprintf(stderr, "%u: compressing %u bytes into %u of %u gave %d\n", iteration, size, short_size, packed_size, err);
+			return -1;
+		}
+
+		free(short_out);
+	}
+
+	// Corrupt or truncate the stream; this may fail, but mustn't crash
+	for(unsigned int c = 0; c < 8 && packed_size; c++) {
+		unsigned int corrupt_size = packed_size;
+
+		if(c & 1) {
+			corrupt_size = rng() % packed_size;
+		} else {
+			packed[rng() % packed_size] ^= 1 << (rng() % 8);
+		}
+
+		uint8_t *corrupt = exact_copy(packed, corrupt_size);
+
+		out_size = size;
+		lzfx_decompress(corrupt, corrupt_size, out, &out_size);
+
+		out_size = 0;
+		lzfx_decompress(corrupt, corrupt_size, NULL, &out_size);
+
+		free(corrupt);
+	}
+
+	free(data);
+	free(stream);
+	free(out);
+
+	return 0;
+}
+
+/*
+ * Main entry point
+ */
+int main(int argc, char *argv[]) {
+	unsigned int iterations = (argc > 1) ? strtoul(argv[1], NULL, 10) : 20000;
+	rng_state = (argc > 2) ? strtoul(argv[2], NULL, 10) : 0x5eed1234;
+
+	if(!rng_state) {
+		rng_state = 1;
+	}
+
+	printf("Fuzzing %u iterations, seed %u\n", iterations, rng_state);
+
+	for(unsigned int i = 0; i < iterations; i++) {
+		if(fuzz_one(i)) {
+			return -1;
+		}
+	}
+
+	printf("All round trips passed\n");
+	return 0;
+}
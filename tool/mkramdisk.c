@@ -1,10 +1,19 @@
 /*
  * Tool to generate a compressed TSOS ramdisk.
  *
- * This automagically aligns the files within the ramdisk to page (4K) bounds,
- * as to make the processing within the kernel easier. This can lead to some
- * wasted space, so it is recommended that the files are minified, if possible,
- * and superfluous files are not included.
+ * The directory is walked recursively; each file and directory gets an entry
+ * named by its path relative to the directory. Entries are sorted by name, so
+ * the kernel can binary search them, and the names are stored in a string
+ * table after the entries, so they can be of any length.
+ *
+ * Files with the same contents are stored once. Files are LZFX compressed if
+ * that makes them smaller, and decompressed by the kernel when they're first
+ * opened; the compression runs on all cores. Uncompressed ELF files (modules)
+ * are aligned to page (4K) bounds, since the kernel links them in place; all
+ * other data is aligned to a dword.
+ *
+ * It's built with the kernel's compressor by "make -C tool mkramdisk", which
+ * build_ramdisk.sh runs before using it.
  */
 
 #include <stdio.h>
@@ -12,19 +21,39 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
 
+#include <strings.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include <zlib.h>
 
- __attribute__((used)) const char *info = "mkramdisk 1.0 by Tristan Seifert";
+#include "../kern/driver_support/ramdisk_compression.h"
 
-#define QRFS_VERSION 0x00010000
+ __attribute__((used)) const char *info = "mkramdisk 2.0 by Tristan Seifert";
+
+#define QRFS_VERSION 0x00030000
 #define QRFS_MAGIC 'QRFS'
 
+// Files with this attribute are stored LZFX compressed
+#define QRFS_ATTR_COMPRESSED	(1 << 0)
+// Entries with this attribute are directories, and have no data
+#define QRFS_ATTR_DIRECTORY		(1 << 1)
+
+// Alignment of ELF files, and of everything else
+#define PAGE_SIZE				4096
+#define DATA_ALIGN				4
+
 typedef struct qrfs_header qrfs_header_t;
 typedef struct qrfs_file_entry qrfs_file_entry_t;
+typedef struct qrfs_compressed_header qrfs_compressed_header_t;
 
 // Header of the filesystem
 struct qrfs_header {
@@ -34,183 +63,688 @@ struct qrfs_header {
 	bool compressed;
 } __attribute__((packed));
 
-// Entry in a filesystem
+// Entry in a filesystem; names and data are offsets from the image's start
 struct qrfs_file_entry {
-	const char name[32];
+	uint32_t name_start;
+	uint32_t name_length;
 
 	uint32_t file_start;
 	uint32_t length;
 	uint32_t attributes;
 } __attribute__((packed));
 
-// Array to hold the file entries
-static qrfs_file_entry_t files[256];
-static qrfs_header_t header;
-static int placement_offset;
+/*
+ * Compressed files start with this, followed by the LZFX stream, which holds
+ * the file's contents without the dword of zeros that terminates them.
+ */
+struct qrfs_compressed_header {
+	uint32_t stored_length;
+} __attribute__((packed));
+
+// A file or directory to put in the ramdisk
+typedef struct node {
+	char *path;
+	size_t path_length;
+	bool directory;
+
+	// Contents of the file (mapped), and its hash
+	uint8_t *data;
+	size_t size;
+	uint64_t hash;
+
+	// File with the same contents, whose data is used instead
+	struct node *duplicate;
+
+	// Compressed data, if it's smaller
+	uint8_t *packed;
+	unsigned int packed_size;
+
+	qrfs_file_entry_t entry;
+} node_t;
+
+// Options
+static bool opt_stats = false;
+static bool opt_compress = true;
+static unsigned int opt_jobs = 0;
+static const char *opt_output = "initrd.bin";
+static const char *opt_gzip = "initrd.gz";
+
+// All nodes, in the order they're found (and later, sorted)
+static node_t *nodes;
+static size_t num_nodes, nodes_capacity;
+
+// Next node for the compression workers to pick up
+static size_t next_job;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+static struct {
+	size_t files, directories, duplicates;
+	size_t compressed;
+
+	uint64_t input_bytes, duplicate_bytes;
+	uint64_t compressed_in, compressed_out;
+	uint64_t names_bytes, padding_bytes;
+	uint64_t image_bytes;
+
+	double scan_time, compress_time, write_time;
+} stats;
 
 /*
- * Main entry point
+ * Gets the current time, in seconds.
  */
-int main(int argc, char *argv[]) {
-	if(argc != 2) {
-		printf("usage: %s directory\n", argv[0]);
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+/*
+ * Hashes a file's contents (FNV-1a)
+ */
+static uint64_t hash_data(const uint8_t *data, size_t size) {
+	uint64_t hash = 14695981039346656037ULL;
+
+	for(size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * Adds a node, and returns it.
+ */
+static node_t *add_node(const char *path, bool directory) {
+	if(num_nodes == nodes_capacity) {
+		nodes_capacity = nodes_capacity ? (nodes_capacity * 2) : 64;
+		nodes = realloc(nodes, nodes_capacity * sizeof(node_t));
+
+		if(!nodes) {
+			perror("Couldn't allocate nodes");
+			exit(-1);
+		}
+	}
+
+	node_t *node = &nodes[num_nodes++];
+	memset(node, 0, sizeof(node_t));
+
+	node->path = strdup(path);
+	node->path_length = strlen(path);
+	node->directory = directory;
+
+	return node;
+}
+
+/*
+ * Maps a file's contents.
+ */
+static int map_file(node_t *node, const char *fullpath) {
+	int fd = open(fullpath, O_RDONLY);
+
+	if(fd < 0) {
+		return -1;
+	}
+
+	struct stat st;
+
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	node->size = st.st_size;
+
+	if(node->size) {
+		node->data = mmap(NULL, node->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if(node->data == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Walks a directory, adding nodes for everything in it. Paths are relative to
+ * the root of the ramdisk.
+ */
+static int scan_directory(const char *root, const char *relpath) {
+	char fullpath[PATH_MAX];
+
+	if(snprintf(fullpath, sizeof(fullpath), "%s/%s", root, relpath) >= (int) sizeof(fullpath)) {
+		fprintf(stderr, "Path too long: '%s/%s'\n", root, relpath);
 		return -1;
 	}
 
-	// List files in directory
-	char *directory = argv[1];
+	DIR *dir = opendir(fullpath);
+
+	if(!dir) {
+		fprintf(stderr, "Couldn't open directory '%s': %s\n", fullpath, strerror(errno));
+		return -1;
+	}
 
-	DIR *dir;
 	struct dirent *ent;
 
-	if((dir = opendir(directory)) != NULL) {
-		while ((ent = readdir (dir)) != NULL) {
-			// Ignore "." and ".."
-			if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
-			} else {
-				// Create a file entry for the files
-				qrfs_file_entry_t *entry = &files[header.numFiles++];
-				strncpy((char *) &entry->name, ent->d_name, 64);
+	while((ent = readdir(dir)) != NULL) {
+		// Ignore "." and ".."
+		if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+			continue;
+		}
+
+		char path[PATH_MAX];
+		int length;
+
+		if(*relpath) {
+			length = snprintf(path, sizeof(path), "%s/%s", relpath, ent->d_name);
+		} else {
+			length = snprintf(path, sizeof(path), "%s", ent->d_name);
+		}
+
+		// Paths that don't fit would be truncated, so give up on them
+		if(length >= (int) sizeof(path) || snprintf(fullpath, sizeof(fullpath), "%s/%s", root, path) >= (int) sizeof(fullpath)) {
+			fprintf(stderr, "Path too long: '%s/%s/%s'\n", root, relpath, ent->d_name);
+			closedir(dir);
+			return -1;
+		}
+
+		struct stat st;
+
+		if(stat(fullpath, &st) < 0) {
+			fprintf(stderr, "Couldn't stat '%s': %s\n", fullpath, strerror(errno));
+			closedir(dir);
+			return -1;
+		}
+
+		if(S_ISDIR(st.st_mode)) {
+			add_node(path, true);
+			stats.directories++;
+
+			if(scan_directory(root, path)) {
+				closedir(dir);
+				return -1;
+			}
+		} else if(S_ISREG(st.st_mode)) {
+			node_t *node = add_node(path, false);
+
+			if(map_file(node, fullpath)) {
+				fprintf(stderr, "Couldn't read '%s': %s\n", fullpath, strerror(errno));
+				closedir(dir);
+				return -1;
 			}
+
+			stats.files++;
+			stats.input_bytes += node->size;
 		}
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/*
+ * Sorts nodes the way the kernel searches them: by bytes, with a name that is
+ * a prefix of another first.
+ */
+static int compare_nodes(const void *a, const void *b) {
+	const node_t *na = a, *nb = b;
+
+	size_t common = (na->path_length < nb->path_length) ? na->path_length : nb->path_length;
+	int result = memcmp(na->path, nb->path, common);
 
-		closedir (dir);
-	} else {
-		perror("Couldn't open directory specified");
+	if(result) {
+		return result;
+	}
+
+	if(na->path_length == nb->path_length) {
+		return 0;
+	}
+
+	return (na->path_length < nb->path_length) ? -1 : 1;
+}
+
+/*
+ * Sorts node pointers by path, ignoring case.
+ */
+static int compare_paths_nocase(const void *a, const void *b) {
+	return strcasecmp((*(const node_t **) a)->path, (*(const node_t **) b)->path);
+}
+
+/*
+ * The kernel looks names up ignoring case, so of two paths that only differ in
+ * case, only one could be reached. Such a ramdisk isn't built.
+ *
+ * @return 0 if all paths are distinct, ignoring case.
+ */
+static int check_case_collisions(void) {
+	node_t **sorted = malloc((num_nodes ? num_nodes : 1) * sizeof(node_t *));
+	int result = 0;
+
+	if(!sorted) {
+		perror("Couldn't allocate nodes");
 		return -1;
 	}
 
-	printf("%s\n\n", info);
+	for(size_t i = 0; i < num_nodes; i++) {
+		sorted[i] = &nodes[i];
+	}
+
+	qsort(sorted, num_nodes, sizeof(node_t *), compare_paths_nocase);
+
+	for(size_t i = 1; i < num_nodes; i++) {
+		if(!strcasecmp(sorted[i - 1]->path, sorted[i]->path)) {
+			fprintf(stderr, "'%s' and '%s' only differ in case\n", sorted[i - 1]->path, sorted[i]->path);
+			result = -1;
+		}
+	}
+
+	free(sorted);
+	return result;
+}
+
+/*
+ * Finds files with the same contents, and points them at the first of them.
+ */
+static void find_duplicates(void) {
+	size_t size = 16;
+
+	while(size < (num_nodes * 2)) {
+		size <<= 1;
+	}
+
+	node_t **table = calloc(size, sizeof(node_t *));
+
+	for(size_t n = 0; n < num_nodes; n++) {
+		node_t *node = &nodes[n];
+
+		if(node->directory) {
+			continue;
+		}
+
+		node->hash = hash_data(node->data, node->size);
+
+		size_t i;
+
+		for(i = node->hash & (size - 1); table[i]; i = (i + 1) & (size - 1)) {
+			node_t *other = table[i];
+
+			if(other->hash == node->hash && other->size == node->size && (!node->size || !memcmp(other->data, node->data, node->size))) {
+				node->duplicate = other;
+
+				stats.duplicates++;
+				stats.duplicate_bytes += node->size;
+				break;
+			}
+		}
+
+		if(!node->duplicate) {
+			table[i] = node;
+		}
+	}
+
+	free(table);
+}
+
+/*
+ * Compresses files, until there are none left. Runs on several threads.
+ */
+static void *compress_worker(void *arg) {
+	for(;;) {
+		pthread_mutex_lock(&job_lock);
+		size_t n = next_job++;
+		pthread_mutex_unlock(&job_lock);
+
+		if(n >= num_nodes) {
+			return NULL;
+		}
+
+		node_t *node = &nodes[n];
+
+		if(node->directory || node->duplicate || !node->size) {
+			continue;
+		}
+
+		// Only keep the compressed data if it's smaller than the file
+		unsigned int packed_size = node->size - 1;
+		uint8_t *packed = malloc(node->size);
+
+		if(packed && lzfx_compress(node->data, node->size, packed, &packed_size) >= 0) {
+			node->packed = packed;
+			node->packed_size = packed_size;
+		} else {
+			free(packed);
+		}
+	}
+}
+
+/*
+ * Compresses all files, using a thread per core.
+ */
+static void compress_files(void) {
+	unsigned int jobs = opt_jobs;
+
+	if(!jobs) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = (cores > 0) ? cores : 1;
+	}
+
+	pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+	unsigned int started = 0;
+
+	for(unsigned int i = 0; i < jobs; i++) {
+		if(pthread_create(&threads[i], NULL, compress_worker, NULL)) {
+			break;
+		}
+
+		started++;
+	}
+
+	// If no threads could be created, do it on this one
+	if(!started) {
+		compress_worker(NULL);
+	}
+
+	for(unsigned int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+}
+
+/*
+ * Writes bytes to the image, and to its gzipped copy.
+ */
+static FILE *image;
+static gzFile image_gz;
+static uint64_t image_offset;
+
+static void write_bytes(const void *buf, size_t length) {
+	if(!length) {
+		return;
+	}
+
+	if(fwrite(buf, 1, length, image) != length) {
+		perror("Couldn't write output file");
+		exit(-1);
+	}
+
+	if(image_gz) {
+		gzwrite(image_gz, buf, length);
+	}
+
+	image_offset += length;
+}
+
+/*
+ * Writes padding to the image.
+ */
+static void write_zeros(size_t length) {
+	static const uint8_t zeros[PAGE_SIZE];
+
+	stats.padding_bytes += length;
+
+	while(length) {
+		size_t chunk = (length > PAGE_SIZE) ? PAGE_SIZE : length;
+
+		write_bytes(zeros, chunk);
+		length -= chunk;
+	}
+}
+
+/*
+ * Works out where everything goes, then writes the image.
+ */
+static int write_image(void) {
+	qrfs_header_t header;
+	memset(&header, 0, sizeof(header));
 
-	// Initialise header
 	header.magic = QRFS_MAGIC;
 	header.version = QRFS_VERSION;
+	header.numFiles = num_nodes;
+
+	// Names follow the entries
+	uint64_t offset = sizeof(qrfs_header_t) + (num_nodes * sizeof(qrfs_file_entry_t));
 
-	// Open initrd file and write header
-	FILE *initrd = fopen("initrd.bin", "wb+");
-	if(!initrd) {
+	for(size_t n = 0; n < num_nodes; n++) {
+		nodes[n].entry.name_start = offset;
+		nodes[n].entry.name_length = nodes[n].path_length;
+
+		offset += nodes[n].path_length;
+	}
+
+	stats.names_bytes = offset - sizeof(qrfs_header_t) - (num_nodes * sizeof(qrfs_file_entry_t));
+
+	// Then the data of each file whose contents weren't seen before
+	for(size_t n = 0; n < num_nodes; n++) {
+		node_t *node = &nodes[n];
+
+		if(node->directory) {
+			node->entry.attributes = QRFS_ATTR_DIRECTORY;
+			continue;
+		}
+
+		node->entry.length = node->size + 4;
+
+		if(node->duplicate) {
+			continue;
+		}
+
+		bool elf = (node->size >= 4 && !memcmp(node->data, "\x7F" "ELF", 4));
+		size_t alignment = (elf && !node->packed) ? PAGE_SIZE : DATA_ALIGN;
+
+		offset = (offset + alignment - 1) & ~((uint64_t) alignment - 1);
+		node->entry.file_start = offset;
+
+		if(node->packed) {
+			node->entry.attributes = QRFS_ATTR_COMPRESSED;
+			header.compressed = true;
+
+			offset += sizeof(qrfs_compressed_header_t) + node->packed_size;
+
+			stats.compressed++;
+			stats.compressed_in += node->size;
+			stats.compressed_out += node->packed_size;
+		} else {
+			offset += node->size + 4;
+		}
+	}
+
+	if(offset > UINT32_MAX) {
+		fprintf(stderr, "Ramdisk would be too large (%llu bytes)\n", (unsigned long long) offset);
+		return -1;
+	}
+
+	for(size_t n = 0; n < num_nodes; n++) {
+		if(nodes[n].duplicate) {
+			nodes[n].entry.file_start = nodes[n].duplicate->entry.file_start;
+			nodes[n].entry.attributes = nodes[n].duplicate->entry.attributes;
+		}
+	}
+
+	// Write it all out
+	if(!(image = fopen(opt_output, "wb"))) {
 		perror("Couldn't open output file");
 		return -1;
 	}
 
-	fwrite(&header, sizeof(qrfs_header_t), 1, initrd);
+	setvbuf(image, NULL, _IOFBF, 1 << 20);
 
-	// Now, write the individual files' entries
-	for(int i = 0; i < header.numFiles; i++) {
-		qrfs_file_entry_t *file = &files[i];
-		fwrite(file, sizeof(qrfs_file_entry_t), 1, initrd);
+	if(opt_gzip && !(image_gz = gzopen(opt_gzip, "wb"))) {
+		perror("Couldn't open compressed output file");
+		fclose(image);
+		return -1;
+	}
+
+	write_bytes(&header, sizeof(header));
+
+	for(size_t n = 0; n < num_nodes; n++) {
+		write_bytes(&nodes[n].entry, sizeof(qrfs_file_entry_t));
 	}
 
-	// Get the current location of the file pointer
-	placement_offset = ftell(initrd);
-	printf("Writing files...\n");
+	for(size_t n = 0; n < num_nodes; n++) {
+		write_bytes(nodes[n].path, nodes[n].path_length);
+	}
+
+	for(size_t n = 0; n < num_nodes; n++) {
+		node_t *node = &nodes[n];
+
+		if(node->directory || node->duplicate) {
+			continue;
+		}
 
-	// We should now have info for files
-	chdir(directory);
+		// Pad up to where the data was placed above
+		write_zeros(node->entry.file_start - image_offset);
 
-	// Iterate through all the files
-	for(int i = 0; i < header.numFiles; i++) {
-		qrfs_file_entry_t *file = &files[i];
+		if(node->packed) {
+			qrfs_compressed_header_t hdr;
+			hdr.stored_length = node->packed_size;
 
-		// Read file
-		FILE *fp = fopen(file->name, "rb");
-		if(fp) {
+			write_bytes(&hdr, sizeof(hdr));
+			write_bytes(node->packed, node->packed_size);
+		} else {
 			uint32_t zero = 0;
-			printf("\tWriting '%s'...\n", file->name);
 
-			// Pad the placement address out to a page boundary
-			int bytes_until_pagealigned = 4096 - (placement_offset % 4096);
-			printf("\t\tInserting %u bytes of padding\n", bytes_until_pagealigned);
+			write_bytes(node->data, node->size);
+			write_bytes(&zero, sizeof(zero));
+		}
+	}
 
-			// Write the correct amount of padding
-			for(int x = 0; x < bytes_until_pagealigned; x++) {
-				fputc(0x00, initrd);
-			}
+	// Pad the image out to a dword
+	write_zeros((DATA_ALIGN - (image_offset % DATA_ALIGN)) % DATA_ALIGN);
+	stats.image_bytes = image_offset;
 
-			// Place the file at the page offset
-			placement_offset += bytes_until_pagealigned;
+	if(fclose(image)) {
+		perror("Couldn't write output file");
+		return -1;
+	}
 
-			// Determine filesize
-			fseek(fp, 0L, SEEK_END);
-			unsigned int sz = ftell(fp);
-			fseek(fp, 0L, SEEK_SET);
+	if(image_gz) {
+		gzclose(image_gz);
+	}
 
-			// Read file
-			void *mem = malloc(sz);
-			fread(mem, sz, 1, fp);
-			fclose(fp);
+	return 0;
+}
 
-			// Write to the output file
-			fwrite(mem, sz, 1, initrd);
-			free(mem);
+/*
+ * Prints a summary of what went into the image.
+ */
+static void print_stats(void) {
+	printf("%zu files, %zu directories\n", stats.files, stats.directories);
+	printf("\tinput:        %12llu bytes\n", (unsigned long long) stats.input_bytes);
+	printf("\tduplicates:   %12llu bytes in %zu files\n", (unsigned long long) stats.duplicate_bytes, stats.duplicates);
+	printf("\tcompressed:   %12llu -> %llu bytes in %zu files", (unsigned long long) stats.compressed_in, (unsigned long long) stats.compressed_out, stats.compressed);
+
+	if(stats.compressed_in) {
+		printf(" (%.1f%%)", (100.0 * stats.compressed_out) / stats.compressed_in);
+	}
+
+	printf("\n");
 
-			// Write a dword of zeros
-			fwrite(&zero, sizeof(unsigned int), 1, initrd);
-			sz += 4;
+	printf("\tnames:        %12llu bytes\n", (unsigned long long) stats.names_bytes);
+	printf("\tpadding:      %12llu bytes\n", (unsigned long long) stats.padding_bytes);
+	printf("\timage:        %12llu bytes\n", (unsigned long long) stats.image_bytes);
+
+	printf("\ttime:         %.3fs scanning, %.3fs compressing, %.3fs writing\n", stats.scan_time, stats.compress_time, stats.write_time);
+}
+
+/*
+ * Prints usage information.
+ */
+static void usage(const char *name) {
+	printf("usage: %s [options] directory\n", name);
+	printf("\t-o file\t\twrite the image to file (default initrd.bin)\n");
+	printf("\t-z file\t\twrite a gzipped copy of the image to file (default initrd.gz)\n");
+	printf("\t-Z\t\tdon't write a gzipped copy\n");
+	printf("\t-u\t\tdon't compress files\n");
+	printf("\t-j jobs\t\tnumber of compression threads (default: one per core)\n");
+	printf("\t--stats\t\tprint statistics about the image\n");
+}
 
-			// Update offset
-			file->file_start = placement_offset;
-			file->length = sz;
-			file->attributes = 0;
-			placement_offset += sz;
+/*
+ * Main entry point
+ */
+int main(int argc, char *argv[]) {
+	char *directory = NULL;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "--stats")) {
+			opt_stats = true;
+		} else if(!strcmp(argv[i], "-u")) {
+			opt_compress = false;
+		} else if(!strcmp(argv[i], "-Z")) {
+			opt_gzip = NULL;
+		} else if(!strcmp(argv[i], "-o") && (i + 1) < argc) {
+			opt_output = argv[++i];
+		} else if(!strcmp(argv[i], "-z") && (i + 1) < argc) {
+			opt_gzip = argv[++i];
+		} else if(!strcmp(argv[i], "-j") && (i + 1) < argc) {
+			opt_jobs = strtoul(argv[++i], NULL, 10);
+		} else if(argv[i][0] != '-' && !directory) {
+			directory = argv[i];
 		} else {
-			perror("Couldn't open an input file");
+			usage(argv[0]);
 			return -1;
 		}
 	}
 
-	// Pad the file out to a page
-	int bytes_until_pagealigned = 4096 - (placement_offset % 4096);
-	printf("\tWriting %u bytes of padding to end of file\n", bytes_until_pagealigned);
+	if(!directory) {
+		usage(argv[0]);
+		return -1;
+	}
 
-	// Write the correct amount of padding
-	for(int x = 0; x < bytes_until_pagealigned; x++) {
-		fputc(0x00, initrd);
+	printf("%s\n\n", info);
+
+	// Find all files, and sort them by name
+	double start = now();
+
+	if(scan_directory(directory, "")) {
+		return -1;
+	}
+
+	if(num_nodes > UINT32_MAX) {
+		fprintf(stderr, "Too many files\n");
+		return -1;
+	}
+
+	qsort(nodes, num_nodes, sizeof(node_t), compare_nodes);
+
+	if(check_case_collisions()) {
+		return -1;
 	}
 
-	// Re-write headers in the output file
-	printf("\nContents of ramdisk:\n");
-	fseek(initrd, sizeof(qrfs_header_t), SEEK_SET);
+	find_duplicates();
+
+	stats.scan_time = now() - start;
 
-	for(int i = 0; i < header.numFiles; i++) {
-		qrfs_file_entry_t *file = &files[i];
-		fwrite(file, sizeof(qrfs_file_entry_t), 1, initrd);
+	// Compress them
+	start = now();
 
-		printf("\t'%s' at offset 0x%08X, %u bytes length\n", file->name, file->file_start, file->length);
+	if(opt_compress) {
+		compress_files();
 	}
 
-	// Get final ramdisk size
-	fseek(initrd, 0L, SEEK_END);
-	unsigned int initrd_sz = ftell(initrd);
-	fseek(initrd, 0L, SEEK_SET);
+	stats.compress_time = now() - start;
 
-	void *initrd_mem = malloc(initrd_sz);
-	fread(initrd_mem, initrd_sz, 1, initrd);
+	// Write the image
+	start = now();
 
-	// Close file
-	fclose(initrd);
-	chdir("..");
-	initrd = fopen("initrd.gz", "wb+");
+	if(write_image()) {
+		return -1;
+	}
 
-	// Compression output buffer
-	unsigned char out[0x4000];
+	stats.write_time = now() - start;
 
-	z_stream strm;
-	deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
-	strm.next_in = initrd_mem;
-	strm.avail_in = initrd_sz;
+	printf("Wrote %zu entries to %s (%llu bytes)\n", num_nodes, opt_output, (unsigned long long) stats.image_bytes);
 
-	// Perform compression
-	do {
-		int have;
-		strm.avail_out = 0x4000;
-		strm.next_out = out;
-		
-		deflate(&strm, Z_FINISH);
-		have = 0x4000 - strm.avail_out;
-		fwrite(out, 1, have, initrd);
-	} while (strm.avail_out == 0);
+	if(opt_stats) {
+		printf("\n");
+		print_stats();
+	}
 
-	deflateEnd(&strm);
-	fclose(initrd);
-}
\ No newline at end of file
+	return 0;
+}